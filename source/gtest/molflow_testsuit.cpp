@@ -3,6 +3,26 @@
 //
 
 #include "gtest/gtest.h"
+#include "MaxwellSampler.h"
+#include "Random.h"
+#include "MolFlow.h"
+#include "Worker.h"
+#include "MolflowGeometry.h"
+#include "IntersectAABB_shared.h"
+#include "Polygon.h"
+#include "File.h"
+#include "CompressedStream.h"
+#include "ParticleLog.h"
+#include "GLApp/GLProgress.h"
+#include "GLApp/MathTools.h"
+#include "GLApp/GLParser.h"
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <sstream>
 //#define MOLFLOW_PATH ""
 
 namespace {
@@ -74,6 +94,824 @@ namespace {
                     "results10.100_tex.xml", "pumpmodel.geo"
             ));
 
+    // Wall speed distribution f(v) ~ v^3*exp(-v^2/(2a^2)): CDF(v) = 1 - exp(-u)*(1+u), u = v^2/(2a^2)
+    double MaxwellCDF(double v, double a) {
+        double u = v * v / (2.0 * a * a);
+        return -std::expm1(-u) - u * std::exp(-u);
+    }
+
+    TEST(MaxwellSamplerTest, InverseCDFIsExact) {
+        for (double r : {1E-12, 1E-6, 0.01, 0.25, 0.5, 0.75, 0.99, 1.0 - 1E-6, 1.0 - 1E-12}) {
+            EXPECT_NEAR(MaxwellCDF(MaxwellSampler::InverseCDF(r), 1.0), r, 1E-13 + 1E-12 * r);
+        }
+    }
+
+    TEST(MaxwellSamplerTest, TableFollowsCDF) {
+        // Stratified draws: each sample should land where the analytic CDF says
+        const MaxwellSampler &sampler = MaxwellSampler::Get();
+        const size_t nbPoints = 1000000;
+        double maxError = 0.0;
+        for (size_t i = 0; i < nbPoints; i++) {
+            double r = ((double)i + 0.5) / (double)nbPoints;
+            maxError = std::max(maxError, std::abs(MaxwellCDF(sampler.Velocity(r, 1.0), 1.0) - r));
+        }
+        EXPECT_LT(maxError, 1E-6);
+
+        // No truncation of the tail (the former 100-point table stopped at 4 times the most probable speed)
+        EXPECT_GT(sampler.Velocity(1.0 - 1E-9, 1.0), 4.0 * std::sqrt(2.0));
+    }
+
+    TEST(MaxwellSamplerTest, MomentsMatchAnalytic) {
+        const MaxwellSampler &sampler = MaxwellSampler::Get();
+        const double a = MaxwellSampler::Scale(293.15, 28.0); // N2 at room temperature
+        const size_t nbSamples = 4000000;
+        std::mt19937_64 generator(42);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        double sumV = 0.0, sumV2 = 0.0, sumInvV = 0.0;
+        for (size_t i = 0; i < nbSamples; i++) {
+            double v = sampler.Velocity(uniform(generator), a) / a;
+            sumV += v;
+            sumV2 += v * v;
+            sumInvV += 1.0 / v;
+        }
+        // Analytic moments (a=1): <v> = 1.5*sqrt(PI/2), <v^2> = 4, <1/v> = sqrt(PI/2)/2.
+        // Tolerances: 6 standard errors (standard deviations 0.68, 2.83 and 0.33 respectively)
+        const double sqrtN = std::sqrt((double)nbSamples);
+        const double pi = 3.14159265358979323846;
+        EXPECT_NEAR(sumV / nbSamples, 1.5 * std::sqrt(pi / 2.0), 6.0 * 0.683 / sqrtN);
+        EXPECT_NEAR(sumV2 / nbSamples, 4.0, 6.0 * 2.829 / sqrtN);
+        EXPECT_NEAR(sumInvV / nbSamples, std::sqrt(pi / 2.0) / 2.0, 6.0 * 0.328 / sqrtN);
+    }
+
+    // Philox output double from the first two words of a block: their 53 high bits, centered in their interval
+    double PhiloxDouble(uint32_t word0, uint32_t word1) {
+        return ((double)((((uint64_t)word0 << 32) | word1) >> 11) + 0.5) / 9007199254740992.0;
+    }
+
+    TEST(PhiloxTest, KnownAnswers) {
+        // Philox4x32-10 known-answer vectors of Random123 (kat_vectors): counter, key, output
+        struct { uint32_t counter[4], key[2], output[4]; } vectors[] = {
+                {{0x00000000, 0x00000000, 0x00000000, 0x00000000}, {0x00000000, 0x00000000}, {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}},
+                {{0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff}, {0xffffffff, 0xffffffff}, {0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}},
+                {{0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}, {0xa4093822, 0x299f31d0}, {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}}
+        };
+        for (const auto &v : vectors) {
+            // Counter words 0-1: block index, 2-3: stream. Key: seed
+            Philox generator;
+            generator.SetSeed(((uint64_t)v.key[1] << 32) | v.key[0]);
+            generator.SetStream(((uint64_t)v.counter[3] << 32) | v.counter[2], ((uint64_t)v.counter[1] << 32) | v.counter[0]);
+            EXPECT_EQ(generator.rnd(), PhiloxDouble(v.output[0], v.output[1]));
+            EXPECT_EQ(generator.rnd(), PhiloxDouble(v.output[2], v.output[3]));
+        }
+    }
+
+    TEST(PhiloxTest, FillUniformMatchesRnd) {
+        Philox a, b;
+        a.SetSeed(42);
+        b.SetSeed(42);
+        a.SetStream(7);
+        b.SetStream(7);
+        std::vector<double> values(3 + 5 * 8 + 3);
+        a.rnd(); a.rnd(); a.rnd(); //FillUniform starting inside a block group
+        b.rnd(); b.rnd(); b.rnd();
+        a.FillUniform(values.data(), values.size());
+        for (double value : values) EXPECT_EQ(value, b.rnd());
+        EXPECT_EQ(a.rnd(), b.rnd());
+    }
+
+    TEST(PolygonGridTest, MatchesIsInPoly) {
+        const double pi = 3.14159265358979323846;
+        std::mt19937_64 generator(42);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        std::vector<std::vector<Vector2d>> polygons;
+        std::vector<Vector2d> circle, star, comb;
+        for (size_t i = 0; i < 256; i++) //Convex: most cells entirely inside or outside
+            circle.emplace_back(0.5 + 0.5 * cos(2.0 * pi * i / 256.0), 0.5 + 0.5 * sin(2.0 * pi * i / 256.0));
+        for (size_t i = 0; i < 40; i++) { //Random radius: concave, many edges per cell
+            double r = 0.1 + 0.4 * uniform(generator);
+            star.emplace_back(0.5 + r * cos(2.0 * pi * i / 40.0), 0.5 + r * sin(2.0 * pi * i / 40.0));
+        }
+        for (size_t i = 0; i < 10; i++) { //Teeth: vertical edges, vertices sharing coordinates
+            comb.emplace_back(0.1 * i, 1.0);
+            comb.emplace_back(0.1 * i + 0.05, 1.0);
+            comb.emplace_back(0.1 * i + 0.05, 0.2);
+            comb.emplace_back(0.1 * i + 0.1, 0.2);
+        }
+        comb.emplace_back(1.0, 0.0);
+        comb.emplace_back(0.0, 0.0);
+        polygons = { circle, star, comb };
+
+        for (const auto &polygon : polygons) {
+            PolygonGrid grid;
+            grid.Build(polygon);
+            ASSERT_TRUE(grid.IsBuilt());
+            std::vector<Vector2d> points = polygon; //Vertices and edge midpoints: the boundary cases
+            for (size_t i = 0; i < polygon.size(); i++) {
+                const Vector2d &next = polygon[(i + 1) % polygon.size()];
+                points.emplace_back(0.5 * (polygon[i].u + next.u), 0.5 * (polygon[i].v + next.v));
+            }
+            for (size_t i = 0; i < 200000; i++) points.emplace_back(uniform(generator) * 1.2 - 0.1, uniform(generator) * 1.2 - 0.1);
+            size_t nbDifferences = 0;
+            for (const Vector2d &point : points) {
+                if (grid.IsInside(point) != IsInPoly(point, polygon)) nbDifferences++;
+            }
+            EXPECT_EQ(nbDifferences, 0u);
+        }
+    }
+
+    // Headless application (molflowCore), created once for the tests that load and save geometries
+    Worker &HeadlessWorker() {
+        static MolFlow *app = nullptr;
+        if (!app) {
+            app = new MolFlow(); //Sets mApp
+            app->worker.SetProcNumber(1); //Result buffers are built for the simulation threads on reload
+        }
+        return app->worker;
+    }
+
+    std::string ReadWholeFile(const std::string &fileName) {
+        std::string content;
+        FILE *f = fopen(fileName.c_str(), "rb");
+        if (!f) return content;
+        char buffer[65536];
+        size_t nbRead;
+        while ((nbRead = fread(buffer, 1, sizeof(buffer), f)) > 0) content.append(buffer, nbRead);
+        fclose(f);
+        return content;
+    }
+
+    TEST(GeoCompressionTest, GeoGzRoundTrip) {
+        Worker &worker = HeadlessWorker();
+        GLProgress prg("Saving...", "Please wait");
+        worker.LoadGeometry(std::string(MOLFLOW_TEST_FILES) + "pumpmodel.geo");
+        size_t nbFacet = worker.GetGeometry()->GetNbFacet();
+        size_t nbVertex = worker.GetGeometry()->GetNbVertex();
+        size_t nbDesorbed = worker.globalHitCache.globalHits.nbDesorbed;
+        size_t nbHit = worker.globalHitCache.globalHits.nbMCHit;
+
+        // .geo.gz is a gzip stream: older versions open .geo7z with 7za, so gzip must not be written under that extension
+        worker.SaveGeometry("roundtrip_plain.geo", &prg, false);
+        worker.SaveGeometry("roundtrip.geo.gz", &prg, false);
+        std::string compressed = ReadWholeFile("roundtrip.geo.gz");
+        ASSERT_GT(compressed.size(), 2u);
+        EXPECT_EQ((unsigned char)compressed[0], 0x1f);
+        EXPECT_EQ((unsigned char)compressed[1], 0x8b);
+        std::string plain = ReadWholeFile("roundtrip_plain.geo");
+        EXPECT_LT(compressed.size(), plain.size());
+        std::string inflated;
+        {
+            GzStreamReader reader("roundtrip.geo.gz");
+            std::vector<char> chunk;
+            while (reader.NextChunk(chunk)) inflated.append(chunk.data(), chunk.size());
+        }
+        EXPECT_TRUE(inflated == plain); //Not EXPECT_EQ: no diff printout of the whole file
+
+        worker.LoadGeometry("roundtrip.geo.gz");
+        EXPECT_EQ(worker.GetGeometry()->GetNbFacet(), nbFacet);
+        EXPECT_EQ(worker.GetGeometry()->GetNbVertex(), nbVertex);
+        EXPECT_EQ(worker.globalHitCache.globalHits.nbDesorbed, nbDesorbed);
+        EXPECT_EQ(worker.globalHitCache.globalHits.nbMCHit, nbHit);
+
+        remove("roundtrip_plain.geo");
+        remove("roundtrip.geo.gz");
+    }
+
+    // Runs the worker's current job (simulation or AC matrix) until every thread is done
+    void RunUntilDone(Worker &worker) {
+        static auto start = std::chrono::steady_clock::now();
+        while (worker.isRunning) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            worker.Update(std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count() + 1.0f); //0 doesn't stop
+        }
+    }
+
+    // Pipe of radius 1 and length 2 (as Molflow's quick pipe): desorbing entrance, absorbing exit, reflecting meshed wall
+    double PipeTransmission(Worker &worker, size_t mode) {
+        MolflowGeometry *geom = worker.GetMolflowGeometry();
+        geom->BuildPipe(2.0, 1.0, 0.0, 16);
+        for (size_t i = 0; i < geom->GetNbFacet(); i++)
+            geom->SetFacetTexture(i, 5.0, true); //5 cells/cm: the AC elements
+        worker.CalcTotalOutgassing();
+        worker.wp.enableDecay = false;
+        worker.wp.gasMass = 28;
+        worker.ontheflyParams.randomSeed = 42;
+        worker.ontheflyParams.desorptionLimit = (mode == MC_MODE) ? 400000 : 0;
+        worker.ResetMoments();
+        worker.needsReload = true;
+        worker.RealReload();
+        worker.ResetStatsAndHits(0.0f);
+
+        if (mode == AC_MODE) {
+            worker.ComputeAC(1.0f);
+            RunUntilDone(worker); //View factors
+        }
+        worker.StartStop(1.0f, mode);
+        RunUntilDone(worker);
+        return geom->GetFacet(1)->facetHitCache.nbAbsEquiv / (double)worker.globalHitCache.globalHits.nbDesorbed;
+    }
+
+    TEST(ACModeTest, PipeTransmissionMatchesMC) {
+        Worker &worker = HeadlessWorker();
+        double transmissionMC = PipeTransmission(worker, MC_MODE);
+        double transmissionAC = PipeTransmission(worker, AC_MODE);
+        // Clausing's transmission probability of a round tube of length/radius 2 is 0.5136. The 16-sided section lowers it slightly.
+        // MC: 400000 desorptions, standard error 0.0008. AC: point-to-point view factors between 0.2 cm cells, about 1% low
+        EXPECT_NEAR(transmissionMC, 0.5136, 0.006);
+        EXPECT_NEAR(transmissionAC, transmissionMC, 0.02);
+        EXPECT_GT(worker.viewFactors.nbIterations, 0u);
+        EXPECT_LE(worker.viewFactors.residual, 1E-9);
+    }
+
+    // Per-facet MC hits of a seeded run of pumpmodel.xml (several structures, partially transparent facets) on nbThreads threads
+    std::vector<size_t> SeededFacetHits(Worker &worker, size_t nbThreads) {
+        worker.SetProcNumber(nbThreads);
+        worker.ontheflyParams.randomSeed = 1234;
+        worker.LoadGeometry(std::string(MOLFLOW_TEST_FILES) + "pumpmodel.xml");
+        worker.ResetStatsAndHits(0.0f);
+        worker.ontheflyParams.desorptionLimit = 4000; //About 150 hits each
+        if (worker.needsReload) worker.RealReload();
+        else worker.ChangeSimuParams();
+        worker.StartStop(1.0f, MC_MODE);
+        RunUntilDone(worker);
+
+        std::vector<size_t> hits = { worker.globalHitCache.globalHits.nbDesorbed, worker.globalHitCache.globalHits.nbMCHit };
+        for (size_t i = 0; i < worker.GetGeometry()->GetNbFacet(); i++)
+            hits.push_back(worker.GetGeometry()->GetFacet(i)->facetHitCache.nbMCHit);
+        return hits;
+    }
+
+    TEST(PhiloxTest, SeededRunIndependentOfThreadCount) {
+        // Each particle draws from its own stream: the same particles are simulated, whichever thread traces them
+        Worker &worker = HeadlessWorker();
+        std::vector<size_t> oneThread = SeededFacetHits(worker, 1);
+        std::vector<size_t> fourThreads = SeededFacetHits(worker, 4);
+        worker.SetProcNumber(1);
+        worker.ontheflyParams.randomSeed = 0;
+        EXPECT_EQ(oneThread[0], 4000u);
+        EXPECT_GT(oneThread[1], 0u);
+        EXPECT_EQ(oneThread, fourThreads);
+    }
+
+    // The old desorption source choice: scans the facets, adding up their outgassing until it exceeds the random number
+    const SubprocessFacet *LinearSourcePick(const Worker &worker, double srcRnd) {
+        double sumA = 0.0;
+        for (auto &s : worker.subprocessStructures) {
+            for (auto &f : s.facets) {
+                if (f.facetRef->sh.desorbType == DES_NONE) continue;
+                double facetOutgassing;
+                if (f.facetRef->sh.useOutgassingFile) {
+                    if (!(f.facetRef->sh.totalOutgassing > 0.0)) continue;
+                    facetOutgassing = worker.wp.latestMoment * f.facetRef->sh.totalOutgassing / (1.38E-23*f.facetRef->sh.temperature);
+                }
+                else {
+                    facetOutgassing =
+                        (f.facetRef->sh.outgassing_paramId >= 0)
+                        ? worker.IDs[f.facetRef->sh.IDid].back().second / (1.38E-23*f.facetRef->sh.temperature)
+                        : worker.wp.latestMoment*f.facetRef->sh.outgassing / (1.38E-23*f.facetRef->sh.temperature);
+                }
+                if ((srcRnd >= sumA) && (srcRnd < (sumA + facetOutgassing))) return &f;
+                sumA += facetOutgassing;
+            }
+        }
+        return NULL;
+    }
+
+    TEST(SourceCdfTest, MatchesLinearScan) {
+        Worker &worker = HeadlessWorker();
+        worker.LoadGeometry(std::string(MOLFLOW_TEST_FILES) + "pumpmodel.xml");
+        if (worker.needsReload) worker.RealReload();
+        ASSERT_GT(worker.sourceCdf.size(), 1u);
+        ASSERT_EQ(worker.sourceCdf.size(), worker.sourceFacets.size());
+        EXPECT_NEAR(worker.sourceCdf.back(), worker.wp.totalDesorbedMolecules, 1E-9 * worker.wp.totalDesorbedMolecules);
+
+        std::mt19937_64 generator(42);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        size_t nbDifferences = 0;
+        std::vector<size_t> nbPicks(worker.sourceFacets.size(), 0);
+        for (size_t i = 0; i < 100000; i++) {
+            double srcRnd = uniform(generator) * worker.sourceCdf.back();
+            size_t sourceIndex = std::upper_bound(worker.sourceCdf.begin(), worker.sourceCdf.end(), srcRnd) - worker.sourceCdf.begin();
+            ASSERT_LT(sourceIndex, worker.sourceCdf.size());
+            if (worker.sourceFacets[sourceIndex] != LinearSourcePick(worker, srcRnd)) nbDifferences++;
+            nbPicks[sourceIndex]++;
+        }
+        EXPECT_EQ(nbDifferences, 0u);
+        for (size_t i = 0; i < nbPicks.size(); i++) {
+            double expected = 100000.0 * (worker.sourceCdf[i] - ((i > 0) ? worker.sourceCdf[i - 1] : 0.0)) / worker.sourceCdf.back();
+            EXPECT_NEAR((double)nbPicks[i], expected, 5.0 * std::sqrt(expected) + 1.0) << "source " << i; //Picked in proportion to outgassing
+        }
+    }
+
+    // Moment series an index is built for: even spacing (direct lookup), uneven and unsorted moments (binary search), overlapping windows
+    TEST(MomentIndexTest, MatchesLinearScan) {
+        std::vector<std::pair<std::vector<double>, double>> cases; //moments, time window
+        std::vector<double> series;
+        for (size_t i = 0; i < 1000; i++) series.push_back(1E-3 + (double)i * 1E-4); //"0.001,0.0001,0.1" series
+        cases.emplace_back(series, 1E-4);
+        cases.emplace_back(series, 3.5E-4);
+        std::mt19937_64 generator(42);
+        std::uniform_real_distribution<double> uniform(0.0, 0.1);
+        std::vector<double> scattered;
+        for (size_t i = 0; i < 300; i++) scattered.push_back(uniform(generator));
+        cases.emplace_back(scattered, 2E-4);
+        cases.emplace_back(scattered, 5E-3);
+        cases.emplace_back(std::vector<double>{ 0.05 }, 1E-3);
+        cases.emplace_back(std::vector<double>{ 0.03, 0.01, 0.02, 0.02 }, 1E-2); //Duplicate moment, windows touching
+
+        for (size_t c = 0; c < cases.size(); c++) {
+            const std::vector<double> &moments = cases[c].first;
+            double timeWindowSize = cases[c].second;
+            MomentIndex index;
+            index.Build(moments, timeWindowSize);
+
+            std::vector<double> times;
+            for (size_t i = 0; i < 20000; i++) times.push_back(uniform(generator) * 1.1 - 0.005);
+            for (double m : moments) { //Window edges and their neighbours
+                for (double t : { m - timeWindowSize / 2.0, m + timeWindowSize / 2.0 }) {
+                    times.push_back(t);
+                    times.push_back(std::nextafter(t, -1.0));
+                    times.push_back(std::nextafter(t, 1.0));
+                }
+            }
+
+            size_t nbDifferences = 0;
+            for (double time : times) {
+                std::vector<size_t> expected;
+                for (size_t m = 0; m < moments.size(); m++) {
+                    if (std::abs(time - moments[m]) < timeWindowSize / 2.0) expected.push_back(m + 1);
+                }
+                std::vector<size_t> found;
+                index.GetMoments(time, found);
+                std::sort(found.begin(), found.end());
+                if (found != expected) nbDifferences++;
+            }
+            EXPECT_EQ(nbDifferences, 0u) << "case " << c;
+        }
+    }
+
+    // The worker's hit counts, sums and textures of every facet and moment
+    std::vector<double> MomentResultValues(Worker &worker) {
+        std::vector<double> values;
+        for (auto &state : worker.results.facetStates) {
+            for (auto &snapshot : state.momentResults) {
+                values.push_back((double)snapshot.hits.nbMCHit);
+                values.push_back(snapshot.hits.nbHitEquiv);
+                values.push_back(snapshot.hits.sum_v_ort);
+                for (auto &cell : snapshot.texture) values.push_back(cell.countEquiv);
+            }
+        }
+        return values;
+    }
+
+    // Seeded pumpmodel.xml run with 50 time moments, on one thread: see MomentResultValues
+    std::vector<double> SeededMomentResults(Worker &worker, bool sparse) {
+        worker.SetProcNumber(1);
+        worker.ontheflyParams.randomSeed = 1234;
+        worker.LoadGeometry(std::string(MOLFLOW_TEST_FILES) + "pumpmodel.xml");
+        worker.moments.clear();
+        worker.AddMoment(worker.ParseMoment("1E-4,1E-4,5E-3"));
+        worker.wp.timeWindowSize = 1E-4;
+        worker.sparseMomentResults = sparse;
+        worker.needsReload = true;
+        worker.RealReload();
+        worker.ResetStatsAndHits(0.0f);
+        worker.ontheflyParams.desorptionLimit = 4000;
+        worker.ChangeSimuParams();
+        worker.StartStop(1.0f, MC_MODE);
+        RunUntilDone(worker);
+        return MomentResultValues(worker);
+    }
+    TEST(SparseMomentsTest, MatchDenseResults) {
+        Worker &worker = HeadlessWorker();
+        std::vector<double> dense = SeededMomentResults(worker, false);
+        std::vector<double> sparse = SeededMomentResults(worker, true);
+        ASSERT_EQ(worker.moments.size(), 50u);
+        worker.moments.clear();
+        worker.sparseMomentResults = true;
+        worker.ontheflyParams.randomSeed = 0;
+
+        size_t nbFacet = worker.results.facetStates.size();
+        double momentHits = 0.0;
+        for (size_t f = 0; f < nbFacet; f++) {
+            for (size_t m = 1; m <= 50; m++) momentHits += worker.results.facetStates[f].momentResults[m].hits.nbHitEquiv;
+        }
+        EXPECT_GT(momentHits, 0.0); //The moments are reached
+        ASSERT_EQ(dense.size(), sparse.size());
+        size_t nbDifferences = 0;
+        for (size_t i = 0; i < dense.size(); i++) {
+            //Same particles: counts are equal, sums only differ by the order partial sums were merged in
+            if (!(std::abs(dense[i] - sparse[i]) <= 1E-12 * std::abs(dense[i]))) nbDifferences++;
+        }
+        EXPECT_EQ(nbDifferences, 0u);
+    }
+
+    // .zip files hold the simulation state as a binary .mfres file next to the XML: every facet and moment must come back unchanged
+    TEST(ResultFileTest, ZipRoundTrip) {
+        Worker &worker = HeadlessWorker();
+        std::vector<double> saved = SeededMomentResults(worker, true);
+        worker.userMoments = { "1E-4,1E-4,5E-3" }; //Saved in the XML, moments are parsed from it on load
+        worker.ontheflyParams.randomSeed = 0;
+        GlobalHitBuffer savedHits = worker.globalHitCache;
+        GLProgress prg("Saving...", "Please wait");
+        worker.SaveGeometry("roundtrip.zip", &prg, false);
+
+        worker.LoadGeometry("roundtrip.zip");
+        remove("roundtrip.zip");
+        EXPECT_EQ(worker.moments.size(), 50u);
+        EXPECT_EQ(worker.globalHitCache.globalHits.nbDesorbed, savedHits.globalHits.nbDesorbed);
+        EXPECT_EQ(worker.globalHitCache.globalHits.nbMCHit, savedHits.globalHits.nbMCHit);
+        EXPECT_EQ(worker.globalHitCache.globalHits.nbHitEquiv, savedHits.globalHits.nbHitEquiv);
+        EXPECT_EQ(worker.globalHitCache.nbLeakTotal, savedHits.nbLeakTotal);
+        EXPECT_EQ(worker.globalHitCache.hitCacheSize, savedHits.hitCacheSize);
+        EXPECT_EQ(worker.globalHitCache.texture_limits[0].max.all, savedHits.texture_limits[0].max.all);
+        std::vector<double> loaded = MomentResultValues(worker);
+        EXPECT_TRUE(loaded == saved); //Not EXPECT_EQ: no printout of 130000 values
+        worker.moments.clear();
+        worker.userMoments.clear();
+    }
+
+    // Hits pushed by two simulation threads go to the binary log file unchanged, and its CSV export has one line per hit
+    TEST(ParticleLogTest, BinaryToCsvRoundTrip) {
+        Worker &worker = HeadlessWorker();
+        worker.LoadGeometry(std::string(MOLFLOW_TEST_FILES) + "pumpmodel.xml");
+        Geometry *geom = worker.GetGeometry();
+
+        std::mt19937_64 generator(42);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        std::vector<ParticleLogRecord> pushed(3 * PARTICLELOG_RING_SIZE); //The rings fill up: the producers wait for the writer
+        for (size_t i = 0; i < pushed.size(); i++) {
+            ParticleLogRecord &r = pushed[i];
+            r.particleId = i;
+            r.facetId = (uint32_t)(generator() % geom->GetNbFacet());
+            r.u = (float)uniform(generator);
+            r.v = (float)uniform(generator);
+            r.hitTheta = (float)(uniform(generator) * PI / 2.0);
+            r.hitPhi = (float)((uniform(generator) - 0.5) * 2.0 * PI);
+            r.oriRatio = (float)uniform(generator);
+            r.velocity = (float)(uniform(generator) * 1000.0);
+            r.time = uniform(generator) * 1E-2;
+            r.particleDecayMoment = (i % 2) ? uniform(generator) : std::numeric_limits<double>::infinity();
+        }
+
+        ParticleLogRing rings[2];
+        ParticleLogWriter writer;
+        writer.Start("particle_log_test.bin", { &rings[0], &rings[1] }, 0);
+        std::vector<std::thread> producers;
+        for (size_t t = 0; t < 2; t++) {
+            producers.emplace_back([&, t] {
+                for (size_t i = t; i < pushed.size(); i += 2) {
+                    while (!rings[t].Push(pushed[i])) {
+                        writer.Wake();
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+        for (auto &producer : producers) producer.join();
+        writer.Stop();
+        EXPECT_EQ(writer.GetNbWritten(), pushed.size());
+        EXPECT_TRUE(writer.GetError().empty());
+
+        std::vector<ParticleLogRecord> written(pushed.size());
+        {
+            ParticleLogReader reader("particle_log_test.bin");
+            ASSERT_EQ(reader.GetNbRecords(), pushed.size());
+            EXPECT_EQ(reader.Read(written.data(), written.size()), pushed.size());
+        }
+        std::vector<ParticleLogRecord> sorted = written; //The writer interleaves the rings
+        std::sort(sorted.begin(), sorted.end(), [](const ParticleLogRecord &a, const ParticleLogRecord &b) { return a.particleId < b.particleId; });
+        size_t nbDifferences = 0;
+        for (size_t i = 0; i < pushed.size(); i++) {
+            const ParticleLogRecord &a = pushed[i], &b = sorted[i];
+            if (a.particleId != b.particleId || a.facetId != b.facetId || a.u != b.u || a.v != b.v || a.hitTheta != b.hitTheta || a.hitPhi != b.hitPhi
+                || a.oriRatio != b.oriRatio || a.velocity != b.velocity || a.time != b.time || a.particleDecayMoment != b.particleDecayMoment) nbDifferences++;
+        }
+        EXPECT_EQ(nbDifferences, 0u);
+
+        std::stringstream csv;
+        size_t nbExported = ExportParticleLog("particle_log_test.bin", geom, ",", csv, [](double) { return true; });
+        remove("particle_log_test.bin");
+        EXPECT_EQ(nbExported, pushed.size());
+        std::string line;
+        std::getline(csv, line);
+        EXPECT_EQ(line.substr(0, 18), "Facet,Particle_ID,");
+        size_t nbLines = 0;
+        nbDifferences = 0;
+        while (std::getline(csv, line)) {
+            std::vector<double> columns;
+            std::stringstream lineStream(line);
+            std::string column;
+            while (std::getline(lineStream, column, ',')) columns.push_back(std::strtod(column.c_str(), NULL));
+            ASSERT_EQ(columns.size(), 16u) << line;
+            const ParticleLogRecord &r = written[nbLines++]; //In file order
+            Facet *f = geom->GetFacet(r.facetId);
+            Vector3d hitPos = f->sh.O + (double)r.u * f->sh.U + (double)r.v * f->sh.V;
+            Vector3d hitDir = sin(r.hitTheta)*cos(r.hitPhi) * f->sh.nU + sin(r.hitTheta)*sin(r.hitPhi) * f->sh.nV + cos(r.hitTheta) * f->sh.N;
+            double scale = 1E-8 * (std::abs(hitPos.x) + std::abs(hitPos.y) + std::abs(hitPos.z) + 1.0);
+            if (columns[0] != r.facetId + 1 || columns[1] != (double)r.particleId
+                || std::abs(columns[2] - hitPos.x) > scale || std::abs(columns[3] - hitPos.y) > scale || std::abs(columns[4] - hitPos.z) > scale
+                || std::abs(columns[7] - hitDir.x) > 1E-8 || std::abs(columns[8] - hitDir.y) > 1E-8 || std::abs(columns[9] - hitDir.z) > 1E-8
+                || (float)columns[5] != r.u || (float)columns[6] != r.v || (float)columns[10] != r.hitTheta || (float)columns[11] != r.hitPhi
+                || (float)columns[12] != r.oriRatio || (float)columns[13] != r.velocity
+                || std::abs(columns[14] - r.time) > 1E-14 * r.time || !(columns[15] == r.particleDecayMoment || std::abs(columns[15] - r.particleDecayMoment) <= 1E-14)) nbDifferences++;
+        }
+        EXPECT_EQ(nbLines, pushed.size());
+        EXPECT_EQ(nbDifferences, 0u);
+    }
+
+    // Compiled formulas (constant folding, postfix program) give the values of the expressions as written, with x=3, y=4, z=5
+    TEST(FormulaTest, GoldenValues) {
+        std::vector<std::pair<const char *, double>> cases = {
+            { "1+2*3", 7.0 },
+            { "(1+2)*3-4/8", 8.5 },
+            { "-(3-5)*2", 4.0 },
+            { "1E-3*2+0.5", 0.502 },
+            { "2^10", 1024.0 },
+            { "pow(2,0.5)*pow(2,0.5)", 2.0 },
+            { "sqrt(16)+abs(-3)+fact(5)", 127.0 },
+            { "ln(exp(2))", 2.0 },
+            { "log10(1000)+log2(8)", 6.0 },
+            { "sin(PI/2)+cos(0)+tan(0)", 2.0 },
+            { "asin(1)+acos(1)+atan(1)", 0.75 * PI },
+            { "cosh(0)+sinh(0)+tanh(0)", 1.0 },
+            { "inv(4)", 0.25 },
+            { "x*y-z", 7.0 },
+            { "x*2+3*4-y", 14.0 }, //Folded constants next to variables
+            { "-x+y*(z-1)/2", 5.0 },
+            { "(x+y+z)/(x*y*z)*60", 12.0 },
+            { "X^2+Y*x-z", 16.0 } //Variable names are case-insensitive
+        };
+        for (auto &c : cases) {
+            GLParser parser;
+            parser.SetExpression(c.first);
+            ASSERT_TRUE(parser.Parse()) << c.first << ": " << parser.GetErrorMsg();
+            parser.SetVariable("x", 3.0);
+            parser.SetVariable("y", 4.0);
+            parser.SetVariable("z", 5.0);
+            double result;
+            ASSERT_TRUE(parser.Evaluate(&result)) << c.first << ": " << parser.GetErrorMsg();
+            EXPECT_NEAR(result, c.second, 1E-12 * std::abs(c.second)) << c.first;
+        }
+
+        for (const char *expression : { "1+", "sin(1", "(2*3", "pow(2)" }) {
+            GLParser parser;
+            parser.SetExpression(expression);
+            EXPECT_FALSE(parser.Parse()) << expression;
+        }
+
+        for (const char *expression : { "1/(x-3)", "inv(x-3)" }) {
+            GLParser parser;
+            parser.SetExpression(expression);
+            ASSERT_TRUE(parser.Parse());
+            parser.SetVariable("x", 3.0);
+            double result;
+            EXPECT_FALSE(parser.Evaluate(&result)) << expression;
+            EXPECT_STREQ(parser.GetErrorMsg(), "Divide by 0");
+        }
+
+        // Batch evaluation: the same values as one Evaluate() per point, NaN where a point fails
+        GLParser parser;
+        parser.SetExpression("sqrt(x)/(y-2)+z*3");
+        ASSERT_TRUE(parser.Parse());
+        std::vector<double> xs = { 0.0, 1.0, 4.0, 9.0, 2.5 };
+        std::vector<double> ys = { 1.0, 2.0, 3.0, 6.0, -1.0 };
+        std::vector<const double *> values(parser.GetNbVariable(), NULL);
+        for (int i = 0; i < parser.GetNbVariable(); i++) {
+            std::string name = parser.GetVariableAt(i)->name;
+            if (name == "x") values[i] = xs.data();
+            else if (name == "y") values[i] = ys.data();
+        }
+        parser.SetVariable("z", 5.0); //Not in the batch: current value for every point
+        std::vector<double> batch(xs.size());
+        ASSERT_TRUE(parser.EvaluateBatch(values.data(), xs.size(), batch.data()));
+        for (size_t i = 0; i < xs.size(); i++) {
+            parser.SetVariable("x", xs[i]);
+            parser.SetVariable("y", ys[i]);
+            double result;
+            if (parser.Evaluate(&result)) EXPECT_EQ(batch[i], result) << "point " << i;
+            else EXPECT_TRUE(std::isnan(batch[i])) << "point " << i;
+        }
+        EXPECT_TRUE(std::isnan(batch[1])); //y=2
+        EXPECT_EQ(batch[2], 17.0);
+    }
+
+    // Facet neighbors from the edge hash: the facet pairs GetCommonEdges accepts, in ascending order
+    TEST(GeometryTest, NeighborsMatchCommonEdges) {
+        Worker &worker = HeadlessWorker();
+        worker.LoadGeometry(std::string(MOLFLOW_TEST_FILES) + "pumpmodel.xml");
+        Geometry *geom = worker.GetGeometry();
+        GLProgress prg("Analyzing...", "Please wait");
+        size_t nbFacet = geom->GetNbFacet();
+        ASSERT_EQ(geom->AnalyzeNeighbors(&worker, &prg), nbFacet);
+
+        size_t nbNeighbors = 0, nbDifferences = 0;
+        for (size_t i = 0; i < nbFacet; i++) {
+            Facet *f1 = geom->GetFacet(i);
+            std::vector<size_t> expected;
+            for (size_t j = 0; j < nbFacet; j++) {
+                size_t c1, c2, chainLength;
+                if (j != i && geom->GetCommonEdges(f1, geom->GetFacet(j), &c1, &c2, &chainLength)) expected.push_back(j);
+            }
+            std::vector<size_t> found;
+            for (auto &neighbor : f1->neighbors) {
+                found.push_back(neighbor.id);
+                double dotProduct = std::min(1.0, std::max(-1.0, Dot(f1->sh.N, geom->GetFacet(neighbor.id)->sh.N)));
+                if (neighbor.angleDiff != std::abs(std::acos(dotProduct))) nbDifferences++;
+            }
+            if (found != expected) nbDifferences++;
+            nbNeighbors += found.size();
+        }
+        EXPECT_GT(nbNeighbors, nbFacet); //Closed model: most facets have several neighbors
+        EXPECT_EQ(nbDifferences, 0u);
+    }
+
+    // pumpmodel.xml with every facet opaque: ray tracing results don't depend on the order the facets are tested in
+    void LoadOpaquePumpModel(Worker &worker) {
+        worker.LoadGeometry(std::string(MOLFLOW_TEST_FILES) + "pumpmodel.xml");
+        Geometry *geom = worker.GetGeometry();
+        for (size_t i = 0; i < geom->GetNbFacet(); i++) {
+            geom->GetFacet(i)->sh.opacity = 1.0;
+            geom->GetFacet(i)->sh.opacity_paramId = -1;
+        }
+        worker.needsReload = true;
+        worker.RealReload();
+    }
+
+    bool Contains(const AxisAlignedBoundingBox &outer, const AxisAlignedBoundingBox &inner) {
+        return outer.min.x <= inner.min.x && outer.min.y <= inner.min.y && outer.min.z <= inner.min.z
+               && outer.max.x >= inner.max.x && outer.max.y >= inner.max.y && outer.max.z >= inner.max.z;
+    }
+
+    // Checks the boxes of a subtree, collecting the facets of its leaves
+    void CheckAABBSubtree(const AABBNODE *node, std::vector<SubprocessFacet *> &leafFacets) {
+        if (node->left == NULL && node->right == NULL) {
+            for (SubprocessFacet *f : node->facets) {
+                EXPECT_TRUE(Contains(node->bb, f->facetRef->sh.bb));
+                leafFacets.push_back(f);
+            }
+            return;
+        }
+        ASSERT_TRUE(node->left != NULL && node->right != NULL);
+        EXPECT_TRUE(node->facets.empty());
+        EXPECT_TRUE(Contains(node->bb, node->left->bb));
+        EXPECT_TRUE(Contains(node->bb, node->right->bb));
+        CheckAABBSubtree(node->left, leafFacets);
+        CheckAABBSubtree(node->right, leafFacets);
+    }
+
+    TEST(RayTracingTest, SAHTreeHoldsEveryFacetOnce) {
+        Worker &worker = HeadlessWorker();
+        LoadOpaquePumpModel(worker);
+        std::vector<SubprocessFacet *> facetPointers;
+        for (auto &f : worker.subprocessStructures[0].facets) facetPointers.push_back(&f);
+        ASSERT_GT(facetPointers.size(), 100u);
+        std::vector<SubprocessFacet *> sortedFacets = facetPointers;
+        std::sort(sortedFacets.begin(), sortedFacets.end());
+
+        for (size_t leafSize : {1, 4, 16}) {
+            AABBNODE *root = BuildAABBTree(facetPointers, leafSize);
+            std::vector<SubprocessFacet *> leafFacets;
+            CheckAABBSubtree(root, leafFacets);
+            std::sort(leafFacets.begin(), leafFacets.end());
+            EXPECT_TRUE(leafFacets == sortedFacets); //Each facet in exactly one leaf
+
+            AABBTreeStats stats = GetAABBTreeStats(root);
+            EXPECT_EQ(stats.nbLeafFacets, facetPointers.size());
+            EXPECT_LE(stats.maxLeafSize, leafSize); //pumpmodel.xml has no coinciding facet centers
+            delete root;
+        }
+    }
+
+    struct TestRay {
+        size_t structureId;
+        SubprocessFacet *source;
+        Vector3d position, direction;
+    };
+
+    // Cosine-distributed rays leaving random points of random facets, as in Worker::BenchmarkRayTracing
+    std::vector<TestRay> RandomRays(std::vector<SubProcessSuperStructure> &structures, size_t nbRays) {
+        std::mt19937_64 generator(42);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        std::vector<TestRay> rays;
+        std::vector<std::pair<size_t, SubprocessFacet *>> sources;
+        for (size_t s = 0; s < structures.size(); s++)
+            for (auto &f : structures[s].facets) sources.emplace_back(s, &f);
+        for (size_t i = 0; i < nbRays; i++) {
+            auto source = sources[std::min((size_t)(uniform(generator) * sources.size()), sources.size() - 1)];
+            const FacetProperties &sh = source.second->facetRef->sh;
+            double u, v;
+            size_t nbTries = 0;
+            do {
+                u = uniform(generator);
+                v = uniform(generator);
+            } while (!IsInFacet(*source.second, u, v) && ++nbTries < 100);
+            double theta = acos(sqrt(uniform(generator)));
+            double phi = uniform(generator) * 2.0 * 3.14159265358979323846;
+            rays.push_back({source.first, source.second, sh.O + u * sh.U + v * sh.V, PolarToCartesian(source.second, theta, phi, false)});
+        }
+        return rays;
+    }
+
+    // Rebuilds the trees of the structures, binary (width 1) or wide, as Worker::RealReload does
+    void RebuildTrees(std::vector<SubProcessSuperStructure> &structures, size_t leafSize, size_t width) {
+        for (auto &s : structures) {
+            std::vector<SubprocessFacet *> facetPointers;
+            for (auto &f : s.facets) facetPointers.push_back(&f);
+            AABBNODE *root = BuildAABBTree(facetPointers, leafSize);
+            if (width > 1) BuildWideAABBTree(root, s, width);
+            else FlattenAABBTree(root, s);
+            delete root;
+        }
+    }
+
+    // Traces the rays through the structures' current trees, with a ray tracing state not attached to a simulation thread
+    std::vector<std::tuple<bool, SubprocessFacet *, double>> TraceRays(Worker &worker, const std::vector<SubProcessSuperStructure> &structures,
+                                                                      const std::vector<TestRay> &rays) {
+        Simulation tracer(&worker);
+        tracer.ConstructFacetTmpVars();
+        tracer.myOtfp = worker.ontheflyParams;
+        tracer.myOtfp.enableLogging = false;
+        tracer.myTmpResults = worker.emptyResultTemplate;
+        tracer.currentParticle.flightTime = 0.0;
+        tracer.currentParticle.velocity = 1.0;
+        std::vector<std::tuple<bool, SubprocessFacet *, double>> results;
+        for (const TestRay &ray : rays) {
+            tracer.currentParticle.structureId = ray.structureId;
+            tracer.currentParticle.lastHitFacet = ray.source;
+            results.push_back(Intersect(&tracer, structures, ray.position, ray.direction));
+        }
+        return results;
+    }
+
+    TEST(RayTracingTest, FlattenedTreeMatchesLinearScan) {
+        Worker &worker = HeadlessWorker();
+        LoadOpaquePumpModel(worker);
+        std::vector<SubProcessSuperStructure> structures = worker.subprocessStructures;
+        std::vector<TestRay> rays = RandomRays(structures, 20000);
+
+        RebuildTrees(structures, 1000000, 1); //A single leaf: every facet is tested, as without a tree
+        auto reference = TraceRays(worker, structures, rays);
+        RebuildTrees(structures, worker.aabbLeafSize, 1);
+        auto traced = TraceRays(worker, structures, rays);
+
+        size_t nbHits = 0, nbDifferences = 0;
+        for (size_t i = 0; i < rays.size(); i++) {
+            if (std::get<0>(reference[i])) nbHits++;
+            if (traced[i] != reference[i]) nbDifferences++; //Same facet test arithmetic: exact match
+        }
+        EXPECT_GT(nbHits, rays.size() * 9 / 10);
+        EXPECT_EQ(nbDifferences, 0u);
+    }
+
+    TEST(RayTracingTest, WideTreesMatchBinaryTree) {
+        Worker &worker = HeadlessWorker();
+        LoadOpaquePumpModel(worker);
+        std::vector<SubProcessSuperStructure> structures = worker.subprocessStructures;
+        std::vector<TestRay> rays = RandomRays(structures, 20000);
+        RebuildTrees(structures, worker.aabbLeafSize, 1);
+        auto reference = TraceRays(worker, structures, rays);
+
+        for (size_t width : {4, 8}) {
+            if (width > GetSupportedAABBWidth()) continue;
+            RebuildTrees(structures, worker.aabbLeafSize, width);
+            auto traced = TraceRays(worker, structures, rays);
+            size_t nbDifferences = 0;
+            for (size_t i = 0; i < rays.size(); i++) {
+                if (traced[i] != reference[i]) nbDifferences++;
+            }
+            EXPECT_EQ(nbDifferences, 0u) << width << "-wide tree";
+        }
+    }
+
+    // Stop, pause or reload must interrupt the wavefront engine's step (about 1 s of bounces once calibrated), not wait for its end
+    TEST(WavefrontTest, StopInterruptsStep) {
+        Worker &worker = HeadlessWorker();
+        MolflowGeometry *geom = worker.GetMolflowGeometry();
+        geom->BuildPipe(2.0, 1.0, 0.0, 16);
+        worker.CalcTotalOutgassing();
+        worker.ontheflyParams.desorptionLimit = 0;
+        worker.ontheflyParams.wavefrontSize = 256;
+        worker.needsReload = true;
+        worker.RealReload();
+        worker.ResetStatsAndHits(0.0f);
+
+        worker.StartStop(1.0f, MC_MODE); //First run: the thread calibrates its step length
+        std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+        worker.StartStop(2.5f, MC_MODE);
+        ASSERT_FALSE(worker.isRunning);
+
+        worker.StartStop(3.0f, MC_MODE); //The thread starts a full step
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        auto stopStart = std::chrono::steady_clock::now();
+        worker.StartStop(3.2f, MC_MODE);
+        double stopMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - stopStart).count();
+        EXPECT_FALSE(worker.isRunning);
+        EXPECT_LT(stopMs, 400.0); //Without the check, the rest of the step: about 800 ms
+        EXPECT_GT(worker.globalHitCache.globalHits.nbMCHit, 0u);
+
+        worker.ontheflyParams.wavefrontSize = 0;
+    }
+
 }  // namespace
 
 int main(int argc, char **argv) {
@@ -0,0 +1,167 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+
+// molflowCLI: headless batch runner
+// Loads a geometry, runs the Monte Carlo simulation on K threads for N desorptions
+// and/or T seconds, then writes the result file. Built on the headless core
+// (MOLFLOW_CLI): no SDL or OpenGL code is compiled in, and the MolFlow application
+// object is the window-less one of MolflowHeadless.h.
+
+#include "MolFlow.h"
+#include "Worker.h"
+#include "MolflowGeometry.h"
+#include "File.h"
+#include "GLApp/GLProgress.h"
+#include "GLApp/MathTools.h" //Saturate
+#include "IntersectAABB_shared.h" //GetSupportedAABBWidth
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <chrono>
+
+extern MolFlow *mApp;
+
+static void PrintUsage(const char *exeName) {
+	printf("Usage: %s -f <file> [options]\n", exeName);
+	printf("  -f, --file <file>       Input file (.xml, .zip, .geo, .geo7z, .geo.gz)\n");
+	printf("  -o, --output <file>     Result file (.xml, .zip, .geo, .geo.gz). Default: <input>_result.zip\n");
+	printf("  -t, --threads <K>       Number of simulation threads. Default: all cores\n");
+	printf("  -d, --ndes <N>          Stop after N desorptions (summed over threads)\n");
+	printf("  -s, --duration <T>      Stop after T seconds of simulation\n");
+	printf("  -r, --reset             Discard the results stored in the input file before running\n");
+	printf("  -l, --leafsize <n>      Max. facets per ray-tracing tree leaf. Default: 4\n");
+	printf("  -w, --width <1|4|8>     Ray-tracing tree width: 1 (binary), 4 (SSE) or 8 (AVX2). Default: widest supported\n");
+	printf("  -v, --wavefront <n>     Trace n particles per thread together (wavefront engine). Default: one at a time\n");
+	printf("  -e, --seed <n>          Random seed (>0). Same seed, input and -d: same result with any number of threads\n");
+	printf("  -b, --benchmark <n>     Trace n random rays with each tree width and compare, instead of simulating\n");
+	printf("At least one of -d or -s is required (except with -b). Whichever limit is hit first ends the run.\n");
+}
+
+int main(int argc, char* argv[])
+{
+	std::string inputFile, outputFile;
+	size_t nbThreads = std::thread::hardware_concurrency();
+	size_t desorptionLimit = 0;
+	double duration = 0.0;
+	bool resetResults = false;
+	size_t leafSize = 0;
+	size_t treeWidth = 0;
+	size_t benchmarkRays = 0;
+	size_t seed = 0;
+	size_t wavefrontSize = 0;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if ((arg == "-f" || arg == "--file") && hasValue) inputFile = argv[++i];
+		else if ((arg == "-o" || arg == "--output") && hasValue) outputFile = argv[++i];
+		else if ((arg == "-t" || arg == "--threads") && hasValue) nbThreads = strtoull(argv[++i], NULL, 10);
+		else if ((arg == "-d" || arg == "--ndes") && hasValue) desorptionLimit = strtoull(argv[++i], NULL, 10);
+		else if ((arg == "-s" || arg == "--duration") && hasValue) duration = atof(argv[++i]);
+		else if (arg == "-r" || arg == "--reset") resetResults = true;
+		else if ((arg == "-l" || arg == "--leafsize") && hasValue) leafSize = strtoull(argv[++i], NULL, 10);
+		else if ((arg == "-w" || arg == "--width") && hasValue) treeWidth = strtoull(argv[++i], NULL, 10);
+		else if ((arg == "-v" || arg == "--wavefront") && hasValue) wavefrontSize = strtoull(argv[++i], NULL, 10);
+		else if ((arg == "-e" || arg == "--seed") && hasValue) seed = strtoull(argv[++i], NULL, 10);
+		else if ((arg == "-b" || arg == "--benchmark") && hasValue) benchmarkRays = strtoull(argv[++i], NULL, 10);
+		else {
+			PrintUsage(argv[0]);
+			return (arg == "-h" || arg == "--help") ? 0 : 1;
+		}
+	}
+	if (inputFile.empty() || (desorptionLimit == 0 && duration <= 0.0 && benchmarkRays == 0)) {
+		PrintUsage(argv[0]);
+		return 1;
+	}
+	if (outputFile.empty()) outputFile = FileUtils::StripExtension(inputFile) + "_result.zip";
+	Saturate(nbThreads, (size_t)1, MAX_PROCESS);
+
+	new MolFlow(); //Sets mApp
+	Worker& worker = mApp->worker;
+	if (leafSize > 0) worker.aabbLeafSize = leafSize;
+	worker.ontheflyParams.randomSeed = seed; //0: unseeded
+	worker.ontheflyParams.wavefrontSize = wavefrontSize;
+	if (treeWidth > 0) {
+		if ((treeWidth != 1 && treeWidth != 4 && treeWidth != 8) || treeWidth > GetSupportedAABBWidth()) {
+			fprintf(stderr, "Error: tree width %zd not supported on this CPU (max. %zd)\n", treeWidth, GetSupportedAABBWidth());
+			return 1;
+		}
+		worker.aabbWidth = treeWidth;
+	}
+
+	auto startTime = std::chrono::steady_clock::now();
+	auto elapsed = [&startTime]() -> float {
+		//Strictly positive: Worker::Update() only detects the end of the simulation for appTime != 0
+		return 1E-3f + std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
+	};
+
+	try {
+		printf("Starting %zd simulation threads...\n", nbThreads);
+		worker.SetProcNumber(nbThreads);
+
+		printf("Loading %s...\n", inputFile.c_str());
+		worker.LoadGeometry(inputFile);
+		if (resetResults) worker.ResetStatsAndHits(0.0f);
+
+		if (benchmarkRays > 0) {
+			worker.BenchmarkRayTracing(benchmarkRays);
+			worker.KillAll();
+			return 0;
+		}
+
+		worker.ontheflyParams.desorptionLimit = desorptionLimit; //0: no limit
+		if (worker.needsReload) worker.RealReload();
+		else worker.ChangeSimuParams();
+
+		size_t nbDesStart = worker.globalHitCache.globalHits.nbDesorbed;
+		printf("Geometry: %zd facets, %zd vertices. Running...\n", worker.GetGeometry()->GetNbFacet(), worker.GetGeometry()->GetNbVertex());
+		worker.StartStop(elapsed(), MC_MODE);
+		if (!worker.isRunning) throw Error("Simulation could not be started."); //Reason already printed by StartStop()
+
+		float lastPrint = 0.0f;
+		while (worker.isRunning) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+			float t = elapsed();
+			worker.Update(t); //Stops (isRunning=false) once all threads reached the desorption limit
+			if (duration > 0.0 && t >= duration && worker.isRunning) {
+				worker.StartStop(t, MC_MODE); //Time limit: pause the threads
+			}
+			if (t - lastPrint >= 1.0f || !worker.isRunning) {
+				size_t nbDes = worker.globalHitCache.globalHits.nbDesorbed - nbDesStart;
+				printf("[%7.1f s] %zd desorptions, %zd hits (%.3g des/s)\n", t, nbDes, worker.globalHitCache.globalHits.nbMCHit, (double)nbDes / (double)t);
+				fflush(stdout);
+				lastPrint = t;
+			}
+		}
+
+		printf("Writing %s...\n", outputFile.c_str());
+		GLProgress prg("Saving file...", "Please wait"); //Console output in headless mode
+		worker.SaveGeometry(outputFile, &prg, false);
+		worker.KillAll();
+	}
+	catch (Error &e) {
+		fprintf(stderr, "Error: %s\n", e.GetMsg());
+		worker.KillAll();
+		return 1;
+	}
+	printf("Done.\n");
+	return 0;
+}
@@ -0,0 +1,167 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+
+// Headless implementations for the molflowCLI core: the application object (see MolflowHeadless.h)
+// and the console versions of the GLApp dialogs still used by the worker and the geometry.
+
+#include "MolFlow.h"
+#include "MolflowGeometry.h"
+#include "GLApp/GLProgress.h"
+#include "GLApp/GLMessageBox.h"
+#include "GLApp/MathTools.h" //Saturate
+#include <stdio.h>
+#include <string.h>
+
+MolFlow *mApp;
+
+//Same prefixes as the GUI (MolFlow.cpp), used to renumber facets in formulas
+std::vector<std::string> formulaPrefixes = { "A","D","H","MCH","P","DEN","Z","V","T","AR","a","d","h","mch","p","den","z","v","t","ar","," };
+
+MolFlow::MolFlow() {
+	mApp = this;
+	headless = true;
+	nbView = 0;
+	changedSinceSave = false;
+	compressSavedFiles = true;
+	leftHandedView = false;
+	m_fTime = 0.0f;
+	needsMesh = needsTexture = needsDirection = false;
+	loadStatus = NULL;
+}
+
+void MolFlow::AddView(const char *viewName, AVIEW v) {
+
+	if (nbView < MAX_VIEW) {
+		views[nbView] = v;
+		views[nbView].name = strdup(viewName);
+		nbView++;
+	}
+	else {
+		SAFE_FREE(views[0].name);
+		for (int i = 0; i < MAX_VIEW - 1; i++) views[i] = views[i + 1];
+		views[MAX_VIEW - 1] = v;
+		views[MAX_VIEW - 1].name = strdup(viewName);
+	}
+}
+
+void MolFlow::ClearAllViews() {
+	for (int i = 0; i < nbView; i++) SAFE_FREE(views[i].name);
+	nbView = 0;
+}
+
+void MolFlow::AddSelection(SelectionGroup s) {
+	selections.push_back(s);
+}
+
+void MolFlow::ClearAllSelections() {
+	selections.clear();
+}
+
+void MolFlow::RenumberSelections(const std::vector<int> &newRefs) {
+	for (int i = 0; i < selections.size(); i++) {
+		for (int j = 0; i >= 0 && i < selections.size() && j >= 0 && j < selections[i].selection.size(); j++) {
+			if (selections[i].selection[j] >= newRefs.size() || newRefs[selections[i].selection[j]] == -1) { //remove from selection
+				selections[i].selection.erase(selections[i].selection.begin() + j);
+				j--; //Do again the element as now it's the next
+				if (selections[i].selection.size() == 0) {
+					selections.erase(selections.begin() + i); //last facet removed from selection
+					i--;
+				}
+			}
+			else { //renumber
+				selections[i].selection[j] = newRefs[selections[i].selection[j]];
+			}
+		}
+	}
+}
+
+void MolFlow::AddFormula(const char *fName, const char *formula) {
+	GLParser *f = new GLParser();
+	f->SetExpression(formula);
+	f->SetName(fName);
+	f->Parse();
+	formulas_n.push_back(f);
+}
+
+void MolFlow::ClearFormulas() {
+	for (auto& f : formulas_n)
+		SAFE_DELETE(f);
+	formulas_n.clear();
+}
+
+void MolFlow::RenumberFormulas(std::vector<int> *newRefs) {
+	for (auto& f : formulas_n) {
+		if (OffsetFormula(f->GetExpression(), 0, -1, newRefs)) {
+			f->Parse();
+		}
+	}
+}
+
+bool MolFlow::OffsetFormula(char* expression, int offset, int filter, std::vector<int> *newRefs) {
+	return GLParser::OffsetIndices(expression, formulaPrefixes, offset, filter, newRefs);
+}
+
+bool MolFlow::AskToReset(Worker *work) {
+	if (work == NULL) work = &worker;
+	if (work->globalHitCache.globalHits.nbMCHit > 0) work->ResetStatsAndHits(m_fTime);
+	return true;
+}
+
+// Display list and texture builders (GeometryRender_shared.cpp, GeometryRender.cpp are not part of the core):
+// called by the worker and the geometry after each change, nothing to build without a GL context
+
+void Geometry::DeleteGLLists(bool deletePoly, bool deleteLine) {}
+void Geometry::UpdateSelection() {}
+void Geometry::BuildGLList() {}
+void Geometry::BuildFacetList(Facet *f) {}
+void MolflowGeometry::BuildFacetTextures(GlobalSimuState& results, bool renderRegularTexture, bool renderDirectionTexture, size_t sMode) {}
+
+GLProgress::GLProgress(const char *message, const char *title) {
+	progress = 0;
+	if (message) printf("%s\n", message);
+}
+
+void GLProgress::SetProgress(double value) {
+	double v = value;
+	Saturate(v, 0.0, 1.0);
+	progress = (int)(v*100.0 + 0.5);
+}
+
+double GLProgress::GetProgress() {
+	return (double)progress / 100.0;
+}
+
+void GLProgress::SetMessage(std::string msg) {
+	SetMessage(msg.c_str());
+}
+
+void GLProgress::SetMessage(const char *msg) {
+	printf("%s\n", msg);
+}
+
+int GLMessageBox::Display(const char *message, const char *title, int mode, int icon) {
+	fprintf(stderr, "[%s] %s\n", title ? title : "Message", message);
+	return GLDLG_OK; //First button, as the GUI dialog returns it
+}
+
+int GLMessageBox::Display(const std::string & message, const std::string & title, const std::vector<std::string>& buttonList, int icon) {
+	fprintf(stderr, "[%s] %s\n", title.c_str(), message.c_str());
+	return 0; //First button
+}
@@ -0,0 +1,79 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+// Application object of the headless core (molflowCLI, MOLFLOW_CLI defined), included by MolFlow.h.
+// Keeps what the worker and the geometry read from or write to the application (worker, views, selections,
+// formulas, flags), without any window, menu or dialog. Everything the GUI would refresh is a no-op.
+
+#include "Worker.h"
+#include "GeometryViewer.h" //AVIEW, SelectionGroup
+#include "GLApp/GLParser.h"
+#include <vector>
+
+#define MAX_VIEW    19
+
+class LoadStatus;
+
+class MolFlow {
+public:
+	MolFlow();
+
+	// Views, selections and formulas: loaded with the geometry and saved back with the results
+	void AddView(const char *viewName, AVIEW v);
+	void ClearAllViews();
+	void AddSelection(SelectionGroup s);
+	void ClearAllSelections();
+	void RenumberSelections(const std::vector<int> &newRefs);
+	void AddFormula(const char *fName, const char *formula);
+	void ClearFormulas();
+	void RenumberFormulas(std::vector<int> *newRefs);
+	bool OffsetFormula(char* expression, int offset, int filter = -1, std::vector<int> *newRefs = NULL);
+
+	bool AskToReset(Worker *work = NULL); //Resets the results (no one to ask), returns true
+	bool AutoSave(bool crashSave = false) { return false; }
+
+	// Interface refreshes: nothing to refresh
+	void DoEvents(bool forced = false) {}
+	void UpdateModelParams() {}
+	void UpdateFacetParams(bool updateSelection = false) {}
+	void UpdateFacetlistSelected() {}
+	void UpdateViewers() {}
+	void UpdateTitle() {}
+	void UpdatePlotters() {}
+	void DisplayCollapseDialog() {}
+
+	Worker worker;
+
+	AVIEW   views[MAX_VIEW];
+	int     nbView;
+	std::vector<SelectionGroup> selections;
+	std::vector<GLParser*> formulas_n;
+
+	bool   headless; //Always true, for code shared with the GUI's Interface::headless
+	bool   changedSinceSave;
+	int    compressSavedFiles;
+	bool   leftHandedView;
+	float  m_fTime; //Application time, not advanced: the worker gets the time from its caller
+	bool   needsMesh;
+	bool   needsTexture;
+	bool   needsDirection;
+	LoadStatus *loadStatus; //Always NULL
+};
@@ -0,0 +1,401 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#include "FormulaEvaluator.h"
+#include "MolFlow.h"
+#include "Worker.h"
+#include "Facet_shared.h"
+#include "Geometry_shared.h"
+#include "GLApp/GLParser.h"
+#include "GLApp/MathTools.h"
+#include <map>
+#include <limits>
+#include <numeric> //std::iota
+
+extern MolFlow *mApp;
+
+/**
+* \brief Resolves a formula variable name (like P5, SUMDES, SUM(H,3,6) or AVG(P,S2))
+* \param name variable name as parsed
+* \param v resolved variable
+* \return false if the name is not a known variable
+*/
+bool FormulaEvaluator::Resolve(const char *name, FormulaVariable& v) {
+	v = FormulaVariable();
+	v.name = name;
+
+	//Facet quantities, in the order they are matched
+	static const std::vector<std::pair<const char*, FormulaQuantity>> facetPrefixes = {
+		{"A",FQ_ABS},{"D",FQ_DES},{"MCH",FQ_MCHIT},{"H",FQ_HIT},{"P",FQ_PRESSURE},
+		{"DEN",FQ_DENSITY},{"Z",FQ_IMPINGEMENT},{"V",FQ_VELOCITY},{"T",FQ_TEMPERATURE},{"AR",FQ_AREA}
+	};
+	for (auto& prefix : facetPrefixes) {
+		int idx = mApp->GetVariable(name, prefix.first);
+		if (idx > 0) {
+			v.quantity = prefix.second;
+			v.scope = FS_FACET;
+			v.firstFacet = (size_t)idx;
+			v.valid = true;
+			return true;
+		}
+	}
+
+	static const std::vector<std::pair<const char*, FormulaQuantity>> globals = {
+		{"SUMDES",FQ_SUMDES},{"SUMABS",FQ_SUMABS},{"SUMMCHIT",FQ_SUMMCHIT},{"SUMHIT",FQ_SUMHIT},
+		{"MPP",FQ_MPP},{"MFP",FQ_MFP},{"DESAR",FQ_DESAR},{"ABSAR",FQ_ABSAR},
+		{"QCONST",FQ_QCONST},{"QCONST_N",FQ_QCONST_N},{"NTOT",FQ_NTOT},{"GASMASS",FQ_GASMASS}
+	};
+	for (auto& global : globals) {
+		if (iequals(name, global.first)) {
+			v.quantity = global.second;
+			v.valid = true;
+			return true;
+		}
+	}
+
+	static const std::vector<std::pair<const char*, double>> constants = {
+		{"KB",1.3806504e-23},{"R",8.314472},{"Na",6.02214179e23}
+	};
+	for (auto& constant : constants) {
+		if (iequals(name, constant.first)) {
+			v.constant = constant.second;
+			v.valid = true;
+			return true;
+		}
+	}
+
+	if ((beginsWith(name, "SUM(") || beginsWith(name, "sum(") || beginsWith(name, "AVG(") || beginsWith(name, "avg(")) && endsWith(name, ")")) {
+		v.average = (beginsWith(name, "AVG(") || beginsWith(name, "avg(")); //else SUM mode
+		std::string inside = name; inside.erase(0, 4); inside.erase(inside.size() - 1, 1);
+		std::vector<std::string> tokens = SplitString(inside, ',');
+		if (!Contains({ 2,3 }, tokens.size()))
+			return false;
+		if (v.average) {
+			if (!Contains({ "P","DEN","Z","p","den","z" }, tokens[0]))
+				return false;
+		}
+		else {
+			if (!Contains({ "MCH","H","D","A","AR","mch","h","d","a","ar" }, tokens[0]))
+				return false;
+		}
+		static const std::map<std::string, FormulaQuantity> summed = {
+			{"MCH",FQ_MCHIT},{"H",FQ_HIT},{"D",FQ_DES},{"A",FQ_ABS},{"AR",FQ_AREA},
+			{"P",FQ_PRESSURE},{"DEN",FQ_DENSITY},{"Z",FQ_IMPINGEMENT}
+		};
+		std::string quantityName = tokens[0];
+		for (auto& c : quantityName) c = (char)toupper(c);
+		v.quantity = summed.at(quantityName);
+
+		if (tokens.size() == 3) { // Like SUM(H,3,6) = H3 + H4 + H5 + H6
+			long startId, endId;
+			size_t pos;
+			try {
+				startId = std::stol(tokens[1], &pos); if (pos != tokens[1].size() || startId <= 0) return false;
+				endId = std::stol(tokens[2], &pos); if (pos != tokens[2].size() || endId <= 0) return false;
+			}
+			catch (...) {
+				return false;
+			}
+			if (!(startId < endId)) return false;
+			v.scope = FS_RANGE;
+			v.firstFacet = (size_t)startId;
+			v.lastFacet = (size_t)endId;
+		}
+		else { //Selection group
+			if (!(beginsWith(tokens[1], "S") || beginsWith(tokens[1], "s"))) return false;
+			std::string selIdString = tokens[1]; selIdString.erase(0, 1);
+			v.scope = FS_SELECTION;
+			if (Contains({ "EL","el" }, selIdString)) { //Current selections
+				v.selectionGroup = -1;
+			}
+			else {
+				long selGroupId;
+				size_t pos;
+				try {
+					selGroupId = std::stol(selIdString, &pos); if (pos != selIdString.size() || selGroupId <= 0) return false;
+				}
+				catch (...) {
+					return false;
+				}
+				v.selectionGroup = (int)selGroupId - 1;
+			}
+		}
+		v.valid = true;
+		return true;
+	}
+	return false;
+}
+
+/**
+* \brief Facets a SUM() or AVG() variable reads, checked against the current geometry and selection groups
+* \return false if the range or the selection group doesn't exist
+*/
+bool FormulaEvaluator::GetFacets(const FormulaVariable& v, std::vector<size_t>& facets) {
+	Geometry *geom = mApp->worker.GetGeometry();
+	if (v.scope == FS_RANGE) {
+		if (v.lastFacet > geom->GetNbFacet()) return false;
+		facets.resize(v.lastFacet - v.firstFacet + 1);
+		std::iota(facets.begin(), facets.end(), v.firstFacet - 1);
+	}
+	else if (v.selectionGroup < 0) {
+		facets = geom->GetSelectedFacets();
+	}
+	else {
+		if (v.selectionGroup >= (int)mApp->selections.size()) return false;
+		facets = mApp->selections[v.selectionGroup].selection;
+	}
+	return true;
+}
+
+/**
+* \brief Computes the value of a resolved variable
+* \param hitsOf function returning the counters of a facet (by index) to read
+* \param moleculesPerTP scaling of the counters to physical quantities (Worker::GetMoleculesPerTP)
+*/
+template <typename HitsOf>
+bool FormulaEvaluator::Compute(const FormulaVariable& v, HitsOf hitsOf, double moleculesPerTP, double& value) {
+	Worker& worker = mApp->worker;
+	Geometry *geom = worker.GetGeometry();
+	size_t nbFacet = geom->GetNbFacet();
+
+	if (!v.valid) return false;
+
+	if (v.scope == FS_GLOBAL) {
+		switch (v.quantity) {
+		case FQ_SUMDES: value = (double)worker.globalHitCache.globalHits.nbDesorbed; break;
+		case FQ_SUMABS: value = worker.globalHitCache.globalHits.nbAbsEquiv; break;
+		case FQ_SUMMCHIT: value = (double)worker.globalHitCache.globalHits.nbMCHit; break;
+		case FQ_SUMHIT: value = worker.globalHitCache.globalHits.nbHitEquiv; break;
+		case FQ_MPP: value = worker.globalHitCache.distTraveled_total / (double)worker.globalHitCache.globalHits.nbDesorbed; break;
+		case FQ_MFP: value = worker.globalHitCache.distTraveledTotal_fullHitsOnly / worker.globalHitCache.globalHits.nbHitEquiv; break;
+		case FQ_DESAR: {
+			double sumArea = 0.0;
+			for (size_t i = 0; i < nbFacet; i++) {
+				Facet *f = geom->GetFacet(i);
+				if (f->sh.desorbType) sumArea += f->GetArea();
+			}
+			value = sumArea;
+			break;
+		}
+		case FQ_ABSAR: {
+			double sumArea = 0.0;
+			for (size_t i = 0; i < nbFacet; i++) {
+				Facet *f = geom->GetFacet(i);
+				if (f->sh.sticking > 0.0) sumArea += f->GetArea()*f->sh.opacity;
+			}
+			value = sumArea;
+			break;
+		}
+		case FQ_QCONST: value = worker.wp.finalOutgassingRate_Pa_m3_sec*10.00; break; //10: Pa*m3/sec -> mbar*l/s
+		case FQ_QCONST_N: value = worker.wp.finalOutgassingRate; break;
+		case FQ_NTOT: value = worker.wp.totalDesorbedMolecules; break;
+		case FQ_GASMASS: value = worker.wp.gasMass; break;
+		case FQ_CONSTANT: value = v.constant; break;
+		default: return false;
+		}
+		return true;
+	}
+
+	if (v.scope == FS_FACET) {
+		if (v.firstFacet > nbFacet) return false;
+		Facet *f = geom->GetFacet(v.firstFacet - 1);
+		const FacetHitBuffer& hits = hitsOf(v.firstFacet - 1);
+		switch (v.quantity) {
+		case FQ_ABS: value = hits.nbAbsEquiv; break;
+		case FQ_DES: value = (double)hits.nbDesorbed; break;
+		case FQ_MCHIT: value = (double)hits.nbMCHit; break;
+		case FQ_HIT: value = hits.nbHitEquiv; break;
+		case FQ_PRESSURE: value = hits.sum_v_ort * moleculesPerTP*1E4 / f->GetArea() * (worker.wp.gasMass / 1000 / 6E23)*0.0100; break;
+		case FQ_DENSITY: value = f->DensityCorrection() * hits.sum_1_per_ort_velocity / f->GetArea() * moleculesPerTP*1E4; break;
+		case FQ_IMPINGEMENT: value = hits.nbHitEquiv / f->GetArea() * moleculesPerTP*1E4; break;
+		case FQ_VELOCITY: value = (hits.nbHitEquiv + static_cast<double>(hits.nbDesorbed)) / hits.sum_1_per_velocity; break;
+		case FQ_TEMPERATURE: value = f->sh.temperature; break;
+		case FQ_AREA: value = f->sh.area; break;
+		default: return false;
+		}
+		return true;
+	}
+
+	//SUM() and AVG()
+	if (!GetFacets(v, facetBuffer)) return false;
+	size_t sumLL = 0;
+	double sumD = 0.0;
+	double sumArea = 0.0; //We average by area
+	for (size_t facetId : facetBuffer) {
+		if (facetId >= nbFacet) return false;
+		Facet *f = geom->GetFacet(facetId);
+		switch (v.quantity) {
+		case FQ_MCHIT: sumLL += hitsOf(facetId).nbMCHit; break;
+		case FQ_HIT: sumD += hitsOf(facetId).nbHitEquiv; break;
+		case FQ_DES: sumLL += hitsOf(facetId).nbDesorbed; break;
+		case FQ_ABS: sumD += hitsOf(facetId).nbAbsEquiv; break;
+		case FQ_AREA: sumArea += f->GetArea(); break;
+		case FQ_PRESSURE:
+			sumD += hitsOf(facetId).sum_v_ort * (worker.wp.gasMass / 1000 / 6E23)*0.0100;
+			sumArea += f->GetArea();
+			break;
+		case FQ_DENSITY:
+			sumD += f->DensityCorrection() * hitsOf(facetId).sum_1_per_ort_velocity;
+			sumArea += f->GetArea();
+			break;
+		case FQ_IMPINGEMENT:
+			sumD += hitsOf(facetId).nbHitEquiv;
+			sumArea += f->GetArea();
+			break;
+		default: return false;
+		}
+	}
+	if (v.average) value = sumD * moleculesPerTP*1E4 / sumArea;
+	else if (v.quantity == FQ_AREA) value = sumArea;
+	else if (v.quantity == FQ_HIT || v.quantity == FQ_ABS) value = sumD;
+	else value = static_cast<double>(sumLL); //Only one conversion at the end (instead of at each summing operation)
+	return true;
+}
+
+/**
+* \brief Value of a resolved variable at the displayed moment (facet hit caches)
+*/
+bool FormulaEvaluator::GetValue(const FormulaVariable& v, double& value) {
+	Worker& worker = mApp->worker;
+	Geometry *geom = worker.GetGeometry();
+	return Compute(v, [geom](size_t facetId) -> const FacetHitBuffer& { return geom->GetFacet(facetId)->facetHitCache; },
+		worker.GetMoleculesPerTP(worker.displayedMoment), value);
+}
+
+/**
+* \brief Resolves the variables of the formulas, unless they are the ones compiled last time and weren't parsed again
+*/
+void FormulaEvaluator::Compile(const std::vector<GLParser*>& formulas) {
+	bool changed = formulas.size() != compiledFormulas.size();
+	for (size_t i = 0; i < formulas.size() && !changed; i++)
+		changed = formulas[i] != compiledFormulas[i] || formulas[i]->GetProgramId() != compiledIds[i];
+	if (!changed) return;
+
+	compiledFormulas = formulas;
+	compiledIds.resize(formulas.size());
+	variables.clear();
+	formulaSlots.resize(formulas.size());
+	std::map<std::string, size_t> variableIds; //Shared by formulas using the same variable
+
+	for (size_t i = 0; i < formulas.size(); i++) {
+		compiledIds[i] = formulas[i]->GetProgramId();
+		int nbVar = formulas[i]->GetNbVariable();
+		formulaSlots[i].resize(nbVar);
+		for (int j = 0; j < nbVar; j++) {
+			const char *name = formulas[i]->GetVariableAt(j)->name;
+			auto found = variableIds.find(name);
+			if (found == variableIds.end()) {
+				FormulaVariable v;
+				Resolve(name, v);
+				found = variableIds.insert({ name, variables.size() }).first;
+				variables.push_back(v);
+			}
+			formulaSlots[i][j] = found->second;
+		}
+	}
+	values.resize(variables.size());
+	valuesOk.resize(variables.size());
+}
+
+/**
+* \brief Evaluates all formulas at the displayed moment, each distinct variable only once
+* \param formulas parsed formulas, results in formulaValues (same order)
+*/
+void FormulaEvaluator::EvaluateAll(const std::vector<GLParser*>& formulas) {
+	Compile(formulas);
+
+	for (size_t i = 0; i < variables.size(); i++)
+		valuesOk[i] = GetValue(variables[i], values[i]);
+
+	formulaValues.resize(formulas.size());
+	for (size_t i = 0; i < formulas.size(); i++) {
+		FormulaValue& result = formulaValues[i];
+		result = FormulaValue();
+		bool ok = true;
+		for (size_t j = 0; j < formulaSlots[i].size() && ok; j++) {
+			size_t id = formulaSlots[i][j];
+			ok = valuesOk[id];
+			if (ok) formulas[i]->GetVariableAt((int)j)->value = values[id];
+			else result.invalidVariable = variables[id].name;
+		}
+		if (ok) { //Variables succesfully evaluated
+			formulas[i]->hasVariableEvalError = false;
+			result.ok = formulas[i]->Evaluate(&result.value);
+		}
+	}
+}
+
+/**
+* \brief Evaluates all formulas at each time moment, every formula running over the whole series in one go
+* \param formulas parsed formulas
+* \param results simulation results to read the moments from, locked by the caller
+* \param maxMoments number of moments to evaluate at most
+* \param momentValues for each formula, its value at moments 1..nbMoments (NaN where it can't be evaluated)
+*/
+void FormulaEvaluator::EvaluateMoments(const std::vector<GLParser*>& formulas, GlobalSimuState *results, size_t maxMoments,
+	std::vector<std::vector<double>>& momentValues) {
+	Compile(formulas);
+
+	Worker& worker = mApp->worker;
+	size_t nbFacet = worker.GetGeometry()->GetNbFacet();
+	size_t nbMoments = Min(worker.moments.size(), maxMoments);
+	if (results->facetStates.size() != nbFacet || (nbFacet && results->facetStates[0].momentResults.size() <= nbMoments))
+		nbMoments = 0; //Results not (yet) laid out for this geometry
+	const double nan = std::numeric_limits<double>::quiet_NaN();
+	double moleculesPerTP = worker.GetMoleculesPerTP(1); //Same for all moments
+
+	//Series of each facet-dependent variable, global ones keep their single value
+	std::vector<std::vector<double>> series(variables.size());
+	for (size_t i = 0; i < variables.size(); i++) {
+		if (variables[i].scope == FS_GLOBAL) {
+			valuesOk[i] = GetValue(variables[i], values[i]);
+		}
+		else {
+			valuesOk[i] = variables[i].valid;
+			series[i].resize(nbMoments);
+			for (size_t m = 0; m < nbMoments; m++) {
+				double value;
+				bool ok = Compute(variables[i], [results, m](size_t facetId) -> const FacetHitBuffer& {
+					return results->facetStates[facetId].momentResults[m + 1].hits; }, moleculesPerTP, value);
+				series[i][m] = ok ? value : nan;
+			}
+		}
+	}
+
+	momentValues.resize(formulas.size());
+	std::vector<const double*> slotValues;
+	for (size_t i = 0; i < formulas.size(); i++) {
+		momentValues[i].resize(nbMoments);
+		slotValues.resize(formulaSlots[i].size());
+		bool ok = true;
+		for (size_t j = 0; j < formulaSlots[i].size() && ok; j++) {
+			size_t id = formulaSlots[i][j];
+			ok = valuesOk[id];
+			if (variables[id].scope == FS_GLOBAL) {
+				slotValues[j] = NULL;
+				formulas[i]->GetVariableAt((int)j)->value = values[id];
+			}
+			else {
+				slotValues[j] = series[id].data();
+			}
+		}
+		if (!ok || !formulas[i]->EvaluateBatch(slotValues.data(), nbMoments, momentValues[i].data()))
+			std::fill(momentValues[i].begin(), momentValues[i].end(), nan);
+	}
+}
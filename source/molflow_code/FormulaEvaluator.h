@@ -0,0 +1,107 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstddef>
+
+class GLParser;
+class GlobalSimuState;
+
+//Quantity a formula variable reads (see FormulaEvaluator::Resolve for the names)
+enum FormulaQuantity : int {
+	FQ_ABS,          //A: absorbed (equiv.)
+	FQ_DES,          //D: desorbed
+	FQ_MCHIT,        //MCH: MC hits
+	FQ_HIT,          //H: hits (equiv.)
+	FQ_PRESSURE,     //P: pressure (mbar)
+	FQ_DENSITY,      //DEN: particle density (1/m3)
+	FQ_IMPINGEMENT,  //Z: impingement rate (1/s/m2)
+	FQ_VELOCITY,     //V: average velocity (m/s)
+	FQ_TEMPERATURE,  //T: temperature (K)
+	FQ_AREA,         //AR: area (cm2)
+	FQ_SUMDES, FQ_SUMABS, FQ_SUMMCHIT, FQ_SUMHIT, FQ_MPP, FQ_MFP, FQ_DESAR, FQ_ABSAR,
+	FQ_QCONST, FQ_QCONST_N, FQ_NTOT, FQ_GASMASS,
+	FQ_CONSTANT      //KB, R, Na
+};
+
+//Which facets a variable reads
+enum FormulaScope : int {
+	FS_GLOBAL,       //Global counter or setting, not facet-dependent
+	FS_FACET,        //Single facet (like P5)
+	FS_RANGE,        //SUM() or AVG() over a facet range (like SUM(H,3,6))
+	FS_SELECTION     //SUM() or AVG() over a selection group (like AVG(P,S2)), or the current selection (S = -1)
+};
+
+/**
+* \brief A formula variable with its name resolved: what to read and where from. Facet indices and selection groups
+* are only checked against the geometry at evaluation, so a resolved variable stays valid across reloads
+*/
+struct FormulaVariable {
+	std::string name;
+	bool valid = false;           //Name could be resolved
+	FormulaQuantity quantity = FQ_CONSTANT;
+	FormulaScope scope = FS_GLOBAL;
+	bool average = false;         //AVG(): area-weighted average of the facets, else SUM()
+	size_t firstFacet = 0;        //FS_FACET and FS_RANGE, 1-based as written
+	size_t lastFacet = 0;         //FS_RANGE
+	int selectionGroup = -1;      //FS_SELECTION: 0-based group, -1 for the current selection
+	double constant = 0.0;        //FQ_CONSTANT
+};
+
+/**
+* \brief Evaluates the user formulas. Variable names are resolved once per parsed expression, and variables shared by
+* several formulas are computed once per refresh. Results can also be computed for all time moments at once, with
+* each compiled formula run over the whole series (see GLParser::EvaluateBatch)
+*/
+class FormulaEvaluator {
+public:
+	//Result of a formula at the displayed moment
+	struct FormulaValue {
+		bool ok = false;
+		double value = 0.0;
+		std::string invalidVariable; //First variable that couldn't be evaluated, empty if the error is in the formula itself
+	};
+
+	bool Resolve(const char *name, FormulaVariable& v);
+	bool GetValue(const FormulaVariable& v, double& value); //At the displayed moment
+
+	void EvaluateAll(const std::vector<GLParser*>& formulas); //Fills formulaValues
+	//Value of every formula at each time moment (1..nbMoments, at most maxMoments), NaN where it can't be evaluated.
+	//Results must be locked by the caller (Worker::GetHits)
+	void EvaluateMoments(const std::vector<GLParser*>& formulas, GlobalSimuState *results, size_t maxMoments,
+		std::vector<std::vector<double>>& momentValues);
+
+	std::vector<FormulaValue> formulaValues;
+
+private:
+	void Compile(const std::vector<GLParser*>& formulas);
+	template <typename HitsOf> bool Compute(const FormulaVariable& v, HitsOf hitsOf, double moleculesPerTP, double& value);
+	bool GetFacets(const FormulaVariable& v, std::vector<size_t>& facets);
+
+	std::vector<GLParser*> compiledFormulas;
+	std::vector<size_t> compiledIds; //GLParser::GetProgramId() of each formula when compiled
+	std::vector<FormulaVariable> variables; //Distinct variables of all formulas
+	std::vector<std::vector<size_t>> formulaSlots; //For each formula, index in variables of each of its variables
+	std::vector<double> values; //Of variables, last evaluation
+	std::vector<char> valuesOk;
+	std::vector<size_t> facetBuffer;
+};
@@ -33,6 +33,9 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #endif
 #include "GLApp/GLWindowManager.h"
 #include "GLApp/GLMessageBox.h"
+#include "GLApp/MathTools.h" //Min, Max
+#include <thread>
+#include <atomic>
 
 #ifdef MOLFLOW
 extern MolFlow *mApp;
@@ -73,6 +76,7 @@ void MolflowGeometry::BuildFacetTextures(GlobalSimuState& results, bool renderRe
 		switch (sMode) {
 
 		case MC_MODE:
+		case AC_MODE: //The AC solution is stored as expected MC results
 
 			dCoef_custom[0] = 1E4 / (double)results.globalHits.globalHits.nbDesorbed * mApp->worker.wp.gasMass / 1000 / 6E23*0.0100; //multiplied by timecorr*sum_v_ort_per_area: pressure
 			dCoef_custom[1] = 1E4 / (double)results.globalHits.globalHits.nbDesorbed;
@@ -87,10 +91,6 @@ void MolflowGeometry::BuildFacetTextures(GlobalSimuState& results, bool renderRe
 				texture_limits[i].autoscale.max.all = results.globalHits.texture_limits[i].max.all*dCoef_custom[i];
 			}
 			break;
-		case AC_MODE:
-			texture_limits[0].autoscale.min.all = results.globalHits.texture_limits[0].min.all;
-			texture_limits[0].autoscale.max.all = results.globalHits.texture_limits[0].max.all;
-			break;
 		}
 
 		if (!texAutoScale) { //manual values
@@ -107,22 +107,17 @@ void MolflowGeometry::BuildFacetTextures(GlobalSimuState& results, bool renderRe
 		}
 	}
 
+	//On this thread: size checks and direction fields. Then the colours of all textures in parallel, then the OpenGL uploads
+	std::vector<size_t> texturedFacets;
+	size_t nbCells = 0;
+	GLint max_t = 0;
+	if (renderRegularTexture) glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_t);
 	for (size_t i = 0; i < sh.nbFacet; i++) {
-		int time = SDL_GetTicks();
-		if (!prg->IsVisible() && ((time - startTime) > 500)) {
-			prg->SetVisible(true);
-		}
-		prg->SetProgress((double)i / (double)sh.nbFacet);
 		Facet *f = facets[i];
-
-		size_t profSize = (f->sh.isProfile) ? (PROFILE_SIZE * sizeof(ProfileSlice)) : 0;
 		size_t nbElem = f->sh.texWidth*f->sh.texHeight;
-		size_t tSize = nbElem * sizeof(TextureCell);
 
 		if (renderRegularTexture && f->sh.isTextured) {
 
-			GLint max_t;
-			glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_t);
 			if (f->sh.texHeight > max_t || f->sh.texWidth > max_t) {
 				if (!f->textureError) {
 					char tmp[1024];
@@ -134,22 +129,16 @@ void MolflowGeometry::BuildFacetTextures(GlobalSimuState& results, bool renderRe
 					GLMessageBox::Display(tmp, "OpenGL Error", GLDLG_OK, GLDLG_ICONWARNING);
 				}
 				f->textureError = true;
-				return;
 			}
 			else {
 				f->textureError = false;
+				texturedFacets.push_back(i);
+				nbCells += nbElem;
 			}
-
-			// Retrieve texture from shared memory (every seconds)
-			//TextureCell *hits_local = (TextureCell *)((BYTE *)shGHit + (f->sh.hitOffset + facetHitsSize + profSize*(1 + nbMoments) + tSize*mApp->worker.displayedMoment));
-			f->BuildTexture(results.facetStates[i].momentResults[mApp->worker.displayedMoment].texture, textureMode, min, max, texColormap,
-				dCoef_custom[0] * timeCorrection, dCoef_custom[1] * timeCorrection, dCoef_custom[2] * timeCorrection, texLogScale, mApp->worker.displayedMoment);
 		}
 
 		if (renderDirectionTexture && f->sh.countDirection && f->dirCache) {
 			
-			size_t dSize = nbElem * sizeof(DirectionCell);
-
 			/*
 			double iDesorbed = 0.0;
 			if (results.globalHits.globalHits.nbDesorbed)
@@ -166,6 +155,41 @@ void MolflowGeometry::BuildFacetTextures(GlobalSimuState& results, bool renderRe
 		}
 	}
 
+	//Threads take the facets one by one: texture sizes vary a lot between facets
+	std::atomic<size_t> nextFacet(0);
+	std::atomic<bool> outOfMemory(false);
+	auto computeColors = [&]() {
+		try {
+			for (size_t k = nextFacet++; k < texturedFacets.size(); k = nextFacet++) {
+				size_t i = texturedFacets[k];
+				facets[i]->ComputeTextureColors(results.facetStates[i].momentResults[mApp->worker.displayedMoment].texture, textureMode, min, max, texColormap,
+					dCoef_custom[0] * timeCorrection, dCoef_custom[1] * timeCorrection, dCoef_custom[2] * timeCorrection, texLogScale);
+			}
+		}
+		catch (const std::bad_alloc&) {
+			outOfMemory = true;
+		}
+	};
+	size_t nbThreads = Min((size_t)Max(1u, std::thread::hardware_concurrency()), Min(texturedFacets.size(), nbCells / 65536 + 1)); //Small textures: not worth a thread
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t < nbThreads; t++) threads.emplace_back(computeColors);
+	computeColors();
+	for (auto& thread : threads) thread.join();
+	if (outOfMemory) {
+		prg->SetVisible(false);
+		SAFE_DELETE(prg);
+		throw Error("Cannot allocate memory for texture buffer");
+	}
+
+	for (size_t k = 0; k < texturedFacets.size(); k++) {
+		int time = SDL_GetTicks();
+		if (!prg->IsVisible() && ((time - startTime) > 500)) {
+			prg->SetVisible(true);
+		}
+		prg->SetProgress((double)k / (double)texturedFacets.size());
+		facets[texturedFacets[k]]->UploadTexture(texColormap);
+	}
+
 	prg->SetVisible(false);
 	SAFE_DELETE(prg);
 }
@@ -0,0 +1,66 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#include "MaxwellSampler.h"
+#include <algorithm> //std::max
+
+MaxwellSampler::MaxwellSampler() {
+	table.resize(MAXWELL_TABLE_SIZE);
+	for (size_t i = 0; i < MAXWELL_TABLE_SIZE; i++) {
+		double x = InverseCDF((double)i / (double)MAXWELL_TABLE_SIZE);
+		table[i].x = x;
+		table[i].slope = (i > 0) ? 2.0 * std::exp(0.5 * x * x) / (x * x * x) / (double)MAXWELL_TABLE_SIZE : 0.0; //dx/dr = 1/f(x)
+	}
+}
+
+/**
+* \brief Returns the shared sampler. The table is built once, by the first caller (thread-safe static initialization)
+*/
+const MaxwellSampler& MaxwellSampler::Get() {
+	static const MaxwellSampler sampler;
+	return sampler;
+}
+
+/**
+* \brief Scale parameter a = sqrt(kT/m) of the distribution, with the constants of Worker::Generate_CDF
+* \param gasTempKelvins gas temperature in Kelvin
+* \param gasMassGramsPerMol molar gas mass in grams per mol
+*/
+double MaxwellSampler::Scale(double gasTempKelvins, double gasMassGramsPerMol) {
+	return std::sqrt(1.38E-23*gasTempKelvins / (gasMassGramsPerMol*1.67E-27)); //Converting molar mass to atomic mass
+}
+
+/**
+* \brief Solves CDF(x) = r for a = 1: with u = x^2/2, exp(-u)*(1+u) = 1-r
+* Newton iterations on u - log(1+u) = -log(1-r), which is convex and increasing in u
+*/
+double MaxwellSampler::InverseCDF(double r) {
+	if (r <= 0.0) return 0.0;
+	double target = -std::log1p(-r);
+	//Starting point: u^2/2 ~ r for small r, u ~ target + log(1+target) in the tail. On a convex increasing function,
+	//Newton converges monotonically from the right, a start on the left only jumps to the right first
+	double u = std::max(std::sqrt(2.0 * r), target + std::log1p(target));
+	for (int iter = 0; iter < 50; iter++) {
+		double residual = u - std::log1p(u) - target;
+		double step = residual * (1.0 + u) / u;
+		u -= step;
+		if (std::abs(step) <= 1E-14 * u) break;
+	}
+	return std::sqrt(2.0 * u);
+}
@@ -0,0 +1,68 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cmath>
+
+#define MAXWELL_TABLE_SIZE 4096 //Bins of the tabulated inverse CDF
+#define MAXWELL_EXACT_HEAD 2 //First bins solved exactly (steep, x ~ r^(1/4) at 0)
+#define MAXWELL_EXACT_TAIL 8 //Last bins solved exactly (unbounded)
+
+/**
+* \brief Sampler of the speed of molecules leaving a wall (flux-weighted Maxwell-Boltzmann distribution),
+* f(v) ~ v^3*exp(-v^2/(2a^2)) with a = sqrt(kT/m), CDF(v) = 1 - exp(-u)*(1+u) with u = v^2/(2a^2).
+* The distribution only scales with a, so a single inverse CDF table (for a = 1) serves every temperature and gas mass.
+* A sample is one table lookup and a cubic Hermite interpolation with the exact slopes. The steep first and last bins
+* (0.25% of the samples) are solved exactly instead, so the speed tail isn't truncated.
+*/
+class MaxwellSampler {
+public:
+	static const MaxwellSampler& Get(); //Shared table, built on first use
+
+	static double Scale(double gasTempKelvins, double gasMassGramsPerMol); //a parameter of the distribution, in m/s
+	static double InverseCDF(double r); //Exact speed (for a = 1) below which a fraction r of the molecules is, 0<=r<1
+
+	/**
+	* \brief Speed of a molecule
+	* \param r uniform random number in [0,1[
+	* \param scale a parameter of the distribution (see Scale)
+	*/
+	inline double Velocity(double r, double scale) const {
+		double pos = r * (double)MAXWELL_TABLE_SIZE;
+		size_t i = (size_t)pos;
+		if (i < MAXWELL_EXACT_HEAD || i >= MAXWELL_TABLE_SIZE - MAXWELL_EXACT_TAIL) return scale * InverseCDF(r);
+		double t = pos - (double)i;
+		const Node& n0 = table[i];
+		const Node& n1 = table[i + 1];
+		double dx = n1.x - n0.x;
+		//Hermite cubic: x0 + t*slope0 + t^2*(3dx - 2slope0 - slope1) + t^3*(slope0 + slope1 - 2dx)
+		return scale * (n0.x + t * (n0.slope + t * ((3.0*dx - 2.0*n0.slope - n1.slope) + t * (n0.slope + n1.slope - 2.0*dx))));
+	}
+
+private:
+	MaxwellSampler();
+	struct Node {
+		double x;     //InverseCDF(i/MAXWELL_TABLE_SIZE)
+		double slope; //Its derivative, times the bin width
+	};
+	std::vector<Node> table;
+};
@@ -87,9 +87,9 @@ static const char *fileDesFilters = "Desorption files\0*.des\0All files\0*.*\0";
 */
 
 //NativeFileDialog compatible file filters
-std::string fileLoadFilters = "txt,xml,zip,stl,str,ase,geo,syn,geo7z,syn7z";
-std::string fileInsertFilters = "txt,xml,zip,stl,geo,syn,geo7z,syn7z";
-std::string fileSaveFilters = "xml,zip,txt,geo,geo7z,stl";
+std::string fileLoadFilters = "txt,xml,zip,stl,str,ase,geo,syn,geo7z,syn7z,geo.gz,syn.gz";
+std::string fileInsertFilters = "txt,xml,zip,stl,geo,syn,geo7z,syn7z,geo.gz,syn.gz";
+std::string fileSaveFilters = "xml,zip,txt,geo,geo7z,geo.gz,stl";
 std::string fileSelFilters = "sel";
 std::string fileTexFilters = "txt";
 std::string fileProfFilters = "csv;txt";
@@ -393,7 +393,7 @@ int MolFlow::OneTimeSceneInit()
 	*/
 
 	modeLabel = new GLLabel("Mode");
-	//simuPanel->Add(modeLabel);
+	simuPanel->Add(modeLabel);
 
 	modeCombo = new GLCombo(0);
 	modeCombo->SetEditable(true);
@@ -401,15 +401,15 @@ int MolFlow::OneTimeSceneInit()
 	modeCombo->SetValueAt(0, "Monte Carlo");
 	modeCombo->SetValueAt(1, "Angular Coef");
 	modeCombo->SetSelectedIndex(0);
-	//simuPanel->Add(modeCombo);
+	simuPanel->Add(modeCombo);
 
 	compACBtn = new GLButton(0, "Calc AC");
 	compACBtn->SetEnabled(false);
-	//simuPanel->Add(compACBtn);
+	simuPanel->Add(compACBtn);
 
 	singleACBtn = new GLButton(0, "1");
 	singleACBtn->SetEnabled(false);
-	//simuPanel->Add(singleACBtn);
+	simuPanel->Add(singleACBtn);
 
 	inputPanel = new GLTitledPanel("Particles in");
 	facetPanel->Add(inputPanel);
@@ -590,20 +590,15 @@ void MolFlow::PlaceComponents() {
 	sy += shortcutPanel->GetHeight() + 5;
 
 	// Simulation ---------------------------------------------
-	simuPanel->SetBounds(sx, sy, 202, 169);
+	simuPanel->SetBounds(sx, sy, 202, 194);
 
 	simuPanel->SetCompBounds(globalSettingsBtn, 5, 20, 48, 19);
 	simuPanel->SetCompBounds(startSimu, 58, 20, 66, 19);
 	simuPanel->SetCompBounds(resetSimu, 128, 20, 66, 19);
 	//simuPanel->SetCompBounds(statusSimu,175,20,20,19);
-	simuPanel->SetCompBounds(modeLabel, 5, 45, 30, 18);
-	simuPanel->SetCompBounds(modeCombo, 40, 45, 85, 18);
-	simuPanel->SetCompBounds(compACBtn, 130, 45, 65, 19);
 	simuPanel->SetCompBounds(autoFrameMoveToggle, 5, 45, 65, 19);
 	simuPanel->SetCompBounds(forceFrameMoveButton, 128, 45, 66, 19);
 
-	//simuPanel->SetCompBounds(compACBtn,123,45,52,19);
-	//simuPanel->SetCompBounds(singleACBtn,178,45,20,19);
 	simuPanel->SetCompBounds(hitLabel, 5, 70, 30, 18);
 	simuPanel->SetCompBounds(hitNumber, 40, 70, 155, 18);
 	simuPanel->SetCompBounds(desLabel, 5, 95, 30, 18);
@@ -613,6 +608,10 @@ void MolFlow::PlaceComponents() {
 	simuPanel->SetCompBounds(sTimeLabel, 5, 145, 30, 18);
 
 	simuPanel->SetCompBounds(sTime, 40, 145, 155, 18);
+	simuPanel->SetCompBounds(modeLabel, 5, 170, 30, 18);
+	simuPanel->SetCompBounds(modeCombo, 40, 170, 85, 18);
+	simuPanel->SetCompBounds(compACBtn, 130, 170, 42, 19);
+	simuPanel->SetCompBounds(singleACBtn, 176, 170, 19, 19);
 
 	sy += (simuPanel->GetHeight() + 5);
 
@@ -2043,14 +2042,14 @@ void MolFlow::ProcessMessage(GLComponent *src, int message)
 			facetAdvParams->Reposition();
 		}
 
-		/*else if (src == compACBtn) {
+		else if (src == compACBtn) {
 			try { lastUpdate = 0.0; worker.ComputeAC(m_fTime); }
 			catch (Error &e) {
 				GLMessageBox::Display(e.GetMsg(), "Error", GLDLG_OK, GLDLG_ICONERROR);
 				return;
 			}
 			break;
-		}*/
+		}
 		else if (src == singleACBtn) {
 			try { lastUpdate = 0.0; worker.StepAC(m_fTime); }
 			catch (Error &e) {
@@ -2116,6 +2115,7 @@ void MolFlow::BuildPipe(double ratio, int steps) {
 	//UpdateModelParams();
 	startSimu->SetEnabled(true);
 	compACBtn->SetEnabled(modeCombo->GetSelectedIndex() == 1);
+	singleACBtn->SetEnabled(modeCombo->GetSelectedIndex() == 1);
 	//resetSimu->SetEnabled(true);
 	ClearFacetParams();
 	ClearFormulas();
@@ -2186,6 +2186,7 @@ void MolFlow::EmptyGeometry() {
 	//UpdateModelParams();
 	startSimu->SetEnabled(true);
 	compACBtn->SetEnabled(modeCombo->GetSelectedIndex() == 1);
+	singleACBtn->SetEnabled(modeCombo->GetSelectedIndex() == 1);
 	//resetSimu->SetEnabled(true);
 	ClearFacetParams();
 	ClearFormulas();
@@ -2595,199 +2596,12 @@ void MolFlow::CrashHandler(Error *e) {
 }
 
 bool MolFlow::EvaluateVariable(VLIST *v) {
-	bool ok = true;
-	Geometry* geom = worker.GetGeometry();
-	size_t nbFacet = geom->GetNbFacet();
-	int idx;
-
-	if ((idx = GetVariable(v->name, "A")) > 0) {
-		ok = (idx > 0 && idx <= nbFacet);
-		if (ok) v->value = geom->GetFacet(idx - 1)->facetHitCache.nbAbsEquiv;
-	}
-	else if ((idx = GetVariable(v->name, "D")) > 0) {
-		ok = (idx > 0 && idx <= nbFacet);
-		if (ok) v->value = (double)geom->GetFacet(idx - 1)->facetHitCache.nbDesorbed;
-	}
-	else if ((idx = GetVariable(v->name, "MCH")) > 0) {
-		ok = (idx > 0 && idx <= nbFacet);
-		if (ok) v->value = (double)geom->GetFacet(idx - 1)->facetHitCache.nbMCHit;
-	}
-	else if ((idx = GetVariable(v->name, "H")) > 0) {
-		ok = (idx > 0 && idx <= nbFacet);
-		if (ok) v->value = (double)geom->GetFacet(idx - 1)->facetHitCache.nbHitEquiv;
-	}
-	else if ((idx = GetVariable(v->name, "P")) > 0) {
-		ok = (idx > 0 && idx <= nbFacet);
-		if (ok) v->value = geom->GetFacet(idx - 1)->facetHitCache.sum_v_ort *
-			worker.GetMoleculesPerTP(worker.displayedMoment)*1E4 / geom->GetFacet(idx - 1)->GetArea() * (worker.wp.gasMass / 1000 / 6E23)*0.0100;
-	}
-	else if ((idx = GetVariable(v->name, "DEN")) > 0) {
-		ok = (idx > 0 && idx <= nbFacet);
-		if (ok) {
-			Facet *f = geom->GetFacet(idx - 1);
-			v->value = f->DensityCorrection() * f->facetHitCache.sum_1_per_ort_velocity /
-				f->GetArea() *
-				worker.GetMoleculesPerTP(worker.displayedMoment)*1E4;
-		}
-	}
-	else if ((idx = GetVariable(v->name, "Z")) > 0) {
-		ok = (idx > 0 && idx <= nbFacet);
-		if (ok) v->value = geom->GetFacet(idx - 1)->facetHitCache.nbHitEquiv /
-			geom->GetFacet(idx - 1)->GetArea() *
-			worker.GetMoleculesPerTP(worker.displayedMoment)*1E4;
-	}
-	else if ((idx = GetVariable(v->name, "V")) > 0) {
-		ok = (idx > 0 && idx <= nbFacet);
-		if (ok) /*v->value = 4.0*(double)(geom->GetFacet(idx - 1)->facetHitCache.nbMCHit + geom->GetFacet(idx - 1)->facetHitCache.nbDesorbed) /
-			geom->GetFacet(idx - 1)->facetHitCache.sum_1_per_ort_velocity;*/
-			v->value = (geom->GetFacet(idx - 1)->facetHitCache.nbHitEquiv + static_cast<double>(geom->GetFacet(idx - 1)->facetHitCache.nbDesorbed)) / geom->GetFacet(idx - 1)->facetHitCache.sum_1_per_velocity;
-	}
-	else if ((idx = GetVariable(v->name, "T")) > 0) {
-		ok = (idx > 0 && idx <= nbFacet);
-		if (ok) v->value = geom->GetFacet(idx - 1)->sh.temperature;
-	}
-	else if ((idx = GetVariable(v->name, "AR")) > 0) {
-		ok = (idx > 0 && idx <= nbFacet);
-		if (ok) v->value = geom->GetFacet(idx - 1)->sh.area;
-	}
-	else if (iequals(v->name, "SUMDES")) {
-		v->value = (double)worker.globalHitCache.globalHits.nbDesorbed;
-	}
-	else if (iequals(v->name, "SUMABS")) {
-		v->value = worker.globalHitCache.globalHits.nbAbsEquiv;
-	}
-	else if (iequals(v->name, "SUMMCHIT")) {
-		v->value = (double)worker.globalHitCache.globalHits.nbMCHit;
-	}
-	else if (iequals(v->name, "SUMHIT")) {
-		v->value = worker.globalHitCache.globalHits.nbHitEquiv;
-	}
-	else if (iequals(v->name, "MPP")) {
-		v->value = worker.globalHitCache.distTraveled_total / (double)worker.globalHitCache.globalHits.nbDesorbed;
-	}
-	else if (iequals(v->name, "MFP")) {
-		v->value = worker.globalHitCache.distTraveledTotal_fullHitsOnly / worker.globalHitCache.globalHits.nbHitEquiv;
-	}
-	else if (iequals(v->name, "DESAR")) {
-		double sumArea = 0.0;
-		for (int i2 = 0; i2 < geom->GetNbFacet(); i2++) {
-			Facet *f_tmp = geom->GetFacet(i2);
-			if (f_tmp->sh.desorbType) sumArea += f_tmp->GetArea();
-		}
-		v->value = sumArea;
-	}
-	else if (iequals(v->name, "ABSAR")) {
-		double sumArea = 0.0;
-
-		for (int i2 = 0; i2 < geom->GetNbFacet(); i2++) {
-			Facet *f_tmp = geom->GetFacet(i2);
-			if (f_tmp->sh.sticking > 0.0) sumArea += f_tmp->GetArea()*f_tmp->sh.opacity;
-		}
-		v->value = sumArea;
-	}
-	else if (iequals(v->name, "QCONST")) {
-		v->value = worker.wp.finalOutgassingRate_Pa_m3_sec*10.00; //10: Pa*m3/sec -> mbar*l/s
-	}
-	else if (iequals(v->name, "QCONST_N")) {
-		v->value = worker.wp.finalOutgassingRate;
-	}
-	else if (iequals(v->name, "NTOT")) {
-		v->value = worker.wp.totalDesorbedMolecules;
-	}
-	else if (iequals(v->name, "GASMASS")) {
-		v->value = worker.wp.gasMass;
-	}
-	else if (iequals(v->name, "KB")) {
-		v->value = 1.3806504e-23;
-	}
-	else if (iequals(v->name, "R")) {
-		v->value = 8.314472;
-	}
-	else if (iequals(v->name, "Na")) {
-		v->value = 6.02214179e23;
-	}
-	else if ((beginsWith(v->name, "SUM(") || beginsWith(v->name, "sum(") || beginsWith(v->name, "AVG(") || beginsWith(v->name, "avg(")) && endsWith(v->name, ")")) {
-		bool avgMode = (beginsWith(v->name, "AVG(") || beginsWith(v->name, "avg(")); //else SUM mode
-		std::string inside = v->name; inside.erase(0, 4); inside.erase(inside.size() - 1, 1);
-		std::vector<std::string> tokens = SplitString(inside,',');
-		if (!Contains({ 2,3 }, tokens.size()))
-			return false;
-		if (avgMode) {
-			if (!Contains({ "P","DEN","Z","p","den","z" }, tokens[0]))
-				return false;
-		}
-		else {
-			if (!Contains({ "MCH","H","D","A","AR","mch","h","d","a","ar" }, tokens[0]))
-				return false;
-		}
-		std::vector<size_t> facetsToSum;
-		if (tokens.size() == 3) { // Like SUM(H,3,6) = H3 + H4 + H5 + H6
-			size_t startId, endId, pos;
-			try {
-				startId = std::stol(tokens[1], &pos); if (pos != tokens[1].size() || startId > geom->GetNbFacet() || startId == 0) return false;
-				endId = std::stol(tokens[2], &pos); if (pos != tokens[2].size() || endId > geom->GetNbFacet() || endId == 0) return false;
-			}
-			catch (...) {
-				return false;
-			}
-			if (!(startId < endId)) return false;
-			facetsToSum = std::vector<size_t>(endId-startId+1);
-			std::iota(facetsToSum.begin(), facetsToSum.end(), startId-1);
-		}
-		else { //Selection group
-			if (!(beginsWith(tokens[1], "S") || beginsWith(tokens[1], "s"))) return false;
-			std::string selIdString = tokens[1]; selIdString.erase(0, 1);
-			if (Contains({ "EL","el" }, selIdString)) { //Current selections
-				facetsToSum = geom->GetSelectedFacets();
-			}
-			else {
-				size_t selGroupId, pos;
-				try {
-					selGroupId = std::stol(selIdString, &pos); if (pos != selIdString.size() || selGroupId > selections.size() || selGroupId == 0) return false;
-				}
-				catch (...) {
-					return false;
-				}
-				facetsToSum = selections[selGroupId - 1].selection;
-			}
-		}
-		size_t sumLL=0;
-		double sumD=0.0;
-		double sumArea = 0.0; //We average by area
-		for (auto& sel : facetsToSum) {
-			if (Contains({"MCH", "mch"},tokens[0])) {
-				sumLL+=geom->GetFacet(sel)->facetHitCache.nbMCHit;
-			} 
-			else if (Contains({ "H", "h" }, tokens[0])) {
-				sumD += geom->GetFacet(sel)->facetHitCache.nbHitEquiv;
-			}
-			else if (Contains({ "D", "d" }, tokens[0])) {
-				sumLL+=geom->GetFacet(sel)->facetHitCache.nbDesorbed;
-			} else if (Contains({ "A", "a" }, tokens[0])) {
-				sumD += geom->GetFacet(sel)->facetHitCache.nbAbsEquiv;
-			} else if (Contains({ "AR", "ar" }, tokens[0])) {
-				sumArea += geom->GetFacet(sel)->GetArea();
-			}
-			else if (Contains({ "P", "p" }, tokens[0])) {
-				sumD+= geom->GetFacet(sel)->facetHitCache.sum_v_ort *
-					(worker.wp.gasMass / 1000 / 6E23)*0.0100;
-				sumArea += geom->GetFacet(sel)->GetArea();
-			} else if (Contains({ "DEN", "den" }, tokens[0])) {
-				Facet *f = geom->GetFacet(sel);
-				sumD += f->DensityCorrection() * f->facetHitCache.sum_1_per_ort_velocity;
-				sumArea += geom->GetFacet(sel)->GetArea();
-			} else if (Contains({ "Z", "z" }, tokens[0])) {
-				sumD += geom->GetFacet(sel)->facetHitCache.nbHitEquiv;
-				sumArea += geom->GetFacet(sel)->GetArea();
-			} else return false;
-		}
-		if (avgMode) v->value=sumD * worker.GetMoleculesPerTP(worker.displayedMoment)*1E4 / sumArea;
-		else if (Contains({ "AR", "ar" }, tokens[0])) v->value = sumArea;
-		else if (Contains({ "H", "h", "A", "a" }, tokens[0])) v->value = sumD;
-		else v->value = static_cast<double>(sumLL); //Only one conversion at the end (instead of at each summing operation)
-	}
-	else ok = false;
-	return ok;
+	//Resolves the name on each call: the formula editor and plotters evaluate through formulaEvaluator instead
+	FormulaVariable variable;
+	double value;
+	if (!formulaEvaluator.Resolve(v->name, variable) || !formulaEvaluator.GetValue(variable, value)) return false;
+	v->value = value;
+	return true;
 }
 
 void MolFlow::UpdatePlotters() {
@@ -2848,6 +2662,7 @@ void MolFlow::UpdateFacetHits(bool allRows) {
 				facetList->SetValueAt(0, i, tmp);
 				switch (modeCombo->GetSelectedIndex()) {
 				case MC_MODE:
+				case AC_MODE: //AC solution is stored as expected MC counts
 					facetList->SetColumnLabel(1, "Hits");
 					sprintf(tmp, "%zd", f->facetHitCache.nbMCHit);
 					facetList->SetValueAt(1, i, tmp);
@@ -2856,16 +2671,6 @@ void MolFlow::UpdateFacetHits(bool allRows) {
 					sprintf(tmp, "%g", f->facetHitCache.nbAbsEquiv);
 					facetList->SetValueAt(3, i, tmp);
 					break;
-				/*case AC_MODE:
-					facetList->SetColumnLabel(1, "Density");
-					sprintf(tmp, "%g", f->facetHitCache.density.value);
-					facetList->SetValueAt(1, i, tmp);
-
-					sprintf(tmp, "%g", f->facetHitCache.density.desorbed);
-					facetList->SetValueAt(2, i, tmp);
-					sprintf(tmp, "%g", f->facetHitCache.density.absorbed);
-					facetList->SetValueAt(3, i, tmp);
-					break;*/
 				}
 			}
 
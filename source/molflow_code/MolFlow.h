@@ -19,7 +19,12 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 */
 #pragma once
 
+#ifdef MOLFLOW_CLI //Headless core: console application object, no GUI
+#include "MolflowHeadless.h"
+#else
+
 #include "Interface.h"
+#include "FormulaEvaluator.h"
 class Worker;
 class ImportDesorption;
 class TimeSettings;
@@ -80,6 +85,7 @@ public:
 	void calcSticking();
 
 	bool EvaluateVariable(VLIST *v);
+	FormulaEvaluator formulaEvaluator;
 
 	//char* appTitle;
 
@@ -152,3 +158,4 @@ protected:
     int  FrameMove();
     void ProcessMessage(GLComponent *src,int message);
 };
+#endif //MOLFLOW_CLI
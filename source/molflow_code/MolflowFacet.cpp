@@ -794,28 +794,24 @@ void Facet::Sum_Neighbor(const int& i, const int& j, const double& weight, Textu
 #define LOG10(x) log10f((float)x)
 
 
+#ifndef MOLFLOW_CLI //Texture display: not part of the headless core
 /**
-* \brief Adds texture value from a neighboring facet to a sum, used for texture smoothing
-* \param texBuffer vector of the texture buffer for each pixel
+* \brief Converts the texture values of the displayed moment to colours (texColors), without touching OpenGL
+* \param texBuffer texture cells of the displayed moment
 * \param textureMode which mode for the texture was used
 * \param min min value for color scaling
 * \param max max value for color scaling
 * \param useColorMap if a 16bit high color map should be used (rainbow)
 */
-void Facet::BuildTexture(std::vector<TextureCell>& texBuffer, int textureMode, double min, double max, bool useColorMap,
-	double dCoeff1, double dCoeff2, double dCoeff3, bool doLog, size_t m) {
+void Facet::ComputeTextureColors(const std::vector<TextureCell>& texBuffer, int textureMode, double min, double max, bool useColorMap,
+	double dCoeff1, double dCoeff2, double dCoeff3, bool doLog) {
 	size_t size = sh.texWidth*sh.texHeight;
 	size_t tSize = texDimW*texDimH;
 	if (size == 0 || tSize == 0) return;
 
 	double scaleFactor = 1.0;
-	int val;
-
-	glBindTexture(GL_TEXTURE_2D, glTex);
 
-		
 		// 16 Bit rainbow colormap
-		
 
 		// Scale
 		if (min < max) {
@@ -832,50 +828,69 @@ void Facet::BuildTexture(std::vector<TextureCell>& texBuffer, int textureMode, d
 			doLog = false;
 			min = 0;
 		}
-
-		unsigned char *buff8;
-		int *buff32;
-
-		if (useColorMap) {
-			buff32 = (int *)calloc(tSize, sizeof(int)); //Color
-			if (!buff32) throw Error("Cannot allocate memory for texture buffer");
+		double offset = doLog ? log10(min) : min;
+		double maxVal = useColorMap ? 65535.0 : 255.0;
+
+		//Impingement rate and density are per area: the mesh areas only change with the mesh, their inverse is kept
+		if (textureMode != 0 && inverseMeshArea.size() != size) {
+			inverseMeshArea.resize(size);
+			for (size_t idx = 0; idx < size; idx++)
+				inverseMeshArea[idx] = 1.0 / GetMeshArea(idx);
 		}
-		else {
-			buff8 = (unsigned char *)calloc(tSize, sizeof(unsigned char)); //Greyscale
-			if (!buff8) throw Error("Cannot allocate memory for texture buffer");
+		double sideCorrection = (cellPropertiesIds && sh.is2sided) ? 0.5 : 1.0; //As GetMeshArea(idx,true)
+		double coeff;
+		switch (textureMode) {
+		case 0: //pressure
+			coeff = dCoeff1;
+			break;
+		case 1: //impingement rate
+			coeff = dCoeff2 * sideCorrection;
+			break;
+		default: //particle density
+			coeff = DensityCorrection() * dCoeff3 * sideCorrection;
+			break;
 		}
 
+		//Reused between refreshes. Border texels are never written and stay 0
+		size_t cellBytes = useColorMap ? sizeof(int) : sizeof(unsigned char);
+		if (texColors.size() != tSize * cellBytes) texColors.assign(tSize * cellBytes, 0);
+		int *buff32 = (int *)texColors.data(); //Color
+		unsigned char *buff8 = texColors.data(); //Greyscale
+
+		//Row by row, each step a plain loop over the row (vectorizable apart from log10)
+		std::vector<double> values(sh.texWidth);
 		for (size_t j = 0; j < sh.texHeight; j++) {
+			const TextureCell *row = texBuffer.data() + j * sh.texWidth;
+			const double *inverseArea = (textureMode != 0) ? inverseMeshArea.data() + j * sh.texWidth : NULL;
+			switch (textureMode) {
+			case 0:
+				for (size_t i = 0; i < sh.texWidth; i++) values[i] = row[i].sum_v_ort_per_area * coeff;
+				break;
+			case 1:
+				for (size_t i = 0; i < sh.texWidth; i++) values[i] = row[i].countEquiv * inverseArea[i] * coeff;
+				break;
+			default:
+				for (size_t i = 0; i < sh.texWidth; i++) values[i] = row[i].sum_1_per_ort_velocity * inverseArea[i] * coeff;
+				break;
+			}
+			if (doLog) {
+				for (size_t i = 0; i < sh.texWidth; i++) values[i] = log10(values[i]);
+			}
 			for (size_t i = 0; i < sh.texWidth; i++) {
-				size_t idx = i + j*sh.texWidth;
-				double physicalValue;
-				switch (textureMode) {
-				case 0: //pressure
-					physicalValue = texBuffer[idx].sum_v_ort_per_area*dCoeff1;
-					break;
-				case 1: //impingement rate
-					physicalValue = texBuffer[idx].countEquiv / this->GetMeshArea(idx, true)*dCoeff2;
-					break;
-				case 2: //particle density
-					physicalValue = DensityCorrection() * texBuffer[idx].sum_1_per_ort_velocity / this->GetMeshArea(idx, true)*dCoeff3;
-					break;
-				}
-				if (doLog) {
-					val = (int)((log10(physicalValue) - log10(min))*scaleFactor + 0.5);
-				}
-				else {
-
-					val = (int)((physicalValue - min)*scaleFactor + 0.5);
-				}
-				Saturate(val, 0, useColorMap ? 65535 : 255);
-				if (useColorMap) {
-					buff32[(i + 1) + (j + 1)*texDimW] = colorMap[val];
-					if (IsEqual(texBuffer[idx].countEquiv, 0.0)) buff32[(i + 1) + (j + 1)*texDimW] = (unsigned long)(65535 + 256 + 1); //show unset value as white
-				}
-				else {
-					buff8[(i + 1) + (j + 1)*texDimW] = val;
+				double v = (values[i] - offset)*scaleFactor + 0.5;
+				values[i] = v > maxVal ? maxVal : (v > 0.0 ? v : 0.0); //Saturate before the int conversion (NaN: 0)
+			}
+			size_t texRow = (j + 1)*texDimW + 1;
+			if (useColorMap) {
+				for (size_t i = 0; i < sh.texWidth; i++) {
+					buff32[texRow + i] = IsEqual(row[i].countEquiv, 0.0) ?
+						(int)(65535 + 256 + 1) //show unset value as white
+						: colorMap[(int)values[i]];
 				}
 			}
+			else {
+				for (size_t i = 0; i < sh.texWidth; i++) buff8[texRow + i] = (unsigned char)values[i];
+			}
 		}
 
 		/*
@@ -900,42 +915,51 @@ void Facet::BuildTexture(std::vector<TextureCell>& texBuffer, int textureMode, d
 		}
 		*/
 
-		GLint width, height, format;
-		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
-		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
-		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
-		if (format == (useColorMap ? GL_RGBA : GL_LUMINANCE) && width == texDimW && height == texDimH) {
-			//Update texture
-			glTexSubImage2D(
-				GL_TEXTURE_2D,       // Type
-				0,                   // No Mipmap
-				0,					// X offset
-				0,					// Y offset
-				(int)texDimW,             // Width
-				(int)texDimH,             // Height
-				(useColorMap ? GL_RGBA : GL_LUMINANCE),             // Format RGBA
-				GL_UNSIGNED_BYTE,    // 8 Bit/pixel
-				(useColorMap ? (void*)buff32 : (void*)buff8)              // Data
-			);
-		}
-		else {
-			//Rebuild texture
-			glTexImage2D(
-				GL_TEXTURE_2D,       // Type
-				0,                   // No Mipmap
-				(useColorMap ? GL_RGBA : GL_LUMINANCE),             // Format RGBA or LUMINANCE
-				(int)texDimW,             // Width
-				(int)texDimH,             // Height
-				0,                   // Border
-				(useColorMap ? GL_RGBA : GL_LUMINANCE),             // Format RGBA or LUMINANCE
-				GL_UNSIGNED_BYTE,    // 8 Bit/pixel
-				(useColorMap ? (void*)buff32 : (void*)buff8)              // Data
-			);
-		}
-		free(useColorMap ? (void*)buff32 : (void*)buff8);
-		GLToolkit::CheckGLErrors("Facet::BuildTexture()");
+}
 
+/**
+* \brief Sends the colours computed by ComputeTextureColors() to the facet's OpenGL texture
+* \param useColorMap same as for ComputeTextureColors()
+*/
+void Facet::UploadTexture(bool useColorMap) {
+	if (texColors.empty()) return;
+
+	glBindTexture(GL_TEXTURE_2D, glTex);
+	GLint width, height, format;
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+	if (format == (useColorMap ? GL_RGBA : GL_LUMINANCE) && width == texDimW && height == texDimH) {
+		//Update texture
+		glTexSubImage2D(
+			GL_TEXTURE_2D,       // Type
+			0,                   // No Mipmap
+			0,					// X offset
+			0,					// Y offset
+			(int)texDimW,             // Width
+			(int)texDimH,             // Height
+			(useColorMap ? GL_RGBA : GL_LUMINANCE),             // Format RGBA
+			GL_UNSIGNED_BYTE,    // 8 Bit/pixel
+			(void*)texColors.data()              // Data
+		);
+	}
+	else {
+		//Rebuild texture
+		glTexImage2D(
+			GL_TEXTURE_2D,       // Type
+			0,                   // No Mipmap
+			(useColorMap ? GL_RGBA : GL_LUMINANCE),             // Format RGBA or LUMINANCE
+			(int)texDimW,             // Width
+			(int)texDimH,             // Height
+			0,                   // Border
+			(useColorMap ? GL_RGBA : GL_LUMINANCE),             // Format RGBA or LUMINANCE
+			GL_UNSIGNED_BYTE,    // 8 Bit/pixel
+			(void*)texColors.data()              // Data
+		);
+	}
+	GLToolkit::CheckGLErrors("Facet::UploadTexture()");
 }
+#endif
 
 /**
 * \brief Converts the desorption type of a facet if it's from a particular type (TODO: check if this implies unneeded backwards compatibility)
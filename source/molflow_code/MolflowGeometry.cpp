@@ -21,7 +21,9 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "MolFlow.h"
 #include "Facet_shared.h"
 #include "GLApp/MathTools.h"
+#ifndef MOLFLOW_CLI
 #include "ProfilePlotter.h"
+#endif
 #include <iomanip>
 
 #include <cereal/types/vector.hpp>
@@ -46,6 +48,16 @@ extern MolFlow *mApp;
 extern SynRad*mApp;
 #endif
 
+const char* profType[] = {
+	"None",
+	"Pressure \201 [mbar]",
+	"Pressure \202 [mbar]",
+	"Incident angle [deg]",
+	"Speed [m/s]",
+	"Ort. velocity [m/s]",
+	"Tan. velocity [m/s]"
+};
+
 /**
 * \brief Basic constructor that initializes a clean (none) geometry
 */
@@ -1360,6 +1372,7 @@ bool MolflowGeometry::LoadTexturesGEO(FileReader *file, GLProgress *prg, GlobalS
 			gHits.texture_limits[2].max.moments_only = file->ReadDouble();
 
 			size_t facetHitsSize = (1 + mApp->worker.moments.size()) * sizeof(FacetHitBuffer);
+			std::vector<double> row; //One texture line, reused
 			for (size_t m = 0; m <= mApp->worker.moments.size() || (m == 0 /*&& version<10*/); m++) {
 				//if (version>=10) {
 				file->ReadKeyword("moment");
@@ -1385,8 +1398,6 @@ bool MolflowGeometry::LoadTexturesGEO(FileReader *file, GLProgress *prg, GlobalS
 
 						file->ReadKeyword("{");
 
-						int ix, iy;
-
 						///Load textures, for GEO file version 3+
 
 						size_t profSize = (f->sh.isProfile) ? ((1 + mApp->worker.moments.size())*(PROFILE_SIZE * sizeof(ProfileSlice))) : 0;
@@ -1407,28 +1418,18 @@ bool MolflowGeometry::LoadTexturesGEO(FileReader *file, GLProgress *prg, GlobalS
 							texHeight_file = f->sh.texHeight;
 						}
 
-						for (iy = 0; iy < (Min(f->sh.texHeight, texHeight_file)); iy++) { //MIN: If stored texture is larger, don't read extra cells
-							for (ix = 0; ix < (Min(f->sh.texWidth, texWidth_file)); ix++) { //MIN: If stored texture is larger, don't read extra cells
+						//A file row is texWidth_file triplets (countEquiv, sum_1_per_ort_velocity, sum_v_ort_per_area), read in one go
+						//If the stored texture is larger, extra cells and rows are read and dropped
+						row.resize(3 * texWidth_file);
+						size_t copyWidth = Min(f->sh.texWidth, texWidth_file);
+						for (size_t iy = 0; iy < texHeight_file; iy++) {
+							file->ReadDoubles(row.data(), row.size());
+							if (iy >= f->sh.texHeight) continue;
+							for (size_t ix = 0; ix < copyWidth; ix++) {
 								size_t index = iy * f->sh.texWidth + ix;
-								texture[index].countEquiv = static_cast<double>(file->ReadSizeT());
-								texture[index].sum_1_per_ort_velocity = file->ReadDouble();
-								texture[index].sum_v_ort_per_area = file->ReadDouble();
-
-							}
-							for (size_t ie = 0; ie < texWidth_file - f->sh.texWidth; ie++) {//Executed if file texture is bigger than expected texture
-								//Read extra cells from file without doing anything
-								file->ReadSizeT();
-								file->ReadDouble();
-								file->ReadDouble();
-							}
-						}
-						for (size_t ie = 0; ie < texHeight_file - f->sh.texHeight; ie++) {//Executed if file texture is bigger than expected texture
-							//Read extra cells ffrom file without doing anything
-							for (int iw = 0; iw < texWidth_file; iw++) {
-								file->ReadSizeT();
-
-								file->ReadDouble();
-								file->ReadDouble();
+								texture[index].countEquiv = row[3 * ix]; //Written as integer
+								texture[index].sum_1_per_ort_velocity = row[3 * ix + 1];
+								texture[index].sum_v_ort_per_area = row[3 * ix + 2];
 							}
 						}
 						file->ReadKeyword("}");
@@ -1864,14 +1865,14 @@ void MolflowGeometry::ExportTextures(FILE *file, int grouping, int mode, GlobalS
 
 							case 2: //Impingement rate
 								dCoef = 1E4; //1E4: conversion m2->cm2
-								if (sMode == MC_MODE) dCoef *= mApp->worker.GetMoleculesPerTP(m);
+								dCoef *= mApp->worker.GetMoleculesPerTP(m); //MC and AC (stored as expected MC counts) alike
 								if (!grouping || texture[index].countEquiv > 0.0) sprintf(tmp, "%g", texture[i + j * w].countEquiv / f->GetMeshArea(i + j * w, true)*dCoef);
 								break;
 
 							case 3: //Particle density
 							{
 								dCoef = 1E4; //1E4: conversion m2->cm2
-								if (sMode == MC_MODE) dCoef *= mApp->worker.GetMoleculesPerTP(m);
+								dCoef *= mApp->worker.GetMoleculesPerTP(m);
 								double v_ort_avg = 2.0*texture[index].countEquiv / texture[index].sum_1_per_ort_velocity;
 								double imp_rate = texture[index].countEquiv / f->GetMeshArea(index, true)*dCoef;
 								double rho = 2.0*imp_rate / v_ort_avg;
@@ -1881,7 +1882,7 @@ void MolflowGeometry::ExportTextures(FILE *file, int grouping, int mode, GlobalS
 							case 4: //Gas density
 							{
 								dCoef = 1E4; //1E4: conversion m2->cm2
-								if (sMode == MC_MODE) dCoef *= mApp->worker.GetMoleculesPerTP(m);
+								dCoef *= mApp->worker.GetMoleculesPerTP(m);
 								double v_ort_avg = 2.0*texture[index].countEquiv / texture[index].sum_1_per_ort_velocity;
 								double imp_rate = texture[index].countEquiv / f->GetMeshArea(index, true)*dCoef;
 								double rho = 2.0*imp_rate / v_ort_avg;
@@ -1893,7 +1894,7 @@ void MolflowGeometry::ExportTextures(FILE *file, int grouping, int mode, GlobalS
 
 								// Lock during update
 								dCoef = 1E4 * (mApp->worker.wp.gasMass / 1000 / 6E23) *0.0100;  //1E4 is conversion from m2 to cm2, 0.01: Pa->mbar
-								if (sMode == MC_MODE) dCoef *= mApp->worker.GetMoleculesPerTP(m);
+								dCoef *= mApp->worker.GetMoleculesPerTP(m);
 								if (!grouping || texture[index].sum_v_ort_per_area) sprintf(tmp, "%g", texture[index].sum_v_ort_per_area*dCoef);
 								break;
 
@@ -1971,8 +1972,6 @@ void MolflowGeometry::ExportProfiles(FILE *file, int isTXT, GlobalSimuState& res
 	// Block dpHit during the whole disc writing
 	if (!LockMutex(results.mutex)) return;
 
-	extern const char* profType[];
-
 	// Globals
 	//BYTE *buffer = (BYTE *)dpHit->buff;
 	//SHGHITS *gHits = (SHGHITS *)buffer;
@@ -2515,6 +2514,7 @@ void MolflowGeometry::SaveXML_geometry(pugi::xml_node saveDoc, Worker *work, GLP
 		}
 	}
 
+#ifndef MOLFLOW_CLI
 	if (mApp->profilePlotter) {
 		std::vector<int> ppViews = mApp->profilePlotter->GetViews();
 		xml_node profilePlotterNode = interfNode.append_child("ProfilePlotter");
@@ -2525,6 +2525,7 @@ void MolflowGeometry::SaveXML_geometry(pugi::xml_node saveDoc, Worker *work, GLP
 			view.append_attribute("facetId") = v;
 		}
 	}
+#endif
 
 	xml_node simuParamNode = saveDoc.append_child("MolflowSimuSettings");
 
@@ -2759,6 +2760,35 @@ bool MolflowGeometry::SaveXML_simustate(xml_node saveDoc, Worker *work, GlobalSi
 	return true;
 }
 
+/**
+* \brief Writes the simulation state to a binary result file (see ResultFile.h), one block per facet and moment
+* \param fileName result file to create
+* \param work worker holding the moments and the hit/leak caches
+* \param results simulation state, already mutex locked
+* \param prg GLProgress window where the save progress is shown
+*/
+void MolflowGeometry::SaveBinary_simustate(const std::string& fileName, Worker *work, GlobalSimuState& results, GLProgress *prg) {
+	prg->SetMessage("Writing simulation results...");
+	//Global counters and texture limits from the results, hit and leak caches from the worker (same sources as the XML format)
+	WriteResultFile(fileName, results, work->globalHitCache, GetResultLayout(), prg);
+}
+
+/**
+* \brief Per-facet description of the recorded results, for WriteResultFile
+*/
+std::vector<FacetResultLayout> MolflowGeometry::GetResultLayout() {
+	std::vector<FacetResultLayout> layout(sh.nbFacet);
+	for (size_t i = 0; i < sh.nbFacet; i++) {
+		Facet *f = GetFacet(i);
+		layout[i].profile = f->sh.isProfile;
+		layout[i].texture = f->hasMesh;
+		layout[i].directions = f->sh.countDirection && f->dirCache;
+		layout[i].texWidth = f->sh.texWidth;
+		layout[i].texHeight = f->sh.texHeight;
+	}
+	return layout;
+}
+
 /**
 * \brief To load geometry data from a XML file
 * \param loadXML xml input file
@@ -2892,8 +2922,9 @@ void MolflowGeometry::LoadXML_geom(pugi::xml_node loadXML, Worker *work, GLProgr
 				newFormula.attribute("expression").as_string());
 		}
 
+#ifndef MOLFLOW_CLI
 		xml_node ppNode = interfNode.child("ProfilePlotter");
-		if (ppNode) {
+		if (ppNode && !mApp->headless) {
 			if (!mApp->profilePlotter) mApp->profilePlotter = new ProfilePlotter(); mApp->profilePlotter->SetWorker(work);
 			xml_node paramsNode = ppNode.child("Parameters");
 			if (paramsNode && paramsNode.attribute("logScale"))
@@ -2906,6 +2937,7 @@ void MolflowGeometry::LoadXML_geom(pugi::xml_node loadXML, Worker *work, GLProgr
 				mApp->profilePlotter->SetViews(views);
 			}
 		}
+#endif
 
 		work->wp.gasMass = simuParamNode.child("Gas").attribute("mass").as_double();
 		work->wp.halfLife = simuParamNode.child("Gas").attribute("halfLife").as_double();
@@ -3461,4 +3493,84 @@ bool MolflowGeometry::LoadXML_simustate(pugi::xml_node loadXML, GlobalSimuState&
 
 	ReleaseMutex(results.mutex);
 	return true;
-}
\ No newline at end of file
+}
+
+/**
+* \brief Restores the simulation state from a binary result file written by SaveBinary_simustate
+* \param fileName result file
+* \param results simulation state to fill
+* \param work worker receiving the global counters and hit/leak caches
+* \param progressDlg GLProgress window where the load progress is shown
+*/
+void MolflowGeometry::LoadBinary_simustate(const std::string& fileName, GlobalSimuState& results, Worker *work, GLProgress *progressDlg) {
+	ResultFileReader reader(fileName);
+	if (reader.GetNbFacet() != sh.nbFacet) throw Error("Result file doesn't match the geometry (different number of facets)");
+	LockMutex(results.mutex);
+	try {
+		ResultBlock block;
+		reader.ReadGlobalBlock(block);
+		GlobalHitBuffer& gHits = work->globalHitCache;
+		block.Get(gHits.globalHits);
+		block.Get(gHits.distTraveled_total);
+		block.Get(gHits.distTraveledTotal_fullHitsOnly);
+		block.Get(gHits.nbLeakTotal);
+		block.Get(gHits.texture_limits);
+		gHits.hitCacheSize = Min(block.GetArray(gHits.hitCache, HITCACHESIZE), (size_t)HITCACHESIZE);
+		gHits.leakCacheSize = Min(block.GetArray(gHits.leakCache, LEAKCACHESIZE), (size_t)LEAKCACHESIZE);
+
+		//Moments added or removed since saving: restore the ones present in both
+		size_t nbMoments = Min(reader.GetNbMoments(), 1 + work->moments.size());
+		std::vector<TextureCell> fileTexture;
+		for (size_t m = 0; m < nbMoments; m++) {
+			progressDlg->SetProgress((double)m / (double)nbMoments);
+			for (size_t i = 0; i < sh.nbFacet; i++) {
+				Facet *f = GetFacet(i);
+				FacetMomentSnapshot& facetResults = results.facetStates[i].momentResults[m];
+				reader.ReadFacetBlock(i, m, block);
+				block.Get(facetResults.hits);
+				if (work->displayedMoment == m) { //For immediate display in facet hits list and facet counter
+					f->facetHitCache = facetResults.hits;
+				}
+				block.GetArray(facetResults.profile.data(), f->sh.isProfile ? facetResults.profile.size() : 0);
+
+				//Texture: if its size changed since saving, keep the overlapping part (as the XML loader does)
+				size_t texWidth_file, texHeight_file;
+				block.Get(texWidth_file);
+				block.Get(texHeight_file);
+				size_t texSize = f->hasMesh ? f->sh.texWidth*f->sh.texHeight : 0;
+				if (texWidth_file == f->sh.texWidth && texHeight_file == f->sh.texHeight) {
+					block.GetArray(facetResults.texture.data(), Min(texSize, facetResults.texture.size()));
+				}
+				else {
+					fileTexture.resize(texWidth_file*texHeight_file);
+					block.GetArray(fileTexture.data(), fileTexture.size());
+					if (f->hasMesh) {
+						for (size_t iy = 0; iy < Min(f->sh.texHeight, texHeight_file); iy++) {
+							for (size_t ix = 0; ix < Min(f->sh.texWidth, texWidth_file); ix++) {
+								facetResults.texture[iy*f->sh.texWidth + ix] = fileTexture[iy*texWidth_file + ix];
+							}
+						}
+					}
+				}
+
+				size_t dirWidth_file, dirHeight_file;
+				block.Get(dirWidth_file);
+				block.Get(dirHeight_file);
+				if (f->sh.countDirection && f->dirCache) {
+					if (dirWidth_file != f->sh.texWidth || dirHeight_file != f->sh.texHeight) {
+						std::stringstream msg;
+						msg << "Direction texture size mismatch on facet " << i + 1 << ".\nExpected: " << f->sh.texWidth << "x" << f->sh.texHeight << "\n"
+							<< "In file: " << dirWidth_file << "x" << dirHeight_file;
+						throw Error(msg.str().c_str());
+					}
+					block.GetArray(facetResults.direction.data(), facetResults.direction.size());
+				}
+			}
+		}
+	}
+	catch (Error &e) {
+		ReleaseMutex(results.mutex);
+		throw e;
+	}
+	ReleaseMutex(results.mutex);
+}
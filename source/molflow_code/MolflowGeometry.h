@@ -21,6 +21,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 
 #include "Geometry_shared.h"
 #include <cereal/archives/xml.hpp>
+#include "ResultFile.h" //FacetResultLayout
 
 #define TEXTURE_MODE_PRESSURE 0
 #define TEXTURE_MODE_IMPINGEMENT 1
@@ -66,6 +67,9 @@ public:
 	void LoadXML_geom(pugi::xml_node loadXML, Worker *work, GLProgress *progressDlg);
 	void InsertXML(pugi::xml_node loadXML, Worker *work, GLProgress *progressDlg, bool newStr);
 	bool LoadXML_simustate(pugi::xml_node loadXML, /*Dataport *dpHit*/ GlobalSimuState& results, Worker *work, GLProgress *progressDlg);
+	void SaveBinary_simustate(const std::string& fileName, Worker *work, GlobalSimuState& results, GLProgress *prg);
+	std::vector<FacetResultLayout> GetResultLayout();
+	void LoadBinary_simustate(const std::string& fileName, GlobalSimuState& results, Worker *work, GLProgress *progressDlg);
 
 	// Geometry
 	void     BuildPipe(double L, double R, double s, int step);
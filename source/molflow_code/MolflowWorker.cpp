@@ -21,23 +21,26 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 //#include <Windows.h>
 #include "MolflowGeometry.h"
 #include "Worker.h"
-#include "GLApp/GLApp.h"
 #include "GLApp/GLMessageBox.h"
 #include <math.h>
 #include <stdlib.h>
 //#include <Process.h>
-#include "GLApp/GLUnitDialog.h"
 #include "GLApp/MathTools.h"
 #include "Facet_shared.h"
 #include "IntersectAABB_shared.h"
 //#include "Simulation.h" //SHELEM
+#ifndef MOLFLOW_CLI
+#include "GLApp/GLApp.h"
+#include "GLApp/GLUnitDialog.h"
 #include "GlobalSettings.h"
 #include "FacetAdvParams.h"
 #include "ProfilePlotter.h"
+#endif
 #include <fstream>
 #include <istream>
 
 #include <filesystem>
+#include <chrono>
 
 #include <cereal/archives/binary.hpp>
 #include <cereal/types/utility.hpp>
@@ -57,6 +60,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "ziplib/ZipArchive.h"
 #include "ziplib/ZipArchiveEntry.h"
 #include "ziplib/ZipFile.h"
+#include "ziplib/methods/StoreMethod.h"
 #include "File.h" //File utils (Get extension, etc)
 
 /*
@@ -110,8 +114,19 @@ Worker::Worker() {
 	sprintf(logDpName, "MFLWLOG%d", pid);*/
 
 	ontheflyParams.nbProcess = 0;
+	reducerEnd = false;
+	backgroundSaveRunning = false;
+	mergesHeld = false;
+	aabbLeafSize = 4;
+	aabbWidth = GetSupportedAABBWidth();
+	sparseMomentResults = true;
 	ontheflyParams.enableLogging = false;
+	ontheflyParams.logLimit = 0;
+	ontheflyParams.logSampling = 1.0;
+	particleLogFileName = "tmp/particle_log.bin"; //Removed on exit with the tmp folder, like the in-memory log was
 	ontheflyParams.desorptionLimit = 0;
+	ontheflyParams.randomSeed = 0;
+	ontheflyParams.wavefrontSize = 0;
 	ontheflyParams.lowFluxCutoff = 1E-7;
 	ontheflyParams.lowFluxMode = false;
 
@@ -139,6 +154,76 @@ MolflowGeometry* Worker::GetMolflowGeometry() {
 	return geom;
 }
 
+/**
+* \brief Saves the geometry and simulation state to a .zip file, while the simulation goes on
+* The geometry XML is built here (it reads the facets). The results mutex is still taken, once the merge in progress is done,
+* but only to raise mergesHeld. The results are then copied to the saveBuffer back buffer outside the mutex. Every merge
+* waits for that copy: the reducer's, and those of simulation threads flushing at pause or end. Between flushes the threads
+* keep accumulating in their local buffers. Writing the XML and the binary results, then zipping, runs on a separate thread.
+* \param fileName output .zip file
+* \param prg GLProgress window shown while the geometry is serialized
+*/
+void Worker::SaveGeometryInBackground(const std::string& fileName, GLProgress *prg) {
+	if (backgroundSaveThread.joinable()) throw Error("Previous background save not finished yet.");
+	if (needsReload) RealReload();
+
+	std::string fileNameWithoutExtension = FileUtils::StripExtension(fileName);
+	std::string fileNameWithXML = fileNameWithoutExtension + ".xml";
+	std::string fileNameWithResults = fileNameWithoutExtension + ".mfres";
+	std::string fileNameWithZIP = fileNameWithoutExtension + ".zip";
+
+	auto saveDoc = std::make_shared<xml_document>();
+	geom->SaveXML_geometry(*saveDoc, this, prg, false);
+	std::vector<FacetResultLayout> layout = geom->GetResultLayout();
+	auto hitCaches = std::make_shared<GlobalHitBuffer>(globalHitCache);
+	prg->SetMessage("Copying simulation results...");
+	LockMutex(results.mutex);
+	mergesHeld = true; //Merges in progress are done, the next ones wait: 'results' is only read until released
+	ReleaseMutex(results.mutex);
+	saveBuffer = results; //Not written by the save thread of the previous autosave, already joined
+	{
+		std::lock_guard<std::mutex> lock(reducerMutex);
+		mergesHeld = false;
+	}
+	mergesResumed.notify_all();
+
+	backgroundSaveError.clear();
+	backgroundSaveRunning = true;
+	backgroundSaveThread = std::thread([=]() {
+		try {
+			if (!saveDoc->save_file(fileNameWithXML.c_str())) throw Error("Error writing XML file.");
+			WriteResultFile(fileNameWithResults, saveBuffer, *hitCaches, layout, NULL);
+			//Zip under a temporary name: the previous autosave stays valid until this one is complete
+			std::string tmpZip = fileNameWithZIP + ".tmp";
+			if (FileUtils::Exist(tmpZip)) remove(tmpZip.c_str());
+			ZipFile::AddFile(tmpZip, fileNameWithXML, FileUtils::GetFilename(fileNameWithXML));
+			ZipFile::AddFile(tmpZip, fileNameWithResults, FileUtils::GetFilename(fileNameWithResults), StoreMethod::Create());
+			remove(fileNameWithXML.c_str());
+			remove(fileNameWithResults.c_str());
+			if (FileUtils::Exist(fileNameWithZIP)) remove(fileNameWithZIP.c_str());
+			if (rename(tmpZip.c_str(), fileNameWithZIP.c_str()) != 0) throw Error("Couldn't rename temporary zip file.");
+		}
+		catch (Error &e) {
+			backgroundSaveError = e.GetMsg();
+		}
+		catch (std::exception &e) { //ZipLib reports errors with standard exceptions
+			backgroundSaveError = e.what();
+		}
+		backgroundSaveRunning = false;
+	});
+}
+
+bool Worker::IsBackgroundSaveRunning() {
+	return backgroundSaveRunning;
+}
+
+bool Worker::FinishBackgroundSave(std::string& errorMsg) {
+	if (!backgroundSaveThread.joinable() || backgroundSaveRunning) return false;
+	backgroundSaveThread.join();
+	errorMsg = backgroundSaveError;
+	return true;
+}
+
 /**
 * \brief Function for saving geometry to a set file
 * \param fileName output file name with extension
@@ -187,11 +272,12 @@ void Worker::SaveGeometry(std::string fileName, GLProgress *prg, bool askConfirm
 	bool isSTR = Contains({ "str","STR" }, ext);
 	bool isGEO = ext == "geo";
 	bool isGEO7Z = ext == "geo7z";
+	bool isGEOGZ = ext == "gz" && FileUtils::GetExtension(FileUtils::StripExtension(fileName)) == "geo"; //gzip stream, written in-process
 	bool isXML = ext == "xml";
 	bool isXMLzip = ext == "zip";
 	bool isSTL = ext == "stl";
 
-	if (isTXT || isGEO || isGEO7Z || isSTR || isXML || isXMLzip || isSTL) {
+	if (isTXT || isGEO || isGEO7Z || isGEOGZ || isSTR || isXML || isXMLzip || isSTL) {
 #ifdef _WIN32
 		//Check (using native handle) if background compressor is still alive
 		if ((isGEO7Z) && WAIT_TIMEOUT == WaitForSingleObject(mApp->compressProcessHandle, 0)) {
@@ -244,6 +330,9 @@ void Worker::SaveGeometry(std::string fileName, GLProgress *prg, bool askConfirm
 					if (isGEO7Z) {
 						f = new FileWriter(fileNameWithGeo); //We first write a GEO file, then compress it to GEO7Z later
 					}
+					else if (isGEOGZ) {
+						f = new FileWriter(fileName, true); //Compressed on a background thread while SaveGEO() writes
+					}
 					else if (!(isXML || isXMLzip))
 
 						f = new FileWriter(fileName); //Txt, stl, geo, etc...
@@ -256,7 +345,7 @@ void Worker::SaveGeometry(std::string fileName, GLProgress *prg, bool askConfirm
 				}
 				
 				if (isTXT) geom->SaveTXT(f, results, saveSelected);
-				else if (isGEO || isGEO7Z) {
+				else if (isGEO || isGEO7Z || isGEOGZ) {
 					/*
 					// Retrieve leak cache
 					int nbLeakSave, nbHHitSave;
@@ -267,33 +356,51 @@ void Worker::SaveGeometry(std::string fileName, GLProgress *prg, bool askConfirm
 					HIT hitCache[HITCACHESIZE];
 					if (!crashSave && !saveSelected) GetHHit(hitCache, &nbHHitSave);
 					*/
-					geom->SaveGEO(f, prg, results, this, saveSelected, crashSave);
+					try {
+						geom->SaveGEO(f, prg, results, this, saveSelected, crashSave);
+						if (isGEOGZ) {
+							prg->SetMessage("Compressing geo file...");
+							f->Close(); //Waits for the compressor to write the rest
+						}
+					}
+					catch (...) {
+						SAFE_DELETE(f); //geo.gz: stops the compressor thread and removes the partial file
+						throw;
+					}
 				}
 				else if (isSTL) {
 					geom->SaveSTL(f, prg);
 				}
 				else if (isXML || isXMLzip) {
+					//Zip: simulation state in a binary result file stored next to the XML. Plain XML: text results (export format)
+					std::string fileNameWithResults = fileNameWithoutExtension + ".mfres";
+					bool resultsSaved = false;
 					{
 						xml_document saveDoc;
 						geom->SaveXML_geometry(saveDoc, this, prg, saveSelected);
-						xml_document geom_only; geom_only.reset(saveDoc);
+						xml_document geom_only; if (!isXMLzip) geom_only.reset(saveDoc);
 						bool success = false; //success: simulation state could be saved
 						if (!crashSave && !saveSelected) {
 							try {
 								LockMutex(results.mutex);
-								success = geom->SaveXML_simustate(saveDoc, this, results, prg, saveSelected);
+								if (isXMLzip) {
+									geom->SaveBinary_simustate(fileNameWithResults, this, results, prg);
+									resultsSaved = true;
+								}
+								else success = geom->SaveXML_simustate(saveDoc, this, results, prg, saveSelected);
 								ReleaseMutex(results.mutex);
 							}
 							catch (Error &e) {
 								SAFE_DELETE(f);
 								ReleaseMutex(results.mutex);
+								remove(fileNameWithResults.c_str());
 								GLMessageBox::Display(e.GetMsg(), "Error saving simulation state.", GLDLG_OK, GLDLG_ICONERROR);
 								return;
 							}
 						}
 
 						prg->SetMessage("Writing xml file...");
-						if (success) {
+						if (success || isXMLzip) {
 							if (!saveDoc.save_file(fileNameWithXML.c_str())) throw Error("Error writing XML file."); //successful save
 						}
 						else {
@@ -308,6 +415,10 @@ void Worker::SaveGeometry(std::string fileName, GLProgress *prg, bool askConfirm
 						//Zipper library
 						if (FileUtils::Exist(fileNameWithZIP)) remove(fileNameWithZIP.c_str());
 						ZipFile::AddFile(fileNameWithZIP, fileNameWithXML,FileUtils::GetFilename(fileNameWithXML));
+						if (resultsSaved) { //Blocks are already compressed: store as is
+							ZipFile::AddFile(fileNameWithZIP, fileNameWithResults, FileUtils::GetFilename(fileNameWithResults), StoreMethod::Create());
+							remove(fileNameWithResults.c_str());
+						}
 						//At this point, if no error was thrown, the compression is successful
 						remove(fileNameWithXML.c_str());
 
@@ -336,7 +447,7 @@ void Worker::SaveGeometry(std::string fileName, GLProgress *prg, bool askConfirm
 	}
 	else {
 		SAFE_DELETE(f);
-		throw Error("SaveGeometry(): Invalid file extension [only xml,zip,geo,geo7z,txt,stl or str]");
+		throw Error("SaveGeometry(): Invalid file extension [only xml,zip,geo,geo7z,geo.gz,txt,stl or str]");
 	}
 
 	SAFE_DELETE(f);
@@ -371,7 +482,7 @@ void Worker::SaveGeometry(std::string fileName, GLProgress *prg, bool askConfirm
 	else if (ok && isGEO) fileName = fileNameWithGeo;
 	if (!autoSave && !saveSelected && !isSTL) { //STL file is just a copy
 		SetCurrentFileName(fileName.c_str());
-		mApp->UpdateTitle();
+		if (!mApp->headless) mApp->UpdateTitle();
 	}
 }
 
@@ -484,6 +595,12 @@ void Worker::LoadGeometry(const std::string& fileName,bool insert,bool newStr) {
 
 		throw Error("LoadGeometry(): No file extension, can't determine type");
 
+	bool isGzip = (ext == "gz"); //.geo.gz or .syn.gz: decompressed in-process while parsing
+	if (isGzip) {
+		ext = FileUtils::GetExtension(FileUtils::StripExtension(fileName));
+		if (ext != "geo" && ext != "syn") throw Error("LoadGeometry(): Only geo and syn files can be gzip compressed");
+	}
+
 	// Read a file
 	FileReader *f = NULL;
 	GLProgress *progressDlg = new GLProgress("Reading file...", "Please wait");
@@ -546,6 +663,9 @@ void Worker::LoadGeometry(const std::string& fileName,bool insert,bool newStr) {
 
 	}
 	else if (ext == "stl" || ext == "STL") {
+#ifdef MOLFLOW_CLI
+		throw Error("STL files have no units: open it in MolFlow+ and save it as XML first.");
+#else
 		try {
 			int ret = GLUnitDialog::Display("", "Choose STL file units:", GLDLG_MM | GLDLG_CM | GLDLG_M | GLDLG_INCH | GLDLG_FOOT | GLDLG_CANCEL_U, GLDLG_ICONNONE);
 			double scaleFactor = 1.0;
@@ -593,7 +713,7 @@ void Worker::LoadGeometry(const std::string& fileName,bool insert,bool newStr) {
 			throw e;
 
 		}
-
+#endif
 	}
 	else if (ext == "str" || ext == "STR") {
 		if (insert) throw Error("STR file inserting is not supported.");
@@ -620,7 +740,10 @@ void Worker::LoadGeometry(const std::string& fileName,bool insert,bool newStr) {
 		int version;
 		progressDlg->SetVisible(true);
 		try {
-			if (ext=="syn7z") {
+			if (isGzip) {
+				f = new FileReader(fileName, true); //Inflated on a background thread while LoadSYN() parses
+			}
+			else if (ext=="syn7z") {
 				//decompress file
 				progressDlg->SetMessage("Decompressing file...");
 					f = ExtractFrom7zAndOpen(fileName, "Geometry.syn");
@@ -662,7 +785,10 @@ void Worker::LoadGeometry(const std::string& fileName,bool insert,bool newStr) {
 		int version;
 		progressDlg->SetVisible(true);
 		try {
-			if (ext == "geo7z") {
+			if (isGzip) {
+				f = new FileReader(fileName, true); //Inflated on a background thread while LoadGEO() parses
+			}
+			else if (ext == "geo7z") {
 				//decompress file
 				progressDlg->SetMessage("Decompressing file...");
 				f = ExtractFrom7zAndOpen(fileName, "Geometry.geo");
@@ -707,6 +833,7 @@ void Worker::LoadGeometry(const std::string& fileName,bool insert,bool newStr) {
 	else if (ext == "xml" || ext=="zip" ) { //XML file, optionally in ZIP container
 		xml_document loadXML;
 		xml_parse_result parseResult;
+		std::string resultsFileName; //Binary simulation state extracted from the ZIP, empty if the results are in the XML
 		progressDlg->SetVisible(true);
 		try {
 			if (ext=="zip") { //compressed in ZIP container
@@ -718,6 +845,14 @@ void Worker::LoadGeometry(const std::string& fileName,bool insert,bool newStr) {
 					throw Error("Can't open ZIP file");
 				}
 				size_t numitems = zip->GetEntriesCount();
+				for (int i = 0; i < numitems && resultsFileName.empty(); i++) { //binary simulation state, if saved as such
+					std::string zipFileName = zip->GetEntry(i)->GetName();
+					if (FileUtils::GetExtension(zipFileName) == "mfres") {
+						FileUtils::CreateDir("tmp");// If doesn't exist yet
+						resultsFileName = "tmp/" + zipFileName;
+						ZipFile::ExtractFile(fileName, zipFileName, resultsFileName);
+					}
+				}
 				bool notFoundYet = true;
 				for (int i = 0; i < numitems && notFoundYet; i++) { //extract first xml file found in ZIP archive
 					auto zipItem = zip->GetEntry(i);
@@ -790,12 +925,18 @@ void Worker::LoadGeometry(const std::string& fileName,bool insert,bool newStr) {
 
 					if (ext == "xml" || ext == "zip")
 						progressDlg->SetMessage("Restoring simulation state...");
-					geom->LoadXML_simustate(loadXML, results, this, progressDlg);
+					if (!resultsFileName.empty()) {
+						geom->LoadBinary_simustate(resultsFileName, results, this, progressDlg);
+						remove(resultsFileName.c_str());
+					}
+					else geom->LoadXML_simustate(loadXML, results, this, progressDlg);
 					SendToHitBuffer(); //Send hits without sending facet counters, as they are directly written during the load process (mutiple moments)
 					RebuildTextures();
 				}
 				catch (Error &e) {
-					mApp->profilePlotter->Reset(); //To avoid trying to display non-loaded results
+#ifndef MOLFLOW_CLI
+					if (mApp->profilePlotter) mApp->profilePlotter->Reset(); //To avoid trying to display non-loaded results
+#endif
 					GLMessageBox::Display(e.GetMsg(), "Error while loading simulation state", GLDLG_CANCEL, GLDLG_ICONWARNING);
 				}
 			}
@@ -838,7 +979,7 @@ void Worker::LoadGeometry(const std::string& fileName,bool insert,bool newStr) {
 	else {
 		progressDlg->SetVisible(false);
 		SAFE_DELETE(progressDlg);
-		throw Error("LoadGeometry(): Invalid file extension [Only xml,zip,geo,geo7z,syn.syn7z,txt,ase,stl or str]");
+		throw Error("LoadGeometry(): Invalid file extension [Only xml,zip,geo,geo7z,geo.gz,syn,syn7z,syn.gz,txt,ase,stl or str]");
 	}
 	if (!insert)
 	{
@@ -897,6 +1038,250 @@ void Worker::InnerStop(float appTime) {
 
 }
 
+/**
+* \brief Launches the reducer thread that merges the results handed over by the simulation threads
+*/
+void Worker::StartReducer() {
+	StopReducer();
+	reducerEnd = false;
+	reducerThread = std::thread(&Worker::ReducerLoop, this);
+}
+
+/**
+* \brief Stops the reducer thread after it merged every block still pending
+*/
+void Worker::StopReducer() {
+	if (!reducerThread.joinable()) return;
+	{
+		std::lock_guard<std::mutex> lock(reducerMutex);
+		reducerEnd = true;
+	}
+	handOverSignal.notify_one();
+	reducerThread.join();
+}
+
+/**
+* \brief Main loop of the reducer thread: merges the simulation threads' handed-over results until StopReducer()
+* Sleeps on handOverSignal while nothing is handed over
+*/
+void Worker::ReducerLoop() {
+	auto handedOver = [this] {
+		for (size_t i = 0; i < ontheflyParams.nbProcess; i++) {
+			Simulation* sim = workerControl.simuPointers[i];
+			if (sim && sim->pendingResultsReady.load(std::memory_order_acquire)) return true;
+		}
+		return false;
+	};
+	while (!reducerEnd) {
+		if (!ReduceMCHits()) {
+			std::unique_lock<std::mutex> lock(reducerMutex);
+			handOverSignal.wait(lock, [&] { return reducerEnd || handedOver(); });
+		}
+	}
+	ReduceMCHits(); //Blocks handed over just before exit
+}
+
+/**
+* \brief Locks the results mutex for a merge, waiting first for a background save to finish copying the results
+* \param timeout maximum wait on the mutex, in milliseconds
+* \return true if the mutex is locked and merges are not held
+*/
+bool Worker::LockResultsForMerge(size_t timeout) {
+	while (true) {
+		if (!LockMutex(results.mutex, timeout)) return false;
+		if (!mergesHeld) return true;
+		ReleaseMutex(results.mutex);
+		std::unique_lock<std::mutex> lock(reducerMutex);
+		mergesResumed.wait(lock, [this] { return !mergesHeld; }); //Only spans the copy in SaveGeometryInBackground
+	}
+}
+
+/**
+* \brief Merges every handed-over block into results, taking the results mutex once for all of them
+* The per-facet buffers are first summed into one block without holding the mutex, so the interface (and the threads' flushes) wait
+* for a single addition and a single texture limit update per cycle, instead of one per thread. Only written facets/cells are visited
+* \return true if at least one block was merged
+*/
+bool Worker::ReduceMCHits() {
+	std::vector<Simulation*> ready;
+	for (size_t i = 0; i < ontheflyParams.nbProcess; i++) {
+		Simulation* sim = workerControl.simuPointers[i];
+		if (sim && sim->pendingResultsReady.load(std::memory_order_acquire)) ready.push_back(sim);
+	}
+	if (ready.empty()) return false;
+
+	GlobalSimuState& sum = ready[0]->myPendingResults;
+	for (size_t i = 1; i < ready.size(); i++)
+		sum.AddModified(ready[i]->myPendingResults, true); //Sum stays sparse, and gets fully reset below
+
+	while (!LockResultsForMerge()); //Blocks are already summed, can't be dropped: retry until the interface releases the results
+	for (auto& sim : ready)
+		AddGlobalHits(sim->myPendingResults.globalHits, sim->prIdx == 0); //HHit (Only prIdx 0)
+	results.AddModified(sum, false);
+	UpdateTextureLimits(sum);
+	ReleaseMutex(results.mutex);
+
+	for (auto& sim : ready)
+		sim->myPendingResults.ResetModified(); //Zeroing also happens here, off the simulation threads
+	{
+		std::lock_guard<std::mutex> lock(reducerMutex);
+		for (auto& sim : ready)
+			sim->pendingResultsReady.store(false, std::memory_order_release);
+	}
+	mergeSignal.notify_all();
+	return true;
+}
+
+/**
+* \brief Adds global hit counters and the leak (and optionally hit) cache of a thread to results. Caller must hold results.mutex
+* \param src global hit buffer recorded by a simulation thread
+* \param copyHitCache if the hit cache should be appended too (only one thread's hits are displayed, to keep the trajectories consistent)
+*/
+void Worker::AddGlobalHits(const GlobalHitBuffer& src, bool copyHitCache) {
+	GlobalHitBuffer& dst = results.globalHits;
+	// Global hits and leaks: adding local hits to shared memory
+	dst.globalHits += src.globalHits;
+	dst.distTraveled_total += src.distTraveled_total;
+	dst.distTraveledTotal_fullHitsOnly += src.distTraveledTotal_fullHitsOnly;
+
+	// Leak
+	for (size_t leakIndex = 0; leakIndex < src.leakCacheSize; leakIndex++)
+		dst.leakCache[(leakIndex + dst.lastLeakIndex) % LEAKCACHESIZE] = src.leakCache[leakIndex];
+	dst.nbLeakTotal += src.nbLeakTotal;
+	dst.lastLeakIndex = (dst.lastLeakIndex + src.leakCacheSize) % LEAKCACHESIZE;
+	dst.leakCacheSize = Min(LEAKCACHESIZE, dst.leakCacheSize + src.leakCacheSize);
+
+	// HHit
+	if (copyHitCache) {
+		for (size_t hitIndex = 0; hitIndex < src.hitCacheSize; hitIndex++)
+			dst.hitCache[(hitIndex + dst.lastHitIndex) % HITCACHESIZE] = src.hitCache[hitIndex];
+
+		if (src.hitCacheSize > 0) {
+			dst.lastHitIndex = (dst.lastHitIndex + src.hitCacheSize) % HITCACHESIZE;
+			dst.hitCache[dst.lastHitIndex].type = HIT_LAST; //Penup (border between blocks of consecutive hits in the hit cache)
+			dst.hitCacheSize = Min(HITCACHESIZE, dst.hitCacheSize + src.hitCacheSize);
+		}
+	}
+}
+
+/**
+* \brief Autoscaling values of a texture cell: pressure, impingement rate and density, without the dCoef factors
+* Time correction makes constant flow and moment values comparable
+* \param val output, the three values
+*/
+static void TextureCellValues(const SubprocessFacet& f, const TextureCell& cell, size_t t, double timeCorrection, double* val) {
+	val[0] = cell.sum_v_ort_per_area*timeCorrection; //pressure without dCoef_pressure
+	val[1] = cell.countEquiv*f.textureCellIncrements[t] * timeCorrection; //imp.rate without dCoef
+	val[2] = f.textureCellIncrements[t] * cell.sum_1_per_ort_velocity* timeCorrection; //particle density without dCoef
+}
+
+/**
+* \brief Widens the texture autoscale limits with the cells written in a merged block, for autoscaling. Caller must hold results.mutex
+* Cells only grow while MC results accumulate, so maxima stay exact by looking at the written cells alone. A minimum can only grow if
+* the cell holding it was written: only then is the full search of RescanTextureLimits() done
+* \param merged block just added to results: its modified facets, moments and cells are looked up in results
+*/
+void Worker::UpdateTextureLimits(const GlobalSimuState& merged) {
+	auto& limits = results.globalHits.texture_limits;
+	bool minGrew = false;
+	for (size_t facetId : merged.modifiedFacets) {
+		if (facetId >= facetsById.size() || !facetsById[facetId] || !facetsById[facetId]->facetRef->sh.isTextured) continue;
+		const SubprocessFacet& f = *facetsById[facetId];
+		const FacetState& src = merged.facetStates[facetId];
+		for (size_t m = 0; m < src.momentResults.size(); m++) {
+			if (!src.momentResults[m].modified) continue;
+			double timeCorrection = m == 0 ? wp.finalOutgassingRate : (wp.totalDesorbedMolecules) / wp.timeWindowSize;
+			const auto& texture = results.facetStates[facetId].momentResults[m].texture;
+			auto visit = [&](size_t t) {
+				if (!f.largeEnough[t]) return;
+				double val[3];
+				TextureCellValues(f, texture[t], t, timeCorrection, val);
+				for (int v = 0; v < 3; v++) {
+					for (int scope = 0; scope < (m == 0 ? 1 : 2); scope++) { //all, then moments only (ignoring constant flow)
+						TEXTURE_MIN_MAX& limit = limits[v];
+						double& min = scope == 0 ? limit.min.all : limit.min.moments_only;
+						double& max = scope == 0 ? limit.max.all : limit.max.moments_only;
+						TextureCellId& minCell = textureMinCells[v][scope];
+						max = std::max(max, val[v]);
+						if (min != 0.0 && val[v] > min && minCell.facetId == facetId && minCell.moment == m && minCell.cell == t) minGrew = true;
+						if (val[v] > 0.0 && (min == 0.0 || val[v] < min)) { //0: no minimum yet (results reset)
+							min = val[v];
+							minCell = { facetId, m, t };
+						}
+					}
+				}
+			};
+			if (src.momentResults[m].denseTexture) {
+				for (size_t t = 0; t < texture.size(); t++) visit(t);
+			}
+			else {
+				for (size_t t : src.momentResults[m].modifiedCells) visit(t);
+			}
+		}
+	}
+	if (minGrew) RescanTextureLimits();
+}
+
+/**
+* \brief Full texture min/max search on results, for autoscaling. Caller must hold results.mutex
+* Needed when cells may have decreased (AC solution replaced) or when the cell holding a minimum grew
+*/
+void Worker::RescanTextureLimits() {
+	//Memorize current limits, then do a min/max search
+	TEXTURE_MIN_MAX texture_limits_old[3];
+	for (size_t i = 0; i < 3; i++) {
+		texture_limits_old[i] = results.globalHits.texture_limits[i];
+		results.globalHits.texture_limits[i].min.all = results.globalHits.texture_limits[i].min.moments_only = HITMAX;
+		results.globalHits.texture_limits[i].max.all = results.globalHits.texture_limits[i].max.moments_only = 0;
+	}
+
+	for (size_t facetId = 0; facetId < std::min(facetsById.size(), results.facetStates.size()); facetId++) {
+		if (!facetsById[facetId] || !facetsById[facetId]->facetRef->sh.isTextured) continue;
+		const SubprocessFacet& f = *facetsById[facetId];
+		for (size_t m = 0; m < results.facetStates[facetId].momentResults.size(); m++) {
+			double timeCorrection = m == 0 ? wp.finalOutgassingRate : (wp.totalDesorbedMolecules) / wp.timeWindowSize;
+			//Timecorrection is required to compare constant flow texture values with moment values (for autoscaling)
+
+			const auto& texture = results.facetStates[facetId].momentResults[m].texture;
+			size_t textureSize = texture.size();
+
+			for (size_t t = 0; t < textureSize; t++) {
+				if (!f.largeEnough[t]) continue;
+				double val[3];  //pre-calculated autoscaling values (Pressure, imp.rate, density)
+				TextureCellValues(f, texture[t], t, timeCorrection, val);
+
+				//Global autoscale
+				for (int v = 0; v < 3; v++) {
+					results.globalHits.texture_limits[v].max.all = std::max(results.globalHits.texture_limits[v].max.all, val[v]);
+
+					if (val[v] > 0.0 && val[v] < results.globalHits.texture_limits[v].min.all) {
+						results.globalHits.texture_limits[v].min.all = val[v];
+						textureMinCells[v][0] = { facetId, m, t };
+					}
+
+					//Autoscale ignoring constant flow (moments only)
+					if (m != 0) {
+						results.globalHits.texture_limits[v].max.moments_only = std::max(results.globalHits.texture_limits[v].max.moments_only, val[v]);
+
+						if (val[v] > 0.0 && val[v] < results.globalHits.texture_limits[v].min.moments_only) {
+							results.globalHits.texture_limits[v].min.moments_only = val[v];
+							textureMinCells[v][1] = { facetId, m, t };
+						}
+					}
+				}
+			}
+		}
+	}
+
+	//if there were no textures:
+	for (int v = 0; v < 3; v++) {
+		if (results.globalHits.texture_limits[v].min.all == HITMAX) results.globalHits.texture_limits[v].min.all = texture_limits_old[v].min.all;
+		if (results.globalHits.texture_limits[v].min.moments_only == HITMAX) results.globalHits.texture_limits[v].min.moments_only = texture_limits_old[v].min.moments_only;
+		if (results.globalHits.texture_limits[v].max.all == 0.0) results.globalHits.texture_limits[v].max.all = texture_limits_old[v].max.all;
+		if (results.globalHits.texture_limits[v].max.moments_only == 0.0) results.globalHits.texture_limits[v].max.moments_only = texture_limits_old[v].max.moments_only;
+	}
+}
+
 /**
 * \brief Function that starts exactly one simulation step for AC (angular coefficient) mode
 */
@@ -906,7 +1291,7 @@ void Worker::OneACStep() {
 		throw Error("No sub process found. (Simulation not available)");
 
 	if (!isRunning)  {
-		if (!ExecuteAndWait(COMMAND_STEPAC, PROCESS_RUN, AC_MODE))
+		if (!ExecuteAndWait(COMMAND_STEPAC, PROCESS_READY))
 			ThrowSubProcError();
 	}
 
@@ -1080,54 +1465,131 @@ void Worker::SendToHitBuffer(bool skipFacetHits ) {
 	hits->globalHits = globalHitCache;
 	ReleaseHits();
 }
-/*
-void Worker::ComputeAC(float appTime) {
-	try {
-		if (needsReload) RealReload();
-	}
-	catch (Error &e) {
-		GLMessageBox::Display(e.GetMsg(), "Error (Stop)", GLDLG_OK, GLDLG_ICONERROR);
-		return;
+/**
+* \brief Function that builds the surface elements of the AC (angular coefficient) mode: texture cells, or whole facets if not textured
+* Desorption is shared by the elements of a source facet in proportion to their area. Throws Error on features the AC mode doesn't model
+*/
+void Worker::BuildACElements() {
+	if (subprocessStructures.size() != 1) throw Error("AC mode doesn't support superstructures");
+	if (wp.enableDecay) throw Error("AC mode doesn't support decaying gas");
+	viewFactors.Clear();
+
+	// Outgassing of each source facet, as used by MC to pick the sources
+	std::vector<double> facetOutgassing(geom->GetNbFacet(), 0.0);
+	for (size_t i = 0; i < sourceFacets.size(); i++)
+		facetOutgassing[sourceFacets[i]->globalId] = sourceCdf[i] - ((i > 0) ? sourceCdf[i - 1] : 0.0);
+	double totalOutgassing = sourceCdf.empty() ? 0.0 : sourceCdf.back();
+
+	for (auto& f : subprocessStructures[0].facets) {
+		const FacetProperties& sh = f.facetRef->sh;
+		std::string facetName = "Facet " + std::to_string(f.globalId + 1);
+		if (sh.opacity_paramId != -1 || (sh.opacity > 0.0 && sh.opacity < 1.0))
+			throw Error((facetName + ": AC mode supports opacity 0 or 1 only").c_str());
+		if (sh.opacity == 0.0) continue; //Fully transparent: neither an element nor an obstacle
+		if (sh.is2sided) throw Error((facetName + ": AC mode doesn't support two-sided facets").c_str());
+		if (sh.superDest || sh.teleportDest) throw Error((facetName + ": AC mode doesn't support link or teleport facets").c_str());
+		if (sh.isMoving && wp.motionType) throw Error((facetName + ": AC mode doesn't support moving facets").c_str());
+		if (sh.sticking_paramId != -1) throw Error((facetName + ": AC mode doesn't support time-dependent sticking").c_str());
+		if (sh.reflection.diffusePart < 0.999999) throw Error((facetName + ": AC mode supports diffuse reflection only").c_str());
+		if (sh.accomodationFactor < 0.9999) throw Error((facetName + ": AC mode doesn't support partial thermal accomodation").c_str());
+		if (facetOutgassing[f.globalId] > 0.0 && (sh.outgassing_paramId >= 0 || sh.useOutgassingFile || sh.desorbType != DES_COSINE))
+			throw Error((facetName + ": AC mode supports constant, uniform outgassing with cosine desorption only").c_str());
+
+		ACElement element;
+		element.facet = &f;
+		element.sticking = sh.sticking;
+		element.desorption = 0.0;
+		// Speed of the particles leaving the facet, as generated by MC at the facet temperature
+		if (wp.useMaxwellDistribution) {
+			double a = sqrt(1.38E-23*sh.temperature / (wp.gasMass*1.67E-27)); //As in Generate_CDF
+			element.meanVelocity = 1.5*sqrt(PI / 2.0)*a; //Flux-weighted Maxwell-Boltzmann distribution
+			element.meanInverseVelocity = 0.5*sqrt(PI / 2.0) / a;
+		}
+		else {
+			element.meanVelocity = 145.469*sqrt(sh.temperature / wp.gasMass);
+			element.meanInverseVelocity = 1.0 / element.meanVelocity;
+		}
+
+		size_t firstElement = viewFactors.elements.size();
+		if (sh.isTextured) {
+			Facet* facet = f.facetRef;
+			size_t nbCells = sh.texWidth*sh.texHeight;
+			for (size_t cell = 0; cell < nbCells; cell++) {
+				Vector2d center;
+				if (facet->cellPropertiesIds) {
+					element.area = facet->GetMeshArea(cell);
+					center = facet->GetMeshCenter(cell);
+				}
+				else { //No mesh: full cells, those with their center on the facet
+					element.area = 1.0 / f.textureCellIncrements[cell];
+					center.u = ((double)(cell % sh.texWidth) + 0.5) / sh.texWidthD;
+					center.v = ((double)(cell / sh.texWidth) + 0.5) / sh.texHeightD;
+					if (!IsInFacet(f, center.u, center.v)) continue;
+				}
+				if (!(element.area > 0.0)) continue;
+				element.cellId = cell;
+				element.center = sh.O + center.u*sh.U + center.v*sh.V;
+				viewFactors.elements.push_back(element);
+			}
+		}
+		else {
+			element.area = sh.area;
+			element.cellId = SIZE_MAX;
+			element.center = sh.center;
+			viewFactors.elements.push_back(element);
+		}
+
+		if (facetOutgassing[f.globalId] > 0.0) {
+			double facetArea = 0.0;
+			for (size_t i = firstElement; i < viewFactors.elements.size(); i++)
+				facetArea += viewFactors.elements[i].area;
+			for (size_t i = firstElement; i < viewFactors.elements.size(); i++)
+				viewFactors.elements[i].desorption = AC_DESORPTION_EQUIVALENT * facetOutgassing[f.globalId] / totalOutgassing * viewFactors.elements[i].area / facetArea;
+		}
 	}
+
+	if (viewFactors.elements.empty()) throw Error("No surface element for AC mode");
+	if (viewFactors.elements.size() > UINT32_MAX) throw Error("Too many surface elements for AC mode");
+	viewFactors.incoming.resize(viewFactors.elements.size());
+	printf("AC mode: %zd surface elements\n", viewFactors.elements.size());
+}
+
+/**
+* \brief Function that starts the view factor (AC matrix) calculation on the simulation threads
+* \param appTime current time of the application
+*/
+void Worker::ComputeAC(float appTime) {
+	if (needsReload) RealReload();
 	if (isRunning)
 		throw Error("Already running");
+	if (ontheflyParams.nbProcess == 0)
+		throw Error("No sub process found. (Simulation not available)");
 
-	// Send correction map to sub process
-	// (correction map contains area a surface elements)
-	size_t maxElem = geom->GetMaxElemNumber();
-	if (!maxElem)
-		throw Error("Mesh with boundary correction must be enabled on all polygons");
-	size_t dpSize = maxElem*sizeof(SHELEM_OLD);
-
-	Dataport *loader = CreateDataport(loadDpName, dpSize);
-	if (!loader)
-		throw Error("Failed to create 'loader' dataport");
-	/*
-	AccessDataport(loader);
-	geom->CopyElemBuffer((BYTE *)loader->buff);
-	ReleaseDataport(loader);
-	//CopyElemBuffer needs fix
-	*/
+	BuildACElements();
 
-	// Load Elem area and send AC matrix calculation order
-	// Send command
-/*
-if (!ExecuteAndWait(COMMAND_LOADAC, PROCESS_RUNAC, dpSize)) {
-		CLOSEDP(loader);
-		char errMsg[1024];
-		sprintf(errMsg, "Failed to send geometry to sub process:\n%s", GetErrorDetails());
-		GLMessageBox::Display(errMsg, "Warning (LoadAC)", GLDLG_OK, GLDLG_ICONWARNING);
-		return;
+	// Profiles and direction vectors aren't derived from the element densities: tell the user instead of showing empty plots
+	std::string profileFacets, directionFacets;
+	for (auto& f : subprocessStructures[0].facets) {
+		const FacetProperties& sh = f.facetRef->sh;
+		if (sh.isProfile) profileFacets += " #" + std::to_string(f.globalId + 1);
+		if (sh.countDirection) directionFacets += " #" + std::to_string(f.globalId + 1);
+	}
+	if (!profileFacets.empty() || !directionFacets.empty()) {
+		std::string msg = "AC mode doesn't compute profiles and direction vectors, they stay empty.";
+		if (!profileFacets.empty()) msg += "\nProfiles on facet" + profileFacets;
+		if (!directionFacets.empty()) msg += "\nDirection vectors on facet" + directionFacets;
+		GLMessageBox::Display(msg.c_str(), "AC mode", GLDLG_OK, GLDLG_ICONWARNING);
 	}
 
-	CLOSEDP(loader);
+	// Each thread computes the view factors towards a share of the elements, reporting its progress in cmdParam
+	if (!ExecuteAndWait(COMMAND_LOADAC, PROCESS_RUNAC))
+		ThrowSubProcError();
 
 	isRunning = true;
 	calcAC = true;
+	calcACprg = 0;
 	startTime = appTime;
-
 }
-*/
 
 /**
 * \brief Function that reloads the whole simulation (resets simulation, rebuilds ray tracing etc) and synchronises subprocesses to main process
@@ -1158,9 +1620,7 @@ void Worker::RealReload(bool sendOnly) { //Sharing geometry with workers
 		LockMutex(results.mutex);
 		results.initialized = false;
 		ReleaseMutex(results.mutex);
-		LockMutex(logMutex);
-		log.clear();
-		ReleaseMutex(logMutex);
+		particleLog.Stop();
 		if (!ExecuteAndWait(COMMAND_CLOSE, PROCESS_READY))
 		{
 			progressDlg->SetVisible(false);
@@ -1177,17 +1637,13 @@ void Worker::RealReload(bool sendOnly) { //Sharing geometry with workers
 		// Create the temporary geometry shared structure
 		progressDlg->SetMessage("Creating particle log...");
 
-		if (ontheflyParams.enableLogging) {
-			try {
-				LockMutex(logMutex);
-				std::vector<ParticleLoggerItem>(ontheflyParams.logLimit).swap(log);
-				ReleaseMutex(logMutex);
-			}
-			catch (...) {
-				progressDlg->SetVisible(false);
-				SAFE_DELETE(progressDlg);
-					throw Error("Failed to create 'dpLog' dataport.\nMost probably out of memory.\nReduce number of logged particles in Particle Logger.");
-			}
+		try {
+			StartParticleLog(); //New file: facet numbers may have changed
+		}
+		catch (Error &e) {
+			progressDlg->SetVisible(false);
+			SAFE_DELETE(progressDlg);
+			throw;
 		}
 	}
 
@@ -1197,7 +1653,8 @@ void Worker::RealReload(bool sendOnly) { //Sharing geometry with workers
 		results.Resize(*this);
 	}
 	emptyResultTemplate = GlobalSimuState();
-	emptyResultTemplate.Resize(*this);
+	emptyResultTemplate.Resize(*this, sparseMomentResults); //Copied by each simulation thread
+	viewFactors.Clear(); //Refers to the subprocess facets rebuilt below
 	//Construct subprocess structures and calculate their AABB
 	std::vector<SubProcessSuperStructure>(GetGeometry()->GetNbStructure()).swap(subprocessStructures); //Create structures
 	size_t nbF = GetGeometry()->GetNbFacet();
@@ -1224,16 +1681,29 @@ void Worker::RealReload(bool sendOnly) { //Sharing geometry with workers
 		SAFE_DELETE(progressDlg);
 		throw Error(e.GetMsg());
 		}
-	size_t maxDepth = 0;
+	facetsById.assign(nbF, nullptr);
+	for (auto& s : subprocessStructures)
+		for (auto& f : s.facets)
+			if (!facetsById[f.globalId]) facetsById[f.globalId] = &f;
 	progressDlg->SetMessage("Constructing ray-tracing volume hierarchy...");
-	for (auto& s : subprocessStructures) {
+	for (size_t i = 0; i < subprocessStructures.size(); i++) {
+		auto& s = subprocessStructures[i];
 		std::vector<SubprocessFacet*> facetPointers; facetPointers.reserve(s.facets.size());
 		for (auto& f : s.facets) {
 			facetPointers.push_back(&f);
 		}
-		s.aabbTree = BuildAABBTree(facetPointers, 0, maxDepth);
+		AABBNODE* aabbTree = BuildAABBTree(facetPointers, aabbLeafSize);
+		AABBTreeStats stats = GetAABBTreeStats(aabbTree);
+		if (aabbWidth > 1) BuildWideAABBTree(aabbTree, s, aabbWidth); //Ray tracing only uses the flattened copy
+		else FlattenAABBTree(aabbTree, s);
+		delete aabbTree;
+		printf("Structure %zd AABB tree: %zd facets, %zd nodes, %zd leaves (avg. %.1f, max. %zd facets), depth %zd, expected cost %.2f, traced %zd-wide\n",
+			i + 1, s.facets.size(), stats.nbNodes, stats.nbLeaves, stats.nbLeaves ? (double)stats.nbLeafFacets / (double)stats.nbLeaves : 0.0,
+			stats.maxLeafSize, stats.maxDepth, stats.expectedCost, aabbWidth);
 	}
 
+	BuildSourceCdf();
+
 	// Load geometry
 	progressDlg->SetMessage("Waiting for subprocesses to load geometry...");
 	if (!ExecuteAndWait(COMMAND_LOAD, PROCESS_READY)) {
@@ -1250,6 +1720,119 @@ void Worker::RealReload(bool sendOnly) { //Sharing geometry with workers
 	SAFE_DELETE(progressDlg);
 }
 
+/**
+* \brief Builds the desorption source table searched by Simulation::StartFromSource(): cumulative molecule counts of the outgassing facets
+* Facets are taken in structure, then facet order, so that a random number picks the same facet as a linear scan would
+*/
+void Worker::BuildSourceCdf() {
+	sourceCdf.clear();
+	sourceFacets.clear();
+	double sum = 0.0;
+	for (auto& s : subprocessStructures) {
+		for (auto& f : s.facets) {
+			if (f.facetRef->sh.desorbType == DES_NONE) continue;
+			double facetOutgassing;
+			if (f.facetRef->sh.useOutgassingFile) { //Using SynRad-generated outgassing map
+				if (!(f.facetRef->sh.totalOutgassing > 0.0)) continue;
+				facetOutgassing = wp.latestMoment * f.facetRef->sh.totalOutgassing / (1.38E-23*f.facetRef->sh.temperature);
+			}
+			else { //constant or time-dependent outgassing
+				facetOutgassing =
+					(f.facetRef->sh.outgassing_paramId >= 0)
+					? IDs[f.facetRef->sh.IDid].back().second / (1.38E-23*f.facetRef->sh.temperature)
+					: wp.latestMoment*f.facetRef->sh.outgassing / (1.38E-23*f.facetRef->sh.temperature);
+			}
+			if (!(facetOutgassing > 0.0)) continue; //Never picked
+			sum += facetOutgassing;
+			sourceCdf.push_back(sum);
+			sourceFacets.push_back(&f);
+		}
+	}
+}
+
+/**
+* \brief Ray tracing micro-benchmark: traces the same random rays with the binary tree (scalar tests) and with each wide tree the CPU supports, then compares speed and hits
+* \param nbRays number of rays, each starting from a random point of a random facet with a cosine-distributed direction
+*/
+void Worker::BenchmarkRayTracing(size_t nbRays) {
+	if (needsReload) RealReload();
+
+	std::vector<SubProcessSuperStructure> structures = subprocessStructures; //Trees are rebuilt on a copy, the simulation's own are left untouched
+	std::vector<std::pair<size_t, SubprocessFacet*>> sources; //Structure, facet
+	for (size_t s = 0; s < structures.size(); s++) {
+		for (auto& f : structures[s].facets) {
+			sources.emplace_back(s, &f);
+		}
+	}
+	if (sources.empty()) throw Error("Benchmark: the geometry has no facets.");
+
+	Simulation bench(this); //Not attached to a thread, only provides the ray tracing state
+	bench.ConstructFacetTmpVars();
+	bench.myOtfp = ontheflyParams;
+	bench.myOtfp.enableLogging = false; //Benchmark rays aren't particles
+	bench.myTmpResults = emptyResultTemplate; //Partially transparent facets record their passes, discarded with bench
+	bench.currentParticle.flightTime = 0.0;
+	bench.currentParticle.velocity = 1.0;
+	MersenneTwister rayGenerator;
+	rayGenerator.SetSeed(42);
+
+	std::vector<Vector3d> rayPos(nbRays), rayDir(nbRays);
+	std::vector<size_t> raySource(nbRays);
+	for (size_t i = 0; i < nbRays; i++) {
+		raySource[i] = std::min((size_t)(rayGenerator.rnd() * sources.size()), sources.size() - 1);
+		SubprocessFacet* f = sources[raySource[i]].second;
+		double u, v;
+		size_t nbTries = 0;
+		do {
+			u = rayGenerator.rnd();
+			v = rayGenerator.rnd();
+		} while (!IsInFacet(*f, u, v) && ++nbTries < 100);
+		rayPos[i] = f->facetRef->sh.O + u * f->facetRef->sh.U + v * f->facetRef->sh.V;
+		rayDir[i] = PolarToCartesian(f, acos(sqrt(rayGenerator.rnd())), rayGenerator.rnd()*2.0*PI, false);
+	}
+
+	std::vector<size_t> widths = { 1 };
+	if (GetSupportedAABBWidth() >= 4) widths.push_back(4);
+	if (GetSupportedAABBWidth() >= 8) widths.push_back(8);
+	std::vector<std::tuple<bool, SubprocessFacet*, double>> reference(nbRays);
+	double referenceTime = 0.0;
+	printf("Tracing %zd rays, %zd facets in %zd structure(s):\n", nbRays, sources.size(), structures.size());
+	for (size_t width : widths) {
+		for (auto& s : structures) {
+			std::vector<SubprocessFacet*> facetPointers; facetPointers.reserve(s.facets.size());
+			for (auto& f : s.facets) {
+				facetPointers.push_back(&f);
+			}
+			AABBNODE* aabbTree = BuildAABBTree(facetPointers, aabbLeafSize);
+			if (width > 1) BuildWideAABBTree(aabbTree, s, width);
+			else FlattenAABBTree(aabbTree, s);
+			delete aabbTree;
+		}
+
+		bench.randomGenerator.SetSeed(42); //Same transparent pass decisions, as long as facets are tested in the same order
+		size_t nbHits = 0, nbDifferences = 0;
+		auto startTime = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < nbRays; i++) {
+			bench.currentParticle.structureId = sources[raySource[i]].first;
+			bench.currentParticle.lastHitFacet = sources[raySource[i]].second;
+			auto result = Intersect(&bench, structures, rayPos[i], rayDir[i]);
+			if (std::get<0>(result)) nbHits++;
+			if (width == 1) reference[i] = result;
+			else if (std::get<0>(result) != std::get<0>(reference[i]) || std::get<1>(result) != std::get<1>(reference[i]) || std::get<2>(result) != std::get<2>(reference[i])) nbDifferences++;
+		}
+		double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		if (width == 1) {
+			referenceTime = time;
+			printf("  binary tree, scalar: %.3f s (%.3g rays/s), %zd hits\n", time, (double)nbRays / time, nbHits);
+		}
+		else {
+			printf("  %zd-wide tree, %s: %.3f s (%.3g rays/s, x%.2f), %zd hits, %zd differences with the binary tree\n",
+				width, width == 8 ? "AVX2" : "SSE", time, (double)nbRays / time, referenceTime / time, nbHits, nbDifferences);
+		}
+	}
+	printf("Differences can only come from the order facets are tested in: random decisions on partially transparent facets, or ties (rays through a shared edge).\n");
+}
+
 /**
 * \brief Serialization function for a binary cereal archive for the worker attributes
 * \return output string stream containing the result of the archiving
@@ -1620,6 +2203,7 @@ void Worker::PrepareToRun() {
 	for (size_t i = 0; i<moments.size(); i++)
 		if (moments[i]>wp.latestMoment) wp.latestMoment = moments[i];
 	wp.latestMoment += wp.timeWindowSize / 2.0;
+	momentIndex.Build(moments, wp.timeWindowSize);
 
 	Geometry *g = GetGeometry();
 	//Generate integrated desorption functions
@@ -1722,8 +2306,10 @@ void Worker::PrepareToRun() {
 		*/
 	}
 
+#ifndef MOLFLOW_CLI
 	if (mApp->facetAdvParams && mApp->facetAdvParams->IsVisible() && needsAngleMapStatusRefresh)
 		mApp->facetAdvParams->Refresh(geom->GetSelectedFacets());
+#endif
 
 	CalcTotalOutgassing();
 	
@@ -1814,7 +2400,9 @@ void Worker::CalcTotalOutgassing() {
 			}
 		}
 	}
+#ifndef MOLFLOW_CLI
 	if (mApp->globalSettings) mApp->globalSettings->UpdateOutgassing();
+#endif
 
 }
 
@@ -32,6 +32,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "Geometry_shared.h"
 #include "Facet_shared.h"
 #include <math.h>
+#include <algorithm> //std::find
 
 #ifdef MOLFLOW
 #include "MolFlow.h"
@@ -98,6 +99,12 @@ PressureEvolution::PressureEvolution(Worker *w) :GLWindow() {
 	addButton = new GLButton(0, "Add selected facet");
 	Add(addButton);
 
+	formulaCombo = new GLCombo(0);
+	Add(formulaCombo);
+
+	addFormulaButton = new GLButton(0, "Add formula");
+	Add(addFormulaButton);
+
 	profCombo = new GLCombo(0);
 	Add(profCombo);
 
@@ -128,7 +135,7 @@ PressureEvolution::PressureEvolution(Worker *w) :GLWindow() {
 	int yD = (hS - hD) / 2;
 	SetBounds(xD, yD, wD, hD);
 	SetResizable(true);
-	SetMinimumSize(wD, 220);
+	SetMinimumSize(wD, 245);
 
 	RestoreDeviceObjects();
 
@@ -146,7 +153,9 @@ PressureEvolution::PressureEvolution(Worker *w) :GLWindow() {
 */
 void PressureEvolution::SetBounds(int x, int y, int w, int h) {
 
-	chart->SetBounds(7, 5, w - 15, h - 60);
+	chart->SetBounds(7, 5, w - 15, h - 85);
+	formulaCombo->SetBounds(7, h - 70, 343, 19);
+	addFormulaButton->SetBounds(370, h - 70, 110, 19);
 	profCombo->SetBounds(7, h - 45, 117, 19);
 	selButton->SetBounds(130, h - 45, 80, 19);
 	removeButton->SetBounds(215, h - 45, 60, 19);
@@ -172,7 +181,15 @@ void PressureEvolution::Refresh() {
 
 	//Remove views that aren't present anymore
 	for (auto i = views.begin();i!=views.end();) {
-		if ((*i)->userData1 >= geom->GetNbFacet()) { //If pointing to non-existent facet
+		bool removed;
+		if ((*i)->userData1 == -1) { //Formula deleted
+			removed = !Contains(mApp->formulas_n, formulaViews[*i]);
+			if (removed) formulaViews.erase(*i);
+		}
+		else {
+			removed = ((size_t)(*i)->userData1 >= geom->GetNbFacet()); //If pointing to non-existent facet
+		}
+		if (removed) {
 			chart->GetY1Axis()->RemoveDataView(*i);
 			SAFE_DELETE(*i);
 			i=views.erase(i);
@@ -191,6 +208,13 @@ void PressureEvolution::Refresh() {
 	}
 	profCombo->SetSelectedIndex(nbProf ? (int)nbProf-1 : -1);
 
+	formulaCombo->SetSize(mApp->formulas_n.size());
+	for (size_t i = 0; i < mApp->formulas_n.size(); i++) {
+		GLParser *formula = mApp->formulas_n[i];
+		formulaCombo->SetValueAt(i, *formula->GetName() ? formula->GetName() : formula->GetExpression(), (int)i);
+	}
+	formulaCombo->SetSelectedIndex(mApp->formulas_n.size() ? 0 : -1);
+
 	//Refresh chart
 	refreshChart();
 }
@@ -234,8 +258,26 @@ void PressureEvolution::refreshChart() {
 	double scaleY;
 	size_t facetHitsSize = (1 + worker->moments.size()) * sizeof(FacetHitBuffer);
 
+	//Formulas are evaluated for all moments in one go
+	if (!formulaViews.empty()) mApp->formulaEvaluator.EvaluateMoments(mApp->formulas_n, results, 10000, formulaMomentValues);
+
 	for (auto& v : views) {
 
+		if (v->userData1 == -1) { //Formula
+			GLParser *formula = formulaViews[v];
+			size_t formulaId = std::find(mApp->formulas_n.begin(), mApp->formulas_n.end(), formula) - mApp->formulas_n.begin();
+			v->Reset();
+			if (formulaId < formulaMomentValues.size()) {
+				v->SetName(*formula->GetName() ? formula->GetName() : formula->GetExpression());
+				const std::vector<double>& values = formulaMomentValues[formulaId];
+				for (size_t m = 0; m < values.size(); m++) {
+					if (std::isfinite(values[m])) v->Add(worker->moments[m], values[m], false);
+				}
+			}
+			v->CommitChange();
+			continue;
+		}
+
 		if (v->userData1 >= 0 && v->userData1 < geom->GetNbFacet()) {
 			Facet *f = geom->GetFacet(v->userData1);
 			v->Reset();
@@ -335,6 +377,36 @@ void PressureEvolution::addView(size_t facetId) {
 	Refresh();
 }
 
+/**
+* \brief Adds a view to the chart plotting a formula against time
+* \param formula formula (of the formula editor) that should be added
+*/
+void PressureEvolution::addFormulaView(GLParser *formula) {
+
+	for (auto& fv : formulaViews) {
+		if (fv.second == formula) {
+			GLMessageBox::Display("Formula already on chart", "Error", GLDLG_OK, GLDLG_ICONERROR);
+			return;
+		}
+	}
+	if (worker->moments.size() > 10000) {
+		GLMessageBox::Display("Only the first 10000 moments will be plotted", "Error", GLDLG_OK, GLDLG_ICONWARNING);
+	}
+
+	auto v = new GLDataView();
+	v->SetName(*formula->GetName() ? formula->GetName() : formula->GetExpression());
+	v->SetViewType(TYPE_BAR);
+	v->SetMarker(MARKER_DOT);
+	GLColor col = chart->GetFirstAvailableColor();
+	v->SetColor(col);
+	v->SetMarkerColor(col);
+	v->userData1 = -1;
+	views.push_back(v);
+	formulaViews[v] = formula;
+	chart->GetY1Axis()->AddDataView(v);
+	Refresh();
+}
+
 /**
 * \brief Removes a view from the chart with a specific ID
 * \param viewId Id of the view that should be removed
@@ -342,6 +414,7 @@ void PressureEvolution::addView(size_t facetId) {
 void PressureEvolution::remView(size_t viewId) {
 
 	chart->GetY1Axis()->RemoveDataView(views[viewId]);
+	formulaViews.erase(views[viewId]);
 	SAFE_DELETE(views[viewId]);
 	views.erase(views.begin()+viewId);
 
@@ -356,6 +429,7 @@ void PressureEvolution::Reset() {
 	for (auto v : views)
 		delete v;
 	views.clear();
+	formulaViews.clear();
 	Refresh();
 }
 
@@ -392,6 +466,14 @@ void PressureEvolution::ProcessMessage(GLComponent *src, int message) {
 				addView(selFacets[0]); //Includes chart refresh
 			}
 		}
+		else if (src == addFormulaButton) {
+			int idx = formulaCombo->GetSelectedIndex();
+			if (idx < 0 || idx >= (int)mApp->formulas_n.size()) {
+				GLMessageBox::Display("No formula to add, define one in the formula editor", "Add formula to chart", { "Sorry!" }, GLDLG_ICONERROR);
+				return;
+			}
+			addFormulaView(mApp->formulas_n[idx]); //Includes chart refresh
+		}
 		else if (src == removeButton) {
 			int idx = profCombo->GetSelectedIndex();
 			if (idx >= 0) remView(idx);
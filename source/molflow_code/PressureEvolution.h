@@ -20,6 +20,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 
 #pragma once
 #include <vector>
+#include <map>
 #include "GLApp/GLWindow.h"
 #include "GLApp/GLChart/GLChartConst.h"
 class GLChart;
@@ -31,6 +32,7 @@ class GLToggle;
 class GLTextField;
 class Worker;
 class Geometry;
+class GLParser;
 
 
 class PressureEvolution : public GLWindow {
@@ -52,6 +54,7 @@ public:
 private:
 
   void addView(size_t facetId);
+  void addFormulaView(GLParser *formula);
   void remView(size_t viewId);
   void refreshChart();
 
@@ -67,10 +70,14 @@ private:
   GLButton    *addButton;
   GLButton    *removeButton;
   GLButton    *removeAllButton;
+  GLCombo     *formulaCombo;
+  GLButton    *addFormulaButton;
 
   GLToggle *logXToggle,*logYToggle;
 
   std::vector<GLDataView*>  views;
+  std::map<GLDataView*,GLParser*> formulaViews; //Views plotting a formula (userData1 = -1)
+  std::vector<std::vector<double>> formulaMomentValues;
   std::vector<GLColor>    colors;
   float        lastUpdate;
 
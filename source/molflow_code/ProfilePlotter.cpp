@@ -31,6 +31,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "Geometry_shared.h"
 #include "Facet_shared.h"
 #include <math.h>
+#include <numeric> //std::iota
 #ifdef MOLFLOW
 #include "MolFlow.h"
 #endif
@@ -49,15 +50,7 @@ extern MolFlow *mApp;
 extern SynRad*mApp;
 #endif
 
-const char* profType[] = {
-	"None",
-	"Pressure \201 [mbar]",
-	"Pressure \202 [mbar]",
-	"Incident angle [deg]",
-	"Speed [m/s]",
-	"Ort. velocity [m/s]",
-	"Tan. velocity [m/s]"
-};
+extern const char* profType[];
 
 /**
 * \brief Constructor with initialisation for Profile plotter window (Tools/Profile Plotter)
@@ -314,13 +307,13 @@ void ProfilePlotter::plot() {
 		}
 	}
 
-	// Plot
-	for (int i = 0; i < 1000; i++) {
-		double x = (double)i;
-		double y;
-		var->value = x;
-		parser->Evaluate(&y);
-		v->Add(x, y, false);
+	// Plot, all points evaluated in one go
+	std::vector<double> x(1000), y(1000);
+	std::iota(x.begin(), x.end(), 0.0);
+	const double *xValues = x.data();
+	parser->EvaluateBatch(&xValues, x.size(), y.data());
+	for (size_t i = 0; i < x.size(); i++) {
+		v->Add(x[i], std::isfinite(y[i]) ? y[i] : 0.0, false);
 	}
 	v->CommitChange();
 
@@ -340,6 +333,10 @@ void ProfilePlotter::refreshViews() {
 
 	Geometry *geom = worker->GetGeometry();
 
+#ifdef MOLFLOW
+	warningLabel->SetText(worker->wp.sMode == AC_MODE ? "AC mode: profiles are not computed." : "Profiles can only be used on rectangular facets.");
+#endif
+
 	double scaleY;
 
 	size_t facetHitsSize = (1 + worker->moments.size()) * sizeof(FacetHitBuffer);
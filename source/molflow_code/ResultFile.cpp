@@ -0,0 +1,193 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#include "ResultFile.h"
+#include "GLApp/GLProgress.h"
+#include "ziplib/extlibs/zlib/zlib.h"
+#include <stdint.h>
+#include <cstddef> //offsetof
+
+static const char resultFileMagic[8] = { 'M','F','R','E','S','U','L','T' };
+
+//64-bit file positions (results can exceed 2GB)
+static bool Seek64(FILE* file, size_t offset) {
+#ifdef _WIN32
+	return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+	return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static size_t Tell64(FILE* file) {
+#ifdef _WIN32
+	return (size_t)_ftelli64(file);
+#else
+	return (size_t)ftello(file);
+#endif
+}
+
+// Header: magic, version, flags, nbMoments, nbFacet, offset of the block offset table
+struct ResultFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t compressed;
+	uint64_t nbMoments;
+	uint64_t nbFacet;
+	uint64_t offsetTable;
+};
+
+// Each block: raw size, stored size (== raw size if not compressed), stored bytes
+struct ResultBlockHeader {
+	uint64_t rawSize;
+	uint64_t storedSize;
+};
+
+ResultFileWriter::ResultFileWriter(const std::string& fileName, size_t nbMoments, size_t nbFacet, bool compress) :
+	nbBlocks(1 + nbMoments * nbFacet), compress(compress) {
+	file = fopen(fileName.c_str(), "wb");
+	if (!file) throw Error(("Cannot open file for writing " + fileName).c_str());
+	ResultFileHeader header;
+	memcpy(header.magic, resultFileMagic, sizeof(header.magic));
+	header.version = RESULTFILE_VERSION;
+	header.compressed = compress ? 1 : 0;
+	header.nbMoments = nbMoments;
+	header.nbFacet = nbFacet;
+	header.offsetTable = 0; //Written by Close()
+	if (fwrite(&header, sizeof(header), 1, file) != 1) throw Error("Error writing result file header");
+	offsets.reserve(nbBlocks);
+}
+
+ResultFileWriter::~ResultFileWriter() {
+	if (file) fclose(file);
+}
+
+void ResultFileWriter::WriteBlock(const ResultBlock& block) {
+	if (offsets.size() >= nbBlocks) throw Error("Result file: too many blocks");
+	offsets.push_back(Tell64(file));
+
+	ResultBlockHeader blockHeader;
+	blockHeader.rawSize = block.data.size();
+	const char* stored = block.data.data();
+	blockHeader.storedSize = block.data.size();
+	if (compress && !block.data.empty()) {
+		uLongf compressedSize = compressBound((uLong)block.data.size());
+		compressed.resize(compressedSize);
+		//Level 1: textures compress well already at the fastest level, higher levels mostly cost time
+		if (compress2((Bytef*)compressed.data(), &compressedSize, (const Bytef*)block.data.data(), (uLong)block.data.size(), 1) == Z_OK
+			&& compressedSize < block.data.size()) {
+			stored = compressed.data();
+			blockHeader.storedSize = compressedSize;
+		}
+	}
+	if (fwrite(&blockHeader, sizeof(blockHeader), 1, file) != 1
+		|| (blockHeader.storedSize > 0 && fwrite(stored, blockHeader.storedSize, 1, file) != 1))
+		throw Error("Error writing result file (disk full?)");
+}
+
+void ResultFileWriter::Close() {
+	if (offsets.size() != nbBlocks) throw Error("Result file: not all blocks written");
+	size_t offsetTable = Tell64(file);
+	std::vector<uint64_t> table(offsets.begin(), offsets.end());
+	if (fwrite(table.data(), sizeof(uint64_t), table.size(), file) != table.size()) throw Error("Error writing result file (disk full?)");
+	uint64_t offsetTable64 = offsetTable;
+	if (!Seek64(file, offsetof(ResultFileHeader, offsetTable)) || fwrite(&offsetTable64, sizeof(offsetTable64), 1, file) != 1)
+		throw Error("Error writing result file header");
+	if (fclose(file) != 0) {
+		file = NULL;
+		throw Error("Error closing result file");
+	}
+	file = NULL;
+}
+
+ResultFileReader::ResultFileReader(const std::string& fileName) {
+	file = fopen(fileName.c_str(), "rb");
+	if (!file) throw Error(("Cannot open result file " + fileName).c_str());
+	ResultFileHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, resultFileMagic, sizeof(header.magic)) != 0)
+		throw Error("Not a Molflow result file");
+	if (header.version > RESULTFILE_VERSION) throw Error("Result file written by a newer Molflow version");
+	if (header.offsetTable == 0) throw Error("Result file incomplete (saving was interrupted?)");
+	nbMoments = header.nbMoments;
+	nbFacet = header.nbFacet;
+
+	std::vector<uint64_t> table(1 + nbMoments * nbFacet);
+	if (!Seek64(file, header.offsetTable) || fread(table.data(), sizeof(uint64_t), table.size(), file) != table.size())
+		throw Error("Result file: can't read block table");
+	offsets.assign(table.begin(), table.end());
+}
+
+ResultFileReader::~ResultFileReader() {
+	if (file) fclose(file);
+}
+
+void ResultFileReader::ReadBlock(size_t blockId, ResultBlock& block) {
+	if (blockId >= offsets.size()) throw Error("Result file: block index out of range");
+	ResultBlockHeader blockHeader;
+	if (!Seek64(file, offsets[blockId]) || fread(&blockHeader, sizeof(blockHeader), 1, file) != 1)
+		throw Error("Result file: can't read block");
+	block.data.resize(blockHeader.rawSize);
+	block.readPos = 0;
+	if (blockHeader.storedSize == blockHeader.rawSize) { //Stored uncompressed
+		if (blockHeader.rawSize > 0 && fread(block.data.data(), blockHeader.rawSize, 1, file) != 1)
+			throw Error("Result file: can't read block");
+		return;
+	}
+	compressed.resize(blockHeader.storedSize);
+	if (fread(compressed.data(), blockHeader.storedSize, 1, file) != 1) throw Error("Result file: can't read block");
+	uLongf rawSize = (uLongf)blockHeader.rawSize;
+	if (uncompress((Bytef*)block.data.data(), &rawSize, (const Bytef*)compressed.data(), (uLong)compressed.size()) != Z_OK
+		|| rawSize != blockHeader.rawSize)
+		throw Error("Result file: corrupt compressed block");
+}
+
+void WriteResultFile(const std::string& fileName, GlobalSimuState& results, const GlobalHitBuffer& hitCaches,
+	const std::vector<FacetResultLayout>& facets, GLProgress* prg) {
+	size_t nbMoments = results.facetStates.empty() ? 1 : results.facetStates[0].momentResults.size();
+	ResultFileWriter writer(fileName, nbMoments, facets.size(), true);
+	ResultBlock block;
+
+	GlobalHitBuffer& gHits = results.globalHits;
+	block.Put(gHits.globalHits);
+	block.Put(gHits.distTraveled_total);
+	block.Put(gHits.distTraveledTotal_fullHitsOnly);
+	block.Put(gHits.nbLeakTotal);
+	block.Put(gHits.texture_limits);
+	block.PutArray(hitCaches.hitCache, hitCaches.hitCacheSize);
+	block.PutArray(hitCaches.leakCache, hitCaches.leakCacheSize);
+	writer.WriteBlock(block);
+
+	for (size_t m = 0; m < nbMoments; m++) {
+		if (prg) prg->SetProgress(0.5 + 0.5*(double)m / (double)nbMoments);
+		for (size_t i = 0; i < facets.size(); i++) {
+			const FacetResultLayout& f = facets[i];
+			FacetMomentSnapshot& facetResults = results.facetStates[i].momentResults[m];
+			block.data.clear();
+			block.Put(facetResults.hits);
+			block.PutArray(facetResults.profile.data(), f.profile ? facetResults.profile.size() : 0);
+			block.Put(f.texture ? f.texWidth : 0);
+			block.Put(f.texture ? f.texHeight : 0);
+			block.PutArray(facetResults.texture.data(), f.texture ? f.texWidth*f.texHeight : 0);
+			block.Put(f.directions ? f.texWidth : 0);
+			block.Put(f.directions ? f.texHeight : 0);
+			block.PutArray(facetResults.direction.data(), f.directions ? f.texWidth*f.texHeight : 0);
+			writer.WriteBlock(block);
+		}
+	}
+	writer.Close();
+}
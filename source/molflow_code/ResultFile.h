@@ -0,0 +1,143 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+// Binary simulation state (.mfres), saved next to the geometry XML in .zip files
+// Layout: header | block 0: global results | blocks 1+m*nbFacet+f: facet f, moment m | block offset table
+// Blocks are written one at a time (nothing else held in memory), each one optionally zlib-compressed,
+// and the offset table allows reading any facet/moment without touching the rest of the file.
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <cstring> //memcpy
+#include <algorithm> //min
+#include "GLApp/GLTypes.h" //Error
+#include "Buffer_shared.h" //GlobalSimuState
+
+class GLProgress;
+
+#define RESULTFILE_VERSION 1
+
+/**
+* \brief Byte buffer of one block: values appended with Put, read back in the same order with Get
+*/
+class ResultBlock {
+public:
+	template <typename T> void Put(const T& value) {
+		const char* bytes = reinterpret_cast<const char*>(&value);
+		data.insert(data.end(), bytes, bytes + sizeof(T));
+	}
+	template <typename T> void PutArray(const T* values, size_t count) {
+		Put((size_t)count);
+		const char* bytes = reinterpret_cast<const char*>(values);
+		data.insert(data.end(), bytes, bytes + count * sizeof(T));
+	}
+	template <typename T> void Get(T& value) {
+		Check(sizeof(T));
+		memcpy(&value, data.data() + readPos, sizeof(T));
+		readPos += sizeof(T);
+	}
+	/**
+	* \brief Reads an array written by PutArray
+	* \param values destination, receives min(count in file, maxCount) elements
+	* \return count in file (elements beyond maxCount are skipped)
+	*/
+	template <typename T> size_t GetArray(T* values, size_t maxCount) {
+		size_t count;
+		Get(count);
+		Check(count * sizeof(T));
+		memcpy(values, data.data() + readPos, std::min(count, maxCount) * sizeof(T));
+		readPos += count * sizeof(T);
+		return count;
+	}
+
+	std::vector<char> data;
+	size_t readPos = 0;
+
+private:
+	void Check(size_t size) {
+		if (readPos + size > data.size()) throw Error("Result file: block shorter than expected (corrupt file?)");
+	}
+};
+
+/**
+* \brief Streams the blocks of a result file to disk, in block order
+*/
+class ResultFileWriter {
+public:
+	ResultFileWriter(const std::string& fileName, size_t nbMoments, size_t nbFacet, bool compress); //Throws Error
+	~ResultFileWriter();
+
+	void WriteBlock(const ResultBlock& block);
+	void Close(); //Writes the offset table. Throws Error if not all blocks were written
+
+private:
+	FILE* file = NULL;
+	size_t nbBlocks;
+	bool compress;
+	std::vector<size_t> offsets;
+	std::vector<char> compressed; //Reused between blocks
+};
+
+/**
+* \brief Random access reader of a result file
+*/
+class ResultFileReader {
+public:
+	ResultFileReader(const std::string& fileName); //Throws Error
+	~ResultFileReader();
+
+	size_t GetNbMoments() const { return nbMoments; }
+	size_t GetNbFacet() const { return nbFacet; }
+
+	void ReadGlobalBlock(ResultBlock& block) { ReadBlock(0, block); }
+	void ReadFacetBlock(size_t facetId, size_t moment, ResultBlock& block) { ReadBlock(1 + moment * nbFacet + facetId, block); }
+
+private:
+	void ReadBlock(size_t blockId, ResultBlock& block);
+
+	FILE* file = NULL;
+	size_t nbMoments = 0;
+	size_t nbFacet = 0;
+	std::vector<size_t> offsets;
+	std::vector<char> compressed;
+};
+
+/**
+* \brief What a facet records, as seen by the geometry when saving (the writer doesn't touch facets, so it can run on a snapshot)
+*/
+struct FacetResultLayout {
+	bool profile = false;
+	bool texture = false;
+	bool directions = false;
+	size_t texWidth = 0;
+	size_t texHeight = 0;
+};
+
+/**
+* \brief Writes a complete result file
+* \param results simulation state (locked or a private copy)
+* \param hitCaches hit and leak caches (the worker keeps them outside the results)
+* \param facets one entry per facet
+* \param prg progress window, NULL when writing from a background thread
+*/
+void WriteResultFile(const std::string& fileName, GlobalSimuState& results, const GlobalHitBuffer& hitCaches,
+	const std::vector<FacetResultLayout>& facets, GLProgress* prg);
@@ -6,14 +6,6 @@
 #include "Random.h"
 #include "GLApp/MathTools.h"
 
-/**
-* \brief Destructor for the SubProcessSuperStructure class deleting the ay tracing tree (aabbTree)
-*/
-SubProcessSuperStructure::~SubProcessSuperStructure()
-{
-	SAFE_DELETE(aabbTree);
-}
-
 /**
 * \brief Copies various states/parameters from worker to the simulation
 */
@@ -27,6 +19,7 @@ void Simulation::CopyMyStateFromControl() {
 		prParam2 = worker->workerControl.cmdParam2[prIdx];
 		worker->workerControl.cmdParam[prIdx] = 0;
 		worker->workerControl.cmdParam2[prIdx] = 0;
+		commandSerialSeen = worker->workerControl.commandSerial;
 
 		ReleaseMutex(worker->workerControl.mutex);
 
@@ -39,6 +32,25 @@ void Simulation::CopyMyStateFromControl() {
 	}
 }
 
+/**
+* \brief Blocks an idle thread until the worker issues a new command (no polling)
+*/
+void Simulation::WaitForCommand() {
+	std::unique_lock<std::timed_mutex> lock(worker->workerControl.mutex);
+	worker->workerControl.commandIssued.wait(lock, [this] {
+		return worker->workerControl.commandSerial != commandSerialSeen || worker->workerControl.states[prIdx] != prState;
+	});
+}
+
+/**
+* \brief Tells whether the worker issued a command since the state was last copied
+* Lock-free, checked by the run loops every few bounces to end their step early, so that stop and reload don't wait for the step
+* \return true if a command is pending
+*/
+bool Simulation::CommandPending() const {
+	return worker->workerControl.commandSerial.load(std::memory_order_relaxed) != commandSerialSeen;
+}
+
 /**
 * \brief Getter that returns the process state
 * \return process state
@@ -62,6 +74,7 @@ void Simulation::SetLocalAndMasterState(size_t state, const std::string& status,
 		if (changeState) worker->workerControl.states[prIdx] = state;
 		if (changeStatus) worker->workerControl.statusStr[prIdx] = status;
 		ReleaseMutex(worker->workerControl.mutex);
+		if (changeState) worker->workerControl.stateChanged.notify_all(); //Acknowledge to Worker::Wait
 	}
 }
 
@@ -82,8 +95,14 @@ void Simulation::SetErrorSub(const std::string& message) {
 std::string Simulation::GetMyStatusAsText() {
 
 	char ret[1024];
+	if (acMode) {
+		const ViewFactorMatrix& viewFactors = worker->viewFactors;
+		if (prIdx == 0) sprintf(ret, "(%s) AC %zd iterations (change %.2e)", worker->GetGeometry()->GetName().c_str(), viewFactors.nbIterations, viewFactors.residual);
+		else sprintf(ret, "(%s) AC (solved by thread 1)", worker->GetGeometry()->GetName().c_str());
+		return ret;
+	}
 	size_t count = totalDesorbed;
-	size_t max = myOtfp.desorptionLimit / myOtfp.nbProcess;
+	size_t max = (myOtfp.desorptionLimit > (size_t)prIdx) ? (myOtfp.desorptionLimit - prIdx + myOtfp.nbProcess - 1) / myOtfp.nbProcess : 0; //This thread's share, see StartFromSource
 
 		if (max != 0) {
 			double percent = (double)(count)*100.0 / (double)(max);
@@ -123,13 +142,14 @@ void Simulation::SetStatusStringAtMaster(const std::string& status ) {
 }
 
 /**
-* \brief Resizes the temporary particle log (log since last update)
+* \brief Flags the logged facets (myOtfp.logFacetIds) for LogHit, and seeds the sampling generator
 */
-void Simulation::ResizeTmpLog() {
-	LockMutex(worker->logMutex);
-	myLogTarget = std::max((myOtfp.enableLogging ? myOtfp.logLimit : 0) - worker->log.size(),(size_t)0) / myOtfp.nbProcess;
-	ReleaseMutex(worker->logMutex);
-	tmpParticleLog.clear();tmpParticleLog.shrink_to_fit(); tmpParticleLog.reserve(myLogTarget);
+void Simulation::UpdateLogFilter() {
+	logFacet.assign(worker->GetGeometry()->GetNbFacet(), 0);
+	for (size_t facetId : myOtfp.logFacetIds)
+		if (facetId < logFacet.size()) logFacet[facetId] = 1;
+	logSampler.SetSeed(myOtfp.randomSeed != 0 ? myOtfp.randomSeed : threadSeed);
+	logSampler.SetStream(UINT64_MAX - prIdx); //Particle streams are numbered from 0: no overlap
 }
 
 /**
@@ -149,7 +169,8 @@ int Simulation::mainLoop(int index) {
 	prIdx = index;
 
 	//InitSimulation(); //Creates sHandle instance
-	randomGenerator.SetSeed(randomGenerator.GetSeed()); //By this point this is a unique thread with its own id
+	threadSeed = Philox::GetSeed(); //By this point this is a unique thread with its own id
+	randomGenerator.SetSeed(threadSeed);
 
 	// Sub process ready
 	SetReady();
@@ -171,7 +192,7 @@ int Simulation::mainLoop(int index) {
 		case COMMAND_UPDATEPARAMS:
 			//printf("COMMAND: UPDATEPARAMS (%zd,%I64d)\n", prParam, prParam2);
 			myOtfp = worker->ontheflyParams;
-			ResizeTmpLog();
+			UpdateLogFilter();
 			SetLocalAndMasterState(prParam, GetMyStatusAsText());
 			break;
 
@@ -197,13 +218,37 @@ int Simulation::mainLoop(int index) {
 				SetErrorSub("No geometry loaded");
 			break;
 
+		case COMMAND_LOADAC:
+			//printf("COMMAND: LOADAC (%zd,%llu)\n", prParam, prParam2);
+			if (loadOK) {
+				SetLocalAndMasterState(PROCESS_RUNAC, "Computing view factors");
+				if (ComputeViewFactors())
+					SetLocalAndMasterState(PROCESS_DONE, "View factors computed");
+				//else interrupted by a new command, or error
+			}
+			else
+				SetErrorSub("No geometry loaded");
+			break;
+
+		case COMMAND_STEPAC:
+			//printf("COMMAND: STEPAC (%zd,%llu)\n", prParam, prParam2);
+			if (loadOK) {
+				acMode = true;
+				if (StartAC()) SimulationACStep(0); //Single sweep
+				if (GetMyState() != PROCESS_ERROR) SetReady();
+			}
+			else
+				SetErrorSub("No geometry loaded");
+			break;
+
 		case COMMAND_PAUSE:
 			//printf("COMMAND: PAUSE (%zd,%llu)\n", prParam, prParam2);
+			WaitForReducer(); //Block handed over during the last run step must be in the results before we report ready
 			if (!lastHitUpdateOK) {
 				// Last update not successful, retry with a longer timeout
 				if (GetMyState() != PROCESS_ERROR) {
-					UpdateMCHits(30000);
-					UpdateLog(30000);
+					if (acMode) UpdateACHits(30000);
+					else UpdateMCHits(30000);
 				}
 			}
 			SetReady();
@@ -229,21 +274,26 @@ int Simulation::mainLoop(int index) {
 		case PROCESS_RUN:
 			SetStatusStringAtMaster(GetMyStatusAsText()); //update hits only
 			eos = SimulationRun();      // Run during 1 sec
-			if (GetMyState() != PROCESS_ERROR) {
-				UpdateMCHits(20); // Update hit with 20ms timeout. If fails, probably an other subprocess is updating, so we'll keep calculating and try it later (latest when the simulation is stopped).
-				UpdateLog(20);
+			if (GetMyState() != PROCESS_ERROR && !acMode) { //AC results are published by each step
+				lastHitUpdateOK = HandOverMCHits(); // Non-blocking. If the reducer is still merging our previous block, we keep calculating and hand over later (latest when the simulation is stopped).
 			}
 			if (eos) {
 				if (GetMyState() != PROCESS_ERROR) {
-					// Max desorption reached
+					// Worker::Update() doesn't pause DONE threads: flush everything before reporting
+					WaitForReducer();
+					if (!lastHitUpdateOK) {
+						if (acMode) UpdateACHits(30000);
+						else UpdateMCHits(30000);
+					}
+					// Max desorption reached (or AC solution converged)
 					SetLocalAndMasterState(PROCESS_DONE, GetMyStatusAsText());
-					printf("COMMAND: PROCESS_DONE (Max reached)\n");
+					printf(acMode ? "COMMAND: PROCESS_DONE (AC converged)\n" : "COMMAND: PROCESS_DONE (Max reached)\n");
 				}
 			}
 			break;
 
 		default:
-			std::this_thread::sleep_for(std::chrono::milliseconds(WAITTIME));
+			WaitForCommand(); //Ready, done or error: sleep until the next command
 			break;
 		}
 	}
@@ -260,6 +310,8 @@ void Simulation::ClearSimulation() {
 	//Put everything to default state
 	//Even better would be to end thread and launch again
 	end = loadOK =  false;
+	WaitForReducer(); //Results are about to be rebuilt: no merge may still be in flight
+	wavefront.Clear();
 	//tmpParticleLog.clear(); tmpParticleLog.shrink_to_fit(); //Will be reinitialized on LoadSimulation()
 	//myTmpResults.clear(); //Will be reinitialized on LoadSimulation()
 	totalDesorbed = 0;
@@ -301,10 +353,17 @@ bool Simulation::LoadSimulation() {
 	ClearSimulation();
 	SetLocalAndMasterState(PROCESS_STARTING, "Loading worker params");
 	myOtfp = worker->ontheflyParams;
+	randomGenerator.SetSeed(myOtfp.randomSeed != 0 ? myOtfp.randomSeed : threadSeed);
+	momentHits.clear(); //Moments may have changed
+	firstParticleId = worker->globalHitCache.globalHits.nbDesorbed; //Loaded results: don't replay their particles. The worker waits for us, no concurrent update
+	maxwellSampler = &MaxwellSampler::Get();
+	velocityScales.resize(worker->temperatures.size());
+	for (size_t i = 0; i < worker->temperatures.size(); i++)
+		velocityScales[i] = MaxwellSampler::Scale(worker->temperatures[i], worker->wp.gasMass);
 	SetLocalAndMasterState(PROCESS_STARTING, "Loading results memory structure");
 	myTmpResults = worker->emptyResultTemplate;
-	SetLocalAndMasterState(PROCESS_STARTING, "Loading log memory structure");
-	ResizeTmpLog();
+	myPendingResults = worker->emptyResultTemplate;
+	UpdateLogFilter();
 	ConstructFacetTmpVars();
 	return loadOK = true;
 }
@@ -340,6 +399,10 @@ void Simulation::CopyStateFromMaster() {
 bool Simulation::StartSimulation() {
 	//StartFromSource();
 	//return currentParticle.lastHitFacet != NULL;
+	acMode = (prParam == AC_MODE); //Simulation mode is the start command's parameter
+	if (acMode) return StartAC();
+	if (myOtfp.wavefrontSize > 0) return StartWavefront();
+	wavefront.Clear(); //Back to the scalar engine: particles in flight are dropped, like the current one below
 	return StartFromSource();
 }
 
@@ -351,12 +414,14 @@ bool Simulation::SimulationRun() {
 	int nbStep = 1;
 	bool goOn;
 
+	if (acMode) return !SimulationACStep(1000);
+
 	if (stepPerSec == 0.0) nbStep = 250;
 	else nbStep = (int)(stepPerSec + 0.5);
 	auto start_time = std::chrono::high_resolution_clock::now();
-	goOn = SimulationMCStep(nbStep);
+	goOn = (wavefront.size() > 0) ? SimulationWavefrontStep(nbStep) : SimulationMCStep(nbStep); //Engine chosen at start (StartSimulation)
 	auto end_time = std::chrono::high_resolution_clock::now();
 	double elapsedTimeMs = std::chrono::duration<double, std::milli>(end_time - start_time).count();
-	stepPerSec = ((double)nbStep / elapsedTimeMs)*1000.0;
+	if (!CommandPending()) stepPerSec = ((double)nbStep / elapsedTimeMs)*1000.0; //Interrupted steps are shorter, don't calibrate on them
 	return !goOn;
 }
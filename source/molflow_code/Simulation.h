@@ -24,12 +24,18 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "Facet_shared.h"
 #include "SMP.h"
 #include <vector>
+#include <cstdint>
 #include "Vector.h"
 #include "Parameter.h"
 #include <tuple>
+#include <atomic>
 #include "Random.h"
+#include "Polygon.h" //PolygonGrid
+#include "ParticleLog.h"
+#include "MaxwellSampler.h"
 
-#define WAITTIME    100
+#define COMMAND_CHECK_STEPS 256 //Bounces between two CommandPending() checks of a run step
+#define AC_DESORPTION_EQUIVALENT 1E9 //AC solutions are stored as the expected MC results of this many desorptions
 
 class GeneratingAnglemap {
 public:
@@ -44,8 +50,8 @@ public:
 	double GetPhiPdfValue(const double & thetaIndex, const int & phiIndex, const AnglemapParams & anglemapParams);
 	double GetPhiCDFValue(const double& thetaIndex, const int& phiIndex, const AnglemapParams& anglemapParams);
 	double GetPhiCDFSum(const double & thetaIndex, const AnglemapParams & anglemapParams);
-	std::tuple<double, int, double> GenerateThetaFromAngleMap(const AnglemapParams& anglemapParams, MersenneTwister& randomGenerator);
-	double GeneratePhiFromAngleMap(const int& thetaLowerIndex, const double& thetaOvershoot, const AnglemapParams& anglemapParams, MersenneTwister& randomGenerator);
+	std::tuple<double, int, double> GenerateThetaFromAngleMap(const AnglemapParams& anglemapParams, Philox& randomGenerator);
+	double GeneratePhiFromAngleMap(const int& thetaLowerIndex, const double& thetaOvershoot, const AnglemapParams& anglemapParams, Philox& randomGenerator);
 };
 
 class Simulation; //Fwd declaration
@@ -77,9 +83,15 @@ public:
 
 	size_t globalId; //Global index (to identify when superstructures are present)
 	Facet* facetRef = NULL; //Reference to interface facet
+
+	// Point-in-facet acceleration (see IsInFacet)
+	bool fillsUV = false; //Polygon is the whole (u,v) unit square: every point of the parallelogram is on the facet
+	PolygonGrid polygonGrid; //Built for facets with many vertices
 	
 	void InitializeOnLoad(size_t nbStruct); //Throws exception
 
+	void InitializePolygonCheck();
+
 	bool InitializeTexture();
 
 	void InitializeAngleMap();
@@ -92,13 +104,58 @@ public:
 
 // Local simulation structure
 
-class AABBNODE;
+// Flattened AABB tree node (32 bytes). Depth-first order: an interior node's first child is the next node
+class LinearAABBNode {
+public:
+	float bbMin[3]; // Bounds rounded outwards to float precision
+	float bbMax[3];
+	uint32_t offset; // Leaf: index of its first facet record. Interior node: index of its second child
+	uint32_t nbFacets : 30; // 0 for interior nodes
+	uint32_t axis : 2; // Interior node: cutting plane axis (0:x, 1:y, 2:z), to visit the child nearer to the ray origin first
+};
+
+// Facet data needed by the ray-facet test, stored contiguously in leaf order (the full FacetProperties is only read on actual hits)
+class FacetIntersectionRecord {
+public:
+	Vector3d O;
+	Vector3d U;
+	Vector3d V;
+	Vector3d Nuv;
+	SubprocessFacet* facet;
+	bool is2sided;
+};
+
+// Node of a 4- or 8-wide tree: the bounds of all children are stored per axis so that one SIMD slab test covers them at once
+template <size_t W>
+class alignas(32) WideAABBNode {
+public:
+	float bbMin[3][W]; // [axis][child], rounded outwards and padded (see BuildWideAABBTree)
+	float bbMax[3][W];
+	uint32_t child[W]; // Interior child: node index. Leaf child: index of its first facet packet
+	uint32_t nbPackets[W]; // 0 for interior children
+	uint32_t nbChildren; // Used slots, first ones
+};
+
+// Ray-facet test data of 4 leaf facets, one lane per facet, for vectorised ray-parallelogram tests. Unused lanes have a NULL facet and zero vectors
+class alignas(32) FacetPacket {
+public:
+	double O[3][4]; // [component][lane]
+	double U[3][4];
+	double V[3][4];
+	double Nuv[3][4];
+	SubprocessFacet* facet[4];
+	bool is2sided[4];
+};
 
 class SubProcessSuperStructure {
 public:
-	~SubProcessSuperStructure();
 	std::vector<SubprocessFacet>  facets;   // Facet handles
-	AABBNODE* aabbTree = NULL; // Structure AABB tree
+	size_t aabbWidth = 1; // Ray tracing tree in use: 1 (binary, scalar tests), 4 (SSE) or 8 (AVX2). Only that one is built
+	std::vector<LinearAABBNode> aabbNodes; // Structure AABB tree, root first
+	std::vector<FacetIntersectionRecord> aabbFacets; // Facets of the tree leaves
+	std::vector<WideAABBNode<4>> aabbNodes4; // 4-wide tree, root first
+	std::vector<WideAABBNode<8>> aabbNodes8; // 8-wide tree, root first
+	std::vector<FacetPacket> aabbPackets; // Facets of the wide tree leaves
 };
 
 class CurrentParticleStatus {
@@ -114,12 +171,104 @@ public:
 
 	double   velocity;
 	double   expectedDecayMoment; //for radioactive gases
+	size_t   particleId; //Index of the desorption in the run, also the particle's random stream
 	size_t   structureId;        // Current structure
 	int      teleportedFrom;   // We memorize where the particle came from: we can teleport back
 	SubprocessFacet *lastHitFacet = NULL;     // Last hitted facet
 	std::vector<SubprocessFacet*> transparentHitBuffer; //Storing this buffer simulation-wide is cheaper than recreating it at every Intersect() call
 };
 
+// Time moments sorted by value, to find the windows a time falls in without testing every moment. Built by Worker::PrepareToRun
+class MomentIndex {
+public:
+	void Build(const std::vector<double>& moments, double timeWindowSize);
+	void GetMoments(double time, std::vector<size_t>& resultIds) const; // Appends the result index (moment index+1) of each moment with |time-moment| < timeWindowSize/2
+private:
+	std::vector<double> sortedMoments;
+	std::vector<size_t> sortedIds; // Result index of each sortedMoments entry
+	double halfWindow = 0.0;
+	double step = 0.0; // Evenly spaced moments (as from a "start,step,end" series): spacing, for a direct lookup. 0 otherwise (binary search)
+};
+
+// Event kinds of the wavefront engine, in processing order
+enum WavefrontEvent : uint64_t {
+	WAVEFRONT_COLLISION, // Stick or bounce (or end of the measured time), grouped by facet
+	WAVEFRONT_TELEPORT,
+	WAVEFRONT_LEAK
+};
+
+// In-flight particles of the wavefront engine (see Simulation::SimulationWavefrontStep), one array per field, indexed by slot
+class WavefrontBatch {
+public:
+	// Particle state, fields of CurrentParticleStatus. Loaded to Simulation::currentParticle for the scalar routines (see LoadWavefrontSlot)
+	std::vector<Vector3d> position;
+	std::vector<Vector3d> direction;
+	std::vector<double> oriRatio;
+	std::vector<size_t> nbBounces;
+	std::vector<double> distanceTraveled;
+	std::vector<double> flightTime;
+	std::vector<double> velocity;
+	std::vector<double> expectedDecayMoment;
+	std::vector<size_t> particleId;
+	std::vector<size_t> structureId;
+	std::vector<int> teleportedFrom;
+	std::vector<SubprocessFacet*> lastHitFacet;
+
+	std::vector<Philox> generators; // Each slot's own random stream, drawn from in place through Simulation::particleGenerator
+	std::vector<char> active; // False if the slot is empty: its last particle ended and the desorption limit is reached
+
+	// Result of the trace phase, kept for the event phase
+	std::vector<char> found;
+	std::vector<SubprocessFacet*> hitFacet;
+	std::vector<double> hitDistance;
+	std::vector<double> hitU; // Hit position, as myTmpFacetVars only holds the last one per facet
+	std::vector<double> hitV;
+	std::vector<std::pair<uint64_t, uint32_t>> events; // (kind<<32 | facet id, slot), sorted for the event phase
+
+	size_t size() const { return position.size(); }
+	void Resize(size_t nbSlots, const Philox& keyedGenerator);
+	void Clear();
+};
+
+// Surface element of the angular coefficient (AC) solver: a texture cell, or a whole facet if it has no texture
+class ACElement {
+public:
+	Vector3d center;
+	double area; // cm2
+	SubprocessFacet* facet;
+	size_t cellId; // Texture cell, or SIZE_MAX for a non-textured facet
+	double desorption; // Desorbed particles, out of AC_DESORPTION_EQUIVALENT
+	double sticking;
+	double meanVelocity; // Mean speed of the particles leaving the element, from the distribution MC generates at the facet temperature
+	double meanInverseVelocity; // Mean 1/speed of the same particles
+};
+
+// View factor from a source element to a target one, stored with the target
+class ACViewFactor {
+public:
+	uint32_t source;
+	float cosTarget; // Incidence cosine at the target, for the orthogonal velocity sums
+	double factor; // Fraction of the particles leaving the source that hit the target
+};
+
+// Sparse view factor matrix and steady-state solution of the AC mode. Owned by the worker, filled by the simulation threads (see SimulationAC.cpp)
+class ViewFactorMatrix {
+public:
+	std::vector<ACElement> elements;
+	std::vector<std::vector<ACViewFactor>> incoming; // Per target element. Rows are computed by the simulation threads, each thread writing its own rows only
+	std::atomic<size_t> nbRowsDone{ 0 };
+	bool normalized = false; // Source view factor sums capped to 1 (see Normalize)
+
+	std::vector<double> hits; // Solution: hits per element, for AC_DESORPTION_EQUIVALENT desorbed particles
+	size_t nbIterations = 0;
+	double residual = 1.0; // Relative change of the last Gauss-Seidel sweep
+
+	bool IsComplete() const { return !elements.empty() && nbRowsDone == elements.size(); }
+	void Normalize();
+	void ResetSolution();
+	void Clear();
+};
+
 class Worker;
 class Geometry;
 
@@ -131,13 +280,22 @@ public:
 	size_t prState;
 	size_t prParam;
 	size_t prParam2;
+	size_t commandSerialSeen = 0; //workerControl.commandSerial when the state was last copied (see CommandPending)
 	bool end = false;
 
-	MersenneTwister randomGenerator;
+	Philox randomGenerator; //Keyed on load. Reseeded to the particle's own stream at each desorption (see StartFromSource) by the scalar engine
+	Philox* particleGenerator; //Stream of the particle being processed: randomGenerator, or the generator of its wavefront slot
+	unsigned long threadSeed; //Key for unseeded runs (myOtfp.randomSeed==0)
+	size_t firstParticleId = 0; //Desorptions already in the results at load: numbering of this run's particles starts after them
+	const MaxwellSampler* maxwellSampler = nullptr; //Shared inverse CDF of the wall speed distribution
+	std::vector<double> velocityScales; //Per CDFid (temperature): scale of the speed distribution, see MaxwellSampler::Scale
 	
-	std::vector<ParticleLoggerItem> tmpParticleLog; //Recorded particle log since last UpdateMCHits
-	size_t myLogTarget = 0;
+	ParticleLogRing logRing; //Hits on the logged facets, drained to the log file by worker->particleLog
+	std::vector<char> logFacet; //Per facet: listed in myOtfp.logFacetIds
+	Philox logSampler; //Picks the hits logged when myOtfp.logSampling<1. Not the particles' generator: logging doesn't change the trajectories
 	GlobalSimuState myTmpResults; //Results recorded since last UpdateMcHits (doesn't include log which is independent)
+	GlobalSimuState myPendingResults; //Results handed over to the worker's reducer thread. Owned by the reducer while pendingResultsReady is set
+	std::atomic<bool> pendingResultsReady{ false }; //Set by the simulation thread on hand-over, cleared by the reducer once merged and zeroed
 	std::vector<SubProcessFacetTempVar> myTmpFacetVars; //One per subprocessfacet, for intersect routine
 	size_t totalDesorbed = 0;           // Total number of desorptions (for this process, not reset on UpdateMCHits)
 
@@ -152,6 +310,10 @@ public:
 	bool lastHitUpdateOK;  // Last hit update timeout
 
 	CurrentParticleStatus currentParticle;
+	std::vector<size_t> momentHits; //Result indices the last GetMomentsAt() time falls in: 0 (constant flow), then the matching moments
+	double momentHitsTime = 0.0;
+	WavefrontBatch wavefront; //Empty unless the wavefront engine is in use (myOtfp.wavefrontSize>0 at start)
+	bool acMode = false; //Started in AC_MODE: runs iterate the view factor solution instead of tracing particles
 
 	//Control related
 	void RecordHitOnTexture(SubprocessFacet *f, double time, bool countHit, double velocity_factor, double ortSpeedFactor);
@@ -161,6 +323,8 @@ public:
 	void RecordAngleMap(SubprocessFacet* collidedFacet);
 	void ClearSimulation();
 	void CopyMyStateFromControl();
+	void WaitForCommand();
+	bool CommandPending() const;
 	size_t GetMyState();
 	void CopyStateFromMaster();
 	void SetLocalAndMasterState(size_t state, const std::string & status, bool changeState = true, bool changeStatus = true);
@@ -168,7 +332,7 @@ public:
 	std::string GetMyStatusAsText();
 	void SetReady();
 	void SetStatusStringAtMaster(const std::string& status);
-	void ResizeTmpLog();
+	void UpdateLogFilter();
 	void ConstructFacetTmpVars();
 	int mainLoop(int index);
 	bool LoadSimulation();
@@ -176,6 +340,15 @@ public:
 	void ResetSimulation();
 	bool SimulationRun();
 	bool SimulationMCStep(size_t nbStep);
+	bool ProcessIntersection(bool found, SubprocessFacet* collidedFacet, double d);
+	bool StartWavefront();
+	bool SimulationWavefrontStep(size_t nbStep);
+	void LoadWavefrontSlot(size_t slot);
+	void StoreWavefrontSlot(size_t slot);
+	bool ComputeViewFactors();
+	bool StartAC();
+	bool SimulationACStep(size_t maxTimeMs);
+	void UpdateACHits(size_t timeout);
 	void IncreaseDistanceCounters(double d);
 	bool StartFromSource();
 	void PerformBounce(SubprocessFacet *iFacet);
@@ -183,8 +356,9 @@ public:
 	void RecordHistograms(SubprocessFacet * iFacet);
 	void PerformTeleport(SubprocessFacet *iFacet);
 	void PerformTransparentPass(SubprocessFacet *iFacet);
-	void UpdateLog(size_t timeout);
 	void UpdateMCHits(size_t timeout);
+	bool HandOverMCHits();
+	void WaitForReducer();
 
 	//Simulation related
 	void RegisterTransparentPass(SubprocessFacet* f);
@@ -194,6 +368,7 @@ public:
 	double GenerateDesorptionTime(SubprocessFacet* src);
 	double GetStickingAt(SubprocessFacet *src, double time);
 	double GetOpacityAt(SubprocessFacet *src, double time);
+	const std::vector<size_t>& GetMomentsAt(double time);
 	void   IncreaseFacetCounter(SubprocessFacet *f, double time, size_t hit, size_t desorb, size_t absorb, double sum_1_per_v, double sum_v_ort);
 	void   TreatMovingFacet();
 	void RecordHit(const int& type);
@@ -0,0 +1,274 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+
+// Angular coefficient (AC) mode: deterministic steady-state solution on the surface elements (texture cells) of the geometry
+// 1. COMMAND_LOADAC: the simulation threads compute the view factors between the elements, each thread a share of the target elements
+// 2. Run or COMMAND_STEPAC: the first thread solves hits = F^T * (desorption + (1-sticking) * hits) by Gauss-Seidel sweeps
+// The solution is published as the expected MC results of AC_DESORPTION_EQUIVALENT desorptions: facet counters,
+// textures and the pressure/density views work unchanged. Profiles and direction vectors are not computed and stay empty
+
+#include <math.h>
+#include <chrono>
+#include <algorithm> //std::max
+#include "Simulation.h"
+#include "IntersectAABB_shared.h"
+#include "GLApp/MathTools.h"
+#include "Worker.h"
+
+#define AC_CONVERGENCE 1E-9 //Relative change of a sweep below which the solution is considered converged
+#define AC_PROGRESS_ROWS 64 //Target elements computed between two progress reports (and stop request checks)
+
+/**
+* \brief Caps the view factor sum of each source element to 1
+* The point-to-point approximation overestimates the view factor of close elements, capping keeps particles conserved.
+* Sums below 1 are particles leaving through openings of the geometry (leaks)
+*/
+void ViewFactorMatrix::Normalize() {
+	if (normalized) return;
+	std::vector<double> sourceSums(elements.size(), 0.0);
+	for (const auto& row : incoming)
+		for (const auto& viewFactor : row)
+			sourceSums[viewFactor.source] += viewFactor.factor;
+	for (auto& row : incoming)
+		for (auto& viewFactor : row)
+			if (sourceSums[viewFactor.source] > 1.0) viewFactor.factor /= sourceSums[viewFactor.source];
+	normalized = true;
+	if (hits.size() != elements.size()) ResetSolution();
+}
+
+/**
+* \brief Restarts the iterative solution from zero hits, keeping the view factors
+*/
+void ViewFactorMatrix::ResetSolution() {
+	hits.assign(elements.size(), 0.0);
+	nbIterations = 0;
+	residual = 1.0;
+}
+
+/**
+* \brief Releases elements, view factors and solution (geometry changed)
+*/
+void ViewFactorMatrix::Clear() {
+	std::vector<ACElement>().swap(elements);
+	std::vector<std::vector<ACViewFactor>>().swap(incoming);
+	std::vector<double>().swap(hits);
+	nbRowsDone = 0;
+	normalized = false;
+	nbIterations = 0;
+	residual = 1.0;
+}
+
+/**
+* \brief Computes the view factors towards this thread's share of the elements (every nbProcess-th, starting at prIdx)
+* A source element sees a target if each is in front of the other (facets are one-sided) and no facet is in between (Visible)
+* \return true if all rows are done, false if interrupted by a new command or on error
+*/
+bool Simulation::ComputeViewFactors() {
+	ViewFactorMatrix& viewFactors = worker->viewFactors;
+	const std::vector<ACElement>& elements = viewFactors.elements;
+	size_t nbElements = elements.size();
+	//Visible() evaluates the opacity at the particle's flight time
+	currentParticle.flightTime = 0.0;
+	currentParticle.velocity = 1.0;
+
+	size_t nbRows = 0;
+	try {
+		for (size_t target = prIdx; target < nbElements; target += myOtfp.nbProcess) {
+			const ACElement& t = elements[target];
+			const Vector3d& targetN = t.facet->facetRef->sh.N;
+			std::vector<ACViewFactor>& row = viewFactors.incoming[target];
+			row.clear();
+			for (size_t source = 0; source < nbElements; source++) {
+				const ACElement& s = elements[source];
+				if (s.facet == t.facet) continue; //Planar facet: doesn't see itself
+				Vector3d sourceToTarget = t.center - s.center;
+				double distanceSquare = Dot(sourceToTarget, sourceToTarget);
+				if (distanceSquare == 0.0) continue;
+				double distance = sqrt(distanceSquare);
+				double cosSource = Dot(s.facet->facetRef->sh.N, sourceToTarget) / distance;
+				double cosTarget = -Dot(targetN, sourceToTarget) / distance;
+				if (cosSource <= 0.0 || cosTarget <= 0.0) continue;
+				Vector3d sourceCenter = s.center;
+				Vector3d targetCenter = t.center;
+				if (!Visible(this, worker->subprocessStructures, &sourceCenter, &targetCenter, s.facet, t.facet)) continue;
+				ACViewFactor viewFactor;
+				viewFactor.source = (uint32_t)source;
+				viewFactor.cosTarget = (float)cosTarget;
+				viewFactor.factor = cosSource * cosTarget * t.area / (PI * distanceSquare);
+				row.push_back(viewFactor);
+			}
+			row.shrink_to_fit();
+			viewFactors.nbRowsDone++;
+
+			if (++nbRows % AC_PROGRESS_ROWS == 0) {
+				bool interrupted = false;
+				if (LockMutex(worker->workerControl.mutex)) {
+					interrupted = worker->workerControl.states[prIdx] != PROCESS_RUNAC; //New command (stop, exit...)
+					if (!interrupted) worker->workerControl.cmdParam[prIdx] = viewFactors.nbRowsDone * 100 / nbElements; //Progress for Worker::Update
+					ReleaseMutex(worker->workerControl.mutex);
+				}
+				if (interrupted) return false;
+			}
+		}
+	}
+	catch (const std::bad_alloc&) {
+		SetErrorSub("Not enough memory for the view factor matrix. Use a coarser mesh.");
+		return false;
+	}
+	return true;
+}
+
+/**
+* \brief Prepares an AC run or step: the first thread solves, the others have nothing to do
+* \return true if this thread runs the solver
+*/
+bool Simulation::StartAC() {
+	ViewFactorMatrix& viewFactors = worker->viewFactors;
+	if (!viewFactors.IsComplete()) {
+		SetErrorSub("View factors not computed (use Calc AC first)");
+		return false;
+	}
+	lastHitUpdateOK = true; //Nothing pending from a previous MC run
+	if (prIdx != 0) return false;
+	viewFactors.Normalize();
+	worker->results.Reset(); //The AC solution replaces any previous (MC) result
+	return true;
+}
+
+/**
+* \brief Gauss-Seidel sweeps on the hits of each element, then publishes the solution
+* \param maxTimeMs sweeps are repeated until this time is elapsed (at least one sweep)
+* \return true if the solution hasn't converged yet
+*/
+bool Simulation::SimulationACStep(size_t maxTimeMs) {
+	ViewFactorMatrix& viewFactors = worker->viewFactors;
+	const std::vector<ACElement>& elements = viewFactors.elements;
+	std::vector<double>& hits = viewFactors.hits;
+	auto startTime = std::chrono::steady_clock::now();
+	double elapsedMs;
+
+	do {
+		double change = 0.0;
+		double sum = 0.0;
+		for (size_t target = 0; target < elements.size(); target++) {
+			double newHits = 0.0;
+			for (const ACViewFactor& viewFactor : viewFactors.incoming[target]) {
+				const ACElement& s = elements[viewFactor.source];
+				newHits += viewFactor.factor * (s.desorption + (1.0 - s.sticking) * hits[viewFactor.source]); //Desorbed and reflected particles
+			}
+			change += std::abs(newHits - hits[target]);
+			sum += newHits;
+			hits[target] = newHits;
+		}
+		viewFactors.residual = (sum > 0.0) ? change / sum : 0.0;
+		viewFactors.nbIterations++;
+		elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+	} while (viewFactors.residual > AC_CONVERGENCE && elapsedMs < (double)maxTimeMs && !CommandPending());
+
+	UpdateACHits(20);
+	return viewFactors.residual > AC_CONVERGENCE;
+}
+
+/**
+* \brief Writes the current AC solution to the worker's results, as the expected values of the MC counters
+* Incident particles are counted with the velocity of their source element and the incidence angle of the view factor,
+* particles leaving an element (desorbed or reflected) with the cosine law at the element's temperature
+* Profiles and direction textures are not written (StartAC left them zeroed)
+* \param timeout time to wait for the results mutex (ms). On timeout, lastHitUpdateOK is false and the update is retried at pause
+*/
+void Simulation::UpdateACHits(size_t timeout) {
+	const ViewFactorMatrix& viewFactors = worker->viewFactors;
+	const std::vector<ACElement>& elements = viewFactors.elements;
+	const std::vector<double>& hits = viewFactors.hits;
+	double velocityFactor = worker->wp.useMaxwellDistribution ? 1.0 : 1.1781; //As in MC
+	const double meanCos = 2.0 / 3.0; //Mean cosine of cosine-law directions (and 2 is their mean 1/cosine)
+
+	lastHitUpdateOK = worker->LockResultsForMerge(timeout);
+	if (!lastHitUpdateOK) return;
+	GlobalSimuState& results = worker->results;
+
+	std::vector<FacetHitBuffer> facetHits(results.facetStates.size());
+	std::vector<double> facetHitSums(results.facetStates.size(), 0.0);
+	std::vector<double> facetDesorbed(results.facetStates.size(), 0.0);
+	double totalHits = 0.0, totalAbsorbed = 0.0, totalDesorbed = 0.0;
+
+	for (size_t target = 0; target < elements.size(); target++) {
+		const ACElement& t = elements[target];
+		//Incident particles
+		double incidentHits = 0.0, sumVOrt = 0.0, sum1PerVOrt = 0.0, sum1PerV = 0.0;
+		for (const ACViewFactor& viewFactor : viewFactors.incoming[target]) {
+			const ACElement& s = elements[viewFactor.source];
+			double arriving = viewFactor.factor * (s.desorption + (1.0 - s.sticking) * hits[viewFactor.source]);
+			incidentHits += arriving;
+			sumVOrt += arriving * s.meanVelocity * viewFactor.cosTarget;
+			sum1PerVOrt += arriving * s.meanInverseVelocity / viewFactor.cosTarget;
+			sum1PerV += arriving * s.meanInverseVelocity;
+		}
+		double absorbed = t.sticking * incidentHits;
+		double reflected = incidentHits - absorbed;
+		double leaving = reflected + t.desorption;
+
+		size_t facetId = t.facet->globalId;
+		FacetHitBuffer& h = facetHits[facetId];
+		facetHitSums[facetId] += incidentHits;
+		facetDesorbed[facetId] += t.desorption;
+		h.nbHitEquiv += incidentHits;
+		h.nbAbsEquiv += absorbed;
+		h.sum_1_per_ort_velocity += (t.sticking + 1.0) * sum1PerVOrt //Absorbed count twice (see RecordAbsorb)
+			+ (reflected + 2.0 * t.desorption) * 2.0 * t.meanInverseVelocity; //Desorbed count twice (see StartFromSource)
+		h.sum_v_ort += velocityFactor * (sumVOrt + leaving * t.meanVelocity * meanCos);
+		h.sum_1_per_velocity += sum1PerV + t.desorption * t.meanInverseVelocity;
+
+		if (t.cellId != SIZE_MAX) {
+			const FacetProperties& sh = t.facet->facetRef->sh;
+			double absorbedWeight = sh.countAbs ? t.sticking : 0.0;
+			double reflectedWeight = sh.countRefl ? 1.0 - t.sticking : 0.0;
+			double desorbed = sh.countDes ? t.desorption : 0.0;
+			double outgoing = reflectedWeight * incidentHits + desorbed; //Recorded leaving particles
+			TextureCell& cell = results.facetStates[facetId].momentResults[0].texture[t.cellId];
+			cell.countEquiv = (absorbedWeight + reflectedWeight) * incidentHits + desorbed;
+			//Texture recorders include the velocity factor in the orthogonal velocity (see RecordHitOnTexture)
+			cell.sum_1_per_ort_velocity = ((2.0 * absorbedWeight + reflectedWeight) * sum1PerVOrt
+				+ (reflectedWeight * incidentHits + 2.0 * desorbed) * 2.0 * t.meanInverseVelocity) / velocityFactor;
+			cell.sum_v_ort_per_area = velocityFactor * ((absorbedWeight + reflectedWeight) * sumVOrt + outgoing * t.meanVelocity * meanCos)
+				* t.facet->textureCellIncrements[t.cellId];
+		}
+		totalHits += incidentHits;
+		totalAbsorbed += absorbed;
+		totalDesorbed += t.desorption;
+	}
+
+	for (size_t i = 0; i < results.facetStates.size(); i++) {
+		if (facetHitSums[i] == 0.0 && facetDesorbed[i] == 0.0) continue;
+		facetHits[i].nbMCHit = (size_t)llround(facetHitSums[i]);
+		facetHits[i].nbDesorbed = (size_t)llround(facetDesorbed[i]);
+		results.facetStates[i].momentResults[0].hits = facetHits[i];
+	}
+	GlobalHitBuffer& globalHits = results.globalHits;
+	globalHits.globalHits.nbMCHit = (size_t)llround(totalHits);
+	globalHits.globalHits.nbHitEquiv = totalHits;
+	globalHits.globalHits.nbAbsEquiv = totalAbsorbed;
+	globalHits.globalHits.nbDesorbed = (size_t)llround(totalDesorbed);
+	globalHits.nbLeakTotal = (size_t)llround(std::max(0.0, totalDesorbed - totalAbsorbed)); //Not yet absorbed: left through openings (or not converged)
+	worker->RescanTextureLimits(); //The solution replaces the previous one: cells may have decreased
+
+	ReleaseMutex(worker->results.mutex);
+	SetLocalAndMasterState(0, GetMyStatusAsText(), false, true);
+}
@@ -26,6 +26,8 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "Random.h"
 #include "GLApp/MathTools.h"
 #include <tuple> //std::tie
+#include <algorithm> //std::upper_bound, std::sort
+#include <thread>
 #include "Worker.h"
 #include "MolflowGeometry.h"
 
@@ -124,281 +126,52 @@ void Simulation::CalcTotalOutgassing() {
 //}
 
 /**
-* \brief Updates hit counters and various variables for an MC hit
+* \brief Adds the locally recorded results directly to the worker's results, blocking for the mutex
+* Only used when the simulation leaves the running state (pause or end of simulation): while running, results go through HandOverMCHits()
 * \param timeout maximum wait time to get a a mutex
 */
 void Simulation::UpdateMCHits(size_t timeout) {
 
 	SetLocalAndMasterState(0, "Waiting for 'hits' dataport access...", false, true);
-	lastHitUpdateOK = LockMutex(worker->results.mutex, timeout);
+	lastHitUpdateOK = worker->LockResultsForMerge(timeout);
 	SetLocalAndMasterState(0, "Updating MC hits...", false, true);
 	if (!lastHitUpdateOK) return; //Timeout, will try again later
 
-	// Global hits and leaks: adding local hits to shared memory
-	worker->results.globalHits.globalHits += myTmpResults.globalHits.globalHits;
-	//gHits->globalHits.nbMCHit += myTmpResults.globalHits.globalHits.nbMCHit;
-	//gHits->globalHits.nbHitEquiv += myTmpResults.globalHits.globalHits.nbHitEquiv;
-	//gHits->globalHits.nbAbsEquiv += myTmpResults.globalHits.globalHits.nbAbsEquiv;
-	//gHits->globalHits.nbDesorbed += myTmpResults.globalHits.globalHits.nbDesorbed;
-	worker->results.globalHits.distTraveled_total += myTmpResults.globalHits.distTraveled_total;
-	worker->results.globalHits.distTraveledTotal_fullHitsOnly += myTmpResults.globalHits.distTraveledTotal_fullHitsOnly;
-
-	//Memorize current limits, then do a min/max search
-	TEXTURE_MIN_MAX texture_limits_old[3];
-	for (size_t i = 0; i < 3; i++) {
-		texture_limits_old[i] = worker->results.globalHits.texture_limits[i];
-		worker->results.globalHits.texture_limits[i].min.all = worker->results.globalHits.texture_limits[i].min.moments_only = HITMAX;
-		worker->results.globalHits.texture_limits[i].max.all = worker->results.globalHits.texture_limits[i].max.moments_only = 0;
-	}
-
-	// Leak
-	for (size_t leakIndex = 0; leakIndex < myTmpResults.globalHits.leakCacheSize; leakIndex++)
-		worker->results.globalHits.leakCache[(leakIndex + worker->results.globalHits.lastLeakIndex) % LEAKCACHESIZE] = myTmpResults.globalHits.leakCache[leakIndex];
-	worker->results.globalHits.nbLeakTotal += myTmpResults.globalHits.nbLeakTotal;
-	worker->results.globalHits.lastLeakIndex = (worker->results.globalHits.lastLeakIndex + myTmpResults.globalHits.leakCacheSize) % LEAKCACHESIZE;
-	worker->results.globalHits.leakCacheSize = Min(LEAKCACHESIZE, worker->results.globalHits.leakCacheSize + myTmpResults.globalHits.leakCacheSize);
-
-	// HHit (Only prIdx 0)
-	if (prIdx == 0) {
-		for (size_t hitIndex = 0; hitIndex < myTmpResults.globalHits.hitCacheSize; hitIndex++)
-			worker->results.globalHits.hitCache[(hitIndex + worker->results.globalHits.lastHitIndex) % HITCACHESIZE] = myTmpResults.globalHits.hitCache[hitIndex];
-
-		if (myTmpResults.globalHits.hitCacheSize > 0) {
-			worker->results.globalHits.lastHitIndex = (worker->results.globalHits.lastHitIndex + myTmpResults.globalHits.hitCacheSize) % HITCACHESIZE;
-			worker->results.globalHits.hitCache[worker->results.globalHits.lastHitIndex].type = HIT_LAST; //Penup (border between blocks of consecutive hits in the hit cache)
-			worker->results.globalHits.hitCacheSize = Min(HITCACHESIZE, worker->results.globalHits.hitCacheSize + myTmpResults.globalHits.hitCacheSize);
-		}
-	}
+	worker->AddGlobalHits(myTmpResults.globalHits, prIdx == 0); //HHit (Only prIdx 0)
+	worker->results.AddModified(myTmpResults, false); //Only the facets and cells written since the last update
+	worker->UpdateTextureLimits(myTmpResults);
 
-	//Global histograms
-	worker->results.globalHistograms += myTmpResults.globalHistograms;
-	/*
-		for (int m = 0; m < (1 + worker->moments.size()); m++) {
-			BYTE *histCurrentMoment = buffer + sizeof(GlobalHitBuffer) + m * worker->wp.globalHistogramParams.GetDataSize();
-			if (worker->wp.globalHistogramParams.recordBounce) {
-				double* nbHitsHistogram = (double*)histCurrentMoment;
-				for (size_t i = 0; i < worker->wp.globalHistogramParams.GetBounceHistogramSize(); i++) {
-					nbHitsHistogram[i] += sHandle->tmpGlobalHistograms[m].nbHitsHistogram[i];
-				}
-			}
-			if (worker->wp.globalHistogramParams.recordDistance) {
-				double* distanceHistogram = (double*)(histCurrentMoment + worker->wp.globalHistogramParams.GetBouncesDataSize());
-				for (size_t i = 0; i < (worker->wp.globalHistogramParams.GetDistanceHistogramSize()); i++) {
-					distanceHistogram[i] += sHandle->tmpGlobalHistograms[m].distanceHistogram[i];
-				}
-			}
-			if (worker->wp.globalHistogramParams.recordTime) {
-				double* timeHistogram = (double*)(histCurrentMoment + worker->wp.globalHistogramParams.GetBouncesDataSize() + worker->wp.globalHistogramParams.GetDistanceDataSize());
-				for (size_t i = 0; i < (worker->wp.globalHistogramParams.GetTimeHistogramSize()); i++) {
-					timeHistogram[i] += sHandle->tmpGlobalHistograms[m].timeHistogram[i];
-				}
-			}
-		}
-		*/
-
-	worker->results.facetStates += myTmpResults.facetStates;
-
-	//Manual texture min/max search
-	for (auto& s : worker->subprocessStructures) {
-		for (auto& f : s.facets) {
-			if (myTmpFacetVars[f.globalId].hitted) {
-				if (f.facetRef->sh.isTextured) {
-					for (int m = 0; m < (1 + worker->moments.size()); m++) {
-						double timeCorrection = m == 0 ? worker->wp.finalOutgassingRate : (worker->wp.totalDesorbedMolecules) / worker->wp.timeWindowSize;
-						//Timecorrection is required to compare constant flow texture values with moment values (for autoscaling)
-
-						const auto& texture = worker->results.facetStates[f.globalId].momentResults[m].texture;
-						size_t textureSize = texture.size();
-
-						for (size_t t = 0; t < textureSize; t++) {
-							double val[3];  //pre-calculated autoscaling values (Pressure, imp.rate, density)
-
-							val[0] = texture[t].sum_v_ort_per_area*timeCorrection; //pressure without dCoef_pressure
-							val[1] = texture[t].countEquiv*f.textureCellIncrements[t] * timeCorrection; //imp.rate without dCoef
-							val[2] = f.textureCellIncrements[t] * texture[t].sum_1_per_ort_velocity* timeCorrection; //particle density without dCoef
-
-						//Global autoscale
-							for (int v = 0; v < 3; v++) {
-								if (f.largeEnough[t])
-									worker->results.globalHits.texture_limits[v].max.all = std::max(worker->results.globalHits.texture_limits[v].max.all, val[v]);
-
-								if (val[v] > 0.0 && val[v] < worker->results.globalHits.texture_limits[v].min.all && f.largeEnough[t])
-									worker->results.globalHits.texture_limits[v].min.all = val[v];
-
-								//Autoscale ignoring constant flow (moments only)
-								if (m != 0) {
-									if (f.largeEnough[t])
-										worker->results.globalHits.texture_limits[v].max.moments_only = std::max(worker->results.globalHits.texture_limits[v].max.moments_only, val[v]);
-
-									if (val[v] > 0.0 && val[v] < worker->results.globalHits.texture_limits[v].min.moments_only && f.largeEnough[t])
-										worker->results.globalHits.texture_limits[v].min.moments_only = val[v];
-								}
-							}
-						}
-					}
-				}
-			}
-		}
-	}
+	ReleaseMutex(worker->results.mutex);
 
-		/*
-		size_t facetHitsSize = (1 + nbMoments) * sizeof(FacetHitBuffer);
-		// Facets
-		for (s = 0; s < structures.size(); s++) {
-			for (SubprocessFacet& f : structures[s].facets) {
-				if (f.hitted) {
-
-					for (int m = 0; m < (1 + nbMoments); m++) {
-						FacetHitBuffer *facetHitBuffer = (FacetHitBuffer *)(buffer + f.sh.hitOffset + m * sizeof(FacetHitBuffer));
-						facetHitBuffer->nbAbsEquiv += f.tmpCounter[m].nbAbsEquiv;
-						facetHitBuffer->nbDesorbed += f.tmpCounter[m].nbDesorbed;
-						facetHitBuffer->nbMCHit += f.tmpCounter[m].nbMCHit;
-						facetHitBuffer->nbHitEquiv += f.tmpCounter[m].nbHitEquiv;
-						facetHitBuffer->sum_1_per_ort_velocity += f.tmpCounter[m].sum_1_per_ort_velocity;
-						facetHitBuffer->sum_v_ort += f.tmpCounter[m].sum_v_ort;
-						facetHitBuffer->sum_1_per_velocity += f.tmpCounter[m].sum_1_per_velocity;
-					}
-
-					if (f.sh.isProfile) {
-						for (int m = 0; m < (1 + nbMoments); m++) {
-							ProfileSlice *shProfile = (ProfileSlice *)(buffer + f.sh.hitOffset + facetHitsSize + m * f.profileSize);
-							for (j = 0; j < PROFILE_SIZE; j++) {
-								shProfile[j] += f.profile[m][j];
-							}
-						}
-					}
-
-					if (f.sh.isTextured) {
-						for (int m = 0; m < (1 + nbMoments); m++) {
-							TextureCell *shTexture = (TextureCell *)(buffer + (f.sh.hitOffset + facetHitsSize + f.profileSize*(1 + nbMoments) + m * f.textureSize));
-							//double dCoef = gHits->globalHits.nbDesorbed * 1E4 * worker->wp.gasMass / 1000 / 6E23 * MAGIC_CORRECTION_FACTOR;  //1E4 is conversion from m2 to cm2
-							double timeCorrection = m == 0 ? worker->wp.finalOutgassingRate : (worker->wp.totalDesorbedMolecules) / worker->wp.timeWindowSize;
-							//Timecorrection is required to compare constant flow texture values with moment values (for autoscaling)
-
-							for (y = 0; y < f.sh.texHeight; y++) {
-								for (x = 0; x < f.sh.texWidth; x++) {
-									size_t add = x + y * f.sh.texWidth;
-
-									//Add temporary hit counts
-									shTexture[add] += f.texture[m][add];
-
-									double val[3];  //pre-calculated autoscaling values (Pressure, imp.rate, density)
-
-									val[0] = shTexture[add].sum_v_ort_per_area*timeCorrection; //pressure without dCoef_pressure
-									val[1] = shTexture[add].countEquiv*f.textureCellIncrements[add] * timeCorrection; //imp.rate without dCoef
-									val[2] = f.textureCellIncrements[add] * shTexture[add].sum_1_per_ort_velocity* timeCorrection; //particle density without dCoef
-
-									//Global autoscale
-									for (int v = 0; v < 3; v++) {
-										if (val[v] > gHits->texture_limits[v].max.all && f.largeEnough[add])
-											gHits->texture_limits[v].max.all = val[v];
-
-										if (val[v] > 0.0 && val[v] < gHits->texture_limits[v].min.all && f.largeEnough[add])
-											gHits->texture_limits[v].min.all = val[v];
-
-										//Autoscale ignoring constant flow (moments only)
-										if (m != 0) {
-											if (val[v] > gHits->texture_limits[v].max.moments_only && f.largeEnough[add])
-												gHits->texture_limits[v].max.moments_only = val[v];
-
-											if (val[v] > 0.0 && val[v] < gHits->texture_limits[v].min.moments_only && f.largeEnough[add])
-												gHits->texture_limits[v].min.moments_only = val[v];
-										}
-									}
-								}
-							}
-						}
-					}
-
-					if (f.sh.countDirection) {
-						for (int m = 0; m < (1 + nbMoments); m++) {
-							DirectionCell *shDir = (DirectionCell *)(buffer + (f.sh.hitOffset + facetHitsSize + f.profileSize*(1 + nbMoments) + f.textureSize*(1 + nbMoments) + f.directionSize*m));
-							for (y = 0; y < f.sh.texHeight; y++) {
-								for (x = 0; x < f.sh.texWidth; x++) {
-									size_t add = x + y * f.sh.texWidth;
-									shDir[add].dir.x += f.direction[m][add].dir.x;
-									shDir[add].dir.y += f.direction[m][add].dir.y;
-									shDir[add].dir.z += f.direction[m][add].dir.z;
-									//shDir[add].sumSpeed += f.direction[m][add].sumSpeed;
-									shDir[add].count += f.direction[m][add].count;
-								}
-							}
-						}
-					}
-
-					if (f.sh.anglemapParams.record) {
-						size_t *shAngleMap = (size_t *)(buffer + f.sh.hitOffset + facetHitsSize + f.profileSize*(1 + nbMoments) + f.textureSize*(1 + nbMoments) + f.directionSize*(1 + nbMoments));
-						for (y = 0; y < (f.sh.anglemapParams.thetaLowerRes + f.sh.anglemapParams.thetaHigherRes); y++) {
-							for (x = 0; x < f.sh.anglemapParams.phiWidth; x++) {
-								size_t add = x + y * f.sh.anglemapParams.phiWidth;
-								shAngleMap[add] += f.angleMap.pdf[add];
-							}
-						}
-					}
-
-					//Facet histograms
-
-						for (int m = 0; m < (1 + nbMoments); m++) {
-							BYTE *histCurrentMoment = buffer + f.sh.hitOffset + facetHitsSize + f.profileSize*(1 + nbMoments) + f.textureSize*(1 + nbMoments) + f.directionSize*(1 + nbMoments) + f.sh.anglemapParams.GetRecordedDataSize() + m * f.sh.facetHistogramParams.GetDataSize();
-							if (f.sh.facetHistogramParams.recordBounce) {
-								double* nbHitsHistogram = (double*)histCurrentMoment;
-								for (size_t i = 0; i < f.sh.facetHistogramParams.GetBounceHistogramSize(); i++) {
-									nbHitsHistogram[i] += f.tmpHistograms[m].nbHitsHistogram[i];
-								}
-							}
-							if (f.sh.facetHistogramParams.recordDistance) {
-								double* distanceHistogram = (double*)(histCurrentMoment + f.sh.facetHistogramParams.GetBouncesDataSize());
-								for (size_t i = 0; i < (f.sh.facetHistogramParams.GetDistanceHistogramSize()); i++) {
-									distanceHistogram[i] += f.tmpHistograms[m].distanceHistogram[i];
-								}
-							}
-							if (f.sh.facetHistogramParams.recordTime) {
-								double* timeHistogram = (double*)(histCurrentMoment + f.sh.facetHistogramParams.GetBouncesDataSize() + f.sh.facetHistogramParams.GetDistanceDataSize());
-								for (size_t i = 0; i < (f.sh.facetHistogramParams.GetTimeHistogramSize()); i++) {
-									timeHistogram[i] += f.tmpHistograms[m].timeHistogram[i];
-								}
-							}
-						}
-
-				} // End if(hitted)
-			} // End nbFacet
-		} // End nbSuper
-		*/
-
-		//if there were no textures:
-		for (int v = 0; v < 3; v++) {
-			if (worker->results.globalHits.texture_limits[v].min.all == HITMAX) worker->results.globalHits.texture_limits[v].min.all = texture_limits_old[v].min.all;
-			if (worker->results.globalHits.texture_limits[v].min.moments_only == HITMAX) worker->results.globalHits.texture_limits[v].min.moments_only = texture_limits_old[v].min.moments_only;
-			if (worker->results.globalHits.texture_limits[v].max.all == 0.0) worker->results.globalHits.texture_limits[v].max.all = texture_limits_old[v].max.all;
-			if (worker->results.globalHits.texture_limits[v].max.moments_only == 0.0) worker->results.globalHits.texture_limits[v].max.moments_only = texture_limits_old[v].max.moments_only;
-		}
+	myTmpResults.ResetModified();
+	SetLocalAndMasterState(0, GetMyStatusAsText(), false, true);
+}
 
-		ReleaseMutex(worker->results.mutex);
+/**
+* \brief Passes the results recorded since the last hand-over to the worker's reducer thread, without waiting
+* The local buffer is exchanged with the (zeroed) pending one, so the thread never holds the global results mutex while running
+* \return true if the results were handed over, false if the reducer hasn't consumed the previous block yet (keep accumulating locally)
+*/
+bool Simulation::HandOverMCHits() {
+	if (pendingResultsReady.load(std::memory_order_acquire)) return false; //Reducer busy with our previous block
 
-		myTmpResults.Reset();
-		SetLocalAndMasterState(0, GetMyStatusAsText(), false, true);
+	myTmpResults.Swap(myPendingResults);
+	{
+		std::lock_guard<std::mutex> lock(worker->reducerMutex);
+		pendingResultsReady.store(true, std::memory_order_release);
+	}
+	worker->handOverSignal.notify_one();
 
+	SetLocalAndMasterState(0, GetMyStatusAsText(), false, true);
+	return true;
 }
 
 /**
-* \brief Updates the log after MC hits have been gathered
-* \param timeout maximum wait time to get a a mutex
+* \brief Blocks until the reducer has merged the last handed-over block (if any) into the worker's results
 */
-void Simulation::UpdateLog(size_t timeout)
-{
-	if (tmpParticleLog.size()) {
-
-		SetLocalAndMasterState(0, "Waiting for 'dpLog' dataport access...", false, true);
-		if (!LockMutex(worker->logMutex, timeout)) return;
-		SetLocalAndMasterState(0, "Updating Log...", false, true);
-		size_t writeNb = myOtfp.logLimit - worker->log.size();
-		Saturate(writeNb, 0, tmpParticleLog.size());
-		worker->log.insert(worker->log.begin(), tmpParticleLog.begin(), tmpParticleLog.begin() + writeNb);
-		myLogTarget = (myOtfp.logLimit - worker->log.size()) / myOtfp.nbProcess + 1; //+1 to avoid all threads rounding down
-		ReleaseMutex(worker->logMutex);
-		tmpParticleLog.clear();
-		SetLocalAndMasterState(0, GetMyStatusAsText(), false, true);
-	}
+void Simulation::WaitForReducer() {
+	std::unique_lock<std::mutex> lock(worker->reducerMutex);
+	worker->mergeSignal.wait(lock, [this] { return !pendingResultsReady.load(std::memory_order_acquire); });
 }
 
 /**
@@ -469,8 +242,8 @@ void Simulation::PerformTeleport(SubprocessFacet *iFacet) {
 		RecordHit(HIT_ABS);
 		bool found = false;
 		while (!found && nbTry < 1000) {
-			u = randomGenerator.rnd();
-			v = randomGenerator.rnd();
+			u = particleGenerator->rnd();
+			v = particleGenerator->rnd();
 			if (IsInFacet(*destination, u, v)) {
 				found = true;
 				currentParticle.position = destination->facetRef->sh.O + u * destination->facetRef->sh.U + v * destination->facetRef->sh.V;
@@ -501,7 +274,7 @@ void Simulation::PerformTeleport(SubprocessFacet *iFacet) {
 
 /**
 * \brief Perform nbStep simulation steps (a step is a bounce)
-* \param nbStep number of steps to be performed
+* \param nbStep number of steps to be performed (fewer if a command arrives meanwhile, see CommandPending)
 */
 bool Simulation::SimulationMCStep(size_t nbStep) {
 
@@ -510,85 +283,248 @@ bool Simulation::SimulationMCStep(size_t nbStep) {
 
 		//Prepare output values
 		auto[found, collidedFacet, d] = Intersect(this, worker->subprocessStructures, currentParticle.position, currentParticle.direction);
+		if (!ProcessIntersection(found, collidedFacet, d)) return false;
+		if ((i + 1) % COMMAND_CHECK_STEPS == 0 && CommandPending()) break; //Stop, reload...: don't finish the step
+	}
+	return true;
+}
 
-		if (found) {
-
-			// Move particle to intersection point
-			currentParticle.position = currentParticle.position + d * currentParticle.direction;
-			//currentParticle.distanceTraveled += d;
-
-			double lastFLightTime = currentParticle.flightTime; //memorize for partial hits
-			currentParticle.flightTime += d / 100.0 / currentParticle.velocity; //conversion from cm to m
-
-			if ((!worker->wp.calcConstantFlow && (currentParticle.flightTime > worker->wp.latestMoment))
-				|| (worker->wp.enableDecay && (currentParticle.expectedDecayMoment < currentParticle.flightTime))) {
-				//hit time over the measured period - we create a new particle
-				//OR particle has decayed
-				double remainderFlightPath = currentParticle.velocity*100.0*
-					Min(worker->wp.latestMoment - lastFLightTime, currentParticle.expectedDecayMoment - lastFLightTime); //distance until the point in space where the particle decayed
-				myTmpResults.globalHits.distTraveled_total += remainderFlightPath * currentParticle.oriRatio;
-				RecordHit(HIT_LAST);
-				//sHandle->distTraveledSinceUpdate += currentParticle.distanceTraveled;
-				if (!StartFromSource())
-					// desorptionLimit reached
-					return false;
+/**
+* \brief Moves the current particle to its next collision and handles it (teleport, stick or bounce), or records a leak
+* \param found,collidedFacet,d result of Intersect() for the current particle. The hit's u,v are in myTmpFacetVars
+* \return false if the particle ended and no new one could be started (desorption limit or error)
+*/
+bool Simulation::ProcessIntersection(bool found, SubprocessFacet* collidedFacet, double d) {
+	if (found) {
+
+		// Move particle to intersection point
+		currentParticle.position = currentParticle.position + d * currentParticle.direction;
+		//currentParticle.distanceTraveled += d;
+
+		double lastFLightTime = currentParticle.flightTime; //memorize for partial hits
+		currentParticle.flightTime += d / 100.0 / currentParticle.velocity; //conversion from cm to m
+
+		if ((!worker->wp.calcConstantFlow && (currentParticle.flightTime > worker->wp.latestMoment))
+			|| (worker->wp.enableDecay && (currentParticle.expectedDecayMoment < currentParticle.flightTime))) {
+			//hit time over the measured period - we create a new particle
+			//OR particle has decayed
+			double remainderFlightPath = currentParticle.velocity*100.0*
+				Min(worker->wp.latestMoment - lastFLightTime, currentParticle.expectedDecayMoment - lastFLightTime); //distance until the point in space where the particle decayed
+			myTmpResults.globalHits.distTraveled_total += remainderFlightPath * currentParticle.oriRatio;
+			RecordHit(HIT_LAST);
+			//sHandle->distTraveledSinceUpdate += currentParticle.distanceTraveled;
+			if (!StartFromSource())
+				// desorptionLimit reached
+				return false;
+		}
+		else { //hit within measured time, particle still alive
+			if (collidedFacet->facetRef->sh.teleportDest != 0) { //Teleport
+				IncreaseDistanceCounters(d * currentParticle.oriRatio);
+				PerformTeleport(collidedFacet);
 			}
-			else { //hit within measured time, particle still alive
-				if (collidedFacet->facetRef->sh.teleportDest != 0) { //Teleport
-					IncreaseDistanceCounters(d * currentParticle.oriRatio);
-					PerformTeleport(collidedFacet);
+			/*else if ((GetOpacityAt(collidedFacet, currentParticle.flightTime) < 1.0) && (particleGenerator->rnd() > GetOpacityAt(collidedFacet, currentParticle.flightTime))) {
+				//Transparent pass
+				myTmpResults.globalHits.distTraveled_total += d;
+				PerformTransparentPass(collidedFacet);
+			}*/
+			else { //Not teleport
+				IncreaseDistanceCounters(d * currentParticle.oriRatio);
+				double stickingProbability = GetStickingAt(collidedFacet, currentParticle.flightTime);
+				if (!myOtfp.lowFluxMode) { //Regular stick or bounce
+					if (stickingProbability == 1.0 || ((stickingProbability > 0.0) && (particleGenerator->rnd() < (stickingProbability)))) {
+						//Absorbed
+						RecordAbsorb(collidedFacet);
+						//sHandle->distTraveledSinceUpdate += currentParticle.distanceTraveled;
+						if (!StartFromSource())
+							// desorptionLimit reached
+							return false;
+					}
+					else {
+						//Reflected
+						PerformBounce(collidedFacet);
+					}
 				}
-				/*else if ((GetOpacityAt(collidedFacet, currentParticle.flightTime) < 1.0) && (randomGenerator.rnd() > GetOpacityAt(collidedFacet, currentParticle.flightTime))) {
-					//Transparent pass
-					myTmpResults.globalHits.distTraveled_total += d;
-					PerformTransparentPass(collidedFacet);
-				}*/
-				else { //Not teleport
-					IncreaseDistanceCounters(d * currentParticle.oriRatio);
-					double stickingProbability = GetStickingAt(collidedFacet, currentParticle.flightTime);
-					if (!myOtfp.lowFluxMode) { //Regular stick or bounce
-						if (stickingProbability == 1.0 || ((stickingProbability > 0.0) && (randomGenerator.rnd() < (stickingProbability)))) {
-							//Absorbed
-							RecordAbsorb(collidedFacet);
-							//sHandle->distTraveledSinceUpdate += currentParticle.distanceTraveled;
-							if (!StartFromSource())
-								// desorptionLimit reached
-								return false;
-						}
-						else {
-							//Reflected
-							PerformBounce(collidedFacet);
-						}
+				else { //Low flux mode
+					if (stickingProbability > 0.0) {
+						double oriRatioBeforeCollision = currentParticle.oriRatio; //Local copy
+						currentParticle.oriRatio *= (stickingProbability); //Sticking part
+						RecordAbsorb(collidedFacet);
+						currentParticle.oriRatio = oriRatioBeforeCollision * (1.0 - stickingProbability); //Reflected part
 					}
-					else { //Low flux mode
-						if (stickingProbability > 0.0) {
-							double oriRatioBeforeCollision = currentParticle.oriRatio; //Local copy
-							currentParticle.oriRatio *= (stickingProbability); //Sticking part
-							RecordAbsorb(collidedFacet);
-							currentParticle.oriRatio = oriRatioBeforeCollision * (1.0 - stickingProbability); //Reflected part
-						}
-						else
-							currentParticle.oriRatio *= (1.0 - stickingProbability);
-						if (currentParticle.oriRatio > myOtfp.lowFluxCutoff) {
-							PerformBounce(collidedFacet);
-						}
-						else { //eliminate remainder and create new particle
-							if (!StartFromSource())
-								// desorptionLimit reached
-								return false;
-						}
+					else
+						currentParticle.oriRatio *= (1.0 - stickingProbability);
+					if (currentParticle.oriRatio > myOtfp.lowFluxCutoff) {
+						PerformBounce(collidedFacet);
+					}
+					else { //eliminate remainder and create new particle
+						if (!StartFromSource())
+							// desorptionLimit reached
+							return false;
 					}
 				}
-			} //end hit within measured time
-		} //end intersection found
-		else {
-			// No intersection found: Leak
-			myTmpResults.globalHits.nbLeakTotal++;
-			RecordLeakPos();
-			if (!StartFromSource())
-				// desorptionLimit reached
-				return false;
+			}
+		} //end hit within measured time
+	} //end intersection found
+	else {
+		// No intersection found: Leak
+		myTmpResults.globalHits.nbLeakTotal++;
+		RecordLeakPos();
+		if (!StartFromSource())
+			// desorptionLimit reached
+			return false;
+	}
+	return true;
+}
+
+/**
+* \brief Sets the number of slots. New slots are empty (inactive), removed slots' particles are dropped
+* \param nbSlots number of in-flight particles
+* \param keyedGenerator generator with the simulation's key, copied to the new slots (streams are chosen on desorption)
+*/
+void WavefrontBatch::Resize(size_t nbSlots, const Philox& keyedGenerator) {
+	position.resize(nbSlots);
+	direction.resize(nbSlots);
+	oriRatio.resize(nbSlots);
+	nbBounces.resize(nbSlots);
+	distanceTraveled.resize(nbSlots);
+	flightTime.resize(nbSlots);
+	velocity.resize(nbSlots);
+	expectedDecayMoment.resize(nbSlots);
+	particleId.resize(nbSlots);
+	structureId.resize(nbSlots);
+	teleportedFrom.resize(nbSlots);
+	lastHitFacet.resize(nbSlots, NULL);
+	generators.resize(nbSlots, keyedGenerator);
+	active.resize(nbSlots, false);
+	found.resize(nbSlots);
+	hitFacet.resize(nbSlots);
+	hitDistance.resize(nbSlots);
+	hitU.resize(nbSlots);
+	hitV.resize(nbSlots);
+	events.reserve(nbSlots);
+}
+
+/**
+* \brief Drops all in-flight particles
+*/
+void WavefrontBatch::Clear() {
+	Resize(0, Philox());
+	events.clear();
+}
+
+/**
+* \brief Makes a wavefront slot's particle the current one: its state is loaded to currentParticle for the scalar routines,
+* and particleGenerator points to the slot's own stream (drawn from in place). Call StoreWavefrontSlot() if the particle was moved
+* \param slot index of the in-flight particle
+*/
+void Simulation::LoadWavefrontSlot(size_t slot) {
+	currentParticle.position = wavefront.position[slot];
+	currentParticle.direction = wavefront.direction[slot];
+	currentParticle.oriRatio = wavefront.oriRatio[slot];
+	currentParticle.nbBounces = wavefront.nbBounces[slot];
+	currentParticle.distanceTraveled = wavefront.distanceTraveled[slot];
+	currentParticle.flightTime = wavefront.flightTime[slot];
+	currentParticle.velocity = wavefront.velocity[slot];
+	currentParticle.expectedDecayMoment = wavefront.expectedDecayMoment[slot];
+	currentParticle.particleId = wavefront.particleId[slot];
+	currentParticle.structureId = wavefront.structureId[slot];
+	currentParticle.teleportedFrom = wavefront.teleportedFrom[slot];
+	currentParticle.lastHitFacet = wavefront.lastHitFacet[slot];
+	particleGenerator = &wavefront.generators[slot];
+}
+
+/**
+* \brief Writes the current particle back to its wavefront slot, and points particleGenerator back to randomGenerator
+* \param slot index of the in-flight particle, as passed to LoadWavefrontSlot()
+*/
+void Simulation::StoreWavefrontSlot(size_t slot) {
+	wavefront.position[slot] = currentParticle.position;
+	wavefront.direction[slot] = currentParticle.direction;
+	wavefront.oriRatio[slot] = currentParticle.oriRatio;
+	wavefront.nbBounces[slot] = currentParticle.nbBounces;
+	wavefront.distanceTraveled[slot] = currentParticle.distanceTraveled;
+	wavefront.flightTime[slot] = currentParticle.flightTime;
+	wavefront.velocity[slot] = currentParticle.velocity;
+	wavefront.expectedDecayMoment[slot] = currentParticle.expectedDecayMoment;
+	wavefront.particleId[slot] = currentParticle.particleId;
+	wavefront.structureId[slot] = currentParticle.structureId;
+	wavefront.teleportedFrom[slot] = currentParticle.teleportedFrom;
+	wavefront.lastHitFacet[slot] = currentParticle.lastHitFacet;
+	particleGenerator = &randomGenerator;
+}
+
+/**
+* \brief Prepares the wavefront engine on simulation start: resizes the batch to myOtfp.wavefrontSize and desorbs a particle in every empty slot. Particles still in flight from before a pause go on
+* \return true if at least one particle is in flight
+*/
+bool Simulation::StartWavefront() {
+	wavefront.Resize(myOtfp.wavefrontSize, randomGenerator);
+	bool anyActive = false;
+	for (size_t slot = 0; slot < wavefront.size(); slot++) {
+		if (!wavefront.active[slot]) {
+			LoadWavefrontSlot(slot);
+			wavefront.active[slot] = StartFromSource();
+			StoreWavefrontSlot(slot);
+			if (!wavefront.active[slot] && GetMyState() == PROCESS_ERROR) return false;
 		}
+		anyActive = anyActive || wavefront.active[slot];
+	}
+	return anyActive;
+}
+
+/**
+* \brief Wavefront engine: advances all in-flight particles by one bounce per iteration, until at least nbStep bounces are done.
+* An iteration first traces every particle (only the tree and the facet test data are touched, they stay in cache),
+* then handles the collisions grouped by kind and facet, so that consecutive events share the facet's counters, textures and profiles.
+* The per-particle work is ProcessIntersection(), as in SimulationMCStep(): each slot draws from its own stream,
+* so with a fixed seed every trajectory is the same as with the scalar engine
+* \param nbStep minimum number of steps (bounces) to perform (fewer if a command arrives meanwhile, checked after each iteration)
+* \return false if no particle is left in flight (desorption limit reached) or on error
+*/
+bool Simulation::SimulationWavefrontStep(size_t nbStep) {
+	const std::vector<SubProcessSuperStructure>& structures = worker->subprocessStructures;
+	size_t nbDone = 0;
+	while (nbDone < nbStep) {
+
+		// Trace phase
+		wavefront.events.clear();
+		for (size_t slot = 0; slot < wavefront.size(); slot++) {
+			if (!wavefront.active[slot]) continue;
+			LoadWavefrontSlot(slot); //Intersect() only reads the particle (and draws transparent passes from the slot's stream): no store
+			auto[found, collidedFacet, d] = Intersect(this, structures, wavefront.position[slot], wavefront.direction[slot]);
+			wavefront.found[slot] = found;
+			wavefront.hitFacet[slot] = collidedFacet;
+			wavefront.hitDistance[slot] = d;
+			uint64_t eventKey = WAVEFRONT_LEAK << 32;
+			if (found) {
+				wavefront.hitU[slot] = myTmpFacetVars[collidedFacet->globalId].colU; //Overwritten by the next particle hitting the same facet
+				wavefront.hitV[slot] = myTmpFacetVars[collidedFacet->globalId].colV;
+				eventKey = ((collidedFacet->facetRef->sh.teleportDest != 0 ? WAVEFRONT_TELEPORT : WAVEFRONT_COLLISION) << 32) | collidedFacet->globalId;
+			}
+			wavefront.events.emplace_back(eventKey, (uint32_t)slot);
+		}
+		particleGenerator = &randomGenerator;
+		if (wavefront.events.empty()) return false; //All slots ended
+		std::sort(wavefront.events.begin(), wavefront.events.end());
+
+		// Event phase
+		for (const auto& event : wavefront.events) {
+			size_t slot = event.second;
+			SubprocessFacet* collidedFacet = wavefront.hitFacet[slot];
+			if (wavefront.found[slot]) {
+				myTmpFacetVars[collidedFacet->globalId].colU = wavefront.hitU[slot];
+				myTmpFacetVars[collidedFacet->globalId].colV = wavefront.hitV[slot];
+			}
+			LoadWavefrontSlot(slot);
+			bool goOn = ProcessIntersection(wavefront.found[slot], collidedFacet, wavefront.hitDistance[slot]);
+			StoreWavefrontSlot(slot);
+			if (!goOn) {
+				if (GetMyState() == PROCESS_ERROR) return false;
+				wavefront.active[slot] = false; //Desorption limit reached, no new particle in this slot
+			}
+		}
+		nbDone += wavefront.events.size();
+		if (CommandPending()) break; //Stop, reload...: don't finish the step
 	}
 	return true;
 }
@@ -614,91 +550,58 @@ bool Simulation::StartFromSource() {
 	size_t mapPositionW, mapPositionH;
 	SubprocessFacet *src = NULL;
 	double srcRnd;
-	double sumA = 0.0;
-	int i = 0, j = 0;
 	int nbTry = 0;
 
+	// Thread prIdx simulates particles prIdx, prIdx+nbProcess, prIdx+2*nbProcess... of the run
+	size_t particleIndex = prIdx + totalDesorbed * myOtfp.nbProcess;
+
 	// Check end of simulation
 	if (myOtfp.desorptionLimit > 0) {
-		if (totalDesorbed >= myOtfp.desorptionLimit / myOtfp.nbProcess) {
+		if (particleIndex >= myOtfp.desorptionLimit) {
 			currentParticle.lastHitFacet = NULL;
 			return false;
 		}
 	}
 
-	// Select source
-	srcRnd = randomGenerator.rnd() * worker->wp.totalDesorbedMolecules;
-
-	while (!found && j < worker->subprocessStructures.size()) { //Go through superstructures
-		i = 0;
-		while (!found && i < worker->subprocessStructures[j].facets.size()) { //Go through facets in a structure
-			SubprocessFacet& f = worker->subprocessStructures[j].facets[i];
-			if (f.facetRef->sh.desorbType != DES_NONE) { //there is some kind of outgassing
-				if (f.facetRef->sh.useOutgassingFile) { //Using SynRad-generated outgassing map
-					if (f.facetRef->sh.totalOutgassing > 0.0) {
-						found = (srcRnd >= sumA) && (srcRnd < (sumA + worker->wp.latestMoment * f.facetRef->sh.totalOutgassing / (1.38E-23*f.facetRef->sh.temperature)));
-						if (found) {
-							//look for exact position in map
-							double rndRemainder = (srcRnd - sumA) / worker->wp.latestMoment*(1.38E-23*f.facetRef->sh.temperature); //remainder, should be less than f.facetRef->sh.totalOutgassing
-							/*double sumB = 0.0;
-							for (w = 0; w < f.facetRef->sh.outgassingMapWidth && !foundInMap; w++) {
-								for (h = 0; h < f.facetRef->sh.outgassingMapHeight && !foundInMap; h++) {
-									double cellOutgassing = f.outgassingMap[h*f.facetRef->sh.outgassingMapWidth + w];
-									if (cellOutgassing > 0.0) {
-										foundInMap = (rndRemainder >= sumB) && (rndRemainder < (sumB + cellOutgassing));
-										if (foundInMap) mapPositionW = w; mapPositionH = h;
-										sumB += cellOutgassing;
-									}
-								}
-							}*/
-							double lookupValue = rndRemainder;
-							int outgLowerIndex = my_lower_bound(lookupValue, f.outgassingMapCdf); //returns line number AFTER WHICH LINE lookup value resides in ( -1 .. size-2 )
-							outgLowerIndex++;
-							mapPositionH = (size_t)((double)outgLowerIndex / (double)f.facetRef->sh.outgassingMapWidth);
-							mapPositionW = (size_t)outgLowerIndex - mapPositionH * f.facetRef->sh.outgassingMapWidth;
-							foundInMap = true;
-							/*if (!foundInMap) {
-								SetErrorSub("Starting point not found in imported desorption map");
-								return false;
-							}*/
-						}
-						sumA += worker->wp.latestMoment * f.facetRef->sh.totalOutgassing / (1.38E-23*f.facetRef->sh.temperature);
-					}
-				} //end outgassing file block
-				else { //constant or time-dependent outgassing
-					double facetOutgassing =
-						(f.facetRef->sh.outgassing_paramId >= 0)
-						? worker->IDs[f.facetRef->sh.IDid].back().second / (1.38E-23*f.facetRef->sh.temperature)
-						: worker->wp.latestMoment*f.facetRef->sh.outgassing / (1.38E-23*f.facetRef->sh.temperature);
-					found = (srcRnd >= sumA) && (srcRnd < (sumA + facetOutgassing));
-					sumA += facetOutgassing;
-				} //end constant or time-dependent outgassing block
-			} //end 'there is some kind of outgassing'
-			if (!found) i++;
-			if (f.facetRef->sh.is2sided) reverse = randomGenerator.rnd() > 0.5;
-			else reverse = false;
-		}
-		if (!found) j++;
-	}
-	if (!found) {
+	// Each particle draws from its own stream: with a fixed seed, its trajectory doesn't depend on which thread runs it
+	currentParticle.particleId = firstParticleId + particleIndex;
+	particleGenerator->SetStream(currentParticle.particleId);
+
+	// Select source: first facet whose cumulative outgassing exceeds the random number
+	srcRnd = particleGenerator->rnd() * worker->wp.totalDesorbedMolecules;
+	const std::vector<double>& sourceCdf = worker->sourceCdf;
+	size_t sourceIndex = std::upper_bound(sourceCdf.begin(), sourceCdf.end(), srcRnd) - sourceCdf.begin();
+	if (sourceIndex == sourceCdf.size()) {
 		SetErrorSub("No starting point, aborting");
 		return false;
 	}
-	src = &(worker->subprocessStructures[j].facets[i]);
+	src = worker->sourceFacets[sourceIndex];
+	if (src->facetRef->sh.useOutgassingFile) {
+		//look for exact position in map
+		double sumA = (sourceIndex > 0) ? sourceCdf[sourceIndex - 1] : 0.0;
+		double rndRemainder = (srcRnd - sumA) / worker->wp.latestMoment*(1.38E-23*src->facetRef->sh.temperature); //remainder, should be less than f.facetRef->sh.totalOutgassing
+		int outgLowerIndex = my_lower_bound(rndRemainder, src->outgassingMapCdf); //returns line number AFTER WHICH LINE lookup value resides in ( -1 .. size-2 )
+		outgLowerIndex++;
+		mapPositionH = (size_t)((double)outgLowerIndex / (double)src->facetRef->sh.outgassingMapWidth);
+		mapPositionW = (size_t)outgLowerIndex - mapPositionH * src->facetRef->sh.outgassingMapWidth;
+		foundInMap = true;
+	}
+	if (src->facetRef->sh.is2sided) reverse = particleGenerator->rnd() > 0.5;
+	else reverse = false;
 
 	currentParticle.lastHitFacet = src;
 	//currentParticle.distanceTraveled = 0.0;  //for mean free path calculations
-	//currentParticle.flightTime = sHandle->desorptionStartTime + (sHandle->desorptionStopTime - sHandle->desorptionStartTime)*randomGenerator.rnd();
+	//currentParticle.flightTime = sHandle->desorptionStartTime + (sHandle->desorptionStopTime - sHandle->desorptionStartTime)*particleGenerator->rnd();
 	currentParticle.flightTime = GenerateDesorptionTime(src);
 	if (worker->wp.useMaxwellDistribution) currentParticle.velocity = GenerateRandomVelocity(src->facetRef->sh.CDFid);
 	else currentParticle.velocity = 145.469*sqrt(src->facetRef->sh.temperature / worker->wp.gasMass);  //sqrt(8*R/PI/1000)=145.47
 	currentParticle.oriRatio = 1.0;
 	if (worker->wp.enableDecay) { //decaying gas
-		currentParticle.expectedDecayMoment = currentParticle.flightTime + worker->wp.halfLife*1.44269*-log(randomGenerator.rnd()); //1.44269=1/ln2
+		currentParticle.expectedDecayMoment = currentParticle.flightTime + worker->wp.halfLife*1.44269*-log(particleGenerator->rnd()); //1.44269=1/ln2
 		//Exponential distribution PDF: probability of 't' life = 1/TAU*exp(-t/TAU) where TAU = half_life/ln2
 		//Exponential distribution CDF: probability of life shorter than 't" = 1-exp(-t/TAU)
-		//Equation: randomGenerator.rnd()=1-exp(-t/TAU)
-		//Solution: t=TAU*-log(1-randomGenerator.rnd()) and 1-randomGenerator.rnd()=randomGenerator.rnd() therefore t=half_life/ln2*-log(randomGenerator.rnd())
+		//Equation: particleGenerator->rnd()=1-exp(-t/TAU)
+		//Solution: t=TAU*-log(1-particleGenerator->rnd()) and 1-particleGenerator->rnd()=particleGenerator->rnd() therefore t=half_life/ln2*-log(particleGenerator->rnd())
 	}
 	else {
 		currentParticle.expectedDecayMoment = 1e100; //never decay
@@ -716,24 +619,24 @@ bool Simulation::StartFromSource() {
 		if (foundInMap) {
 			if (mapPositionW < (src->facetRef->sh.outgassingMapWidth - 1)) {
 				//Somewhere in the middle of the facet
-				u = ((double)mapPositionW + randomGenerator.rnd()) / src->outgassingMapWidthD;
+				u = ((double)mapPositionW + particleGenerator->rnd()) / src->outgassingMapWidthD;
 			}
 			else {
 				//Last element, prevent from going out of facet
-				u = ((double)mapPositionW + randomGenerator.rnd() * (src->outgassingMapWidthD - (src->facetRef->sh.outgassingMapWidth - 1))) / src->outgassingMapWidthD;
+				u = ((double)mapPositionW + particleGenerator->rnd() * (src->outgassingMapWidthD - (src->facetRef->sh.outgassingMapWidth - 1))) / src->outgassingMapWidthD;
 			}
 			if (mapPositionH < (src->facetRef->sh.outgassingMapHeight - 1)) {
 				//Somewhere in the middle of the facet
-				v = ((double)mapPositionH + randomGenerator.rnd()) / src->outgassingMapHeightD;
+				v = ((double)mapPositionH + particleGenerator->rnd()) / src->outgassingMapHeightD;
 			}
 			else {
 				//Last element, prevent from going out of facet
-				v = ((double)mapPositionH + randomGenerator.rnd() * (src->outgassingMapHeightD - (src->facetRef->sh.outgassingMapHeight - 1))) / src->outgassingMapHeightD;
+				v = ((double)mapPositionH + particleGenerator->rnd() * (src->outgassingMapHeightD - (src->facetRef->sh.outgassingMapHeight - 1))) / src->outgassingMapHeightD;
 			}
 		}
 		else {
-			u = randomGenerator.rnd();
-			v = randomGenerator.rnd();
+			u = particleGenerator->rnd();
+			v = particleGenerator->rnd();
 		}
 		if (IsInFacet(*src, u, v)) {
 
@@ -761,7 +664,7 @@ bool Simulation::StartFromSource() {
 		else {
 			myTmpFacetVars[src->globalId].colU = 0.5;
 			myTmpFacetVars[src->globalId].colV = 0.5;
-			currentParticle.position = worker->subprocessStructures[j].facets[i].facetRef->sh.center;
+			currentParticle.position = src->facetRef->sh.center;
 		}
 
 	}
@@ -772,19 +675,19 @@ bool Simulation::StartFromSource() {
 	//See docs/theta_gen.png for further details on angular distribution generation
 	switch (src->facetRef->sh.desorbType) {
 	case DES_UNIFORM:
-		currentParticle.direction = PolarToCartesian(src, acos(randomGenerator.rnd()), randomGenerator.rnd()*2.0*PI, reverse);
+		currentParticle.direction = PolarToCartesian(src, acos(particleGenerator->rnd()), particleGenerator->rnd()*2.0*PI, reverse);
 		break;
 	case DES_NONE: //for file-based
 	case DES_COSINE:
-		currentParticle.direction = PolarToCartesian(src, acos(sqrt(randomGenerator.rnd())), randomGenerator.rnd()*2.0*PI, reverse);
+		currentParticle.direction = PolarToCartesian(src, acos(sqrt(particleGenerator->rnd())), particleGenerator->rnd()*2.0*PI, reverse);
 		break;
 	case DES_COSINE_N:
-		currentParticle.direction = PolarToCartesian(src, acos(pow(randomGenerator.rnd(), 1.0 / (src->facetRef->sh.desorbTypeN + 1.0))), randomGenerator.rnd()*2.0*PI, reverse);
+		currentParticle.direction = PolarToCartesian(src, acos(pow(particleGenerator->rnd(), 1.0 / (src->facetRef->sh.desorbTypeN + 1.0))), particleGenerator->rnd()*2.0*PI, reverse);
 		break;
 	case DES_ANGLEMAP:
 	{
-		auto [theta, thetaLowerIndex, thetaOvershoot] = src->generatingAngleMap.GenerateThetaFromAngleMap(src->facetRef->sh.anglemapParams, randomGenerator);
-		auto phi = src->generatingAngleMap.GeneratePhiFromAngleMap(thetaLowerIndex, thetaOvershoot, src->facetRef->sh.anglemapParams, randomGenerator);
+		auto [theta, thetaLowerIndex, thetaOvershoot] = src->generatingAngleMap.GenerateThetaFromAngleMap(src->facetRef->sh.anglemapParams, *particleGenerator);
+		auto phi = src->generatingAngleMap.GeneratePhiFromAngleMap(thetaLowerIndex, thetaOvershoot, src->facetRef->sh.anglemapParams, *particleGenerator);
 		/*
 
 		size_t angleMapSum = src->angleMapLineSums[(src->facetRef->sh.anglemapParams.thetaLowerRes + src->facetRef->sh.anglemapParams.thetaHigherRes) - 1];
@@ -794,7 +697,7 @@ bool Simulation::StartFromSource() {
 			SetErrorSub(tmp.str().c_str());
 			return false;
 		}
-		double lookupValue = randomGenerator.rnd()*(double)angleMapSum; //last element of cumulative distr. = sum
+		double lookupValue = particleGenerator->rnd()*(double)angleMapSum; //last element of cumulative distr. = sum
 		int thetaLowerIndex = my_lower_bound(lookupValue, src->angleMapLineSums, (src->facetRef->sh.anglemapParams.thetaLowerRes + src->facetRef->sh.anglemapParams.thetaHigherRes)); //returns line number AFTER WHICH LINE lookup value resides in ( -1 .. size-2 )
 		double thetaOvershoot;
 		double theta_a, theta_b, theta_c, theta_cumulative_A, theta_cumulative_B, theta_cumulative_C;
@@ -841,7 +744,7 @@ bool Simulation::StartFromSource() {
 		size_t distr1sum = src->angleMapLineSums[distr1index]-((distr1index!=distr2index && distr1index>0)?src->angleMapLineSums[distr1index-1]:0);
 		size_t distr2sum = src->angleMapLineSums[distr2index] - ((distr1index != distr2index) ? src->angleMapLineSums[distr2index - 1] : 0);
 		double weighedSum=Weigh((double)distr1sum, (double)distr2sum, weigh);
-		double phiLookup = randomGenerator.rnd() * weighedSum;
+		double phiLookup = particleGenerator->rnd() * weighedSum;
 		int phiLowerIndex = weighed_lower_bound_X(phiLookup, weigh, &(src->angleMap_pdf[src->facetRef->sh.anglemapParams.phiWidth*distr1index]), &(src->angleMap_pdf[src->facetRef->sh.anglemapParams.phiWidth*distr2index]), src->facetRef->sh.anglemapParams.phiWidth);
 
 		////////////////
@@ -924,7 +827,7 @@ bool Simulation::StartFromSource() {
 * \param randomGenerator reference to the random number generator (Mersenne Twister)
 * \return tuple { theta, thetaLowerIndex, thetaOvershoot }
 */
-std::tuple<double, int, double> GeneratingAnglemap::GenerateThetaFromAngleMap(const AnglemapParams& anglemapParams, MersenneTwister& randomGenerator) {
+std::tuple<double, int, double> GeneratingAnglemap::GenerateThetaFromAngleMap(const AnglemapParams& anglemapParams, Philox& randomGenerator) {
 	double lookupValue = randomGenerator.rnd();
 	int thetaLowerIndex = my_lower_bound(lookupValue, theta_CDF); //returns line number AFTER WHICH LINE lookup value resides in ( -1 .. size-2 )
 	double theta, thetaOvershoot;
@@ -980,7 +883,7 @@ std::tuple<double, int, double> GeneratingAnglemap::GenerateThetaFromAngleMap(co
 * \param randomGenerator reference to the random number generator (Mersenne Twister)
 * \return phi angle
 */
-double GeneratingAnglemap::GeneratePhiFromAngleMap(const int & thetaLowerIndex, const double & thetaOvershoot, const AnglemapParams & anglemapParams, MersenneTwister& randomGenerator) {
+double GeneratingAnglemap::GeneratePhiFromAngleMap(const int & thetaLowerIndex, const double & thetaOvershoot, const AnglemapParams & anglemapParams, Philox& randomGenerator) {
 	double lookupValue = randomGenerator.rnd();
 	if (anglemapParams.phiWidth == 1) return -PI + 2.0 * PI * lookupValue; //special case, uniform phi distribution
 	int phiLowerIndex;
@@ -1227,19 +1130,19 @@ double GeneratingAnglemap::GetPhiCDFSum(const double & thetaIndex, const Anglema
 	//Sojourn time
 	if (iFacet->facetRef->sh.enableSojournTime) {
 		double A = exp(-iFacet->facetRef->sh.sojournE / (8.31*iFacet->facetRef->sh.temperature));
-		currentParticle.flightTime += -log(randomGenerator.rnd()) / (A*iFacet->facetRef->sh.sojournFreq);
+		currentParticle.flightTime += -log(particleGenerator->rnd()) / (A*iFacet->facetRef->sh.sojournFreq);
 	}
 
 	if (iFacet->facetRef->sh.reflection.diffusePart > 0.999999) { //Speedup branch for most common, diffuse case
-		currentParticle.direction = PolarToCartesian(iFacet, acos(sqrt(randomGenerator.rnd())), randomGenerator.rnd()*2.0*PI, revert);
+		currentParticle.direction = PolarToCartesian(iFacet, acos(sqrt(particleGenerator->rnd())), particleGenerator->rnd()*2.0*PI, revert);
 	}
 	else {
-		double reflTypeRnd = randomGenerator.rnd();
+		double reflTypeRnd = particleGenerator->rnd();
 		if (reflTypeRnd < iFacet->facetRef->sh.reflection.diffusePart)
 		{
 			//diffuse reflection
 			//See docs/theta_gen.png for further details on angular distribution generation
-			currentParticle.direction = PolarToCartesian(iFacet, acos(sqrt(randomGenerator.rnd())), randomGenerator.rnd()*2.0*PI, revert);
+			currentParticle.direction = PolarToCartesian(iFacet, acos(sqrt(particleGenerator->rnd())), particleGenerator->rnd()*2.0*PI, revert);
 		}
 		else  if (reflTypeRnd < (iFacet->facetRef->sh.reflection.diffusePart + iFacet->facetRef->sh.reflection.specularPart))
 		{
@@ -1250,7 +1153,7 @@ double GeneratingAnglemap::GetPhiCDFSum(const double & thetaIndex, const Anglema
 		}
 		else {
 			//Cos^N reflection
-			currentParticle.direction = PolarToCartesian(iFacet, acos(pow(randomGenerator.rnd(), 1.0 / (iFacet->facetRef->sh.reflection.cosineExponent + 1.0))), randomGenerator.rnd()*2.0*PI, revert);
+			currentParticle.direction = PolarToCartesian(iFacet, acos(pow(particleGenerator->rnd(), 1.0 / (iFacet->facetRef->sh.reflection.cosineExponent + 1.0))), particleGenerator->rnd()*2.0*PI, revert);
 		}
 	}
 
@@ -1323,33 +1226,31 @@ void Simulation::RecordAbsorb(SubprocessFacet *iFacet) {
 */
 void Simulation::RecordHistograms(SubprocessFacet * iFacet) {
 	//Record in global and facet histograms
-	for (size_t m = 0; m <= worker->moments.size(); m++) {
-		if (m == 0 || std::abs(currentParticle.flightTime - worker->moments[m - 1]) < worker->wp.timeWindowSize / 2.0) {
-			size_t binIndex;
-			if (worker->wp.globalHistogramParams.recordBounce) {
-				binIndex = Min(currentParticle.nbBounces / worker->wp.globalHistogramParams.nbBounceBinsize, worker->wp.globalHistogramParams.GetBounceHistogramSize() - 1);
-				myTmpResults.globalHistograms[m].nbHitsHistogram[binIndex] += currentParticle.oriRatio;
-			}
-			if (worker->wp.globalHistogramParams.recordDistance) {
-				binIndex = Min(static_cast<size_t>(currentParticle.distanceTraveled / worker->wp.globalHistogramParams.distanceBinsize), worker->wp.globalHistogramParams.GetDistanceHistogramSize() - 1);
-				myTmpResults.globalHistograms[m].distanceHistogram[binIndex] += currentParticle.oriRatio;
-			}
-			if (worker->wp.globalHistogramParams.recordTime) {
-				binIndex = Min(static_cast<size_t>(currentParticle.flightTime / worker->wp.globalHistogramParams.timeBinsize), worker->wp.globalHistogramParams.GetTimeHistogramSize() - 1);
-				myTmpResults.globalHistograms[m].timeHistogram[binIndex] += currentParticle.oriRatio;
-			}
-			if (iFacet->facetRef->sh.facetHistogramParams.recordBounce) {
-				binIndex = Min(currentParticle.nbBounces / iFacet->facetRef->sh.facetHistogramParams.nbBounceBinsize, iFacet->facetRef->sh.facetHistogramParams.GetBounceHistogramSize() - 1);
-				myTmpResults.facetStates[iFacet->globalId].momentResults[m].histogram.nbHitsHistogram[binIndex] += currentParticle.oriRatio;
-			}
-			if (iFacet->facetRef->sh.facetHistogramParams.recordDistance) {
-				binIndex = Min(static_cast<size_t>(currentParticle.distanceTraveled / iFacet->facetRef->sh.facetHistogramParams.distanceBinsize), iFacet->facetRef->sh.facetHistogramParams.GetDistanceHistogramSize() - 1);
-				myTmpResults.facetStates[iFacet->globalId].momentResults[m].histogram.distanceHistogram[binIndex] += currentParticle.oriRatio;
-			}
-			if (iFacet->facetRef->sh.facetHistogramParams.recordTime) {
-				binIndex = Min(static_cast<size_t>(currentParticle.flightTime / iFacet->facetRef->sh.facetHistogramParams.timeBinsize), iFacet->facetRef->sh.facetHistogramParams.GetTimeHistogramSize() - 1);
-				myTmpResults.facetStates[iFacet->globalId].momentResults[m].histogram.timeHistogram[binIndex] += currentParticle.oriRatio;
-			}
+	for (size_t m : GetMomentsAt(currentParticle.flightTime)) {
+		size_t binIndex;
+		if (worker->wp.globalHistogramParams.recordBounce) {
+			binIndex = Min(currentParticle.nbBounces / worker->wp.globalHistogramParams.nbBounceBinsize, worker->wp.globalHistogramParams.GetBounceHistogramSize() - 1);
+			myTmpResults.globalHistograms[m].nbHitsHistogram[binIndex] += currentParticle.oriRatio;
+		}
+		if (worker->wp.globalHistogramParams.recordDistance) {
+			binIndex = Min(static_cast<size_t>(currentParticle.distanceTraveled / worker->wp.globalHistogramParams.distanceBinsize), worker->wp.globalHistogramParams.GetDistanceHistogramSize() - 1);
+			myTmpResults.globalHistograms[m].distanceHistogram[binIndex] += currentParticle.oriRatio;
+		}
+		if (worker->wp.globalHistogramParams.recordTime) {
+			binIndex = Min(static_cast<size_t>(currentParticle.flightTime / worker->wp.globalHistogramParams.timeBinsize), worker->wp.globalHistogramParams.GetTimeHistogramSize() - 1);
+			myTmpResults.globalHistograms[m].timeHistogram[binIndex] += currentParticle.oriRatio;
+		}
+		if (iFacet->facetRef->sh.facetHistogramParams.recordBounce) {
+			binIndex = Min(currentParticle.nbBounces / iFacet->facetRef->sh.facetHistogramParams.nbBounceBinsize, iFacet->facetRef->sh.facetHistogramParams.GetBounceHistogramSize() - 1);
+			myTmpResults.Modify(iFacet->globalId, m).histogram.nbHitsHistogram[binIndex] += currentParticle.oriRatio;
+		}
+		if (iFacet->facetRef->sh.facetHistogramParams.recordDistance) {
+			binIndex = Min(static_cast<size_t>(currentParticle.distanceTraveled / iFacet->facetRef->sh.facetHistogramParams.distanceBinsize), iFacet->facetRef->sh.facetHistogramParams.GetDistanceHistogramSize() - 1);
+			myTmpResults.Modify(iFacet->globalId, m).histogram.distanceHistogram[binIndex] += currentParticle.oriRatio;
+		}
+		if (iFacet->facetRef->sh.facetHistogramParams.recordTime) {
+			binIndex = Min(static_cast<size_t>(currentParticle.flightTime / iFacet->facetRef->sh.facetHistogramParams.timeBinsize), iFacet->facetRef->sh.facetHistogramParams.GetTimeHistogramSize() - 1);
+			myTmpResults.Modify(iFacet->globalId, m).histogram.timeHistogram[binIndex] += currentParticle.oriRatio;
 		}
 	}
 }
@@ -1361,6 +1262,7 @@ void Simulation::RecordHistograms(SubprocessFacet * iFacet) {
 Simulation::Simulation(Worker*  w) {
 	worker = w;
 	geom = w->GetMolflowGeometry();
+	particleGenerator = &randomGenerator;
 }
 
 /**
@@ -1378,12 +1280,13 @@ void Simulation::RecordHitOnTexture(SubprocessFacet *f, double time, bool countH
 	size_t add = tu + tv * (f->facetRef->sh.texWidth);
 	double ortVelocity = (worker->wp.useMaxwellDistribution ? 1.0 : 1.1781)*currentParticle.velocity*std::abs(Dot(currentParticle.direction, f->facetRef->sh.N)); //surface-orthogonal velocity component
 
-	for (size_t m = 0; m <= worker->moments.size(); m++) {
-		if (m == 0 || std::abs(time - worker->moments[m - 1]) < worker->wp.timeWindowSize / 2.0) {
-			if (countHit) myTmpResults.facetStates[f->globalId].momentResults[m].texture[add].countEquiv += currentParticle.oriRatio;
-			myTmpResults.facetStates[f->globalId].momentResults[m].texture[add].sum_1_per_ort_velocity += currentParticle.oriRatio * velocity_factor / ortVelocity;
-			myTmpResults.facetStates[f->globalId].momentResults[m].texture[add].sum_v_ort_per_area += currentParticle.oriRatio * ortSpeedFactor*ortVelocity*f->textureCellIncrements[add]; // sum ortho_velocity[m/s] / cell_area[cm2]
-		}
+	for (size_t m : GetMomentsAt(time)) {
+		FacetMomentSnapshot& snapshot = myTmpResults.Modify(f->globalId, m);
+		TextureCell& cell = snapshot.texture[add];
+		if (cell.sum_1_per_ort_velocity == 0.0) snapshot.RegisterTextureCell(add); //First hit on this cell since the last merge (always incremented below)
+		if (countHit) cell.countEquiv += currentParticle.oriRatio;
+		cell.sum_1_per_ort_velocity += currentParticle.oriRatio * velocity_factor / ortVelocity;
+		cell.sum_v_ort_per_area += currentParticle.oriRatio * ortSpeedFactor*ortVelocity*f->textureCellIncrements[add]; // sum ortho_velocity[m/s] / cell_area[cm2]
 	}
 }
 
@@ -1397,11 +1300,10 @@ void Simulation::RecordDirectionVector(SubprocessFacet *f, double time) {
 	size_t tv = (size_t)(myTmpFacetVars[f->globalId].colV * f->facetRef->sh.texHeightD);
 	size_t add = tu + tv * (f->facetRef->sh.texWidth);
 
-	for (size_t m = 0; m <= worker->moments.size(); m++) {
-		if (m == 0 || std::abs(time - worker->moments[m - 1]) < worker->wp.timeWindowSize / 2.0) {
-			myTmpResults.facetStates[f->globalId].momentResults[m].direction[add].dir += currentParticle.oriRatio * currentParticle.direction * currentParticle.velocity;
-			myTmpResults.facetStates[f->globalId].momentResults[m].direction[add].count++;
-		}
+	for (size_t m : GetMomentsAt(time)) {
+		DirectionCell& cell = myTmpResults.Modify(f->globalId, m).direction[add];
+		cell.dir += currentParticle.oriRatio * currentParticle.direction * currentParticle.velocity;
+		cell.count++;
 	}
 }
 
@@ -1415,29 +1317,23 @@ void Simulation::RecordDirectionVector(SubprocessFacet *f, double time) {
 */
 void Simulation::ProfileFacet(SubprocessFacet *f, double time, bool countHit, double velocity_factor, double ortSpeedFactor) {
 
-	size_t nbMoments = worker->moments.size();
-
 	if (countHit && f->facetRef->sh.profileType == PROFILE_ANGULAR) {
 		double dot = Dot(f->facetRef->sh.N, currentParticle.direction);
 		double theta = acos(std::abs(dot));     // Angle to normal (PI/2 => PI)
 		size_t pos = (size_t)(theta / (PI / 2)*((double)PROFILE_SIZE)); // To Grad
 		Saturate(pos, 0, PROFILE_SIZE - 1);
-		for (size_t m = 0; m <= nbMoments; m++) {
-			if (m == 0 || std::abs(time - worker->moments[m - 1]) < worker->wp.timeWindowSize / 2.0) {
-				myTmpResults.facetStates[f->globalId].momentResults[m].profile[pos].countEquiv += currentParticle.oriRatio;
-			}
+		for (size_t m : GetMomentsAt(time)) {
+			myTmpResults.Modify(f->globalId, m).profile[pos].countEquiv += currentParticle.oriRatio;
 		}
 	}
 	else if (f->facetRef->sh.profileType == PROFILE_U || f->facetRef->sh.profileType == PROFILE_V) {
 		size_t pos = (size_t)((f->facetRef->sh.profileType == PROFILE_U ? myTmpFacetVars[f->globalId].colU : myTmpFacetVars[f->globalId].colV)*(double)PROFILE_SIZE);
 		if (pos >= 0 && pos < PROFILE_SIZE) {
-			for (size_t m = 0; m <= nbMoments; m++) {
-				if (m == 0 || std::abs(time - worker->moments[m - 1]) < worker->wp.timeWindowSize / 2.0) {
-					if (countHit) myTmpResults.facetStates[f->globalId].momentResults[m].profile[pos].countEquiv += currentParticle.oriRatio;
-					double ortVelocity = currentParticle.velocity*std::abs(Dot(f->facetRef->sh.N, currentParticle.direction));
-					myTmpResults.facetStates[f->globalId].momentResults[m].profile[pos].sum_1_per_ort_velocity += currentParticle.oriRatio * velocity_factor / ortVelocity;
-					myTmpResults.facetStates[f->globalId].momentResults[m].profile[pos].sum_v_ort += currentParticle.oriRatio * ortSpeedFactor*(worker->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity;
-				}
+			for (size_t m : GetMomentsAt(time)) {
+				if (countHit) myTmpResults.Modify(f->globalId, m).profile[pos].countEquiv += currentParticle.oriRatio;
+				double ortVelocity = currentParticle.velocity*std::abs(Dot(f->facetRef->sh.N, currentParticle.direction));
+				myTmpResults.Modify(f->globalId, m).profile[pos].sum_1_per_ort_velocity += currentParticle.oriRatio * velocity_factor / ortVelocity;
+				myTmpResults.Modify(f->globalId, m).profile[pos].sum_v_ort += currentParticle.oriRatio * ortSpeedFactor*(worker->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity;
 			}
 		}
 	}
@@ -1454,10 +1350,8 @@ void Simulation::ProfileFacet(SubprocessFacet *f, double time, bool countHit, do
 		}
 		size_t pos = (size_t)(dot*currentParticle.velocity / f->facetRef->sh.maxSpeed*(double)PROFILE_SIZE); //"dot" default value is 1.0
 		if (pos >= 0 && pos < PROFILE_SIZE) {
-			for (size_t m = 0; m <= nbMoments; m++) {
-				if (m == 0 || std::abs(time - worker->moments[m - 1]) < worker->wp.timeWindowSize / 2.0) {
-					myTmpResults.facetStates[f->globalId].momentResults[m].profile[pos].countEquiv += currentParticle.oriRatio;
-				}
+			for (size_t m : GetMomentsAt(time)) {
+				myTmpResults.Modify(f->globalId, m).profile[pos].countEquiv += currentParticle.oriRatio;
 			}
 		}
 	}
@@ -1468,18 +1362,29 @@ void Simulation::ProfileFacet(SubprocessFacet *f, double time, bool countHit, do
 * \param f facet corresponding to the hit
 */
 void Simulation::LogHit(SubprocessFacet * f) {
-	if (myOtfp.enableLogging &&
-		myOtfp.logFacetId == f->globalId &&
-		tmpParticleLog.size() < myLogTarget) {
-		ParticleLoggerItem log;
-		log.facetHitPosition = Vector2d(myTmpFacetVars[f->globalId].colU, myTmpFacetVars[f->globalId].colV);
-		std::tie(log.hitTheta, log.hitPhi) = CartesianToPolar(currentParticle.direction, f->facetRef->sh.nU, f->facetRef->sh.nV, f->facetRef->sh.N);
-		log.oriRatio = currentParticle.oriRatio;
-		log.particleDecayMoment = currentParticle.expectedDecayMoment;
-		log.time = currentParticle.flightTime;
-		log.velocity = currentParticle.velocity;
-		tmpParticleLog.push_back(log);
-	}
+	if (!myOtfp.enableLogging || !logFacet[f->globalId] || !worker->particleLog.Accepting()) return;
+	if (myOtfp.logSampling < 1.0 && logSampler.rnd() >= myOtfp.logSampling) return;
+
+	ParticleLogRecord record;
+	record.particleId = currentParticle.particleId;
+	record.facetId = (uint32_t)f->globalId;
+	record.u = (float)myTmpFacetVars[f->globalId].colU;
+	record.v = (float)myTmpFacetVars[f->globalId].colV;
+	double hitTheta, hitPhi;
+	std::tie(hitTheta, hitPhi) = CartesianToPolar(currentParticle.direction, f->facetRef->sh.nU, f->facetRef->sh.nV, f->facetRef->sh.N);
+	record.hitTheta = (float)hitTheta;
+	record.hitPhi = (float)hitPhi;
+	record.oriRatio = (float)currentParticle.oriRatio;
+	record.particleDecayMoment = currentParticle.expectedDecayMoment;
+	record.time = currentParticle.flightTime;
+	record.velocity = (float)currentParticle.velocity;
+
+	while (!logRing.Push(record)) { //Writer behind (disk): wait for it rather than lose hits
+		if (!worker->particleLog.Accepting()) return;
+		worker->particleLog.Wake();
+		std::this_thread::yield();
+	}
+	if (logRing.Size() == PARTICLELOG_RING_SIZE / 2) worker->particleLog.Wake();
 }
 
 /**
@@ -1510,7 +1415,7 @@ void Simulation::RecordAngleMap(SubprocessFacet* collidedFacet) {
 	}
 	if (countTheta) {
 		size_t phiIndex = (size_t)((inPhi + 3.1415926) / (2.0*PI)*(double)collidedFacet->facetRef->sh.anglemapParams.phiWidth); //Phi: -PI..PI , and shifting by a number slightly smaller than PI to store on interval [0,2PI[
-		myTmpResults.facetStates[collidedFacet->globalId].recordedAngleMapPdf[thetaIndex*collidedFacet->facetRef->sh.anglemapParams.phiWidth + phiIndex]++;
+		myTmpResults.ModifyFacet(collidedFacet->globalId).recordedAngleMapPdf[thetaIndex*collidedFacet->facetRef->sh.anglemapParams.phiWidth + phiIndex]++;
 		//collidedFacet->angleMap.pdf[thetaIndex*collidedFacet->facetRef->sh.anglemapParams.phiWidth + phiIndex]++;
 	}
 }
@@ -1536,15 +1441,12 @@ void Simulation::RecordAngleMap(SubprocessFacet* collidedFacet) {
 }
 
 /**
-* \brief Generates a new interpolated velocity value via the Mersenne Twister algorithm
-* \param CDFId ID of the cummulative distribution function
+* \brief Generates a random wall-collision speed (Maxwell-Boltzmann) with the shared inverse CDF
+* \param CDFId ID of the temperature's distribution
 * \return random velocity
 */
 /*inline*/ double Simulation::GenerateRandomVelocity(int CDFId) {
-	//return FastLookupY(randomGenerator.rnd(),worker->CDFs[CDFId],false);
-	double r = randomGenerator.rnd();
-	double v = InterpolateX(r, worker->CDFs[CDFId], false, true); //Allow extrapolate
-	return v;
+	return maxwellSampler->Velocity(particleGenerator->rnd(), velocityScales[CDFId]);
 }
 
 /**
@@ -1554,10 +1456,10 @@ void Simulation::RecordAngleMap(SubprocessFacet* collidedFacet) {
 */
 double Simulation::GenerateDesorptionTime(SubprocessFacet *src) {
 	if (src->facetRef->sh.outgassing_paramId >= 0) { //time-dependent desorption
-		return InterpolateX(randomGenerator.rnd()*worker->IDs[src->facetRef->sh.IDid].back().second, worker->IDs[src->facetRef->sh.IDid], false, true); //allow extrapolate
+		return InterpolateX(particleGenerator->rnd()*worker->IDs[src->facetRef->sh.IDid].back().second, worker->IDs[src->facetRef->sh.IDid], false, true); //allow extrapolate
 	}
 	else {
-		return randomGenerator.rnd()*worker->wp.latestMoment; //continous desorption between 0 and latestMoment
+		return particleGenerator->rnd()*worker->wp.latestMoment; //continous desorption between 0 and latestMoment
 	}
 }
 
@@ -1604,6 +1506,71 @@ void Simulation::TreatMovingFacet() {
 	currentParticle.velocity = newVelocity.Norme();
 }
 
+/**
+* \brief Sorts the moments and detects even spacing, for GetMoments()
+* \param moments time moments, in result order
+* \param timeWindowSize width of the window around each moment
+*/
+void MomentIndex::Build(const std::vector<double>& moments, double timeWindowSize) {
+	halfWindow = timeWindowSize / 2.0; //Same expression as the per-moment test it replaces, for identical decisions
+	std::vector<std::pair<double, size_t>> sorted;
+	for (size_t i = 0; i < moments.size(); i++) sorted.emplace_back(moments[i], i + 1);
+	std::sort(sorted.begin(), sorted.end());
+	sortedMoments.clear(); sortedIds.clear();
+	for (const auto& moment : sorted) {
+		sortedMoments.push_back(moment.first);
+		sortedIds.push_back(moment.second);
+	}
+
+	step = 0.0;
+	size_t n = sortedMoments.size();
+	if (n >= 2) {
+		double spacing = (sortedMoments[n - 1] - sortedMoments[0]) / (double)(n - 1);
+		bool even = spacing > 0.0;
+		for (size_t i = 0; even && i < n; i++)
+			even = std::abs(sortedMoments[i] - (sortedMoments[0] + (double)i * spacing)) <= 1E-6 * spacing;
+		if (even) step = spacing;
+	}
+}
+
+/**
+* \brief Finds the moments whose time window contains a time. Candidates come from a direct lookup (even spacing) or a binary search, then get the exact per-moment test
+* \param time time to look up
+* \param resultIds the result indices (moment index+1) of the matching moments are appended here, in increasing time order
+*/
+void MomentIndex::GetMoments(double time, std::vector<size_t>& resultIds) const {
+	size_t n = sortedMoments.size();
+	if (n == 0) return;
+	double lowest = time - 2.0 * halfWindow; //Candidates: twice the window, so that rounding can't hide a match
+	double highest = time + 2.0 * halfWindow;
+	size_t first;
+	if (step > 0.0) {
+		//One index earlier than the estimate: moments are within 1E-6*step of their even position
+		double estimate = std::floor((lowest - sortedMoments[0]) / step) - 1.0;
+		if (!(estimate > 0.0)) first = 0; //Also catches NaN
+		else first = (estimate >= (double)n) ? n : (size_t)estimate;
+	}
+	else first = std::lower_bound(sortedMoments.begin(), sortedMoments.end(), lowest) - sortedMoments.begin();
+	for (size_t i = first; i < n && sortedMoments[i] < highest; i++) {
+		if (std::abs(time - sortedMoments[i]) < halfWindow) resultIds.push_back(sortedIds[i]);
+	}
+}
+
+/**
+* \brief Result indices (0 for constant flow, then the time-dependent moments) that an event at a given time is recorded in.
+* An event calls several recorders with the same time: the last answer is kept
+* \param time event time
+* \return list of result indices, valid until the next call with a different time
+*/
+const std::vector<size_t>& Simulation::GetMomentsAt(double time) {
+	if (momentHits.empty() || time != momentHitsTime) {
+		momentHits.assign(1, 0); //Constant flow: every event
+		worker->momentIndex.GetMoments(time, momentHits);
+		momentHitsTime = time;
+	}
+	return momentHits;
+}
+
 /**
 * \brief Increase facet counter on a hit, pass etc.
 * \param f source facet
@@ -1615,18 +1582,16 @@ void Simulation::TreatMovingFacet() {
 * \param sum_v_ort orthogonal momentum change to add
 */
 void Simulation::IncreaseFacetCounter(SubprocessFacet *f, double time, size_t hit, size_t desorb, size_t absorb, double sum_1_per_v, double sum_v_ort) {
-	size_t nbMoments = worker->moments.size();
-	for (size_t m = 0; m <= nbMoments; m++) {
-		if (m == 0 || std::abs(time - worker->moments[m - 1]) < worker->wp.timeWindowSize / 2.0) {
-			myTmpResults.facetStates[f->globalId].momentResults[m].hits.nbMCHit += hit;
-			double hitEquiv = static_cast<double>(hit)*currentParticle.oriRatio;
-			myTmpResults.facetStates[f->globalId].momentResults[m].hits.nbHitEquiv += hitEquiv;
-			myTmpResults.facetStates[f->globalId].momentResults[m].hits.nbDesorbed += desorb;
-			myTmpResults.facetStates[f->globalId].momentResults[m].hits.nbAbsEquiv += static_cast<double>(absorb)*currentParticle.oriRatio;
-			myTmpResults.facetStates[f->globalId].momentResults[m].hits.sum_1_per_ort_velocity += currentParticle.oriRatio * sum_1_per_v;
-			myTmpResults.facetStates[f->globalId].momentResults[m].hits.sum_v_ort += currentParticle.oriRatio * sum_v_ort;
-			myTmpResults.facetStates[f->globalId].momentResults[m].hits.sum_1_per_velocity += (hitEquiv + static_cast<double>(desorb)) / currentParticle.velocity;
-		}
+	for (size_t m : GetMomentsAt(time)) {
+		FacetHitBuffer& hits = myTmpResults.Modify(f->globalId, m).hits;
+		hits.nbMCHit += hit;
+		double hitEquiv = static_cast<double>(hit)*currentParticle.oriRatio;
+		hits.nbHitEquiv += hitEquiv;
+		hits.nbDesorbed += desorb;
+		hits.nbAbsEquiv += static_cast<double>(absorb)*currentParticle.oriRatio;
+		hits.sum_1_per_ort_velocity += currentParticle.oriRatio * sum_1_per_v;
+		hits.sum_v_ort += currentParticle.oriRatio * sum_v_ort;
+		hits.sum_1_per_velocity += (hitEquiv + static_cast<double>(desorb)) / currentParticle.velocity;
 	}
 }
 
@@ -1635,11 +1600,13 @@ void Simulation::IncreaseFacetCounter(SubprocessFacet *f, double time, size_t hi
 */
 void Simulation::ResetSimulation() {
 	currentParticle.lastHitFacet = NULL;
+	wavefront.Clear();
 	totalDesorbed = 0;
+	firstParticleId = 0;
+	WaitForReducer();
 	myTmpResults.Reset();
-	tmpParticleLog.clear();
+	if (prIdx == 0) worker->viewFactors.ResetSolution(); //AC: restart from zero hits, the view factors are kept
 	ConstructFacetTmpVars(); //Reset "hitted" property of facets
-	myLogTarget = 0;
 }
 
 /**
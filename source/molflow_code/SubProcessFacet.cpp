@@ -10,6 +10,28 @@ void SubprocessFacet::InitializeOnLoad(size_t nbStruct) {
 	InitializeOutgassingMap();
 	InitializeAngleMap();
 	InitializeTexture();
+	InitializePolygonCheck();
+}
+
+/**
+* \brief Prepares the fastest point-in-polygon check for the facet: none for rectangles filling their (u,v) parallelogram, a grid for many-vertex polygons, IsInPoly otherwise
+*/
+void SubprocessFacet::InitializePolygonCheck() {
+	const std::vector<Vector2d>& vertices2 = facetRef->vertices2;
+	fillsUV = false;
+	polygonGrid = PolygonGrid();
+	if (vertices2.size() == 4) {
+		bool corners[2][2] = { { false, false }, { false, false } };
+		for (const auto& p : vertices2) {
+			bool onU = std::abs(p.u) < 1E-12 || std::abs(p.u - 1.0) < 1E-12;
+			bool onV = std::abs(p.v) < 1E-12 || std::abs(p.v - 1.0) < 1E-12;
+			if (onU && onV) corners[p.u > 0.5][p.v > 0.5] = true;
+		}
+		fillsUV = corners[0][0] && corners[0][1] && corners[1][0] && corners[1][1];
+	}
+	else if (vertices2.size() >= POLYGON_GRID_MIN_VERTICES) {
+		polygonGrid.Build(vertices2);
+	}
 }
 
 /*
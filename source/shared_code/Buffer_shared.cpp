@@ -14,10 +14,29 @@ GlobalSimuState& GlobalSimuState::operator=(const GlobalSimuState & src) {
 	facetStates = src.facetStates;
 	globalHistograms = src.globalHistograms;
 	globalHits = src.globalHits;
+	modifiedFacets = src.modifiedFacets;
+	sparseMoments = src.sparseMoments;
+	momentLayouts = src.momentLayouts;
+	allocatedMoments = src.allocatedMoments;
 	initialized = src.initialized;
 	return *this;
 }
 
+/**
+* \brief Exchanges the recorded results (all but mutex) with another state, without copying the facet buffers
+* \param other state to exchange contents with
+*/
+void GlobalSimuState::Swap(GlobalSimuState & other) {
+	facetStates.swap(other.facetStates);
+	globalHistograms.swap(other.globalHistograms);
+	std::swap(globalHits, other.globalHits);
+	modifiedFacets.swap(other.modifiedFacets);
+	std::swap(sparseMoments, other.sparseMoments);
+	momentLayouts.swap(other.momentLayouts);
+	allocatedMoments.swap(other.allocatedMoments);
+	std::swap(initialized, other.initialized);
+}
+
 /**
 * \brief Clears simulation state
 */
@@ -26,17 +45,22 @@ void GlobalSimuState::clear() {
 	globalHits = GlobalHitBuffer();
 	globalHistograms.clear();
 	facetStates.clear();
+	modifiedFacets.clear();
+	momentLayouts.reset();
+	allocatedMoments.clear();
 	ReleaseMutex(mutex);
 }
 
 /**
 * \brief Constructs the 'dpHit' structure to hold all results, zero-init
 * \param w Worker handle
+* \param sparseMoments allocate the time moments' snapshots (all but constant flow) only when written (see Modify), for simulation threads' buffers
 */
-void GlobalSimuState::Resize(Worker& w) { //Constructs the 'dpHit' structure to hold all results, zero-init
+void GlobalSimuState::Resize(Worker& w, bool sparseMoments) { //Constructs the 'dpHit' structure to hold all results, zero-init
 	LockMutex(mutex);
 	size_t nbF = w.GetGeometry()->GetNbFacet();
 	std::vector<FacetState>(nbF).swap(facetStates);
+	std::vector<FacetMomentSnapshot> layouts;
 	for (size_t i = 0; i < nbF; i++) {
 		Facet* f = w.GetMolflowGeometry()->GetFacet(i);
 		FacetMomentSnapshot facetMomentTemplate;
@@ -45,9 +69,20 @@ void GlobalSimuState::Resize(Worker& w) { //Constructs the 'dpHit' structure to
 		facetMomentTemplate.profile = std::vector<ProfileSlice>(f->sh.isProfile ? PROFILE_SIZE : 0);
 		facetMomentTemplate.texture = std::vector<TextureCell>(f->sh.isTextured ? f->sh.texWidth*f->sh.texHeight : 0);
 		//No init for hits 
-		facetStates[i].momentResults = std::vector<FacetMomentSnapshot>(1 + w.moments.size(), facetMomentTemplate);
+		if (sparseMoments) {
+			FacetMomentSnapshot released;
+			released.allocated = false;
+			facetStates[i].momentResults = std::vector<FacetMomentSnapshot>(1 + w.moments.size(), released);
+			facetStates[i].momentResults[0] = facetMomentTemplate; //Constant flow is written by every event
+			layouts.push_back(std::move(facetMomentTemplate));
+		}
+		else facetStates[i].momentResults = std::vector<FacetMomentSnapshot>(1 + w.moments.size(), facetMomentTemplate);
 		if (f->sh.anglemapParams.record) facetStates[i].recordedAngleMapPdf = std::vector<size_t>(f->sh.anglemapParams.GetMapSize());
 	}
+	this->sparseMoments = sparseMoments;
+	if (sparseMoments) momentLayouts = std::make_shared<const std::vector<FacetMomentSnapshot>>(std::move(layouts));
+	else momentLayouts.reset();
+	allocatedMoments.clear();
 	//Global histogram
 	FacetHistogramBuffer globalHistTemplate; globalHistTemplate.Resize(w.wp.globalHistogramParams);
 	globalHistograms = std::vector<FacetHistogramBuffer>(1 + w.moments.size(), globalHistTemplate);
@@ -55,6 +90,16 @@ void GlobalSimuState::Resize(Worker& w) { //Constructs the 'dpHit' structure to
 	ReleaseMutex(mutex);
 }
 
+/**
+* \brief Gives storage to a sparse buffer's moment snapshot on its first write (see Modify)
+* \param facetId facet index
+* \param moment moment index (>0)
+*/
+void GlobalSimuState::AllocateMoment(size_t facetId, size_t moment) {
+	facetStates[facetId].momentResults[moment].Allocate((*momentLayouts)[facetId]);
+	allocatedMoments.emplace_back(facetId, moment);
+}
+
 /**
 * \brief zero-init for all structures
 */
@@ -66,6 +111,8 @@ void GlobalSimuState::Reset() {
 		ZEROVECTOR(h.timeHistogram);
 	}
 	memset(&globalHits, 0, sizeof(globalHits)); //Plain old data
+	for (const auto& id : allocatedMoments) facetStates[id.first].momentResults[id.second].Release(); //Sparse buffers: back to no storage
+	allocatedMoments.clear();
 	for (auto& state : facetStates) {
 		ZEROVECTOR(state.recordedAngleMapPdf);
 		for (auto& m : state.momentResults) {
@@ -76,11 +123,91 @@ void GlobalSimuState::Reset() {
 			std::vector<TextureCell>(m.texture.size()).swap(m.texture);
 			std::vector<ProfileSlice>(m.profile.size()).swap(m.profile);
 			memset(&(m.hits), 0, sizeof(m.hits));
+			m.modified = m.denseTexture = false;
+			m.modifiedCells.clear();
+		}
+		state.modified = false;
+	}
+	modifiedFacets.clear();
+	ReleaseMutex(mutex);
+}
+
+/**
+* \brief zero-init for the facets and moments written since the last reset only (simulation threads' buffers)
+* Global counters and histograms are small and always cleared. Textures are cleared cell by cell when few cells were hit.
+* Sparse buffers also release the moment snapshots that weren't written since the last reset (they are already zero)
+*/
+void GlobalSimuState::ResetModified() {
+	LockMutex(mutex);
+	size_t nbKept = 0;
+	for (const auto& id : allocatedMoments) {
+		FacetMomentSnapshot& m = facetStates[id.first].momentResults[id.second];
+		if (m.modified) allocatedMoments[nbKept++] = id; //Still in use, zeroed below
+		else m.Release();
+	}
+	allocatedMoments.resize(nbKept);
+	for (auto& h : globalHistograms) {
+		ZEROVECTOR(h.distanceHistogram);
+		ZEROVECTOR(h.nbHitsHistogram);
+		ZEROVECTOR(h.timeHistogram);
+	}
+	memset(&globalHits, 0, sizeof(globalHits)); //Plain old data
+	for (size_t facetId : modifiedFacets) {
+		FacetState& state = facetStates[facetId];
+		ZEROVECTOR(state.recordedAngleMapPdf);
+		for (auto& m : state.momentResults) {
+			if (!m.modified) continue;
+			ZEROVECTOR(m.histogram.distanceHistogram);
+			ZEROVECTOR(m.histogram.nbHitsHistogram);
+			ZEROVECTOR(m.histogram.timeHistogram);
+			std::fill(m.direction.begin(), m.direction.end(), DirectionCell());
+			std::fill(m.profile.begin(), m.profile.end(), ProfileSlice());
+			if (m.denseTexture) std::fill(m.texture.begin(), m.texture.end(), TextureCell());
+			else for (size_t cell : m.modifiedCells) m.texture[cell] = TextureCell();
+			memset(&(m.hits), 0, sizeof(m.hits));
+			m.modified = m.denseTexture = false;
+			m.modifiedCells.clear();
 		}
+		state.modified = false;
 	}
+	modifiedFacets.clear();
 	ReleaseMutex(mutex);
 }
 
+/**
+* \brief Adds the facets and moments written in src (see ModifyFacet, Modify) to this state, plus the global histograms
+* Global hit counters and leak/hit caches are not added, see Worker::AddGlobalHits
+* \param src simulation thread's buffer with modification tracking
+* \param trackModified register the written facets here too (when this is also a buffer that will be merged and reset sparsely)
+*/
+void GlobalSimuState::AddModified(const GlobalSimuState & src, bool trackModified) {
+	globalHistograms += src.globalHistograms;
+	for (size_t facetId : src.modifiedFacets) {
+		const FacetState& srcState = src.facetStates[facetId];
+		FacetState& dstState = trackModified ? ModifyFacet(facetId) : facetStates[facetId];
+		dstState.recordedAngleMapPdf += srcState.recordedAngleMapPdf;
+		for (size_t m = 0; m < srcState.momentResults.size(); m++) {
+			const FacetMomentSnapshot& srcMoment = srcState.momentResults[m];
+			if (!srcMoment.modified) continue;
+			FacetMomentSnapshot& dstMoment = trackModified ? Modify(facetId, m) : dstState.momentResults[m];
+			dstMoment.hits += srcMoment.hits;
+			dstMoment.profile += srcMoment.profile;
+			dstMoment.direction += srcMoment.direction;
+			dstMoment.histogram += srcMoment.histogram;
+			if (srcMoment.denseTexture) {
+				dstMoment.texture += srcMoment.texture;
+				if (trackModified) dstMoment.denseTexture = true;
+			}
+			else {
+				for (size_t cell : srcMoment.modifiedCells) {
+					if (trackModified && dstMoment.texture[cell].sum_1_per_ort_velocity == 0.0) dstMoment.RegisterTextureCell(cell);
+					dstMoment.texture[cell] += srcMoment.texture[cell];
+				}
+			}
+		}
+	}
+}
+
 /**
 * \brief += operator, with simple += of underlying structures
 * \param rhs reference object on the right hand
@@ -133,6 +260,42 @@ FacetMomentSnapshot& FacetMomentSnapshot::operator+=(const FacetMomentSnapshot &
 	return *this;
 }
 
+/**
+* \brief Lists a texture cell for the sparse merge and reset, or switches to whole-texture mode once the list gets long
+* \param cell index of a cell that was all-zero before the current write
+*/
+void FacetMomentSnapshot::RegisterTextureCell(size_t cell) {
+	if (denseTexture) return;
+	if (modifiedCells.size() < texture.size() / 8) modifiedCells.push_back(cell);
+	else denseTexture = true; //Beyond 1/8 of the cells a sequential pass is cheaper than scattered access
+}
+
+/**
+* \brief Gives storage (zeroed) to a released snapshot
+* \param layout zeroed snapshot with the facet's texture, direction, profile and histogram sizes
+*/
+void FacetMomentSnapshot::Allocate(const FacetMomentSnapshot& layout) {
+	profile = layout.profile;
+	texture = layout.texture;
+	direction = layout.direction;
+	histogram = layout.histogram;
+	allocated = true;
+}
+
+/**
+* \brief Frees the storage of a zero snapshot. Hit counters are kept (they are small and zero anyway)
+*/
+void FacetMomentSnapshot::Release() {
+	std::vector<ProfileSlice>().swap(profile);
+	std::vector<TextureCell>().swap(texture);
+	std::vector<DirectionCell>().swap(direction);
+	std::vector<double>().swap(histogram.nbHitsHistogram);
+	std::vector<double>().swap(histogram.distanceHistogram);
+	std::vector<double>().swap(histogram.timeHistogram);
+	std::vector<size_t>().swap(modifiedCells);
+	allocated = modified = denseTexture = false;
+}
+
 /**
 * \brief + operator, simply calls implemented +=
 * \param rhs reference object on the right hand
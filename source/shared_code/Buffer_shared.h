@@ -25,6 +25,9 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include <array>
 #include <mutex>
 #include <thread>
+#include <memory>
+#include <condition_variable>
+#include <atomic>
 
 #ifdef MOLFLOW
 #include "MolflowTypes.h" //Texture Min Max of GlobalHitBuffer, anglemapparams
@@ -398,10 +401,14 @@ public:
 	double	 lowFluxCutoff;
 
 	bool enableLogging;
-	size_t logFacetId, logLimit;
+	std::vector<size_t> logFacetIds; //Facets whose hits are logged (see ParticleLog.h)
+	size_t logLimit; //Max. number of logged hits, 0: no limit
+	double logSampling; //Fraction of the hits logged, each hit is chosen at random. 1: all
 
 	size_t desorptionLimit;
 	size_t nbProcess; //For desorption limit / log size calculation
+	size_t wavefrontSize; //0: particles are traced one by one. Otherwise number of particles in flight per thread (wavefront engine), applied on start
+	size_t randomSeed; //0: every thread seeds itself from time and thread id. Otherwise the same key for all threads, runs are reproducible
 
 	template<class Archive> void serialize(Archive& archive) {
 		archive(
@@ -411,10 +418,13 @@ public:
 			CEREAL_NVP(lowFluxMode),
 			CEREAL_NVP(lowFluxCutoff),
 			CEREAL_NVP(enableLogging),
-			CEREAL_NVP(logFacetId),
+			CEREAL_NVP(logFacetIds),
 			CEREAL_NVP(logLimit),
+			CEREAL_NVP(logSampling),
 			CEREAL_NVP(desorptionLimit),
-			CEREAL_NVP(nbProcess)
+			CEREAL_NVP(nbProcess),
+			CEREAL_NVP(wavefrontSize),
+			CEREAL_NVP(randomSeed)
 		);
 	}
 
@@ -607,34 +617,6 @@ public:
 	}
 };
 
-class ParticleLoggerItem {
-public:
-	Vector2d facetHitPosition;
-	double hitTheta, hitPhi;
-	double oriRatio;
-#ifdef MOLFLOW
-	double time, particleDecayMoment, velocity;
-#endif
-#ifdef SYNRAD
-	double energy, dF, dP;
-#endif
-	template<class Archive>
-	void serialize(Archive & archive)
-	{
-		archive(
-			CEREAL_NVP(facetHitPosition),
-			CEREAL_NVP(hitTheta), CEREAL_NVP(hitPhi),
-			CEREAL_NVP(oriRatio)
-#ifdef MOLFLOW
-			,CEREAL_NVP(time), CEREAL_NVP(particleDecayMoment), CEREAL_NVP(velocity)
-#endif
-#ifdef SYNRAD
-			,CEREAL_NVP(energy), CEREAL_NVP(dF), CEREAL_NVP(dP)
-#endif
-		);
-	}
-};
-
 
 // Master control shared memory block  (name: MFLWCTRL[masterPID])
 // 
@@ -690,6 +672,10 @@ class Simulation;
 class WorkerControl {
 public:
 	std::timed_mutex mutex;
+	// Signalling, both used with 'mutex': no polling in either direction
+	std::condition_variable_any commandIssued; //Notified by the worker after writing new commands to 'states'
+	std::condition_variable_any stateChanged; //Notified by the simulation threads after changing their entry in 'states'
+	std::atomic<size_t> commandSerial{ 0 }; //Incremented with each command (under 'mutex'). Running threads compare it without locking to stop their step early
 	// Process control
 	std::vector<size_t> states = std::vector<size_t>(MAX_PROCESS);        // Process states/commands
 	std::vector<size_t>   cmdParam = std::vector<size_t>(MAX_PROCESS);      // Command param 1
@@ -719,6 +705,16 @@ public:
 	std::vector<TextureCell> texture;
 	std::vector<DirectionCell> direction;
 	FacetHistogramBuffer histogram;
+
+	//Modification tracking, only used in the simulation threads' buffers (see GlobalSimuState::AddModified)
+	bool modified = false; //Written since the last ResetModified()
+	bool denseTexture = false; //Too many texture cells written to list them: merge/reset the whole texture
+	std::vector<size_t> modifiedCells; //Texture cells written since the last ResetModified() (unless denseTexture)
+	void RegisterTextureCell(size_t cell); //Call on the first write to an all-zero cell
+
+	bool allocated = true; //False: no storage (all vectors empty) until the first write, see GlobalSimuState::Resize with sparseMoments
+	void Allocate(const FacetMomentSnapshot& layout);
+	void Release();
 };
 
 class FacetState {
@@ -726,6 +722,7 @@ public:
 	FacetState& operator+=(const FacetState& rhs);
 	std::vector<size_t> recordedAngleMapPdf; //Not time-dependent
 	std::vector<FacetMomentSnapshot> momentResults; //1+nbMoment
+	bool modified = false; //Written since the last ResetModified() (simulation threads' buffers only)
 };
 
 
@@ -733,14 +730,42 @@ class Worker;
 class GlobalSimuState { //replaces old hits dataport
 public:
 	GlobalSimuState& operator=(const GlobalSimuState& src);
+	void Swap(GlobalSimuState& other);
 	bool initialized = false;
 	void clear();
-	void Resize(Worker& w);
+	void Resize(Worker& w, bool sparseMoments = false);
 	void Reset();
 #ifdef MOLFLOW
+	void ResetModified();
+	void AddModified(const GlobalSimuState& src, bool trackModified);
+	//Write access to a facet (or one of its moments) that registers it for the sparse merge and reset. Hot path, kept inline
+	FacetState& ModifyFacet(size_t facetId) {
+		FacetState& state = facetStates[facetId];
+		if (!state.modified) {
+			state.modified = true;
+			modifiedFacets.push_back(facetId);
+		}
+		return state;
+	}
+	FacetMomentSnapshot& Modify(size_t facetId, size_t moment) {
+		FacetMomentSnapshot& snapshot = ModifyFacet(facetId).momentResults[moment];
+		if (!snapshot.modified) {
+			snapshot.modified = true;
+			if (!snapshot.allocated) AllocateMoment(facetId, moment);
+		}
+		return snapshot;
+	}
+	void AllocateMoment(size_t facetId, size_t moment);
 	GlobalHitBuffer globalHits;
 	std::vector<FacetHistogramBuffer> globalHistograms; //1+nbMoment
 	std::vector<FacetState> facetStates; //nbFacet
+	std::vector<size_t> modifiedFacets; //Facets written since the last ResetModified(), each listed once
+
+	//Sparse time moments (simulation threads' buffers): moment snapshots only get storage when written, and lose it
+	//again when a merge cycle passes without writes, so that memory follows the moments particles actually reach
+	bool sparseMoments = false;
+	std::shared_ptr<const std::vector<FacetMomentSnapshot>> momentLayouts; //Zeroed snapshot of each facet, to allocate from. Shared by all copies
+	std::vector<std::pair<size_t, size_t>> allocatedMoments; //(facet, moment) of the snapshots currently allocated
 #endif
 	std::timed_mutex mutex;
 };
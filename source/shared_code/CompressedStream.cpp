@@ -0,0 +1,187 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#include "CompressedStream.h"
+#include <cstring> //memcmp
+#include "ziplib/extlibs/zlib/zlib.h"
+
+#define GZ_CHUNK_SIZE (4 << 20) //Decompressed text handed to the parser at once
+#define GZ_BUFFER_SIZE (1 << 20) //Compressed bytes read or written at once
+#define GZ_QUEUE_LENGTH 4 //Chunks in flight: bounds the memory if one side is slower
+#define GZ_WINDOW_BITS (15 + 16) //zlib: max. window, gzip header and trailer (so that gzip and 7-zip also open the files)
+
+bool ChunkQueue::Push(std::vector<char>&& chunk) {
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this] { return closed || chunks.size() < maxChunks; });
+	if (closed) return false;
+	chunks.push_back(std::move(chunk));
+	changed.notify_all();
+	return true;
+}
+
+bool ChunkQueue::Pop(std::vector<char>& chunk) {
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this] { return closed || !chunks.empty(); });
+	if (chunks.empty()) return false;
+	chunk = std::move(chunks.front());
+	chunks.pop_front();
+	changed.notify_all();
+	return true;
+}
+
+void ChunkQueue::Close() {
+	std::lock_guard<std::mutex> lock(mutex);
+	closed = true;
+	changed.notify_all();
+}
+
+GzStreamWriter::GzStreamWriter(const std::string& fileName) : fileName(fileName), queue(GZ_QUEUE_LENGTH) {
+	file = fopen(fileName.c_str(), "wb");
+	if (!file) throw Error(("Cannot open file for writing " + fileName).c_str());
+	compressorThread = std::thread(&GzStreamWriter::Compress, this);
+}
+
+GzStreamWriter::~GzStreamWriter() {
+	if (!finished) { //Interrupted save: don't leave a truncated archive behind
+		queue.Close();
+		compressorThread.join();
+		fclose(file);
+		remove(fileName.c_str());
+	}
+}
+
+void GzStreamWriter::Compress() {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	//Fastest level: compression is the bottleneck of the save, higher levels cost much more time than they save space
+	if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, GZ_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		error = "Can't initialize compressor";
+		queue.Close(); //Unblocks the writer, which reports the error
+		return;
+	}
+	std::vector<char> chunk;
+	std::vector<Bytef> out(GZ_BUFFER_SIZE);
+	bool lastChunk = false;
+	while (!lastChunk && error.empty()) {
+		lastChunk = !queue.Pop(chunk);
+		if (lastChunk) chunk.clear();
+		stream.next_in = (Bytef*)chunk.data();
+		stream.avail_in = (uInt)chunk.size();
+		do {
+			stream.next_out = out.data();
+			stream.avail_out = (uInt)out.size();
+			deflate(&stream, lastChunk ? Z_FINISH : Z_NO_FLUSH);
+			size_t produced = out.size() - stream.avail_out;
+			if (produced > 0 && fwrite(out.data(), 1, produced, file) != produced) {
+				error = "Error writing compressed file (disk full?)";
+				break;
+			}
+		} while (stream.avail_out == 0); //Output buffer full: more to come
+	}
+	deflateEnd(&stream);
+	if (!error.empty()) queue.Close();
+}
+
+void GzStreamWriter::Write(std::vector<char>&& chunk) {
+	if (!queue.Push(std::move(chunk))) {
+		//Compressor stopped early
+		compressorThread.join();
+		finished = true;
+		fclose(file);
+		remove(fileName.c_str());
+		throw Error(error.c_str());
+	}
+}
+
+void GzStreamWriter::Finish() {
+	queue.Close();
+	compressorThread.join();
+	finished = true;
+	bool closeOk = fclose(file) == 0;
+	if (error.empty() && !closeOk) error = "Error closing compressed file (disk full?)";
+	if (!error.empty()) {
+		remove(fileName.c_str());
+		throw Error(error.c_str());
+	}
+}
+
+GzStreamReader::GzStreamReader(const std::string& fileName) : queue(GZ_QUEUE_LENGTH) {
+	file = fopen(fileName.c_str(), "rb");
+	if (!file) throw Error(("Cannot open file for reading (" + fileName + ")").c_str());
+	decompressorThread = std::thread(&GzStreamReader::Decompress, this);
+}
+
+GzStreamReader::~GzStreamReader() {
+	queue.Close(); //Stops the decompressor if the parser gave up early
+	if (decompressorThread.joinable()) decompressorThread.join();
+	fclose(file);
+}
+
+void GzStreamReader::Decompress() {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit2(&stream, GZ_WINDOW_BITS) != Z_OK) {
+		error = "Can't initialize decompressor";
+		queue.Close();
+		return;
+	}
+	std::vector<Bytef> in(GZ_BUFFER_SIZE);
+	std::vector<char> out(GZ_CHUNK_SIZE);
+	stream.next_out = (Bytef*)out.data();
+	stream.avail_out = (uInt)out.size();
+	bool stopped = false; //Reader closed the queue
+	int ret = Z_OK;
+
+	while (ret != Z_STREAM_END) {
+		if (stream.avail_in == 0) {
+			stream.avail_in = (uInt)fread(in.data(), 1, in.size(), file);
+			stream.next_in = in.data();
+			if (stream.avail_in == 0) {
+				error = "Compressed file truncated";
+				break;
+			}
+		}
+		ret = inflate(&stream, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			error = "Corrupt compressed file";
+			break;
+		}
+		if (stream.avail_out == 0) {
+			if (!queue.Push(std::move(out))) { stopped = true; break; }
+			out.assign(GZ_CHUNK_SIZE, 0);
+			stream.next_out = (Bytef*)out.data();
+			stream.avail_out = (uInt)out.size();
+		}
+	}
+	size_t outPos = out.size() - stream.avail_out;
+	if (!stopped && error.empty() && outPos > 0) {
+		out.resize(outPos);
+		queue.Push(std::move(out));
+	}
+	inflateEnd(&stream);
+	queue.Close();
+}
+
+bool GzStreamReader::NextChunk(std::vector<char>& chunk) {
+	if (queue.Pop(chunk)) return true;
+	//Queue drained: decompressor done, maybe with an error
+	if (decompressorThread.joinable()) decompressorThread.join();
+	if (!error.empty()) throw Error(error.c_str());
+	return false;
+}
@@ -0,0 +1,93 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+// In-process gzip compression of .geo.gz/.syn.gz files (.geo7z/.syn7z stay 7z archives, through the external compress / 7za executables)
+// The text is produced (FileWriter) or parsed (FileReader) on the calling thread while the (de)compression
+// runs on its own thread. Chunks of text are passed between the two through a bounded queue: no temporary files.
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "GLApp/GLTypes.h" //Error
+
+/**
+* \brief Bounded FIFO of text chunks between a producer and a consumer thread
+*/
+class ChunkQueue {
+public:
+	ChunkQueue(size_t maxChunks) : maxChunks(maxChunks) {}
+
+	bool Push(std::vector<char>&& chunk); //Blocks while full, false if the queue was closed by the consumer
+	bool Pop(std::vector<char>& chunk); //Blocks while empty, false once closed and drained
+	void Close(); //No more chunks: wakes up both sides
+
+private:
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<std::vector<char>> chunks;
+	size_t maxChunks;
+	bool closed = false;
+};
+
+/**
+* \brief Compresses text chunks to a gzip file on a background thread
+*/
+class GzStreamWriter {
+public:
+	GzStreamWriter(const std::string& fileName); //Throws Error
+	~GzStreamWriter(); //Aborts (and removes the file) if Finish() wasn't called
+
+	void Write(std::vector<char>&& chunk); //Throws Error if the compressor failed
+	void Finish(); //Waits for the compressor to write the last block. Throws Error
+
+private:
+	void Compress();
+
+	std::string fileName;
+	FILE* file = NULL;
+	ChunkQueue queue;
+	std::thread compressorThread;
+	std::string error; //Set by the compressor thread
+	bool finished = false;
+};
+
+/**
+* \brief Decompresses a gzip file on a background thread, handing out the text in chunks
+*/
+class GzStreamReader {
+public:
+	GzStreamReader(const std::string& fileName); //Throws Error
+	~GzStreamReader();
+
+	bool NextChunk(std::vector<char>& chunk); //False at the end of the text. Throws Error on corrupt input
+
+private:
+	void Decompress();
+
+	FILE* file = NULL;
+	ChunkQueue queue;
+	std::thread decompressorThread;
+	std::string error; //Set by the decompressor thread
+};
@@ -228,6 +228,7 @@ void Facet::DetectOrientation() {
 */
 int Facet::RestoreDeviceObjects() {
 
+#ifndef MOLFLOW_CLI //No GL context in the headless core
 	// Initialize scene objects (OpenGL)
 	if (sh.isTextured) {
 		glGenTextures(1, &glTex);
@@ -236,6 +237,7 @@ int Facet::RestoreDeviceObjects() {
 
 	//BuildMeshGLList();
 	BuildSelElemList();
+#endif
 
 	return GL_OK;
 
@@ -300,6 +302,10 @@ bool Facet::SetTexture(double width, double height, bool useMesh) {
 
 	//SAFE_FREE(meshPts);
 	SAFE_FREE(cellPropertiesIds);
+#ifdef MOLFLOW
+	inverseMeshArea.clear();
+	texColors.clear();
+#endif
 	//nbElem = 0;
 	UnselectElem();
 
@@ -310,8 +316,12 @@ bool Facet::SetTexture(double width, double height, bool useMesh) {
 		texDimH = GetPower2(sh.texHeight + 2);
 		if (texDimW < 4) texDimW = 4;
 		if (texDimH < 4) texDimH = 4;
-		glGenTextures(1, &glTex);
-		glList = glGenLists(1);
+#ifndef MOLFLOW_CLI
+		if (!mApp->headless) {
+			glGenTextures(1, &glTex);
+			glList = glGenLists(1);
+		}
+#endif
 		if (useMesh)
 			if (!BuildMesh()) return false;
 		if (sh.countDirection) {
@@ -334,9 +344,11 @@ bool Facet::SetTexture(double width, double height, bool useMesh) {
 */
 void Facet::glVertex2u(double u, double v) {
 
+#ifndef MOLFLOW_CLI
 	glVertex3d(sh.O.x + sh.U.x*u + sh.V.x*v,
 		sh.O.y + sh.U.y*u + sh.V.y*v,
 		sh.O.z + sh.U.z*u + sh.V.z*v);
+#endif
 
 }
 
@@ -345,6 +357,9 @@ void Facet::glVertex2u(double u, double v) {
 * \return true if mesh properly build
 */
 bool Facet::BuildMesh() {
+#ifdef MOLFLOW
+	inverseMeshArea.clear(); //Rebuilt from the new mesh at the next texture refresh
+#endif
 
 	if (!(cellPropertiesIds = (int *)malloc(sh.texWidth * sh.texHeight * sizeof(int))))
 	{
@@ -526,6 +541,7 @@ void Facet::BuildMeshGLList() {
 
 	DELETE_LIST(glElem);
 
+#ifndef MOLFLOW_CLI
 	// Build OpenGL geometry for meshing
 	glElem = glGenLists(1);
 	glNewList(glElem, GL_COMPILE);
@@ -563,6 +579,7 @@ void Facet::BuildMeshGLList() {
 
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 	glEndList();
+#endif
 
 }
 
@@ -572,6 +589,7 @@ void Facet::BuildMeshGLList() {
 void Facet::BuildSelElemList() {
 
 	DELETE_LIST(glSelElem);
+#ifndef MOLFLOW_CLI
 	int nbSel = 0;
 
 	if (cellPropertiesIds && selectedElem.width != 0 && selectedElem.height != 0) {
@@ -617,6 +635,7 @@ void Facet::BuildSelElemList() {
 		// Empty selection
 		if (nbSel == 0) UnselectElem();
 	}
+#endif
 }
 
 /**
@@ -659,7 +678,9 @@ void Facet::SelectElem(size_t u, size_t v, size_t width, size_t height) {
 * \brief For specific rendering a selected element
 */
 void Facet::RenderSelectedElem() {
+#ifndef MOLFLOW_CLI
 	if (glSelElem) glCallList(glSelElem);
+#endif
 }
 
 /**
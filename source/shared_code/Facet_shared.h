@@ -114,7 +114,8 @@ public:
 	size_t GetHitsSize(size_t nbMoments);
 	size_t GetTexRamSize(size_t nbMoments);
 	size_t GetTexRamSizeForRatio(double ratio, bool useMesh, bool countDir, size_t nbMoments);
-	void  BuildTexture(std::vector<TextureCell>& texBuffer, int textureMode, double min, double max, bool useColorMap, double dCoeff1, double dCoeff2, double dCoeff3, bool doLog, size_t m);
+	void  ComputeTextureColors(const std::vector<TextureCell>& texBuffer, int textureMode, double min, double max, bool useColorMap, double dCoeff1, double dCoeff2, double dCoeff3, bool doLog); //No GL calls: can run on any thread
+	void  UploadTexture(bool useColorMap); //Sends texColors to glTex
 	double GetSmooth(int i, int j, TextureCell *texBuffer, int textureMode, double scaleF);
 	void Sum_Neighbor(const int& i, const int& j, const double& weight, TextureCell *texBuffer, const int& textureMode, const double& scaleF, double *sum, double *totalWeight);
 	std::string GetAngleMap(size_t formatId); //formatId: 1=CSV 2=TAB-separated
@@ -178,6 +179,8 @@ public:
 	std::vector<NeighborFacet> neighbors;
 
 #ifdef MOLFLOW
+	std::vector<double> inverseMeshArea; //1/GetMeshArea(i) per cell (one side), built on the first texture refresh after a mesh change
+	std::vector<unsigned char> texColors; //Texture image (texDimW*texDimH RGBA or greyscale), kept between refreshes
 	std::vector<double> outgassingMap; //outgassing map cell values (loaded from file)
 	std::vector<size_t> angleMapCache; //Stores either the recorded or the generating angle map. Worker::Update reads results here. A better implementation would be to separate recorded and generating angle maps
 	bool hasOutgassingFile; //true if a desorption file was loaded and had info about this facet
@@ -18,11 +18,26 @@ GNU General Public License for more details.
 Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 */
 #include "File.h"
+#include "CompressedStream.h"
 #include <string.h>
 #include "GLApp/GLTypes.h"
 #include <sstream>
 #include <filesystem>
 #include <cstring> //strcpy, etc.
+#include <charconv> //from_chars
+#include <stdlib.h> //strtod_l
+#include <locale.h>
+#ifdef __APPLE__
+#include <xlocale.h>
+#endif
+#ifdef _WIN32
+#include <windows.h> //CreateFileMapping
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 //#ifdef _WIN32
 //#include <direct.h>
@@ -33,6 +48,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 //#endif
 
 #define MAX_WORD_LENGTH 65536 //expected length of the longest line
+#define WRITE_CHUNKSIZE (1 << 20) //Text handed to the compressor thread at once
 
 // Error class
 
@@ -64,49 +80,173 @@ bool FileUtils::Exist(const char *fileName) {
 	return std::filesystem::exists(fileName);
 }
 
+template <typename T> static const char *FromChars(const char *first, const char *last, T &value) {
+	if (first < last && *first == '+' && first + 1 < last && first[1] != '-') first++; //from_chars doesn't take a leading '+'
+	auto result = std::from_chars(first, last, value);
+	return (result.ec == std::errc()) ? result.ptr : NULL;
+}
+
+const char *FileUtils::ParseNumber(const char *first, const char *last, double &value) {
+#if defined(__cpp_lib_to_chars)
+	return FromChars(first, last, value);
+#else
+	//No floating point from_chars in this standard library (GCC<11, libc++): strtod in the C locale,
+	//on a terminated copy as the range isn't terminated
+	char buf[128];
+	size_t len = 0;
+	while (first + len < last && len < sizeof(buf) - 1 && (unsigned char)first[len] > ' ') {
+		buf[len] = first[len];
+		len++;
+	}
+	buf[len] = 0;
+	if (len == 0 || (buf[0] == '+' && buf[1] == '-')) return NULL;
+	char *endPtr;
+#ifdef _WIN32
+	static _locale_t cLocale = _create_locale(LC_NUMERIC, "C");
+	value = _strtod_l(buf, &endPtr, cLocale);
+#else
+	static locale_t cLocale = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+	value = strtod_l(buf, &endPtr, cLocale);
+#endif
+	if (endPtr == buf) return NULL;
+	return first + (endPtr - buf);
+#endif
+}
+
+const char *FileUtils::ParseNumber(const char *first, const char *last, int &value) {
+	return FromChars(first, last, value);
+}
+
+const char *FileUtils::ParseNumber(const char *first, const char *last, size_t &value) {
+	return FromChars(first, last, value);
+}
+
+// MappedFile class
+
+MappedFile::MappedFile(const std::string& fileName) {
+	std::string errMsg = "Cannot open file for reading (" + fileName + ")";
+#ifdef _WIN32
+	HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) throw Error(errMsg.c_str());
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize)) {
+		CloseHandle(file);
+		throw Error(errMsg.c_str());
+	}
+	size = (size_t)fileSize.QuadPart;
+	fileHandle = file;
+	if (size == 0) return; //Empty files can't be mapped
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping) data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data) {
+		if (mapping) CloseHandle(mapping);
+		CloseHandle(file);
+		throw Error(("Cannot map file to memory (" + fileName + ")").c_str());
+	}
+	mappingHandle = mapping;
+#else
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0) throw Error(errMsg.c_str());
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) != 0) {
+		close(fd);
+		throw Error(errMsg.c_str());
+	}
+	size = (size_t)fileStat.st_size;
+	if (size > 0) {
+		void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			throw Error(("Cannot map file to memory (" + fileName + ")").c_str());
+		}
+		madvise(map, size, MADV_SEQUENTIAL);
+		data = (const char*)map;
+	}
+	close(fd); //The mapping stays valid
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+	if (data) UnmapViewOfFile(data);
+	if (mappingHandle) CloseHandle(mappingHandle);
+	if (fileHandle) CloseHandle(fileHandle);
+#else
+	if (data) munmap((void*)data, size);
+#endif
+}
+
 // FileReader class
 
-FileReader::FileReader(const char *fileName) {
+FileReader::FileReader(const char *fileName, bool compressed) {
 
-  file = fopen(fileName,"r");
-  char tmp[512];
-  sprintf(tmp,"Cannot open file for reading (%s)",fileName);
-  if(!file) throw Error(tmp);
+  mappedFile = NULL;
+  gzReader = NULL;
+  if (compressed) {
+    gzReader = new GzStreamReader(fileName);
+    data = NULL;
+    size = 0; //First chunk fetched by the first ReadChar()
+  } else {
+    mappedFile = new MappedFile(fileName); //Throws "Cannot open file for reading"
+    data = mappedFile->Data();
+    size = mappedFile->Size();
+  }
+  pos = 0;
   curLine = 1;
   strcpy(this->fileName,fileName);
   isEof = 0;
   CurrentChar = ' ';
-  RefillBuffer();
 
 }
 
-void FileReader::RefillBuffer() {
+void FileReader::NextChunk() {
 
-  if( !isEof ) {
-    nbLeft = (int)fread(readBuffer,1,READ_BUFFSIZE,file);
-    isEof = (nbLeft==0);
+  if (gzReader->NextChunk(chunk)) {
+    data = chunk.data();
+    size = chunk.size();
+    pos = 0;
   }
-  buffPos = 0;
 
 }
 
 char FileReader::ReadChar() {
 
-  if( buffPos>=nbLeft ) RefillBuffer();
-
-  if( !isEof ) {
-    CurrentChar = readBuffer[buffPos++];
+  if( pos>=size && gzReader ) NextChunk();
+  if( pos<size ) {
+    CurrentChar = data[pos++];
+	if (CurrentChar == '\r' && pos < size && data[pos] == '\n') CurrentChar = data[pos++]; //CRLF as in text mode
 	if(CurrentChar=='\n') {
 		curLine++;
 		wasLineEnd=true;
 	}
   } else {
+    isEof = 1;
     CurrentChar = 0;
   }
 
   return CurrentChar;
 }
 
+template <typename T> bool FileReader::ParseNumber(T& value) {
+
+  JumpControlChars();
+  if (isEof) return false;
+  const char *start = data + pos - 1; //Position of CurrentChar
+  const char *end = data + size;
+  const char *numberEnd = FileUtils::ParseNumber(start, end, value);
+  if (!numberEnd) return false;
+  if (gzReader && numberEnd == end) return false; //Might continue in the next chunk
+  //The number must be the whole word, otherwise let ReadWord() and sscanf decide as before
+  if (numberEnd < end) {
+    char c = *numberEnd;
+    if (c > 32 && c != ':' && c != '{' && c != '}' && c != ',') return false;
+  }
+  pos = numberEnd - data;
+  ReadChar();
+  return true;
+
+}
+
 int FileReader::IsEof() {
 
   JumpControlChars();
@@ -125,7 +265,8 @@ char *FileReader::GetName() {
 }
 
 FileReader::~FileReader() {
-  fclose(file);
+  delete mappedFile;
+  delete gzReader;
 }
 
 Error FileReader::MakeError(const char *msg) {
@@ -137,6 +278,7 @@ Error FileReader::MakeError(const char *msg) {
 int FileReader::ReadInt() {
 
   int ret;
+  if (ParseNumber(ret)) return ret;
   char *w = ReadWord();
   if( sscanf(w,"%d",&ret)<=0 ) throw Error(MakeError("Wrong integer format"));
   return ret;
@@ -146,6 +288,7 @@ int FileReader::ReadInt() {
 size_t FileReader::ReadSizeT() {
 
   size_t ret;
+  if (ParseNumber(ret)) return ret;
   char *w = ReadWord();
   if (sscanf(w, "%zd", &ret) <= 0) {
 	  throw Error(MakeError("Wrong integer64 format"));
@@ -155,10 +298,10 @@ size_t FileReader::ReadSizeT() {
 }
 
 void FileReader::SeekStart() {
-  fseek(file, 0L, SEEK_SET);
+  if (gzReader) throw Error("Can't rewind a compressed file");
+  pos = 0;
   isEof = 0;
   curLine = 1;
-  RefillBuffer();
   CurrentChar = ' ';
 }
 
@@ -182,6 +325,7 @@ void FileReader::ReadKeyword(const char *keyword) {
 double FileReader::ReadDouble() {
 
   double ret;
+  if (ParseNumber(ret)) return ret;
   char *w = ReadWord();
   if( sscanf(w,"%lf",&ret)<=0 ) {
 	  throw Error(MakeError("Wrong double format"));
@@ -190,6 +334,31 @@ double FileReader::ReadDouble() {
 
 }
 
+void FileReader::ReadDoubles(double *values, size_t count) {
+
+  size_t i = 0;
+  JumpControlChars();
+  if (!gzReader && !isEof) {
+    //Mapped file: one pass over the mapped range, the only bound being its end
+    const char *p = data + pos - 1; //Position of CurrentChar
+    const char *end = data + size;
+    int nbLines = 0;
+    for (; i < count; i++) {
+      while (p < end && (unsigned char)*p <= 32) nbLines += (*p++ == '\n');
+      const char *numberEnd = (p < end) ? FileUtils::ParseNumber(p, end, values[i]) : NULL;
+      if (!numberEnd || (numberEnd < end && (unsigned char)*numberEnd > 32)) break; //Not a plain number: ReadDouble() decides
+      p = numberEnd;
+    }
+    curLine += nbLines;
+    pos = p - data;
+    ReadChar(); //Back to the character reader
+  }
+  //Compressed files arrive in chunks: value by value
+  for (; i < count; i++)
+    values[i] = ReadDouble();
+
+}
+
 bool FileReader::SeekFor(const char *keyword) {
 	char *w;
 	int i=0;
@@ -339,13 +508,20 @@ char *FileReader::ReadWord() {
 
 // FileWriter class
 
-FileWriter::FileWriter(const char *fileName) {
+FileWriter::FileWriter(const char *fileName, bool compressed) {
 
-  file = fopen(fileName,"w");
-  if(!file) {
+  file = NULL;
+  gzWriter = NULL;
+  if (compressed) {
+    gzWriter = new GzStreamWriter(fileName);
+    buffer.reserve(WRITE_CHUNKSIZE);
+  } else {
+    file = fopen(fileName,"w");
+    if(!file) {
 	  char tmp[256];
 	  sprintf(tmp,"Cannot open file for writing %s",fileName);
 	  throw Error(tmp);
+    }
   }
   strcpy(this->fileName,fileName);
 
@@ -356,33 +532,57 @@ char *FileWriter::GetName() {
 }
 
 FileWriter::~FileWriter() {
-  fclose(file);
+  if (file) fclose(file);
+  delete gzWriter;
 }
 
-void FileWriter::Write(const int &v, const char *sep) {
-  if( !fprintf(file,"%d",v) )
+void FileWriter::Close() {
+  if (gzWriter) {
+    if (!buffer.empty()) gzWriter->Write(std::move(buffer));
+    buffer.clear();
+    gzWriter->Finish();
+    SAFE_DELETE(gzWriter);
+  }
+  if (file) {
+    int ret = fclose(file);
+    file = NULL;
+    if (ret != 0) throw Error("Error while writing to file");
+  }
+}
+
+void FileWriter::Put(const char *s) {
+  if (gzWriter) {
+    buffer.insert(buffer.end(), s, s + strlen(s));
+    if (buffer.size() >= WRITE_CHUNKSIZE) { //Hand over to the compressor thread
+      gzWriter->Write(std::move(buffer));
+      buffer.clear();
+      buffer.reserve(WRITE_CHUNKSIZE);
+    }
+  }
+  else if (fputs(s, file) < 0)
     throw Error("Error while writing to file");
-  if(sep) fprintf(file,"%s",sep);
+}
+
+void FileWriter::Write(const int &v, const char *sep) {
+  char tmp[32];
+  sprintf(tmp,"%d",v);
+  Put(tmp);
+  if(sep) Put(sep);
 }
 
 void FileWriter::Write(const size_t & v, const char * sep)
 {
-//#ifdef _WIN32
-	if (!fprintf(file, "%zd", v))
-		throw Error("Error while writing to file");
-//#else
-//	throw Error("FileWriter::Write() not implemented"); //commented out: fprintf works just as well on Linux
-//#endif
-	if (sep) fprintf(file, "%s", sep);
+  char tmp[32];
+  sprintf(tmp, "%zd", v);
+  Put(tmp);
+  if (sep) Put(sep);
 }
 
 void FileWriter::Write(const double &v, const char *sep) {
-
-  //if(v>=0.0) fprintf(file," ");
-	fprintf(file," ");
-  if( !fprintf(file,"%.14E",v) )
-    throw Error("Error while writing to file");
-  if(sep) fprintf(file,"%s",sep);
+  char tmp[64];
+  sprintf(tmp," %.14E",v);
+  Put(tmp);
+  if(sep) Put(sep);
 }
 
 void FileWriter::Write(std::string str) {
@@ -391,8 +591,7 @@ void FileWriter::Write(std::string str) {
 
 void FileWriter::Write(const char *s) {
 	if (*s==0) return; //null expression: don't do anything (for example formulas without name)
-	if( !fprintf(file,"%s",s) )
-    throw Error("Error while writing to file");
+	Put(s);
 }
 
 std::string FileUtils::GetFilename(const std::string& str)
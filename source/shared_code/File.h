@@ -24,9 +24,11 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 
 #include <stdio.h>
 #include <string>
+#include <vector>
 #include "GLApp/GLTypes.h"
 
-#define READ_BUFFSIZE 4096
+class GzStreamReader;
+class GzStreamWriter;
 
 class FileUtils {
 
@@ -41,14 +43,41 @@ public:
 	//static bool Copy(const std::string& src, const std::string& dst);
 	static std::string get_working_path();
 	static void CreateDir(const std::string& path);
+
+	// Parse the number at the start of [first,last[ like std::from_chars, also accepting a leading '+'.
+	// Locale independent. Returns the end of the number, or NULL if there is none.
+	static const char *ParseNumber(const char *first, const char *last, double &value);
+	static const char *ParseNumber(const char *first, const char *last, int &value);
+	static const char *ParseNumber(const char *first, const char *last, size_t &value);
+};
+
+// Read-only memory map of a whole file, for loaders that parse the bytes directly (binary formats, multithreaded parsing)
+class MappedFile {
+
+public:
+	MappedFile(const std::string& fileName); //Throws Error
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const char *Data() const { return data; }
+	size_t Size() const { return size; }
+
+private:
+	const char *data = NULL;
+	size_t size = 0;
+#ifdef _WIN32
+	void *fileHandle = NULL;
+	void *mappingHandle = NULL;
+#endif
 };
 
 class FileReader {
 
 public:
   // Constructor/Destructor
-	FileReader(std::string fileName) :FileReader(fileName.c_str()){};
-	FileReader(const char *fileName);
+	FileReader(std::string fileName, bool compressed = false) :FileReader(fileName.c_str(), compressed){};
+	FileReader(const char *fileName, bool compressed = false); //compressed: decompressed on a background thread while parsing
 	~FileReader();
 
   char *GetName();
@@ -61,6 +90,7 @@ public:
   size_t ReadSizeT();
   int ReadInt();
   double ReadDouble();
+  void ReadDoubles(double *values, size_t count); //count numbers in a row, e.g. a texture line
   void ReadKeyword(const char *keyword);
   char *ReadWord();
   void JumpSection(const char *end);
@@ -76,16 +106,19 @@ public:
   void JumpControlChars();
 private:
 
-  void RefillBuffer();
   char ReadChar();
+  void NextChunk();
+  template <typename T> bool ParseNumber(T& value); //In-place parsing of the current word, false if it isn't a plain number
   
   
-  FILE *file;
+  MappedFile *mappedFile; //The whole file is mapped, words and numbers are parsed in place
+  GzStreamReader *gzReader; //Or, for compressed files, the text arrives in chunks
+  std::vector<char> chunk;
+  const char *data;
+  size_t size;
+  size_t pos; //Offset of the character after CurrentChar
   int curLine;
   char fileName[2048];
-  char readBuffer[READ_BUFFSIZE];
-  int  nbLeft;
-  int  buffPos;
   int  isEof;
   char CurrentChar;
 };
@@ -94,9 +127,10 @@ class FileWriter {
 
 public:
   // Constructor/Destructor
-  FileWriter(std::string fileName) :FileWriter(fileName.c_str()) {};
-  FileWriter(const char *fileName);
-  ~FileWriter();
+  FileWriter(std::string fileName, bool compressed = false) :FileWriter(fileName.c_str(), compressed) {};
+  FileWriter(const char *fileName, bool compressed = false); //compressed: compressed on a background thread while writing
+  ~FileWriter(); //Without Close(), a compressed file is discarded
+  void Close(); //Throws Error if the file couldn't be completed
 
   char *GetName();
 
@@ -110,7 +144,11 @@ public:
 
 private:
 
+  void Put(const char *s);
+
   FILE *file;
+  GzStreamWriter *gzWriter;
+  std::vector<char> buffer; //Text not yet handed to the compressor
   char fileName[2048];
   
 };
@@ -308,13 +308,36 @@ void FormulaEditor::Refresh() {
 	}
 	RebuildList();
 	ReEvaluate();
+#ifdef MOLFLOW
+	mApp->RefreshPlotterCombos(); //Formulas that can be plotted against time
+#endif
 }
 
 void FormulaEditor::ReEvaluate() {
-	
-	//       NEW CODE
-	
 
+#ifdef MOLFLOW
+	//All formulas in one pass, variables resolved once per expression and shared between formulas
+	mApp->formulaEvaluator.EvaluateAll(mApp->formulas_n);
+	for (size_t i = 0; i < mApp->formulas_n.size(); i++) {
+		const FormulaEvaluator::FormulaValue& result = mApp->formulaEvaluator.formulaValues[i];
+		if (!result.invalidVariable.empty()) {
+			std::stringstream tmp;
+			tmp << "Invalid variable " << result.invalidVariable;
+			formulaList->SetValueAt(2, i, tmp.str().c_str());
+		}
+		else {
+			if (result.ok) {
+				std::stringstream tmp;
+				tmp << result.value;
+				formulaList->SetValueAt(2, i, tmp.str().c_str());
+			}
+			else { //Variables OK but the formula itself can't be evaluated
+				formulaList->SetValueAt(2, i, mApp->formulas_n[i]->GetErrorMsg());
+			}
+			formulaList->SetColumnColor(2, mApp->worker.displayedMoment == 0 ? COLOR_BLACK : COLOR_BLUE);
+		}
+	}
+#else
 	for (size_t i = 0; i < mApp->formulas_n.size(); i++) {
 
 		// Evaluate variables
@@ -351,4 +374,5 @@ void FormulaEditor::ReEvaluate() {
 			   //formulas[i].value->SetText("Invalid variable name"); //We set it directly at the error location
 		}
 	}
+#endif
 }
\ No newline at end of file
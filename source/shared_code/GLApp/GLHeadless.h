@@ -0,0 +1,18 @@
+// Copyright (c) 2011 rubicon IT GmbH
+#ifndef _GLHEADLESSH_
+#define _GLHEADLESSH_
+
+// Headless core (molflowCLI, MOLFLOW_CLI defined): the worker, geometry and facet classes keep their
+// OpenGL handle members, but no SDL or OpenGL header is included and no GL call is compiled.
+// Handles stay 0 as no context ever exists.
+
+typedef unsigned int   GLenum;
+typedef unsigned char  GLboolean;
+typedef unsigned char  GLubyte;
+typedef int            GLint;
+typedef int            GLsizei;
+typedef unsigned int   GLuint;
+typedef float          GLfloat;
+typedef double         GLdouble;
+
+#endif /* _GLHEADLESSH_ */
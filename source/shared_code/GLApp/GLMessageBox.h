@@ -2,9 +2,12 @@
 #ifndef _GLMESSAGEBOXH_
 #define _GLMESSAGEBOXH_
 
+#include <vector>
+#include <string>
+#ifndef MOLFLOW_CLI
 //#include <SDL_opengl.h>
 #include "GLWindow.h"
-#include <vector>
+#endif
 
 // Buttons
 #define GLDLG_OK          0x0001
@@ -17,6 +20,19 @@
 #define GLDLG_ICONINFO    3
 #define GLDGL_ICONDEAD    4
 
+#ifdef MOLFLOW_CLI //Headless core: messages go to the console, see molflow_cli/MolflowHeadless.cpp
+
+class GLMessageBox {
+
+public:
+  // Print the message and return the first button's code
+  static int Display(const char *message, const char *title=NULL,int mode=GLDLG_OK,int icon=GLDLG_ICONNONE);
+  static int Display(const std::string & message, const std::string & title, const std::vector<std::string>& buttonList, int icon);
+
+};
+
+#else
+
 class GLMessageBox : private GLWindow {
 
 public:
@@ -33,4 +49,5 @@ private:
 
 };
 
+#endif //MOLFLOW_CLI
 #endif /* _GLMESSAGEBOXH_ */
@@ -6,6 +6,8 @@
 #include <errno.h>
 #include "GLParser.h"
 #include <cstring> //strcpy, etc.
+#include <algorithm> //std::fill, std::copy
+#include <limits>
 #include "MathTools.h"
 #ifdef MOLFLOW
 #include "MolFlow.h"
@@ -71,6 +73,8 @@ GLParser::GLParser() {
  strcpy(expr,"");
  strcpy(name,"");
  hasVariableEvalError = false;
+ stackSize=0;
+ programId=0;
 
 }
 
@@ -621,14 +625,79 @@ bool GLParser::Parse()
   if(current != (int)strlen(expr)) 
     SetError("Syntax error",current);
 
+  program.clear();
+  varSlots.clear();
+  stackSize=0;
+  programId=0;
+
   if(error) {
     safe_free_tree(&evalTree);
     safe_free_list(&varList);
+  } else {
+    // Compile to a flat program with variables resolved to slots, Evaluate() doesn't walk the tree
+    static size_t lastProgramId = 0;
+    for(VLIST *p=varList;p;p=p->next) varSlots.push_back(p);
+    size_t depth=0;
+    Compile(evalTree,&depth);
+    programId=++lastProgramId;
   }
 
   return !error;
 }
 
+// Flatten the evaluation tree into the postfix program, folding constant operations that cannot fail
+void GLParser::Compile(ETREE *t,size_t *depth) {
+
+  if(t->left)  Compile(t->left,depth);
+  if(t->right) Compile(t->right,depth);
+
+  PINSTR in;
+  in.type=t->type;
+  in.slot=0;
+  in.value=0.0;
+
+  switch( t->type ) {
+   case TDOUBLE:
+        in.value=t->info.value;
+        (*depth)++;
+        break;
+   case TVARIABLE:
+        for(size_t i=0;i<varSlots.size();i++)
+          if(varSlots[i]==t->info.variable) in.slot=(int)i;
+        (*depth)++;
+        break;
+   case OPER_MINUS1:
+        if(program.back().type==TDOUBLE) {
+          program.back().value=-program.back().value;
+          return;
+        }
+        break;
+   case OPER_PLUS:
+   case OPER_MINUS:
+   case OPER_MUL:
+        (*depth)--;
+        if(program.size()>=2 && program[program.size()-1].type==TDOUBLE && program[program.size()-2].type==TDOUBLE) {
+          double b=program.back().value;
+          program.pop_back();
+          double &a=program.back().value;
+          if(t->type==OPER_PLUS) a=a+b;
+          else if(t->type==OPER_MINUS) a=a-b;
+          else a=a*b;
+          return;
+        }
+        break;
+   case OPER_DIV:
+   case OPER_PUIS:
+   case OPER_CI95:
+   case OPER_POW:
+        (*depth)--;
+        break;
+  }
+
+  program.push_back(in);
+  if(*depth>stackSize) stackSize=*depth;
+}
+
 double fact(double x) {
 
   int f = (int)(x+0.5);
@@ -640,184 +709,37 @@ double fact(double x) {
 
 }
 
-double GLParser::EvalTree(ETREE *t) {
-
-  double a,b,r;
-  r=0.0;
-
-  if(!error) 
-  switch( t->type ) {
-   case OPER_PLUS : 
-        a=EvalTree(t->left);
-        b=EvalTree(t->right);
-        r=a+b;
-        break;
-   case OPER_MINUS: 
-        a=EvalTree(t->left);
-        b=EvalTree(t->right);
-        r=a-b;
-        break;
-   case OPER_MUL:   
-        a=EvalTree(t->left);
-        b=EvalTree(t->right);
-        r=a*b;
-        break;
-   case OPER_DIV:   
-        a=EvalTree(t->left);
-        b=EvalTree(t->right);
-        if(b==0.0) {
-          error=true;
-          sprintf(errMsg,"Divide by 0");
-        } else {
-          r=a/b;
-        }
-        break;
-   case OPER_PUIS: 
-       a=EvalTree(t->left);
-       b=EvalTree(t->right);
-       r=pow(a,b);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_COS:  
-       a=EvalTree(t->left);
-       r=cos(a);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_CI95:  
-        a=EvalTree(t->left);
-        b=EvalTree(t->right);
-        r=1.96*sqrt(a*(1.0-a)/b);
-        break;
-   case OPER_POW:  
-        a=EvalTree(t->left);
-        b=EvalTree(t->right);
-        r=pow(a,b);
-        break;
-   case OPER_FACT:  a=EvalTree(t->left);
-       r=fact(a);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_ACOS:  a=EvalTree(t->left);
-       r=acos(a);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_SIN:  a=EvalTree(t->left);
-       r=sin(a);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_ASIN:  a=EvalTree(t->left);
-       r=asin(a);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_COSH:  a=EvalTree(t->left);
-       r=cosh(a);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_SINH:  a=EvalTree(t->left);
-       r=sinh(a);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_EXP:   a=EvalTree(t->left);
-       r=exp(a);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_LN:   a=EvalTree(t->left);
-       r=log(a);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_LOG10:   a=EvalTree(t->left);
-       r=log10(a);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_LOG2:   a=EvalTree(t->left);
-       r=log(a)/log(2.0);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_INV:  a=EvalTree(t->left);
-       if(a==0.0) {
-         error=true;
-         sprintf(errMsg,"Divide by 0");
-       } else {
-         r=1/a;
-       }
-       break;
-   case OPER_SQRT: a=EvalTree(t->left);
-       r=sqrt(a);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_TAN:  a=EvalTree(t->left);
-       r=tan(a);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_ATAN:  a=EvalTree(t->left);
-       r=atan(a);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_TANH:  a=EvalTree(t->left);
-       r=tanh(a);
-       if( errno!=0 ) {
-          error=true;
-          strcpy(errMsg,strerror(errno));
-       }
-       break;
-   case OPER_ABS:  a=EvalTree(t->left);
-       r=fabs(a);
-       break;
-   case OPER_MINUS1: a=EvalTree(t->left);
-       r=-a;
-       break;
-   case TDOUBLE:   r=(t->info.value);
-       break;
-   case TVARIABLE: r=(t->info.variable)->value;
-       break;
+// Value of a function node (not +,-,*,/ which are inlined by the evaluators)
+static double EvalFunction(int type,double a,double b) {
+
+  switch( type ) {
+   case OPER_PUIS:  return pow(a,b);
+   case OPER_POW:   return pow(a,b);
+   case OPER_CI95:  return 1.96*sqrt(a*(1.0-a)/b);
+   case OPER_COS:   return cos(a);
+   case OPER_SIN:   return sin(a);
+   case OPER_TAN:   return tan(a);
+   case OPER_ACOS:  return acos(a);
+   case OPER_ASIN:  return asin(a);
+   case OPER_ATAN:  return atan(a);
+   case OPER_COSH:  return cosh(a);
+   case OPER_SINH:  return sinh(a);
+   case OPER_TANH:  return tanh(a);
+   case OPER_EXP:   return exp(a);
+   case OPER_LN:    return log(a);
+   case OPER_LOG10: return log10(a);
+   case OPER_LOG2:  return log(a)/log(2.0);
+   case OPER_SQRT:  return sqrt(a);
+   case OPER_ABS:   return fabs(a);
+   case OPER_FACT:  return fact(a);
   }
+  return 0.0;
 
-  return r;
+}
+
+// Functions that report math library errors (errno) in Evaluate()
+static bool ChecksErrno(int type) {
+  return type!=OPER_CI95 && type!=OPER_POW && type!=OPER_ABS;
 }
 
 int GLParser::GetNbVariable() {
@@ -831,6 +753,7 @@ int GLParser::GetNbVariable() {
 }
 
 VLIST *GLParser::GetVariableAt(int idx) {
+  if(idx>=0 && idx<(int)varSlots.size()) return varSlots[idx];
   int nb = 0;
   VLIST *p = varList;
   while(nb<idx && p) {
@@ -860,20 +783,192 @@ int GLParser::GetCurrentPos() {
   return current;
 }
 
+size_t GLParser::GetProgramId() {
+  return programId;
+}
+
 bool GLParser::Evaluate(double *result)
 {
   error=false;
   errno=0;
 
-  /* Evaluate expression */
-  
-  if(evalTree)
-  {
-    *result=EvalTree(evalTree);
-  } else {
+  if(program.empty()) {
     //sprintf(errMsg,"Parsing failed"); //Already has an error message
     error=true;
+    return false;
   }
 
-  return !error;
-}
\ No newline at end of file
+  /* Run the program */
+
+  stack.resize(stackSize);
+  double *s = stack.data();
+  size_t sp = 0;
+
+  for(const PINSTR &in : program) {
+    switch( in.type ) {
+     case TDOUBLE:    s[sp++]=in.value; break;
+     case TVARIABLE:  s[sp++]=varSlots[in.slot]->value; break;
+     case OPER_PLUS:  sp--; s[sp-1]+=s[sp]; break;
+     case OPER_MINUS: sp--; s[sp-1]-=s[sp]; break;
+     case OPER_MUL:   sp--; s[sp-1]*=s[sp]; break;
+     case OPER_DIV:
+          sp--;
+          if(s[sp]==0.0) {
+            error=true;
+            sprintf(errMsg,"Divide by 0");
+          } else {
+            s[sp-1]/=s[sp];
+          }
+          break;
+     case OPER_MINUS1: s[sp-1]=-s[sp-1]; break;
+     case OPER_INV:
+          if(s[sp-1]==0.0) {
+            error=true;
+            sprintf(errMsg,"Divide by 0");
+          } else {
+            s[sp-1]=1/s[sp-1];
+          }
+          break;
+     case OPER_PUIS:
+     case OPER_POW:
+     case OPER_CI95:
+          sp--;
+          s[sp-1]=EvalFunction(in.type,s[sp-1],s[sp]);
+          break;
+     default:
+          s[sp-1]=EvalFunction(in.type,s[sp-1],0.0);
+          break;
+    }
+    if( !error && errno!=0 && ChecksErrno(in.type) ) {
+      error=true;
+      strcpy(errMsg,strerror(errno));
+    }
+    if(error) {
+      *result=0.0;
+      return false;
+    }
+  }
+
+  *result=s[0];
+  return true;
+}
+
+bool GLParser::EvaluateBatch(const double *const *variableValues,size_t nbPoints,double *results)
+{
+  if(program.empty()) return false;
+  if(nbPoints==0) return true;
+
+  // One row of nbPoints values per stack level, each instruction runs over a whole row
+  stack.resize(stackSize*nbPoints);
+  double *s = stack.data();
+  size_t sp = 0;
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+
+  for(const PINSTR &in : program) {
+    double *a = (in.type==TDOUBLE || in.type==TVARIABLE) ? s + sp*nbPoints : s + (sp-1)*nbPoints;
+    double *b = a + nbPoints;
+    switch( in.type ) {
+     case TDOUBLE:
+          std::fill(a,a+nbPoints,in.value);
+          sp++;
+          break;
+     case TVARIABLE:
+          if(variableValues[in.slot]) std::copy(variableValues[in.slot],variableValues[in.slot]+nbPoints,a);
+          else std::fill(a,a+nbPoints,varSlots[in.slot]->value);
+          sp++;
+          break;
+     case OPER_PLUS:
+     case OPER_MINUS:
+     case OPER_MUL:
+     case OPER_DIV:
+     case OPER_PUIS:
+     case OPER_POW:
+     case OPER_CI95:
+          sp--;
+          a -= nbPoints;
+          b -= nbPoints;
+          if(in.type==OPER_PLUS)       for(size_t i=0;i<nbPoints;i++) a[i]+=b[i];
+          else if(in.type==OPER_MINUS) for(size_t i=0;i<nbPoints;i++) a[i]-=b[i];
+          else if(in.type==OPER_MUL)   for(size_t i=0;i<nbPoints;i++) a[i]*=b[i];
+          else if(in.type==OPER_DIV)   for(size_t i=0;i<nbPoints;i++) a[i]=(b[i]==0.0) ? nan : a[i]/b[i];
+          else                         for(size_t i=0;i<nbPoints;i++) a[i]=EvalFunction(in.type,a[i],b[i]);
+          break;
+     case OPER_MINUS1:
+          for(size_t i=0;i<nbPoints;i++) a[i]=-a[i];
+          break;
+     case OPER_INV:
+          for(size_t i=0;i<nbPoints;i++) a[i]=(a[i]==0.0) ? nan : 1/a[i];
+          break;
+     default:
+          for(size_t i=0;i<nbPoints;i++) a[i]=EvalFunction(in.type,a[i],0.0);
+          break;
+    }
+  }
+
+  std::copy(s,s+nbPoints,results);
+  return true;
+}
+
+// Shifts the 1-based indices (facet numbers) following any of the prefixes in an expression
+// Offset mode (newRefs==NULL): indices above filter+1 are increased by offset, index filter+1 becomes 0
+// Renumber mode: index i becomes newRefs[i-1]+1, or 0 if newRefs[i-1]==-1 (removed)
+// Returns true if the expression changed
+bool GLParser::OffsetIndices(char *expression,const std::vector<std::string>& prefixes,int offset,int filter,std::vector<int> *newRefs) {
+	bool changed = false;
+
+	std::string newExpr = expression; //convert char* to string
+
+	size_t pos = 0; //analyzed until this position
+	while (pos < newExpr.size()) { //while not end of expression
+
+		std::vector<size_t> location; //for each prefix, we store where it was found
+
+		for (size_t j = 0; j < prefixes.size(); j++) { //try all expressions
+			location.push_back(newExpr.find(prefixes[j], pos));
+		}
+		size_t minPos = std::string::npos;
+		size_t maxLength = 0;
+		for (size_t j = 0; j < prefixes.size(); j++)  //try all expressions, find first prefix location
+			if (location[j] < minPos) minPos = location[j];
+		for (size_t j = 0; j < prefixes.size(); j++)  //try all expressions, find longest prefix at location
+			if (location[j] == minPos && prefixes[j].size() > maxLength) maxLength = prefixes[j].size();
+		int digitsLength = 0;
+		if (minPos != std::string::npos) { //found expression, let's find tailing facet number digits
+			while ((minPos + maxLength + digitsLength) < newExpr.length() && newExpr[minPos + maxLength + digitsLength] >= '0' && newExpr[minPos + maxLength + digitsLength] <= '9')
+				digitsLength++;
+			if (digitsLength > 0) { //there was a digit after the prefix
+				int facetNumber;
+				if (sscanf(newExpr.substr(minPos + maxLength, digitsLength).c_str(), "%d", &facetNumber)) {
+					if (newRefs == NULL) { //Offset mode
+						if ((facetNumber - 1) > filter) {
+							char tmp[10];
+							sprintf(tmp, "%d", facetNumber + offset);
+							newExpr.replace(minPos + maxLength, digitsLength, tmp);
+							changed = true;
+						}
+						else if ((facetNumber - 1) == filter) {
+							newExpr.replace(minPos + maxLength, digitsLength, "0");
+							changed = true;
+						}
+					}
+					else { //newRefs mode
+						if ((facetNumber - 1) >= (*newRefs).size() || (*newRefs)[facetNumber - 1] == -1) { //Facet doesn't exist anymore
+							newExpr.replace(minPos + maxLength, digitsLength, "0");
+							changed = true;
+						}
+						else { //Update facet number
+							char tmp[12];
+							sprintf(tmp, "%d", (*newRefs)[facetNumber - 1]+1);
+							newExpr.replace(minPos + maxLength, digitsLength, tmp);
+							changed = true;
+						}
+					}
+				}
+			}
+		}
+		if (minPos != std::string::npos) pos = minPos + maxLength + digitsLength;
+		else pos = minPos;
+	}
+	strcpy(expression, newExpr.c_str());
+	return changed;
+}
@@ -42,6 +42,7 @@
 
 #include "GLTypes.h" // For bool typedef
 #include <string>
+#include <vector>
 
 // Evaluation tree node type
 #define OPER_PLUS   1
@@ -94,6 +95,13 @@ typedef struct _ETREE {
   struct _ETREE *right;
 } ETREE;
 
+//Compiled program instruction: the evaluation tree flattened to postfix order, run on a value stack
+typedef struct {
+  int    type;  // Node type (OPER_xxx, TDOUBLE or TVARIABLE)
+  int    slot;  // TVARIABLE: variable index (see GetVariableAt)
+  double value; // TDOUBLE: constant value
+} PINSTR;
+
 class GLParser {
 
 public:
@@ -121,12 +129,19 @@ public:
 
   // Evaluation
   bool   Evaluate(double *result); // Evaluate the expression
+  // Evaluate the expression for nbPoints sets of variable values at once. variableValues[i] points to nbPoints values
+  // of the variable at index i, or is NULL to use its current value for every point.
+  // Points where the evaluation fails (divide by 0, domain error) are set to NaN
+  bool   EvaluateBatch(const double *const *variableValues,size_t nbPoints,double *results);
+  size_t GetProgramId();           // Unique id of the last successful Parse(), 0 if none
+  // Shift or renumber the indices following the variable prefixes (facet numbers), see Interface::OffsetFormula()
+  static bool OffsetIndices(char *expression,const std::vector<std::string>& prefixes,int offset,int filter,std::vector<int> *newRefs);
   bool   hasVariableEvalError;
   std::string variableEvalErrorMsg;
 
 private:
 
-  double EvalTree(ETREE *t);
+  void   Compile(ETREE *t,size_t *depth);
   void   ReadExpression(ETREE **node,VLIST **var_list);
   void   ReadTerm(ETREE **node,VLIST **var_list);
   void   ReadPower(ETREE **node,VLIST **var_list);
@@ -150,6 +165,12 @@ private:
   VLIST *varList;
   ETREE *evalTree;
 
+  std::vector<PINSTR> program;     // Compiled evaluation tree
+  std::vector<VLIST*> varSlots;    // Variables by index
+  std::vector<double> stack;       // Evaluation stack (stackSize values, or stackSize*nbPoints in batch mode)
+  size_t stackSize;                // Stack depth the program needs
+  size_t programId;
+
 };
 
 #endif /* _GLPARSERH_ */
\ No newline at end of file
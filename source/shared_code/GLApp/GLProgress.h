@@ -2,9 +2,34 @@
 #ifndef _GLPROGESSH_
 #define _GLPROGESSH_
 
+#include <string>
+
+#ifdef MOLFLOW_CLI //Headless core: console progress, see molflow_cli/MolflowHeadless.cpp
+#include "GLHeadless.h"
+
+class GLProgress {
+
+public:
+
+  GLProgress(const char *message,const char *title);
+
+  // Update progress (0 to 1)
+  void SetProgress(double value);
+  double GetProgress();
+  void SetMessage(const char *msg);
+  void SetMessage(std::string msg);
+  void SetVisible(bool visible) {}
+
+private:
+
+  int        progress;
+
+};
+
+#else
+
 //#include <SDL_opengl.h>
 #include "GLWindow.h"
-#include <string>
 
 class GLLabel;
 
@@ -33,4 +58,5 @@ private:
 
 };
 
+#endif //MOLFLOW_CLI
 #endif /* _GLPROGESSH_ */
@@ -2,6 +2,11 @@
 #ifndef _GLTOOLKITH_
 #define _GLTOOLKITH_
 
+#ifdef MOLFLOW_CLI //Headless core: GL handle types only, no toolkit
+#include "GLHeadless.h"
+#include "GLTypes.h"
+#else
+
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_opengl.h>
 #include <string>
@@ -103,4 +108,5 @@ public:
   static std::string GetOSName();
 };
 
+#endif //MOLFLOW_CLI
 #endif /* _GLTOOLKITH_ */
@@ -52,8 +52,13 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #define SDL_MOUSEBUTTONDBLCLICK SDL_USEREVENT + 0
 
 // Macros
+#ifdef MOLFLOW_CLI //Headless core: no GL context, handles are never allocated
+#define DELETE_LIST(l) l=0;
+#define DELETE_TEX(t)  t=0;
+#else
 #define DELETE_LIST(l) if(l) { glDeleteLists(l,1);l=0; }
 #define DELETE_TEX(t)  if(t) { glDeleteTextures(1,&t);t=0; }
+#endif
 #define SAFE_DELETE(x) if(x) { delete x;x=NULL; }
 #define SAFE_FREE(x) if(x) { free(x);x=NULL; }
 #define SAFE_CLEAR(vect) if(vect) {vect.clear();}
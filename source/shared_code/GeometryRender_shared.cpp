@@ -49,15 +49,6 @@ extern MolFlow *mApp;
 extern SynRad*mApp;
 #endif
 
-void Geometry::SelectFacet(size_t facetId) {
-	if (!isLoaded) return;
-	Facet *f = facets[facetId];
-	f->selected = (viewStruct == -1) || (viewStruct == f->sh.superIdx) || (f->sh.superIdx == -1);
-	if (!f->selected) f->UnselectElem();
-	nbSelectedHist = 0;
-	AddToSelectionHist(facetId);
-}
-
 void Geometry::SelectArea(int x1, int y1, int x2, int y2, bool clear, bool unselect, bool vertexBound, bool circularSelection) {
 
 	// Select a set of facet according to a 2D bounding rectangle
@@ -294,14 +285,6 @@ void Geometry::Select(int x, int y, bool clear, bool unselect, bool vertexBound,
 
 }
 
-void Geometry::SelectVertex(int vertexId) {
-	//isVertexSelected[vertexId] = (viewStruct==-1) || (viewStruct==f->wp.superIdx);
-	//here we should look through facets if vertex is member of any
-	//if( !f->selected ) f->UnselectElem();
-	if (!isLoaded) return;
-	vertices3[vertexId].selected = true;
-}
-
 void Geometry::SelectVertex(int x1, int y1, int x2, int y2, bool shiftDown, bool ctrlDown, bool circularSelection, bool facetBound) {
 
 	// Select a set of vertices according to a 2D bounding rectangle
@@ -440,84 +423,6 @@ void Geometry::SelectVertex(int x, int y, bool shiftDown, bool ctrlDown, bool fa
 	if (mApp->vertexCoordinates) mApp->vertexCoordinates->Update();
 }
 
-void Geometry::AddToSelectionHist(size_t f) {
-
-	if (nbSelectedHist < SEL_HISTORY) {
-		selectHist[nbSelectedHist] = f;
-		nbSelectedHist++;
-	}
-
-}
-
-bool Geometry::AlreadySelected(size_t f) {
-
-	// Check if the facet has already been selected
-	bool found = false;
-	size_t i = 0;
-	while (!found && i < nbSelectedHist) {
-		found = (selectHist[i] == f);
-		if (!found) i++;
-	}
-	return found;
-
-}
-
-void Geometry::SelectAll() {
-	for (int i = 0; i < sh.nbFacet; i++)
-		SelectFacet(i);
-	UpdateSelection();
-}
-
-void Geometry::EmptySelectedVertexList() {
-	selectedVertexList_ordered.clear();
-}
-
-void Geometry::RemoveFromSelectedVertexList(size_t vertexId) {
-	selectedVertexList_ordered.erase(std::remove(selectedVertexList_ordered.begin(), selectedVertexList_ordered.end(), vertexId), selectedVertexList_ordered.end());
-}
-
-void Geometry::AddToSelectedVertexList(size_t vertexId) {
-	selectedVertexList_ordered.push_back(vertexId);
-}
-
-void Geometry::SelectAllVertex() {
-	for (int i = 0; i < sh.nbVertex; i++)
-		SelectVertex(i);
-	//UpdateSelectionVertex();
-}
-
-size_t Geometry::GetNbSelectedVertex() {
-	size_t nbSelectedVertex = 0;
-	for (int i = 0; i < sh.nbVertex; i++) {
-		if (vertices3[i].selected) nbSelectedVertex++;
-	}
-	return nbSelectedVertex;
-}
-
-void Geometry::UnselectAll() {
-	for (int i = 0; i < sh.nbFacet; i++) {
-		facets[i]->selected = false;
-		facets[i]->UnselectElem();
-	}
-	UpdateSelection();
-}
-
-void Geometry::UnselectAllVertex() {
-	for (int i = 0; i < sh.nbVertex; i++) {
-		vertices3[i].selected = false;
-		//facets[i]->UnselectElem(); //what is this?
-	}
-	//UpdateSelectionVertex();
-}
-
-std::vector<size_t> Geometry::GetSelectedVertices()
-{
-	std::vector<size_t> sel;
-	for (size_t i = 0; i < sh.nbVertex; i++)
-		if (vertices3[i].selected) sel.push_back(i);
-	return sel;
-}
-
 void Geometry::DrawFacet(Facet *f, bool offset, bool showHidden, bool selOffset) {
 
 	// Render a facet (wireframe)
@@ -1127,17 +1032,6 @@ void Geometry::DeleteGLLists(bool deletePoly, bool deleteLine) {
 	DELETE_LIST(selectList3);
 }
 
-std::vector<bool> Geometry::GetVertexBelongsToSelectedFacet() {
-	std::vector<bool> result(sh.nbVertex, false);
-	std::vector<size_t> selFacetIds = GetSelectedFacets();
-	for (auto& facetId : selFacetIds) {
-		Facet* f = facets[facetId];
-		for (size_t i = 0; i < f->sh.nbIndex; i++)
-			result[f->indices[i]] = true;
-	}
-	return result;
-}
-
 void Geometry::BuildShapeList() {
 
 	// Shapes used for direction field rendering
@@ -1452,6 +1346,7 @@ int Geometry::RestoreDeviceObjects() {
 void Geometry::BuildFacetList(Facet *f) {
 
 	// Rebuild OpenGL geometry with texture
+	if (mApp->headless) return; //No GL context
 
 	if (f->sh.isTextured) {
 
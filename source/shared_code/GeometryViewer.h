@@ -20,7 +20,9 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #ifndef _GEOMETRYVIEWERH_
 #define _GEOMETRYVIEWERH_
 
+#ifndef MOLFLOW_CLI
 #include "GLApp/GLComponent.h"
+#endif
 #include "GLApp/GLTypes.h"
 #include "Vector.h"
 #include <vector>
@@ -105,6 +107,7 @@ typedef struct {
 	int x, y, w, h; //Screenshotarea
 } ScreenshotStatus;
 
+#ifndef MOLFLOW_CLI //Views and selections above are also kept by the headless core
 class GeometryViewer : public GLComponent {
 
 public:
@@ -281,5 +284,6 @@ private:
   //Debug
   //GLLabel* debugLabel;
 };
+#endif //MOLFLOW_CLI
 
 #endif /* _GEOMETRYVIEWERH_ */
@@ -26,11 +26,13 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "GLApp/MathTools.h"
 #include "GLApp/GLMessageBox.h"
 #include "GLApp/GLToolkit.h"
+#ifndef MOLFLOW_CLI
 #include "SplitFacet.h"
 #include "BuildIntersection.h"
 #include "MirrorFacet.h"
 #include "MirrorVertex.h"
 #include "GLApp/GLList.h"
+#endif
 
 #include "Clipper/clipper.hpp"
 
@@ -46,6 +48,10 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "ASELoader.h"
 //#include <algorithm>
 #include <list>
+#include <array>
+#include <unordered_map>
+#include <string_view>
+#include <thread>
 
 #ifdef MOLFLOW
 extern MolFlow *mApp;
@@ -191,7 +197,7 @@ void Geometry::InitializeGeometry(int facet_number) {
 	}
 
 	isLoaded = true;
-	if (facet_number == -1) {
+	if (facet_number == -1 && !mApp->headless) {
 		BuildGLList();
 		mApp->UpdateModelParams();
 		mApp->UpdateFacetParams();
@@ -270,31 +276,61 @@ void Geometry::CorrectNonSimple(int *nonSimpleList, int nbNonSimple) {
 
 size_t Geometry::AnalyzeNeighbors(Worker *work, GLProgress *prg)
 {
-	size_t i = 0;
+	// Two facets are neighbors if one has an edge a->b and the other the opposite edge b->a (same rule as GetCommonEdges)
+	// Directed edges are hashed once, then each edge looks up its reverse: O(total edges) instead of all facet pairs
 	work->abortRequested = false;
-	for (i = 0; i < sh.nbFacet; i++) {
+	for (size_t i = 0; i < sh.nbFacet; i++) {
 		facets[i]->neighbors.clear();
 	}
+
+	struct EdgeHash {
+		size_t operator()(const std::pair<size_t, size_t>& e) const {
+			return (size_t)((uint64_t)e.first * 0x9E3779B97F4A7C15ULL ^ (uint64_t)e.second * 0xC2B2AE3D27D4EB4FULL);
+		}
+	};
+	std::unordered_multimap<std::pair<size_t, size_t>, size_t, EdgeHash> edgeFacets; //Directed edge -> facet
+	size_t nbEdges = 0;
+	for (size_t i = 0; i < sh.nbFacet; i++) nbEdges += facets[i]->sh.nbIndex;
+	edgeFacets.reserve(nbEdges);
+	for (size_t i = 0; i < sh.nbFacet; i++) {
+		Facet *f = facets[i];
+		for (size_t j = 0; j < f->sh.nbIndex; j++)
+			edgeFacets.emplace(std::make_pair(f->GetIndex(j), f->GetIndex(j + 1)), i);
+	}
+
+	std::vector<std::pair<size_t, size_t>> pairs; //(i,j) with i<j
+	size_t i;
 	for (i = 0; !work->abortRequested && i < sh.nbFacet; i++) {
-		mApp->DoEvents(); //Cathch possible cancel press
-		Facet *f1 = facets[i];
-		prg->SetProgress(double(i) / double(sh.nbFacet));
-		for (size_t j = i + 1; j < sh.nbFacet; j++) {
-			Facet *f2 = facets[j];
-			size_t c1, c2, l;
-			if (GetCommonEdges(facets[i], facets[j], &c1, &c2, &l)) {
-				double dotProduct = Dot(f1->sh.N, f2->sh.N);
-				Saturate(dotProduct, -1.0, 1.0); //Rounding errors...
-				double angleDiff = fabs(acos(dotProduct));
-				NeighborFacet n1, n2;
-				n1.id = i;
-				n2.id = j;
-				n1.angleDiff = n2.angleDiff = angleDiff;
-				f1->neighbors.push_back(n2);
-				f2->neighbors.push_back(n1);
+		if (i % 4096 == 0) {
+			mApp->DoEvents(); //Catch possible cancel press
+			prg->SetProgress(double(i) / double(sh.nbFacet));
+		}
+		Facet *f = facets[i];
+		for (size_t j = 0; j < f->sh.nbIndex; j++) {
+			auto range = edgeFacets.equal_range(std::make_pair(f->GetIndex(j + 1), f->GetIndex(j)));
+			for (auto it = range.first; it != range.second; ++it) {
+				if (it->second > i) pairs.emplace_back(i, it->second);
 			}
 		}
 	}
+	if (work->abortRequested) return i;
+
+	//Sorted pairs give each facet its neighbors in ascending order, as the former pairwise loop did
+	std::sort(pairs.begin(), pairs.end());
+	pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end()); //Several common edges: one neighbor entry
+	for (auto& pair : pairs) {
+		Facet *f1 = facets[pair.first];
+		Facet *f2 = facets[pair.second];
+		double dotProduct = Dot(f1->sh.N, f2->sh.N);
+		Saturate(dotProduct, -1.0, 1.0); //Rounding errors...
+		double angleDiff = fabs(acos(dotProduct));
+		NeighborFacet n1, n2;
+		n1.id = pair.first;
+		n2.id = pair.second;
+		n1.angleDiff = n2.angleDiff = angleDiff;
+		f1->neighbors.push_back(n2);
+		f2->neighbors.push_back(n1);
+	}
 	return i;
 }
 
@@ -363,8 +399,10 @@ void Geometry::AddFacet(const std::vector<size_t>& vertexIds) {
 	mApp->changedSinceSave = true;
 	InitializeGeometry(); //Need to recalc facet hit offsets
 	UpdateSelection();
+#ifndef MOLFLOW_CLI
 	mApp->facetList->SetSelectedRow((int)sh.nbFacet - 1);
 	mApp->facetList->ScrollToVisible(sh.nbFacet - 1, 1, false);
+#endif
 }
 
 void Geometry::CreatePolyFromVertices_Convex() {
@@ -477,8 +515,10 @@ void Geometry::CreateDifference() {
 	InitializeGeometry();
 	mApp->UpdateFacetParams(true);
 	UpdateSelection();
+#ifndef MOLFLOW_CLI
 	mApp->facetList->SetSelectedRow((int)sh.nbFacet - 1);
 	mApp->facetList->ScrollToVisible(sh.nbFacet - 1, 1, false);
+#endif
 }
 
 void Geometry::ClipSelectedPolygons(ClipperLib::ClipType type, int reverseOrder) {
@@ -714,6 +754,7 @@ void Geometry::RegisterVertex(Facet *f, const Vector2d &vert, size_t id1, const
 	}
 }
 
+#ifndef MOLFLOW_CLI //Screen-space selection, needs the GL viewport
 void Geometry::SelectCoplanar(int width, int height, double tolerance) {
 
 	auto selectedVertices = GetSelectedVertices();
@@ -761,6 +802,7 @@ void Geometry::SelectCoplanar(int width, int height, double tolerance) {
 		}
 	}
 }
+#endif
 
 InterfaceVertex* Geometry::GetVertex(size_t idx) {
 	return &(vertices3[idx]);
@@ -874,79 +916,130 @@ Vector3d Geometry::GetCenter() {
 	//}
 }
 
-int Geometry::AddRefVertex(const InterfaceVertex& p, InterfaceVertex *refs, int *nbRef, double vT) {
-
-	bool found = false;
-	int i = 0;
-	//Vector3d n;
-	double v2 = vT*vT;
-
-	while (i < *nbRef && !found) {
-		//Sub(&n,p,refs + i);
-		double dx = std::abs(p.x - (refs + i)->x);
-		if (dx < vT) {
-			double dy = std::abs(p.y - (refs + i)->y);
-			if (dy < vT) {
-				double dz = std::abs(p.z - (refs + i)->z);
-				if (dz < vT) {
-					found = (dx*dx + dy*dy + dz*dz < v2);
+/**
+* \brief Uniform grid over the kept (reference) vertices of CollapseVertex, cell size slightly above the tolerance
+* Any reference closer than the tolerance is then in the same or in one of the 26 neighboring cells.
+* Cells live in an open addressing hash table, each holds a chain of its references (linked through 'next').
+* Cell coordinates count from the lower corner of the bounding box. A tiny tolerance enlarges the cells to at least
+* 1/2^40 of the box, keeping the coordinates far from the int64 range (larger cells only cost speed)
+*/
+class VertexWeldGrid {
+public:
+	VertexWeldGrid(const std::vector<InterfaceVertex>& vertices, double vT) {
+		origin = vertices.empty() ? Vector3d(0.0, 0.0, 0.0) : (Vector3d)vertices[0];
+		Vector3d upper = origin;
+		for (const InterfaceVertex& v : vertices) {
+			origin.x = std::min(origin.x, v.x); upper.x = std::max(upper.x, v.x);
+			origin.y = std::min(origin.y, v.y); upper.y = std::max(upper.y, v.y);
+			origin.z = std::min(origin.z, v.z); upper.z = std::max(upper.z, v.z);
+		}
+		double extent = std::max({ upper.x - origin.x, upper.y - origin.y, upper.z - origin.z });
+		cellSize = std::max({ vT * 1.001, extent / 1099511627776.0, std::numeric_limits<double>::min() }); //1.001: margin against rounding of the cell coordinates
+		size_t tableSize = 16;
+		while (tableSize < 2 * vertices.size()) tableSize <<= 1;
+		cells.resize(tableSize);
+		next.reserve(vertices.size());
+	}
+
+	/**
+	* \brief Same rule as the former linear scan: the lowest-index reference within vT, or a new reference
+	* \return index of the reference vertex p is merged into
+	*/
+	int AddRefVertex(const InterfaceVertex& p, std::vector<InterfaceVertex>& refs, double vT) {
+		int64_t cx = (int64_t)std::floor((p.x - origin.x) / cellSize);
+		int64_t cy = (int64_t)std::floor((p.y - origin.y) / cellSize);
+		int64_t cz = (int64_t)std::floor((p.z - origin.z) / cellSize);
+		double v2 = vT*vT;
+		int found = -1;
+		for (int64_t i = -1; i <= 1; i++) {
+			for (int64_t j = -1; j <= 1; j++) {
+				for (int64_t k = -1; k <= 1; k++) {
+					const Cell& cell = cells[FindSlot(cx + i, cy + j, cz + k)];
+					for (int r = cell.head; r >= 0; r = next[r]) { //Chain in descending index order
+						if (found >= 0 && r > found) continue;
+						double dx = std::abs(p.x - refs[r].x);
+						if (dx < vT) {
+							double dy = std::abs(p.y - refs[r].y);
+							if (dy < vT) {
+								double dz = std::abs(p.z - refs[r].z);
+								if (dz < vT && dx*dx + dy*dy + dz*dz < v2) found = r;
+							}
+						}
+					}
 				}
 			}
 		}
-		if (!found) i++;
-	}
+		if (found >= 0) return found;
 
-	if (!found) {
 		// Add a new reference vertex
-		refs[*nbRef] = p;
-		*nbRef = *nbRef + 1;
-	}
+		int newRef = (int)refs.size();
+		refs.push_back(p);
+		Cell& cell = cells[FindSlot(cx, cy, cz)];
+		if (!cell.used) { //New cell
+			cell.used = true;
+			cell.x = cx; cell.y = cy; cell.z = cz;
+		}
+		next.push_back(cell.head);
+		cell.head = newRef;
+		return newRef;
+	}
+
+private:
+	struct Cell {
+		int64_t x = 0, y = 0, z = 0;
+		int head = -1; //Highest reference index in the cell, -1 if empty
+		bool used = false;
+	};
 
-	return i;
+	//Slot of the cell, or of the empty slot where it would be inserted
+	size_t FindSlot(int64_t x, int64_t y, int64_t z) const {
+		uint64_t h = (uint64_t)x * 0x9E3779B97F4A7C15ULL ^ (uint64_t)y * 0xC2B2AE3D27D4EB4FULL ^ (uint64_t)z * 0x165667B19E3779F9ULL;
+		h ^= h >> 29;
+		size_t mask = cells.size() - 1;
+		size_t slot = (size_t)h & mask;
+		while (cells[slot].used && !(cells[slot].x == x && cells[slot].y == y && cells[slot].z == z)) slot = (slot + 1) & mask;
+		return slot;
+	}
 
-}
+	Vector3d origin; //Lower corner of the vertices' bounding box
+	double cellSize;
+	std::vector<Cell> cells;
+	std::vector<int> next; //Next (lower) reference in the same cell, -1 at the end of the chain
+};
 
 void Geometry::CollapseVertex(Worker *work, GLProgress *prg, double totalWork, double vT) {
 	mApp->changedSinceSave = true;
 	if (!isLoaded) return;
 	// Collapse neighbor vertices
-	InterfaceVertex *refs = (InterfaceVertex *)malloc(sh.nbVertex * sizeof(InterfaceVertex));
-	if (!refs) throw Error("Out of memory: CollapseVertex");
-	int      *idx = (int *)malloc(sh.nbVertex * sizeof(int));
-	if (!idx) throw Error("Out of memory: CollapseVertex");
-	int       nbRef = 0;
+	std::vector<InterfaceVertex> refs;
+	std::vector<int> idx(sh.nbVertex);
+	VertexWeldGrid grid(vertices3, vT);
 
 	// Collapse
 	prg->SetMessage("Collapsing vertices...");
 	for (int i = 0; !work->abortRequested && i < sh.nbVertex; i++) {
-		mApp->DoEvents();  //Catch abort request
-		prg->SetProgress(((double)i / (double)sh.nbVertex) / totalWork);
-		idx[i] = AddRefVertex(vertices3[i], refs, &nbRef, vT);
+		if (i % 4096 == 0) {
+			mApp->DoEvents();  //Catch abort request
+			prg->SetProgress(((double)i / (double)sh.nbVertex) / totalWork);
+		}
+		idx[i] = grid.AddRefVertex(vertices3[i], refs, vT);
 	}
 
-	if (work->abortRequested) {
-		delete refs;
-		delete idx;
-		return;
-	}
+	if (work->abortRequested) return;
 
 	// Create the new vertex array
-	vertices3.resize(nbRef); vertices3.shrink_to_fit();
-
-	memcpy(vertices3.data(), refs, nbRef * sizeof(InterfaceVertex));
-	sh.nbVertex = nbRef;
+	refs.swap(vertices3);
+	vertices3.shrink_to_fit();
+	sh.nbVertex = vertices3.size();
 
 	// Update facets indices
 	for (int i = 0; i < sh.nbFacet; i++) {
 		Facet *f = facets[i];
-		prg->SetProgress(((double)i / (double)sh.nbFacet) * 0.05 + 0.45);
+		if (i % 4096 == 0) prg->SetProgress(((double)i / (double)sh.nbFacet) * 0.05 + 0.45);
 		for (int j = 0; j < f->sh.nbIndex; j++)
 			f->indices[j] = idx[f->indices[j]];
 	}
 
-	free(idx);
-	free(refs);
-
 }
 
 bool Geometry::GetCommonEdges(Facet *f1, Facet *f2, size_t * c1, size_t * c2, size_t * chainLength) {
@@ -1140,8 +1233,10 @@ void Geometry::Extrude(int mode, Vector3d radiusBase, Vector3d offsetORradiusdir
 	InitializeGeometry();
 	mApp->UpdateFacetParams(true);
 	UpdateSelection();
+#ifndef MOLFLOW_CLI
 	mApp->facetList->SetSelectedRow((int)sh.nbFacet - 1);
 	mApp->facetList->ScrollToVisible(sh.nbFacet - 1, 1, false);
+#endif
 }
 
 void Geometry::ShiftVertex() {
@@ -1301,10 +1396,12 @@ void Geometry::Clear() {
 	memset(strFileName, 0, MAX_SUPERSTR * sizeof(char *));
 	DeleteGLLists(true, true);
 
+#ifndef MOLFLOW_CLI
 	if (mApp && mApp->splitFacet) mApp->splitFacet->ClearUndoFacets();
 	if (mApp && mApp->buildIntersection) mApp->buildIntersection->ClearUndoFacets();
 	if (mApp && mApp->mirrorFacet) mApp->mirrorFacet->ClearUndoVertices();
 	if (mApp && mApp->mirrorVertex) mApp->mirrorVertex->ClearUndoVertices();
+#endif
 
 	// Init default
 	facets = NULL;         // Facets array
@@ -1963,6 +2060,112 @@ std::vector<size_t> Geometry::GetSelectedFacets() {
 	return selection;
 }
 
+void Geometry::SelectFacet(size_t facetId) {
+	if (!isLoaded) return;
+	Facet *f = facets[facetId];
+	f->selected = (viewStruct == -1) || (viewStruct == f->sh.superIdx) || (f->sh.superIdx == -1);
+	if (!f->selected) f->UnselectElem();
+	nbSelectedHist = 0;
+	AddToSelectionHist(facetId);
+}
+
+void Geometry::SelectVertex(int vertexId) {
+	//isVertexSelected[vertexId] = (viewStruct==-1) || (viewStruct==f->wp.superIdx);
+	//here we should look through facets if vertex is member of any
+	//if( !f->selected ) f->UnselectElem();
+	if (!isLoaded) return;
+	vertices3[vertexId].selected = true;
+}
+
+void Geometry::AddToSelectionHist(size_t f) {
+
+	if (nbSelectedHist < SEL_HISTORY) {
+		selectHist[nbSelectedHist] = f;
+		nbSelectedHist++;
+	}
+
+}
+
+bool Geometry::AlreadySelected(size_t f) {
+
+	// Check if the facet has already been selected
+	bool found = false;
+	size_t i = 0;
+	while (!found && i < nbSelectedHist) {
+		found = (selectHist[i] == f);
+		if (!found) i++;
+	}
+	return found;
+
+}
+
+void Geometry::SelectAll() {
+	for (int i = 0; i < sh.nbFacet; i++)
+		SelectFacet(i);
+	UpdateSelection();
+}
+
+void Geometry::EmptySelectedVertexList() {
+	selectedVertexList_ordered.clear();
+}
+
+void Geometry::RemoveFromSelectedVertexList(size_t vertexId) {
+	selectedVertexList_ordered.erase(std::remove(selectedVertexList_ordered.begin(), selectedVertexList_ordered.end(), vertexId), selectedVertexList_ordered.end());
+}
+
+void Geometry::AddToSelectedVertexList(size_t vertexId) {
+	selectedVertexList_ordered.push_back(vertexId);
+}
+
+void Geometry::SelectAllVertex() {
+	for (int i = 0; i < sh.nbVertex; i++)
+		SelectVertex(i);
+	//UpdateSelectionVertex();
+}
+
+size_t Geometry::GetNbSelectedVertex() {
+	size_t nbSelectedVertex = 0;
+	for (int i = 0; i < sh.nbVertex; i++) {
+		if (vertices3[i].selected) nbSelectedVertex++;
+	}
+	return nbSelectedVertex;
+}
+
+void Geometry::UnselectAll() {
+	for (int i = 0; i < sh.nbFacet; i++) {
+		facets[i]->selected = false;
+		facets[i]->UnselectElem();
+	}
+	UpdateSelection();
+}
+
+void Geometry::UnselectAllVertex() {
+	for (int i = 0; i < sh.nbVertex; i++) {
+		vertices3[i].selected = false;
+		//facets[i]->UnselectElem(); //what is this?
+	}
+	//UpdateSelectionVertex();
+}
+
+std::vector<size_t> Geometry::GetSelectedVertices()
+{
+	std::vector<size_t> sel;
+	for (size_t i = 0; i < sh.nbVertex; i++)
+		if (vertices3[i].selected) sel.push_back(i);
+	return sel;
+}
+
+std::vector<bool> Geometry::GetVertexBelongsToSelectedFacet() {
+	std::vector<bool> result(sh.nbVertex, false);
+	std::vector<size_t> selFacetIds = GetSelectedFacets();
+	for (auto& facetId : selFacetIds) {
+		Facet* f = facets[facetId];
+		for (size_t i = 0; i < f->sh.nbIndex; i++)
+			result[f->indices[i]] = true;
+	}
+	return result;
+}
+
 std::vector<size_t> Geometry::GetNonPlanarFacetIds(const double& tolerance) {
 	std::vector<size_t> nonPlanar;
 	for (size_t i = 0; i < sh.nbFacet; i++)
@@ -1984,7 +2187,9 @@ void Geometry::SetSelection(std::vector<size_t> selectedFacets, bool isShiftDown
 		if (sel < sh.nbFacet) facets[sel]->selected = !isCtrlDown;
 	}
 	UpdateSelection();
+#ifndef MOLFLOW_CLI
 	if (selectedFacets.size()) mApp->facetList->ScrollToVisible(selectedFacets.back(), 0, true); //in facet list, select the last facet of selection group
+#endif
 	mApp->UpdateFacetParams(true);
 }
 
@@ -2655,46 +2860,88 @@ void Geometry::Collapse(double vT, double fT, double lT, bool doSelectedOnly, Wo
 
 		// Collapse facets
 		prg->SetMessage("Collapsing facets...");
-		std::vector<int> newRef(sh.nbFacet);
+		// Facets are bucketed on their plane equation (cell size ~fT), so coplanar candidates are looked up
+		// in the 3^4 neighboring buckets instead of testing every later facet
+		struct PlaneKey {
+			int64_t a, b, c, d;
+			bool operator==(const PlaneKey& other) const { return a == other.a && b == other.b && c == other.c && d == other.d; }
+		};
+		struct PlaneKeyHash {
+			size_t operator()(const PlaneKey& k) const {
+				return (size_t)((uint64_t)k.a * 0x9E3779B97F4A7C15ULL ^ (uint64_t)k.b * 0xC2B2AE3D27D4EB4FULL ^ (uint64_t)k.c * 0x165667B19E3779F9ULL ^ (uint64_t)k.d * 0x27D4EB2F165667C5ULL);
+			}
+		};
+		double cellSize = fT * 1.001; //Margin against rounding of the cell coordinates
+		auto planeKey = [cellSize](Facet *f) {
+			return PlaneKey{ (int64_t)std::floor(f->a / cellSize), (int64_t)std::floor(f->b / cellSize), (int64_t)std::floor(f->c / cellSize), (int64_t)std::floor(f->d / cellSize) };
+		};
+		std::unordered_map<PlaneKey, std::vector<int>, PlaneKeyHash> planeBuckets;
 		for (int i = 0; i < sh.nbFacet; i++) {
-			newRef[i] = i; //Default: reference doesn't change
-		}
-		for (int i = 0; !work->abortRequested && i < sh.nbFacet; i++) {
-			prg->SetProgress((1.0 + ((double)i / (double)sh.nbFacet)) / totalWork);
-			mApp->DoEvents(); //To catch eventual abort button click
+			planeBuckets[planeKey(facets[i])].push_back(i);
+		}
+
+		// Merging keeps the plane of fi (MergeFacet copies it) and only replaces facets[i] or removes later facets,
+		// so work on the original indices and compact the facet array once at the end
+		size_t nbOriginal = sh.nbFacet;
+		std::vector<bool> removed(nbOriginal, false);
+		std::vector<bool> wasMerged(nbOriginal, false);
+		for (int i = 0; !work->abortRequested && i < nbOriginal; i++) {
+			if (i % 4096 == 0) {
+				prg->SetProgress((1.0 + ((double)i / (double)nbOriginal)) / totalWork);
+				mApp->DoEvents(); //To catch eventual abort button click
+			}
+			if (removed[i]) continue;
 			fi = facets[i];
-			// Search a coplanar facet
-			int j = i + 1;
-			while ((!doSelectedOnly || fi->selected) && j < sh.nbFacet) {
-				fj = facets[j];
+			if (doSelectedOnly && !fi->selected) continue;
+
+			// Coplanar later facets, in index order (the order the former linear search met them)
+			std::vector<int> candidates;
+			PlaneKey key = planeKey(fi);
+			for (int64_t da = -1; da <= 1; da++) for (int64_t db = -1; db <= 1; db++) for (int64_t dc = -1; dc <= 1; dc++) for (int64_t dd = -1; dd <= 1; dd++) {
+				auto bucket = planeBuckets.find({ key.a + da, key.b + db, key.c + dc, key.d + dd });
+				if (bucket == planeBuckets.end()) continue;
+				for (int j : bucket->second) {
+					if (j > i && !removed[j] && (!doSelectedOnly || facets[j]->selected) && fi->IsCoplanarAndEqual(facets[j], fT))
+						candidates.push_back(j);
+				}
+			}
+			std::sort(candidates.begin(), candidates.end());
+
+			size_t k = 0;
+			while ((!doSelectedOnly || fi->selected) && k < candidates.size()) {
+				int j = candidates[k];
 				merged = NULL;
-				if ((!doSelectedOnly || fj->selected) && fi->IsCoplanarAndEqual(fj, fT)) {
-					// Collapse
+				if (!removed[j]) {
+					fj = facets[j];
 					merged = MergeFacet(fi, fj);
-
 					if (merged) {
 						// Replace the old 2 facets by the new one
 						SAFE_DELETE(fi);
 						SAFE_DELETE(fj);
-						newRef[i] = newRef[j] = -1;
-						for (int k = j; k < sh.nbFacet - 1; k++) {
-							facets[k] = facets[k + 1];
-						}
-						for (int k = j + 1; k < newRef.size(); k++) {
-							newRef[k] --; //Renumber references
-						}
-						sh.nbFacet--;
+						facets[j] = NULL;
+						removed[j] = true;
+						wasMerged[i] = wasMerged[j] = true;
 						facets[i] = merged;
-						//InitializeGeometry(i);
-						//SetFacetTexture(i,facets[i]->tRatio,facets[i]->hasMesh);  //rebuild mesh
 						fi = facets[i];
-						j = i + 1;
-
+						k = 0; //Its new sides may touch candidates that didn't fit before
 					}
 				}
-				if (!merged) j++;
+				if (!merged) k++;
+			}
+		}
+
+		// Remove merged-away facets, renumber references
+		std::vector<int> newRef(nbOriginal);
+		size_t nbKept = 0;
+		for (size_t i = 0; i < nbOriginal; i++) {
+			if (removed[i]) {
+				newRef[i] = -1;
+				continue;
 			}
+			newRef[i] = wasMerged[i] ? -1 : (int)nbKept; //Merged facets leave selections, like removed ones
+			facets[nbKept++] = facets[i];
 		}
+		sh.nbFacet = nbKept;
 		mApp->RenumberSelections(newRef);
 		mApp->RenumberFormulas(&newRef);
 		RenumberNeighbors(newRef);
@@ -3481,69 +3728,298 @@ void Geometry::LoadSTR(FileReader *file, GLProgress *prg) {
 
 }
 
+// STL import
+// Binary files are read straight from a memory map, ASCII files are cut at "endfacet" boundaries and parsed
+// on all cores. Triangle corners with identical coordinates are welded into one vertex on the fly, so the
+// imported mesh is already connected (no vertex collapse needed to find neighbors).
+
+class STLMesh {
+public:
+	std::vector<Vector3d> vertices;
+	std::vector<std::array<size_t, 3>> triangles; //Vertex indices, in file order
+	size_t nbDegenerate = 0; //Triangles dropped because two of their corners are the same point
+};
+
+/**
+* \brief Runs body(begin,end) on consecutive slices of [0,nbItems[, one per hardware thread
+* \param minPerThread below this many items per thread, fewer threads are started
+*/
+template <typename Body>
+static void STLParallelFor(size_t nbItems, size_t minPerThread, Body body) {
+	size_t nbThreads = std::max((size_t)1, (size_t)std::thread::hardware_concurrency());
+	nbThreads = std::min(nbThreads, std::max((size_t)1, nbItems / std::max((size_t)1, minPerThread)));
+	if (nbThreads == 1) {
+		body(0, 0, nbItems);
+		return;
+	}
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < nbThreads; t++) {
+		threads.emplace_back(body, t, nbItems * t / nbThreads, nbItems * (t + 1) / nbThreads);
+	}
+	for (auto& thread : threads) thread.join();
+}
+
+/**
+* \brief Tokenizer over a memory range of an ASCII STL file
+*/
+class STLTokenizer {
+public:
+	STLTokenizer(const char* begin, const char* end, const char* fileStart) : pos(begin), end(end), fileStart(fileStart) {}
+
+	//Skips whitespace, returns false at the end of the range
+	bool SkipSpace() {
+		while (pos < end && (unsigned char)*pos <= ' ') pos++;
+		return pos < end;
+	}
+
+	std::string_view Word() {
+		SkipSpace();
+		const char* start = pos;
+		while (pos < end && (unsigned char)*pos > ' ') pos++;
+		return std::string_view(start, pos - start);
+	}
+
+	void Keyword(const char* keyword) {
+		std::string_view w = Word();
+		if (w != keyword) Fail(("'" + std::string(keyword) + "' expected, found '" + std::string(w) + "'").c_str());
+	}
+
+	double Number() {
+		SkipSpace();
+		double value;
+		const char* numberEnd = FileUtils::ParseNumber(pos, end, value);
+		if (!numberEnd || (numberEnd < end && (unsigned char)*numberEnd > ' ')) {
+			Fail(("number expected, found '" + std::string(Word()) + "'").c_str());
+		}
+		pos = numberEnd;
+		return value;
+	}
+
+	void SkipLine() {
+		while (pos < end && *pos != '\n') pos++;
+	}
+
+	[[noreturn]] void Fail(const char* msg) {
+		char tmp[64];
+		sprintf(tmp, " (at byte %zd)", (size_t)(pos - fileStart));
+		throw Error((std::string("STL file: ") + msg + tmp).c_str());
+	}
+
+	const char* pos;
+	const char* end;
+	const char* fileStart;
+};
+
+/**
+* \brief Parses the facets starting in [begin,chunkEnd[ of an ASCII STL file
+* \param corners receives 3 corners per triangle
+*/
+static void ParseSTLChunk(const char* begin, const char* chunkEnd, const char* fileStart, const char* fileEnd, double scaleFactor, std::vector<Vector3d>& corners) {
+	STLTokenizer tok(begin, fileEnd, fileStart); //A facet may run past chunkEnd only if the boundary search failed: read until it ends
+	while (tok.pos < chunkEnd && tok.SkipSpace()) {
+		std::string_view w = tok.Word();
+		if (w == "facet") {
+			tok.Keyword("normal");
+			tok.Number(); tok.Number(); tok.Number(); //Normal ignored, recalculated from the vertex order
+			tok.Keyword("outer");
+			tok.Keyword("loop");
+			for (int v = 0; v < 3; v++) {
+				tok.Keyword("vertex");
+				double x = tok.Number();
+				double y = tok.Number();
+				double z = tok.Number();
+				corners.emplace_back(x * scaleFactor, y * scaleFactor, z * scaleFactor);
+			}
+			tok.Keyword("endloop");
+			tok.Keyword("endfacet");
+		}
+		else if (w == "endsolid") {
+			tok.SkipLine(); //endsolid name
+			//Files concatenated from several solids: the next one starts with its own "solid name" line
+			STLTokenizer next = tok;
+			if (next.Word() == "solid") {
+				next.SkipLine();
+				tok.pos = next.pos;
+			}
+		}
+		else {
+			tok.Fail(("unexpected keyword '" + std::string(w) + "', 'facet' or 'endsolid' expected").c_str());
+		}
+	}
+}
+
+static void ReadSTLAscii(const char* data, size_t size, double scaleFactor, std::vector<Vector3d>& corners) {
+	const char* fileEnd = data + size;
+	const char* start = (const char*)memchr(data, '\n', size); //Skip "solid name"
+	start = start ? start + 1 : fileEnd;
+
+	//Cut the body in chunks ending right after an "endfacet", so that every chunk starts on a facet boundary
+	std::string_view text(data, size);
+	const size_t minChunkSize = 1 << 20; //Small files: not worth starting threads
+	std::vector<const char*> bounds = { start };
+	size_t nbChunks = std::min((size_t)std::max(1u, std::thread::hardware_concurrency()), std::max((size_t)1, (size_t)(fileEnd - start) / minChunkSize));
+	for (size_t k = 1; k < nbChunks; k++) {
+		size_t nominal = std::max((size_t)(bounds.back() - data), (size_t)(start - data) + (size_t)(fileEnd - start) * k / nbChunks);
+		size_t found = text.find("endfacet", nominal);
+		bounds.push_back(found == std::string_view::npos ? fileEnd : data + found + strlen("endfacet"));
+	}
+	bounds.push_back(fileEnd);
+
+	std::vector<std::vector<Vector3d>> chunkCorners(nbChunks);
+	std::vector<std::string> errors(nbChunks);
+	STLParallelFor(nbChunks, 1, [&](size_t, size_t first, size_t last) {
+		for (size_t k = first; k < last; k++) {
+			try {
+				chunkCorners[k].reserve((bounds[k + 1] - bounds[k]) / 80); //~250 bytes per facet
+				ParseSTLChunk(bounds[k], bounds[k + 1], data, fileEnd, scaleFactor, chunkCorners[k]);
+			}
+			catch (Error& e) {
+				errors[k] = e.GetMsg();
+			}
+			catch (std::bad_alloc&) {
+				errors[k] = "Out of memory: ReadSTL";
+			}
+		}
+	});
+	for (auto& error : errors) {
+		if (!error.empty()) throw Error(error.c_str()); //First error in file order
+	}
+
+	size_t nbCorners = 0;
+	for (auto& c : chunkCorners) nbCorners += c.size();
+	corners.reserve(nbCorners);
+	for (auto& c : chunkCorners) {
+		corners.insert(corners.end(), c.begin(), c.end());
+		std::vector<Vector3d>().swap(c);
+	}
+}
+
+static void ReadSTLBinary(const char* data, size_t size, double scaleFactor, std::vector<Vector3d>& corners) {
+	//80 byte header, uint32 triangle count, then 50 bytes per triangle: float32 normal[3], float32 vertex[3][3], uint16 attribute
+	uint32_t nbTriangles;
+	memcpy(&nbTriangles, data + 80, sizeof(uint32_t));
+	corners.resize(3 * (size_t)nbTriangles);
+	STLParallelFor(nbTriangles, 65536, [&](size_t, size_t first, size_t last) {
+		for (size_t i = first; i < last; i++) {
+			float coords[9];
+			memcpy(coords, data + 84 + 50 * i + 12, sizeof(coords));
+			for (size_t v = 0; v < 3; v++) {
+				corners[3 * i + v] = Vector3d((double)coords[3 * v] * scaleFactor, (double)coords[3 * v + 1] * scaleFactor, (double)coords[3 * v + 2] * scaleFactor);
+			}
+		}
+	});
+}
+
+/**
+* \brief Merges corners with bit-identical coordinates (open addressing hash table), builds the triangle list
+*/
+static void WeldSTLCorners(const std::vector<Vector3d>& corners, STLMesh& mesh) {
+	if (corners.size() >= (size_t)std::numeric_limits<uint32_t>::max()) throw Error("STL file: too many triangles");
+	size_t tableSize = 16;
+	while (tableSize < 2 * corners.size()) tableSize <<= 1;
+	const size_t mask = tableSize - 1;
+	const uint32_t empty = std::numeric_limits<uint32_t>::max();
+	std::vector<uint32_t> table(tableSize, empty); //Vertex index per slot
+	std::vector<uint32_t> cornerVertex(corners.size());
+	mesh.vertices.reserve(corners.size() / 5); //Closed triangle meshes: ~6 corners per vertex
+
+	for (size_t i = 0; i < corners.size(); i++) {
+		//+0.0 turns -0.0 into +0.0, so both hash the same (they already compare equal)
+		double coord[3] = { corners[i].x + 0.0, corners[i].y + 0.0, corners[i].z + 0.0 };
+		uint64_t bits[3];
+		memcpy(bits, coord, sizeof(bits));
+		uint64_t h = bits[0] * 0x9E3779B97F4A7C15ULL ^ bits[1] * 0xC2B2AE3D27D4EB4FULL ^ bits[2] * 0x165667B19E3779F9ULL;
+		h ^= h >> 31;
+		size_t slot = (size_t)h & mask;
+		while (table[slot] != empty) {
+			const Vector3d& v = mesh.vertices[table[slot]];
+			if (v.x == coord[0] && v.y == coord[1] && v.z == coord[2]) break;
+			slot = (slot + 1) & mask;
+		}
+		if (table[slot] == empty) {
+			table[slot] = (uint32_t)mesh.vertices.size();
+			mesh.vertices.emplace_back(coord[0], coord[1], coord[2]);
+		}
+		cornerVertex[i] = table[slot];
+	}
+
+	mesh.triangles.reserve(corners.size() / 3);
+	for (size_t i = 0; i + 2 < corners.size(); i += 3) {
+		std::array<size_t, 3> tri = { cornerVertex[i], cornerVertex[i + 1], cornerVertex[i + 2] };
+		if (tri[0] == tri[1] || tri[1] == tri[2] || tri[0] == tri[2]) mesh.nbDegenerate++;
+		else mesh.triangles.push_back(tri);
+	}
+}
+
+/**
+* \brief Reads an ASCII or binary STL file into a welded triangle mesh
+* \param prg progress window for status messages, can be NULL
+*/
+static STLMesh ReadSTL(const std::string& fileName, double scaleFactor, GLProgress* prg) {
+	MappedFile file(fileName);
+	const char* data = file.Data();
+	size_t size = file.Size();
+
+	//Binary files may also start with "solid" (some exporters write it in the header): trust the size check first
+	size_t nbBinaryTriangles = 0;
+	if (size >= 84) {
+		uint32_t n;
+		memcpy(&n, data + 80, sizeof(uint32_t));
+		nbBinaryTriangles = n;
+	}
+	bool exactBinarySize = size >= 84 && 84 + 50 * nbBinaryTriangles == size;
+	bool asciiHeader = size >= 5 && strncmp(data, "solid", 5) == 0;
+
+	std::vector<Vector3d> corners;
+	try {
+		if (exactBinarySize || (!asciiHeader && size >= 84 + 50 * nbBinaryTriangles)) {
+			if (prg) prg->SetMessage("Reading binary STL file...");
+			ReadSTLBinary(data, size, scaleFactor, corners);
+		}
+		else if (asciiHeader) {
+			if (prg) prg->SetMessage("Reading ASCII STL file...");
+			ReadSTLAscii(data, size, scaleFactor, corners);
+		}
+		else throw Error("Not a valid STL file (neither ASCII 'solid' header nor consistent binary triangle count)");
+	}
+	catch (std::bad_alloc&) {
+		throw Error("Out of memory: ReadSTL");
+	}
+
+	if (prg) prg->SetMessage("Merging identical vertices...");
+	STLMesh mesh;
+	WeldSTLCorners(corners, mesh);
+	if (mesh.nbDegenerate > 0) {
+		char tmp[256];
+		sprintf(tmp, "%zd degenerate triangle(s) skipped !\nThese triangles have two identical corners, thus they do nothing.", mesh.nbDegenerate);
+		GLMessageBox::Display(tmp, "STL import", GLDLG_OK, GLDLG_ICONINFO);
+	}
+	return mesh;
+}
+
 void Geometry::LoadSTL(FileReader *file, GLProgress *prg, double scaleFactor) {
 	//mApp->ClearAllSelections();
 	//mApp->ClearAllViews();
-	char *w;
 
 	prg->SetMessage("Clearing current geometry...");
 	Clear();
 
-	// First pass
-	prg->SetMessage("Counting facets in STL file...");
-	//file->ReadKeyword("solid");
-	file->ReadLine(); // solid name
-	w = file->ReadWord();
-	while (strcmp(w, "facet") == 0) {
-		sh.nbFacet++;
-		file->JumpSection("endfacet");
-		w = file->ReadWord();
-	}
-	if (strcmp(w, "endsolid") != 0) throw Error("Unexpected or not supported STL keyword, 'endsolid' required\nMaybe the STL file was saved in binary instead of ASCII format?");
+	STLMesh mesh = ReadSTL(file->GetName(), scaleFactor, prg);
 
 	// Allocate mem
-	sh.nbVertex = 3 * sh.nbFacet;
+	sh.nbFacet = mesh.triangles.size();
+	sh.nbVertex = mesh.vertices.size();
 	facets = (Facet **)malloc(sh.nbFacet * sizeof(Facet *));
 	if (!facets) throw Error("Out of memory: LoadSTL");
 	memset(facets, 0, sh.nbFacet * sizeof(Facet *));
 
 	std::vector<InterfaceVertex>(sh.nbVertex).swap(vertices3);
+	for (size_t i = 0; i < sh.nbVertex; i++) vertices3[i].SetLocation(mesh.vertices[i]);
 
-	// Second pass
-	prg->SetMessage("Reading facets...");
-	file->SeekStart();
-	//file->ReadKeyword("solid");
-	file->ReadLine();
-	for (int i = 0; i < sh.nbFacet; i++) {
-
-		double p = (double)i / (double)(sh.nbFacet);
-		prg->SetProgress(p);
-
-		file->ReadKeyword("facet");
-		file->ReadKeyword("normal");
-		file->ReadDouble();
-		file->ReadDouble();
-		file->ReadDouble();
-		file->ReadKeyword("outer");
-		file->ReadKeyword("loop");
-
-		file->ReadKeyword("vertex");
-		vertices3[3 * i + 0].x = file->ReadDouble()*scaleFactor;
-		vertices3[3 * i + 0].y = file->ReadDouble()*scaleFactor;
-		vertices3[3 * i + 0].z = file->ReadDouble()*scaleFactor;
-
-		file->ReadKeyword("vertex");
-		vertices3[3 * i + 1].x = file->ReadDouble()*scaleFactor;
-		vertices3[3 * i + 1].y = file->ReadDouble()*scaleFactor;
-		vertices3[3 * i + 1].z = file->ReadDouble()*scaleFactor;
-
-		file->ReadKeyword("vertex");
-		vertices3[3 * i + 2].x = file->ReadDouble()*scaleFactor;
-		vertices3[3 * i + 2].y = file->ReadDouble()*scaleFactor;
-		vertices3[3 * i + 2].z = file->ReadDouble()*scaleFactor;
+	prg->SetMessage("Creating facets...");
+	for (size_t i = 0; i < sh.nbFacet; i++) {
 
-		file->ReadKeyword("endloop");
-		file->ReadKeyword("endfacet");
+		if (i % 65536 == 0) prg->SetProgress((double)i / (double)(sh.nbFacet));
 
 		try {
 			facets[i] = new Facet(3);
@@ -3551,9 +4027,9 @@ void Geometry::LoadSTL(FileReader *file, GLProgress *prg, double scaleFactor) {
 		catch (...) {
 			throw Error("Out of memory");
 		}
-		facets[i]->indices[0] = 3 * i + 0;
-		facets[i]->indices[1] = 3 * i + 2;
-		facets[i]->indices[2] = 3 * i + 1;
+		facets[i]->indices[0] = mesh.triangles[i][0];
+		facets[i]->indices[1] = mesh.triangles[i][2];
+		facets[i]->indices[2] = mesh.triangles[i][1];
 
 	}
 
@@ -4028,72 +4504,25 @@ void Geometry::InsertGEOGeom(FileReader *file, size_t strIdx, bool newStruct) {
 void Geometry::InsertSTLGeom(FileReader *file, size_t strIdx, double scaleFactor, bool newStruct) {
 
 	UnselectAll();
-	char *w;
 
-	int nbNewFacets = 0;
-	// First pass
-	file->ReadKeyword("solid");
-	file->ReadLine(); // solid name
-	w = file->ReadWord();
-	while (strcmp(w, "facet") == 0) {
-		nbNewFacets++;
-		file->JumpSection("endfacet");
-		w = file->ReadWord();
-	}
-	if (strcmp(w, "endsolid") != 0) throw Error("Unexpected or not supported STL keyword, 'endsolid' required");
+	STLMesh mesh = ReadSTL(file->GetName(), scaleFactor, NULL);
 
 	// Allocate memory
-	int nbNewVertex = 3 * nbNewFacets;
+	size_t nbNewFacets = mesh.triangles.size();
+	size_t nbNewVertex = mesh.vertices.size();
 	facets = (Facet **)realloc(facets, (nbNewFacets + sh.nbFacet) * sizeof(Facet **));
+	if (!facets) throw Error("Out of memory: InsertSTLGeom");
 	memset(facets + sh.nbFacet, 0, nbNewFacets * sizeof(Facet *));
-	
-	/*
-	//vertices3 = (Vector3d*)realloc(vertices3,(nbNewVertex+wp.nbVertex) * sizeof(Vector3d));
-	InterfaceVertex *tmp_vertices3 = (InterfaceVertex *)malloc((nbNewVertex + wp.nbVertex) * sizeof(InterfaceVertex));
-	memmove(tmp_vertices3, vertices3, (wp.nbVertex) * sizeof(InterfaceVertex));
-	memset(tmp_vertices3 + wp.nbVertex, 0, nbNewVertex * sizeof(InterfaceVertex));
-	SAFE_FREEvertices3;
-	vertices3 = tmp_vertices3;
-	*/
-	vertices3.resize(nbNewVertex + sh.nbVertex);
-
-	// Second pass
-	file->SeekStart();
-	file->ReadKeyword("solid");
-	file->ReadLine();
-	for (int i = 0; i < nbNewFacets; i++) {
-
-		file->ReadKeyword("facet");
-		file->ReadKeyword("normal");
-		file->ReadDouble(); //ignoring normal vector, will be calculated from triangle orientation
-		file->ReadDouble();
-		file->ReadDouble();
-		file->ReadKeyword("outer");
-		file->ReadKeyword("loop");
-
-		file->ReadKeyword("vertex");
-		vertices3[sh.nbVertex + 3 * i + 0].x = file->ReadDouble()*scaleFactor;
-		vertices3[sh.nbVertex + 3 * i + 0].y = file->ReadDouble()*scaleFactor;
-		vertices3[sh.nbVertex + 3 * i + 0].z = file->ReadDouble()*scaleFactor;
-
-		file->ReadKeyword("vertex");
-		vertices3[sh.nbVertex + 3 * i + 1].x = file->ReadDouble()*scaleFactor;
-		vertices3[sh.nbVertex + 3 * i + 1].y = file->ReadDouble()*scaleFactor;
-		vertices3[sh.nbVertex + 3 * i + 1].z = file->ReadDouble()*scaleFactor;
 
-		file->ReadKeyword("vertex");
-		vertices3[sh.nbVertex + 3 * i + 2].x = file->ReadDouble()*scaleFactor;
-		vertices3[sh.nbVertex + 3 * i + 2].y = file->ReadDouble()*scaleFactor;
-		vertices3[sh.nbVertex + 3 * i + 2].z = file->ReadDouble()*scaleFactor;
-
-		file->ReadKeyword("endloop");
-		file->ReadKeyword("endfacet");
+	vertices3.resize(nbNewVertex + sh.nbVertex);
+	for (size_t i = 0; i < nbNewVertex; i++) vertices3[sh.nbVertex + i].SetLocation(mesh.vertices[i]);
 
+	for (size_t i = 0; i < nbNewFacets; i++) {
 		*(facets + i + sh.nbFacet) = new Facet(3);
 		facets[i + sh.nbFacet]->selected = true;
-		facets[i + sh.nbFacet]->indices[0] = sh.nbVertex + 3 * i + 0;
-		facets[i + sh.nbFacet]->indices[1] = sh.nbVertex + 3 * i + 1;
-		facets[i + sh.nbFacet]->indices[2] = sh.nbVertex + 3 * i + 2;
+		facets[i + sh.nbFacet]->indices[0] = sh.nbVertex + mesh.triangles[i][0];
+		facets[i + sh.nbFacet]->indices[1] = sh.nbVertex + mesh.triangles[i][1];
+		facets[i + sh.nbFacet]->indices[2] = sh.nbVertex + mesh.triangles[i][2];
 
 		if (newStruct) {
 			facets[i + sh.nbFacet]->sh.superIdx = static_cast<int>(sh.nbSuper);
@@ -144,7 +144,6 @@ public:
 	Vector3d GetCenter();
 
 	// Collapsing stuff
-	int  AddRefVertex(const InterfaceVertex& p, InterfaceVertex *refs, int *nbRef, double vT);
 	bool RemoveNullFacet();
 	Facet *MergeFacet(Facet *f1, Facet *f2);
 	bool GetCommonEdges(Facet *f1, Facet *f2, size_t * c1, size_t * c2, size_t * chainLength);
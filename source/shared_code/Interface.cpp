@@ -125,6 +125,7 @@ Interface::Interface() {
 	autoSaveSimuOnly = false;
 	autosaveFilename = "";
 	autoFrameMove = true;
+	headless = false;
 
 	lastSaveTime = 0.0f;
 	lastSaveTimeSimu = 0.0f;
@@ -1988,6 +1989,7 @@ void Interface::ClearSelectionMenus() {
 }
 
 void Interface::RebuildSelectionMenus() {
+	if (headless) return; //No menus in batch mode, selections are still kept for saving
 	ClearSelectionMenus();
 	size_t i;
 	for (i = 0; i < selections.size(); i++) {
@@ -2057,6 +2059,7 @@ void Interface::ClearViewMenus() {
 }
 
 void Interface::RebuildViewMenus() {
+	if (headless) return; //No menus in batch mode, views are still kept for saving
 	ClearViewMenus();
 	std::vector<int> fKeys = { SDLK_F1,SDLK_F2,SDLK_F3,SDLK_F5,SDLK_F6,SDLK_F7,SDLK_F8,SDLK_F9,SDLK_F10,SDLK_F11,SDLK_F12 }; //Skip ALT+F4 shortcut :)
 	for (int i = 0; i < nbView; i++) {
@@ -2400,63 +2403,7 @@ bool Interface::OffsetFormula(char* expression, int offset, int filter, std::vec
 	//will increase or decrease facet numbers in a formula
 	//only applies to facet numbers larger than "filter" parameter
 	//If *newRefs is not NULL, a vector is passed containing the new references
-	bool changed = false;
-
-	string newExpr = expression; //convert char* to string
-
-	size_t pos = 0; //analyzed until this position
-	while (pos < newExpr.size()) { //while not end of expression
-
-		vector<size_t> location; //for each prefix, we store where it was found
-
-		for (size_t j = 0; j < formulaPrefixes.size(); j++) { //try all expressions
-			location.push_back(newExpr.find(formulaPrefixes[j], pos));
-		}
-		size_t minPos = string::npos;
-		size_t maxLength = 0;
-		for (size_t j = 0; j < formulaPrefixes.size(); j++)  //try all expressions, find first prefix location
-			if (location[j] < minPos) minPos = location[j];
-		for (size_t j = 0; j < formulaPrefixes.size(); j++)  //try all expressions, find longest prefix at location
-			if (location[j] == minPos && formulaPrefixes[j].size() > maxLength) maxLength = formulaPrefixes[j].size();
-		int digitsLength = 0;
-		if (minPos != string::npos) { //found expression, let's find tailing facet number digits
-			while ((minPos + maxLength + digitsLength) < newExpr.length() && newExpr[minPos + maxLength + digitsLength] >= '0' && newExpr[minPos + maxLength + digitsLength] <= '9')
-				digitsLength++;
-			if (digitsLength > 0) { //there was a digit after the prefix
-				int facetNumber;
-				if (sscanf(newExpr.substr(minPos + maxLength, digitsLength).c_str(), "%d", &facetNumber)) {
-					if (newRefs == NULL) { //Offset mode
-						if ((facetNumber - 1) > filter) {
-							char tmp[10];
-							sprintf(tmp, "%d", facetNumber + offset);
-							newExpr.replace(minPos + maxLength, digitsLength, tmp);
-							changed = true;
-						}
-						else if ((facetNumber - 1) == filter) {
-							newExpr.replace(minPos + maxLength, digitsLength, "0");
-							changed = true;
-						}
-					}
-					else { //newRefs mode
-						if ((facetNumber - 1) >= (*newRefs).size() || (*newRefs)[facetNumber - 1] == -1) { //Facet doesn't exist anymore
-							newExpr.replace(minPos + maxLength, digitsLength, "0");
-							changed = true;
-						}
-						else { //Update facet number
-							char tmp[12];
-							sprintf(tmp, "%d", (*newRefs)[facetNumber - 1]+1);
-							newExpr.replace(minPos + maxLength, digitsLength, tmp);
-							changed = true;
-						}
-					}
-				}
-			}
-		}
-		if (minPos != string::npos) pos = minPos + maxLength + digitsLength;
-		else pos = minPos;
-	}
-	strcpy(expression, newExpr.c_str());
-	return changed;
+	return GLParser::OffsetIndices(expression, formulaPrefixes, offset, filter, newRefs);
 }
 
 int Interface::Resize(size_t width, size_t height, bool forceWindowed) {
@@ -2685,6 +2632,7 @@ void Interface::ExportTextures(int grouping, int mode) {
 
 void Interface::DoEvents(bool forced)
 {
+	if (headless) return; //No window to poll nor repaint
 	static int lastChkEvent = 0;
 	static int lastRepaint = 0;
 	int time = SDL_GetTicks();
@@ -2731,6 +2679,16 @@ int Interface::FrameMove()
 	Geometry *geom = worker.GetGeometry();
 
 	//Autosave routines
+#ifdef MOLFLOW
+	std::string backgroundSaveError;
+	if (worker.FinishBackgroundSave(backgroundSaveError)) {
+		if (backgroundSaveError.empty()) {
+			if (autosaveFilename != "" && autosaveFilename != pendingAutosaveFilename) remove(autosaveFilename.c_str());
+			autosaveFilename = pendingAutosaveFilename;
+		}
+		else GLMessageBox::Display(backgroundSaveError + "\n" + pendingAutosaveFilename, "Autosave error", { "OK" }, GLDLG_ICONERROR);
+	}
+#endif
 	bool timeForAutoSave = false;
 	if (geom->IsLoaded()) {
 		if (autoSaveSimuOnly) {
@@ -2918,6 +2876,31 @@ bool Interface::AutoSave(bool crashSave) {
 #endif
 	char fn[1024];
 	strcpy(fn, newAutosaveFilename.c_str());
+#ifdef MOLFLOW
+	if (!crashSave) { //Serialize and compress on a background thread, the simulation continues. FrameMove() collects the result
+		if (worker.IsBackgroundSaveRunning()) { //Previous one still writing: skip this turn
+			progressDlg2->SetVisible(false);
+			SAFE_DELETE(progressDlg2);
+			return true;
+		}
+		try {
+			worker.SaveGeometryInBackground(fn, progressDlg2);
+			pendingAutosaveFilename = newAutosaveFilename;
+			ResetAutoSaveTimer();
+		}
+		catch (Error &e) {
+			GLMessageBox::Display(std::string(e.GetMsg()) + "\n" + fn, "Autosave error", { "OK" }, GLDLG_ICONERROR);
+			progressDlg2->SetVisible(false);
+			SAFE_DELETE(progressDlg2);
+			ResetAutoSaveTimer();
+			return false;
+		}
+		progressDlg2->SetVisible(false);
+		SAFE_DELETE(progressDlg2);
+		wereEvents = true;
+		return true;
+	}
+#endif
 	try {
 		worker.SaveGeometry(fn, progressDlg2, false, false, true, crashSave);
 		//Success:
@@ -274,6 +274,7 @@ public:
 	float    lastSaveTime;
 	float    lastSaveTimeSimu;
 	std::string autosaveFilename; //only delete files that this instance saved
+	std::string pendingAutosaveFilename; //being written by a background save
 	bool     autoFrameMove; //Refresh scene every 1 second
 	bool     updateRequested; //Force frame move
 	
@@ -480,6 +481,7 @@ public:
 	bool needsMesh;    //At least one viewer displays mesh
 	bool needsTexture; //At least one viewer displays textures
 	bool needsDirection; //At least one viewer displays direction vectors
+	bool headless; //No window nor OpenGL context (molflowCLI batch mode): skip menus, GL lists and dialogs
 	void CheckNeedsTexture();
 	void DoEvents(bool forced = false); //Used to catch button presses (check if an abort button was pressed during an operation)
 
@@ -29,144 +29,269 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "Simulation.h"
 #include "Worker.h"
 #include <tuple>
+#include <thread>
+#include <limits>
 
 // AABB tree stuff
 
-// Minimum number of facet inside a BB
-#define MINBB    1
-#define MAXDEPTH 50
+#define MAXDEPTH 50 // Nodes at this depth become leaves, whatever their facet count
+#define SAH_NB_BINS 16 // Candidate cutting planes on each axis: borders of this many equal bins over the facet centers
+#define SAH_TRAVERSAL_COST 1.0 // Cost of visiting a node (ray-box tests)...
+#define SAH_INTERSECTION_COST 2.0 // ...relative to testing a facet (3x3 system solving and polygon check)
+#define PARALLEL_BUILD_MIN_FACETS 4096 // Smaller subtrees are built on the calling thread
 
-std::tuple<size_t,size_t,size_t> AABBNODE::FindBestCuttingPlane() {
+static double Component(const Vector3d& v, const size_t& axis) {
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
 
-	// AABB tree balancing
+static AxisAlignedBoundingBox EmptyBB() {
+	AxisAlignedBoundingBox bb;
+	bb.min = Vector3d(1e100, 1e100, 1e100);
+	bb.max = Vector3d(-1e100, -1e100, -1e100);
+	return bb;
+}
 
-	double centerX = (bb.min.x + bb.max.x) / 2.0;
-	double centerY = (bb.min.y + bb.max.y) / 2.0;
-	double centerZ = (bb.min.z + bb.max.z) / 2.0;
-	size_t rightFromCenterX = 0;
-	size_t rightFromCenterY = 0;
-	size_t rightFromCenterZ = 0;
-	size_t planeType; //1: YZ, 2: XZ, 3: XY
-	double best = 1e100;
-	size_t nbLeft, nbRight;
+static void Enlarge(AxisAlignedBoundingBox& bb, const Vector3d& minCorner, const Vector3d& maxCorner) {
+	bb.min.x = std::min(minCorner.x, bb.min.x);
+	bb.min.y = std::min(minCorner.y, bb.min.y);
+	bb.min.z = std::min(minCorner.z, bb.min.z);
+	bb.max.x = std::max(maxCorner.x, bb.max.x);
+	bb.max.y = std::max(maxCorner.y, bb.max.y);
+	bb.max.z = std::max(maxCorner.z, bb.max.z);
+}
 
-	for (const auto& f : facets) {
-		if (f->facetRef->sh.center.x > centerX) rightFromCenterZ++;
-		if (f->facetRef->sh.center.y > centerY) rightFromCenterY++;
-		if (f->facetRef->sh.center.z > centerZ) rightFromCenterX++;
-	}
+static double SurfaceArea(const AxisAlignedBoundingBox& bb) {
+	Vector3d d = bb.max - bb.min;
+	if (d.x < 0.0 || d.y < 0.0 || d.z < 0.0) return 0.0; //Empty
+	return 2.0 * (d.x*d.y + d.y*d.z + d.z*d.x);
+}
 
-	double deviationFromHalfHalf_X = fabs((double)rightFromCenterZ - (double)(facets.size()) / 2.0);
-	if (deviationFromHalfHalf_X < best) {
-		best = deviationFromHalfHalf_X;
-		nbLeft = facets.size() - rightFromCenterZ;
-		nbRight = rightFromCenterZ;
-		planeType = 1;
-	}
-	double deviationFromHalfHalf_Y = fabs((double)rightFromCenterY - (double)(facets.size()) / 2.0);
-	if (deviationFromHalfHalf_Y < best) {
-		best = deviationFromHalfHalf_Y;
-		nbLeft = facets.size() - rightFromCenterY;
-		nbRight = rightFromCenterY;
-		planeType = 2;
-	}
-	double deviationFromHalfHalf_Z = fabs((double)rightFromCenterX - (double)(facets.size()) / 2.0);
-	if (deviationFromHalfHalf_Z < best) {
-		best = deviationFromHalfHalf_Z;
-		nbLeft = facets.size() - rightFromCenterX;
-		nbRight = rightFromCenterX;
-		planeType = 3;
-	}
+void AABBNODE::ComputeBB() {
 
-	return { planeType,nbLeft,nbRight };
+	bb = EmptyBB();
+	for (const auto& f : facets) {
+		Enlarge(bb, f->facetRef->sh.bb.min, f->facetRef->sh.bb.max);
+	}
 
 }
 
-void AABBNODE::ComputeBB() {
+/**
+* \brief Recursive binned SAH (surface area heuristic) build on a range of facet pointers, partitioned in place
+* \param facets first facet of the range, reordered so that the left subtree's facets come first
+* \param nbFacets number of facets in the range
+* \param maxLeafSize ranges of at most this many facets become leaves
+* \param depth depth of the node to build
+* \param parallelLevels on how many more levels the right subtree can be built on a new thread
+* \return the new node (never NULL)
+*/
+static AABBNODE *BuildAABBSubtree(SubprocessFacet** facets, const size_t nbFacets, const size_t maxLeafSize, const size_t depth, const size_t parallelLevels) {
 
-	bb.max=Vector3d(-1e100,-1e100,-1e100);
-	bb.min=Vector3d(1e100,1e100,1e100);
+	AABBNODE *newNode = new AABBNODE();
+	newNode->bb = EmptyBB();
+	AxisAlignedBoundingBox centerBB = EmptyBB();
+	for (size_t i = 0; i < nbFacets; i++) {
+		Enlarge(newNode->bb, facets[i]->facetRef->sh.bb.min, facets[i]->facetRef->sh.bb.max);
+		Enlarge(centerBB, facets[i]->facetRef->sh.center, facets[i]->facetRef->sh.center);
+	}
 
-	for (const auto& f : facets) {
-		bb.min.x = std::min(f->facetRef->sh.bb.min.x,bb.min.x);
-		bb.min.y = std::min(f->facetRef->sh.bb.min.y, bb.min.y);
-		bb.min.z = std::min(f->facetRef->sh.bb.min.z, bb.min.z);
-		bb.max.x = std::max(f->facetRef->sh.bb.max.x, bb.max.x);
-		bb.max.y = std::max(f->facetRef->sh.bb.max.y, bb.max.y);
-		bb.max.z = std::max(f->facetRef->sh.bb.max.z, bb.max.z);
+	// Find the cheapest bin border on the three axes. Cost of a cut: area(left)*nbLeft + area(right)*nbRight
+	size_t bestAxis = 3, bestBin = 0;
+	if (nbFacets > maxLeafSize && depth + 1 < MAXDEPTH) {
+		double bestCost = 1e100;
+		for (size_t axis = 0; axis < 3; axis++) {
+			double centerMin = Component(centerBB.min, axis);
+			double extent = Component(centerBB.max, axis) - centerMin;
+			if (extent <= 0.0) continue; //All facet centers in one plane, can't cut along this axis
+			double binScale = (double)SAH_NB_BINS / extent;
+
+			AxisAlignedBoundingBox binBB[SAH_NB_BINS];
+			size_t binCount[SAH_NB_BINS] = {};
+			for (size_t b = 0; b < SAH_NB_BINS; b++) binBB[b] = EmptyBB();
+			for (size_t i = 0; i < nbFacets; i++) {
+				size_t b = std::min((size_t)((Component(facets[i]->facetRef->sh.center, axis) - centerMin)*binScale), (size_t)SAH_NB_BINS - 1);
+				binCount[b]++;
+				Enlarge(binBB[b], facets[i]->facetRef->sh.bb.min, facets[i]->facetRef->sh.bb.max);
+			}
+
+			// Sweep from the right, then from the left: cut b is between bins b and b+1
+			double rightArea[SAH_NB_BINS];
+			size_t rightCount[SAH_NB_BINS];
+			AxisAlignedBoundingBox sweepBB = EmptyBB();
+			size_t sweepCount = 0;
+			for (size_t b = SAH_NB_BINS - 1; b > 0; b--) {
+				Enlarge(sweepBB, binBB[b].min, binBB[b].max);
+				sweepCount += binCount[b];
+				rightArea[b] = SurfaceArea(sweepBB);
+				rightCount[b] = sweepCount;
+			}
+			sweepBB = EmptyBB();
+			sweepCount = 0;
+			for (size_t b = 0; b < SAH_NB_BINS - 1; b++) {
+				Enlarge(sweepBB, binBB[b].min, binBB[b].max);
+				sweepCount += binCount[b];
+				if (sweepCount == 0 || rightCount[b + 1] == 0) continue;
+				double cost = SurfaceArea(sweepBB)*(double)sweepCount + rightArea[b + 1] * (double)rightCount[b + 1];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestBin = b;
+				}
+			}
+		}
 	}
 
-}
+	if (bestAxis == 3) { // Leaf: small enough, too deep, or all facet centers coincide
+		newNode->facets.assign(facets, facets + nbFacets);
+		return newNode;
+	}
 
-AABBNODE *BuildAABBTree(const std::vector<SubprocessFacet*>& facets, const size_t depth,size_t& maxDepth) {
+	newNode->axis = bestAxis;
+	double centerMin = Component(centerBB.min, bestAxis);
+	double binScale = (double)SAH_NB_BINS / (Component(centerBB.max, bestAxis) - centerMin);
+	SubprocessFacet** middle = std::partition(facets, facets + nbFacets, [&](SubprocessFacet* f) {
+		return std::min((size_t)((Component(f->facetRef->sh.center, bestAxis) - centerMin)*binScale), (size_t)SAH_NB_BINS - 1) <= bestBin;
+	});
+	size_t nbLeft = middle - facets;
+
+	if (parallelLevels > 0 && nbFacets >= PARALLEL_BUILD_MIN_FACETS) {
+		std::thread rightBuilder([&]() {
+			newNode->right = BuildAABBSubtree(middle, nbFacets - nbLeft, maxLeafSize, depth + 1, parallelLevels - 1);
+		});
+		newNode->left = BuildAABBSubtree(facets, nbLeft, maxLeafSize, depth + 1, parallelLevels - 1);
+		rightBuilder.join();
+	}
+	else {
+		newNode->left = BuildAABBSubtree(facets, nbLeft, maxLeafSize, depth + 1, 0);
+		newNode->right = BuildAABBSubtree(middle, nbFacets - nbLeft, maxLeafSize, depth + 1, 0);
+	}
+	return newNode;
 
-	size_t    nbl = 0, nbr = 0;
-	double m;
-	
-	maxDepth = std::max(depth, maxDepth); //debug
-	if (depth >= MAXDEPTH) return NULL;
+}
 
-	AABBNODE *newNode = new AABBNODE();
-	newNode->facets = facets;
-	newNode->ComputeBB();
+/**
+* \brief Builds the ray-tracing AABB tree of a structure with a binned SAH split, large subtrees in parallel
+* \param facets facets of the structure (reordered)
+* \param maxLeafSize maximum number of facets in a leaf
+* \return root node (a leaf, possibly empty, for small structures)
+*/
+AABBNODE *BuildAABBTree(std::vector<SubprocessFacet*>& facets, const size_t maxLeafSize) {
 
-	auto [planeType, nbLeft, nbRight] = newNode->FindBestCuttingPlane();
+	size_t parallelLevels = 0; //Enough levels to occupy all cores
+	for (size_t nbThreads = std::thread::hardware_concurrency(); nbThreads > 1; nbThreads /= 2) parallelLevels++;
+	return BuildAABBSubtree(facets.data(), facets.size(), std::max(maxLeafSize, (size_t)1), 0, parallelLevels);
 
-	if (nbLeft >= MINBB && nbRight >= MINBB) {
+}
 
-		// We can cut
-		std::vector<SubprocessFacet*> lList(nbLeft);
-		std::vector<SubprocessFacet*> rList(nbRight);
-		switch (planeType) {
+static void AddNodeStats(const AABBNODE* node, const size_t depth, const double rootArea, AABBTreeStats& stats) {
+	stats.nbNodes++;
+	stats.maxDepth = std::max(stats.maxDepth, depth);
+	double relativeArea = rootArea > 0.0 ? SurfaceArea(node->bb) / rootArea : 1.0; //Probability that a ray hitting the root hits this node
+	if (node->left == NULL || node->right == NULL) {
+		stats.nbLeaves++;
+		stats.nbLeafFacets += node->facets.size();
+		stats.maxLeafSize = std::max(stats.maxLeafSize, node->facets.size());
+		stats.expectedCost += relativeArea * (double)node->facets.size() * SAH_INTERSECTION_COST;
+	}
+	else {
+		stats.expectedCost += relativeArea * SAH_TRAVERSAL_COST;
+		AddNodeStats(node->left, depth + 1, rootArea, stats);
+		AddNodeStats(node->right, depth + 1, rootArea, stats);
+	}
+}
 
-		case 1: // yz
-			m = (newNode->bb.min.x + newNode->bb.max.x) / 2.0;
-			for (const auto& f : newNode->facets) {
-				if (f->facetRef->sh.center.x > m) rList[nbr++] = f;
-				else                   lList[nbl++] = f;
-			}
-			break;
+/**
+* \brief Tree quality figures, to compare builds
+* \param root root node of an AABB tree
+* \return node count, depth, leaf sizes and SAH expected cost of a ray query
+*/
+AABBTreeStats GetAABBTreeStats(const AABBNODE* root) {
+	AABBTreeStats stats;
+	if (root) AddNodeStats(root, 0, SurfaceArea(root->bb), stats);
+	return stats;
+}
 
-		case 2: // xz
-			m = (newNode->bb.min.y + newNode->bb.max.y) / 2.0;
-			for (const auto& f : newNode->facets) {
-				if (f->facetRef->sh.center.y > m) rList[nbr++] = f;
-				else                   lList[nbl++] = f;
-			}
-			break;
+static float RoundDown(const double& value) {
+	float f = (float)value;
+	return ((double)f > value) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
 
-		case 3: // xy
-			m = (newNode->bb.min.z + newNode->bb.max.z) / 2.0;
-			for (const auto& f : newNode->facets) {
-				if (f->facetRef->sh.center.z > m) rList[nbr++] = f;
-				else                   lList[nbl++] = f;
-			}
-			break;
+static float RoundUp(const double& value) {
+	float f = (float)value;
+	return ((double)f < value) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
 
+static void FlattenNode(const AABBNODE* node, SubProcessSuperStructure& structure) {
+	size_t index = structure.aabbNodes.size();
+	structure.aabbNodes.emplace_back();
+	LinearAABBNode& linearNode = structure.aabbNodes[index];
+	linearNode.bbMin[0] = RoundDown(node->bb.min.x); linearNode.bbMin[1] = RoundDown(node->bb.min.y); linearNode.bbMin[2] = RoundDown(node->bb.min.z);
+	linearNode.bbMax[0] = RoundUp(node->bb.max.x); linearNode.bbMax[1] = RoundUp(node->bb.max.y); linearNode.bbMax[2] = RoundUp(node->bb.max.z);
+	linearNode.axis = 0;
+
+	if (node->left == NULL || node->right == NULL) { // Leaf
+		linearNode.offset = (uint32_t)structure.aabbFacets.size();
+		linearNode.nbFacets = (uint32_t)node->facets.size();
+		for (const auto& f : node->facets) {
+			FacetIntersectionRecord record;
+			record.O = f->facetRef->sh.O;
+			record.U = f->facetRef->sh.U;
+			record.V = f->facetRef->sh.V;
+			record.Nuv = f->facetRef->sh.Nuv;
+			record.facet = f;
+			record.is2sided = f->facetRef->sh.is2sided;
+			structure.aabbFacets.push_back(record);
 		}
-		newNode->left = BuildAABBTree(lList, depth + 1, maxDepth);
-		newNode->right = BuildAABBTree(rList, depth + 1, maxDepth);
 	}
+	else {
+		linearNode.nbFacets = 0;
+		linearNode.axis = (uint32_t)node->axis;
+		FlattenNode(node->left, structure); //Right after its parent
+		structure.aabbNodes[index].offset = (uint32_t)structure.aabbNodes.size(); //linearNode may have been invalidated
+		FlattenNode(node->right, structure);
+	}
+}
 
-	return newNode;
+/**
+* \brief Releases all ray tracing tree representations of a structure
+*/
+void ClearAABBTrees(SubProcessSuperStructure& structure) {
+	std::vector<LinearAABBNode>().swap(structure.aabbNodes);
+	std::vector<FacetIntersectionRecord>().swap(structure.aabbFacets);
+	std::vector<WideAABBNode<4>>().swap(structure.aabbNodes4);
+	std::vector<WideAABBNode<8>>().swap(structure.aabbNodes8);
+	std::vector<FacetPacket>().swap(structure.aabbPackets);
+}
 
+/**
+* \brief Converts a built AABB tree into the structure's node array (depth-first) and facet record array used for ray tracing
+* \param root root node of the tree (may be a leaf)
+* \param structure structure whose aabbNodes and aabbFacets are rebuilt
+*/
+void FlattenAABBTree(const AABBNODE* root, SubProcessSuperStructure& structure) {
+	ClearAABBTrees(structure);
+	structure.aabbWidth = 1;
+	if (!root || (root->left == NULL && root->right == NULL && root->facets.empty())) return; //Empty structure: no nodes
+	FlattenNode(root, structure);
+	structure.aabbNodes.shrink_to_fit();
+	structure.aabbFacets.shrink_to_fit();
 }
 
-bool IntersectBB_new(const AABBNODE& node,const Vector3d& rayPos,const bool& nullRx,const bool& nullRy,const bool& nullRz,const Vector3d& inverseRayDir) {
-	double tNear, tFar;
+/**
+* \brief Ray-box (slabs) test on a flattened tree node
+* \param tNear distance along the ray where it enters the box (output, can be negative if the ray starts inside)
+* \return true if the ray (in positive direction) intersects the box
+*/
+static bool IntersectBB(const LinearAABBNode& node, const Vector3d& rayPos, const bool& nullRx, const bool& nullRy, const bool& nullRz, const Vector3d& inverseRayDir, double& tNear) {
+	double tFar;
 	//X component
 	if (nullRx) {
-		if (rayPos.x < node.bb.min.x || rayPos.x > node.bb.max.x) {
-			return false;
-		} 
-		else {
-			tNear = -1e100;
-			tFar = 1e100;
-		}
+		if (rayPos.x < node.bbMin[0] || rayPos.x > node.bbMax[0]) return false;
+		tNear = -1e100;
+		tFar = 1e100;
 	}
 	else {
-		double intersection1 = (node.bb.min.x - rayPos.x) * inverseRayDir.x;
-		double intersection2 = (node.bb.max.x - rayPos.x) * inverseRayDir.x;
+		double intersection1 = (node.bbMin[0] - rayPos.x) * inverseRayDir.x;
+		double intersection2 = (node.bbMax[0] - rayPos.x) * inverseRayDir.x;
 		tNear = std::min(intersection1, intersection2);
 		tFar = std::max(intersection1, intersection2);
 		if (tFar < 0.0) return false;
@@ -174,26 +299,26 @@ bool IntersectBB_new(const AABBNODE& node,const Vector3d& rayPos,const bool& nul
 
 	//Y component
 	if (nullRy) {
-		if (rayPos.y < node.bb.min.y || rayPos.y > node.bb.max.y) return false;
+		if (rayPos.y < node.bbMin[1] || rayPos.y > node.bbMax[1]) return false;
 	}
 	else {
-		double intersection1 = (node.bb.min.y - rayPos.y) * inverseRayDir.y;
-		double intersection2 = (node.bb.max.y - rayPos.y) * inverseRayDir.y;
+		double intersection1 = (node.bbMin[1] - rayPos.y) * inverseRayDir.y;
+		double intersection2 = (node.bbMax[1] - rayPos.y) * inverseRayDir.y;
 		tNear = std::max(tNear, std::min(intersection1, intersection2));
 		tFar = std::min(tFar, std::max(intersection1, intersection2));
-		if (tNear>tFar || tFar<0.0) return false;
+		if (tNear > tFar || tFar < 0.0) return false;
 	}
 
 	//Z component
 	if (nullRz) {
-			if (rayPos.z < node.bb.min.z || rayPos.z > node.bb.max.z) return false;   
+		if (rayPos.z < node.bbMin[2] || rayPos.z > node.bbMax[2]) return false;
 	}
 	else {
-		double intersection1 = (node.bb.min.z - rayPos.z) * inverseRayDir.z;
-		double intersection2 = (node.bb.max.z - rayPos.z) * inverseRayDir.z;
+		double intersection1 = (node.bbMin[2] - rayPos.z) * inverseRayDir.z;
+		double intersection2 = (node.bbMax[2] - rayPos.z) * inverseRayDir.z;
 		tNear = std::max(tNear, std::min(intersection1, intersection2));
 		tFar = std::min(tFar, std::max(intersection1, intersection2));
-		if (tNear>tFar || tFar<0.0) return false;
+		if (tNear > tFar || tFar < 0.0) return false;
 	}
 	return true;
 }
@@ -270,7 +395,51 @@ bool RaySphereIntersect(Vector3d *center, double radius, Vector3d *rPos, Vector3
 }
 
 
-/*std::tuple<bool,SubprocessFacet*,double>*/ void IntersectTree(Simulation* sHandle, const AABBNODE& node, const Vector3d& rayPos, const Vector3d& rayDirOpposite, SubprocessFacet* const lastHitBefore,
+/**
+* \brief Second half of a ray-facet test, once the ray is known to cross the facet's parallelogram in front of the ray origin: polygon check, then hard hit or transparent pass
+* \param u,v,d facet coordinates and distance of the crossing
+* \param found,collidedFacet,minLength closest hard hit so far, updated if this one is closer
+*/
+void CheckFacetHit(Simulation* sHandle, SubprocessFacet* f, const double& u, const double& v, const double& d, bool& found, SubprocessFacet*& collidedFacet, double& minLength) {
+	// Now check intersection with the facet polygon (in the u,v space)
+	// This check could be avoided on rectangular facet.
+	if (!IsInFacet(*f, u, v)) return;
+
+	bool hardHit;
+#ifdef MOLFLOW
+	double time = sHandle->currentParticle.flightTime + d / 100.0 / sHandle->currentParticle.velocity;
+	double currentOpacity = sHandle->GetOpacityAt(f, time);
+	hardHit = ((currentOpacity == 1.0) || (sHandle->particleGenerator->rnd()<currentOpacity));
+#endif
+
+#ifdef SYNRAD
+	hardHit = !((f->facetRef->sh.opacity < 0.999999 //Partially transparent facet
+		&& rnd()>f->facetRef->sh.opacity)
+		|| (f->facetRef->sh.reflectType > 10 //Material reflection
+		&& sHandle->materials[f->facetRef->sh.reflectType - 10].hasBackscattering //Has complex scattering
+		&& sHandle->materials[f->facetRef->sh.reflectType - 10].GetReflectionType(sHandle->energy,
+		acos(Dot(sHandle->direction, f->facetRef->sh.N)) - PI / 2, rnd()) == REFL_TRANS));
+#endif
+	if (hardHit) {
+
+		// Hard hit
+		if (d < minLength) {
+			minLength = d;
+			collidedFacet = f;
+			found = true;
+			sHandle->myTmpFacetVars[f->globalId].colU = u;
+			sHandle->myTmpFacetVars[f->globalId].colV = v;
+		}
+	}
+	else {
+		sHandle->myTmpFacetVars[f->globalId].colDistTranspPass = d;
+		sHandle->myTmpFacetVars[f->globalId].colU = u;
+		sHandle->myTmpFacetVars[f->globalId].colV = v;
+		sHandle->currentParticle.transparentHitBuffer.push_back(f);
+	}
+}
+
+/*std::tuple<bool,SubprocessFacet*,double>*/ void IntersectTree(Simulation* sHandle, const SubProcessSuperStructure& structure, const Vector3d& rayPos, const Vector3d& rayDirOpposite, SubprocessFacet* const lastHitBefore,
 	const bool& nullRx, const bool& nullRy, const bool& nullRz, const Vector3d& inverseRayDir,
 	/*std::vector<SubprocessFacet*>& transparentHitFacetPointers,*/ bool& found, SubprocessFacet*& collidedFacet, double& minLength) {
 
@@ -283,97 +452,100 @@ bool RaySphereIntersect(Vector3d *center, double radius, Vector3d *rPos, Vector3
 	// Solve the vector equation u*U + v*V + d*D = Z (using Cramer's rule)
 	// nuv = u^v (for faster calculation)
 
-	/*bool found = false;
-	SubprocessFacet* collidedFacet = lastHitBefore;
-	double minLength=minLengthSoFar;*/
+	// Iterative depth-first traversal of the flattened tree, nearer child first.
+	// Boxes entered beyond the closest hard hit found so far are skipped (transparent passes beyond it are discarded anyway)
 
-	if (node.left == NULL || node.right == NULL) { // Leaf
+	const std::vector<LinearAABBNode>& nodes = structure.aabbNodes;
+	if (nodes.empty()) return;
 
-		for (const auto& f : node.facets) {
+	size_t stack[MAXDEPTH + 1]; //At most one pending sibling per level
+	size_t stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0) {
+
+		size_t nodeIndex = stack[--stackSize];
+		const LinearAABBNode& node = nodes[nodeIndex];
+		double tNear;
+		if (!IntersectBB(node, rayPos, nullRx, nullRy, nullRz, inverseRayDir, tNear) || tNear > minLength) continue;
+
+		if (node.nbFacets == 0) { // Interior node
+			// rayDirOpposite points backwards: positive component means the ray goes towards the lower side, the second child (right of the plane) is nearer
+			double backwardsComponent = node.axis == 0 ? rayDirOpposite.x : (node.axis == 1 ? rayDirOpposite.y : rayDirOpposite.z);
+			if (backwardsComponent > 0.0) {
+				stack[stackSize++] = nodeIndex + 1;
+				stack[stackSize++] = node.offset;
+			}
+			else {
+				stack[stackSize++] = node.offset;
+				stack[stackSize++] = nodeIndex + 1;
+			}
+			continue;
+		}
+
+		// Leaf
+		const FacetIntersectionRecord* records = structure.aabbFacets.data() + node.offset;
+		for (size_t i = 0; i < node.nbFacets; i++) {
+
+			const FacetIntersectionRecord& r = records[i];
+			SubprocessFacet* f = r.facet;
 
 			// Do not check last collided facet
 			if (f == lastHitBefore)
 				continue;
 
-			double det = Dot(f->facetRef->sh.Nuv, rayDirOpposite);
+			double det = Dot(r.Nuv, rayDirOpposite);
 			// Eliminate "back facet"
-			if ((f->facetRef->sh.is2sided) || (det > 0.0)) { //If 2-sided or if ray going opposite facet normal
+			if ((r.is2sided) || (det > 0.0)) { //If 2-sided or if ray going opposite facet normal
 
 				double u, v, d;
 				// Ray/rectangle instersection. Find (u,v,dist) and check 0<=u<=1, 0<=v<=1, dist>=0
-				
+
 				if (det != 0.0) {
 
 					double iDet = 1.0 / det;
-					Vector3d intZ = rayPos - f->facetRef->sh.O;
+					Vector3d intZ = rayPos - r.O;
 
-					u = iDet * DET33(intZ.x, f->facetRef->sh.V.x, rayDirOpposite.x,
-						intZ.y, f->facetRef->sh.V.y, rayDirOpposite.y,
-						intZ.z, f->facetRef->sh.V.z, rayDirOpposite.z);
+					u = iDet * DET33(intZ.x, r.V.x, rayDirOpposite.x,
+						intZ.y, r.V.y, rayDirOpposite.y,
+						intZ.z, r.V.z, rayDirOpposite.z);
 
 					if (u >= 0.0 && u <= 1.0) {
 
-						v = iDet * DET33(f->facetRef->sh.U.x, intZ.x, rayDirOpposite.x,
-							f->facetRef->sh.U.y, intZ.y, rayDirOpposite.y,
-							f->facetRef->sh.U.z, intZ.z, rayDirOpposite.z);
+						v = iDet * DET33(r.U.x, intZ.x, rayDirOpposite.x,
+							r.U.y, intZ.y, rayDirOpposite.y,
+							r.U.z, intZ.z, rayDirOpposite.z);
 
 						if (v >= 0.0 && v <= 1.0) {
 
-							d = iDet * Dot(f->facetRef->sh.Nuv, intZ);
+							d = iDet * Dot(r.Nuv, intZ);
 
 							if (d>0.0) {
-
-								// Now check intersection with the facet polygon (in the u,v space)
-								// This check could be avoided on rectangular facet.
-								if (IsInFacet(*f, u, v)) {
-									bool hardHit;
-#ifdef MOLFLOW
-									double time = sHandle->currentParticle.flightTime + d / 100.0 / sHandle->currentParticle.velocity;
-									double currentOpacity = sHandle->GetOpacityAt(f, time);
-									hardHit = ((currentOpacity == 1.0) || (sHandle->randomGenerator.rnd()<currentOpacity));
-#endif
-
-#ifdef SYNRAD
-									hardHit = !((f->facetRef->sh.opacity < 0.999999 //Partially transparent facet
-										&& rnd()>f->facetRef->sh.opacity)
-										|| (f->facetRef->sh.reflectType > 10 //Material reflection
-										&& sHandle->materials[f->facetRef->sh.reflectType - 10].hasBackscattering //Has complex scattering
-										&& sHandle->materials[f->facetRef->sh.reflectType - 10].GetReflectionType(sHandle->energy,
-										acos(Dot(sHandle->direction, f->facetRef->sh.N)) - PI / 2, rnd()) == REFL_TRANS));
-#endif
-									if (hardHit) {
-
-										// Hard hit
-										if (d < minLength) {
-											minLength = d;
-											collidedFacet = f;
-											found = true;
-											sHandle->myTmpFacetVars[f->globalId].colU = u;
-											sHandle->myTmpFacetVars[f->globalId].colV = v;
-										}
-									}
-									else {
-										sHandle->myTmpFacetVars[f->globalId].colDistTranspPass = d;
-										sHandle->myTmpFacetVars[f->globalId].colU = u;
-										sHandle->myTmpFacetVars[f->globalId].colV = v;
-										sHandle->currentParticle.transparentHitBuffer.push_back(f);
-									}
-								} // IsInFacet
+								CheckFacetHit(sHandle, f, u, v, d, found, collidedFacet, minLength);
 							} // d range
 						} // u range
 					} // v range
 				} // det==0
 			} // dot<0
 		} // end for
+	}
+}
 
-	} /* end Leaf */ else {
-
-		if (IntersectBB_new(*(node.left), rayPos, nullRx, nullRy, nullRz, inverseRayDir)) {
-			IntersectTree(sHandle, *(node.left), rayPos, rayDirOpposite, lastHitBefore, nullRx, nullRy, nullRz, inverseRayDir, /*transparentHitFacetPointers,*/ found, collidedFacet, minLength);
-		}
-		if (IntersectBB_new(*(node.right), rayPos, nullRx, nullRy, nullRz, inverseRayDir)) {
-			IntersectTree(sHandle, *(node.right), rayPos, rayDirOpposite, lastHitBefore, nullRx, nullRy, nullRz, inverseRayDir, /*transparentHitFacetPointers,*/ found, collidedFacet, minLength);
-		}
+/**
+* \brief Traces a ray in a structure with the tree representation it was built with (see SubProcessSuperStructure::aabbWidth)
+*/
+static void IntersectStructure(Simulation* sHandle, const SubProcessSuperStructure& structure, const Vector3d& rayPos, const Vector3d& rayDirOpposite, SubprocessFacet* const lastHitBefore,
+	const bool& nullRx, const bool& nullRy, const bool& nullRz, const Vector3d& inverseRayDir,
+	bool& found, SubprocessFacet*& collidedFacet, double& minLength) {
+	switch (structure.aabbWidth) {
+	case 8:
+		IntersectWideTree8(sHandle, structure, rayPos, rayDirOpposite, lastHitBefore, found, collidedFacet, minLength);
+		break;
+	case 4:
+		IntersectWideTree4(sHandle, structure, rayPos, rayDirOpposite, lastHitBefore, found, collidedFacet, minLength);
+		break;
+	default:
+		IntersectTree(sHandle, structure, rayPos, rayDirOpposite, lastHitBefore, nullRx, nullRy, nullRz, inverseRayDir, found, collidedFacet, minLength);
 	}
 }
 
@@ -437,6 +609,8 @@ bool IsInFacet(const SubprocessFacet &f, const double &u, const double &v) {
 	return (((n_found / 2) & 1) ^ ((n_updown / 2) & 1));
 	*/
 
+	if (f.fillsUV) return true;
+	if (f.polygonGrid.IsBuilt()) return f.polygonGrid.IsInside(Vector2d(u, v));
 	return IsInPoly(Vector2d(u, v), f.facetRef->vertices2);
 
 }
@@ -463,7 +637,7 @@ std::tuple<bool, SubprocessFacet*, double> Intersect(Simulation* sHandle, const
 	sHandle->currentParticle.transparentHitBuffer.clear();
 	double minLength = 1e100;
 
-	IntersectTree(sHandle, *structures[sHandle->currentParticle.structureId].aabbTree, rayPos, -1.0*rayDir, sHandle->currentParticle.lastHitFacet,
+	IntersectStructure(sHandle, structures[sHandle->currentParticle.structureId], rayPos, -1.0*rayDir, sHandle->currentParticle.lastHitFacet,
 		nullRx, nullRy, nullRz, inverseRayDir,
 		/*transparentHitFacetPointers,*/ found, collidedFacet, minLength); //output params
 
@@ -611,14 +785,14 @@ bool Visible(Simulation* sHandle, const std::vector<SubProcessSuperStructure>& s
 	size_t intNbTHits = 0;
 
 	//Output values
-	bool found;
-	SubprocessFacet *collidedFacet;
-	double minLength;
+	bool found = false;
+	SubprocessFacet *collidedFacet = NULL;
+	double minLength = 1e100;
 
 	//std::vector<SubprocessFacet*> transparentHitFacetPointers;
 	sHandle->currentParticle.transparentHitBuffer.clear();
 
-	IntersectTree(sHandle, *structures[0].aabbTree, rayPos, -1.0*rayDir,
+	IntersectStructure(sHandle, structures[0], rayPos, -1.0*rayDir,
 		f1, nullRx, nullRy, nullRz, inverseRayDir, /*transparentHitFacetPointers,*/ found, collidedFacet, minLength);
 
 	if (found) {
@@ -634,6 +808,7 @@ bool Visible(Simulation* sHandle, const std::vector<SubProcessSuperStructure>& s
 AABBNODE::AABBNODE()
 {
 	left = right = NULL;
+	axis = 0;
 }
 
 AABBNODE::~AABBNODE()
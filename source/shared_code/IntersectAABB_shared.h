@@ -30,17 +30,41 @@ public:
 	AABBNODE();
 	~AABBNODE();
 	void ComputeBB();
-	std::tuple<size_t, size_t, size_t> FindBestCuttingPlane();
 	AxisAlignedBoundingBox             bb;
 	AABBNODE *left;
 	AABBNODE *right;
-	std::vector<SubprocessFacet*> facets;
+	size_t axis; //Cutting plane of interior nodes (0:x, 1:y, 2:z)
+	std::vector<SubprocessFacet*> facets; //Leaves only
 
 };
 
-AABBNODE *BuildAABBTree(const std::vector<SubprocessFacet*>& facets,const size_t depth,size_t& maxDepth);
+// AABB tree quality report
+class AABBTreeStats {
+public:
+	size_t nbNodes = 0;
+	size_t nbLeaves = 0;
+	size_t nbLeafFacets = 0; //Facet references in leaves (same as the structure's facet count)
+	size_t maxLeafSize = 0;
+	size_t maxDepth = 0;
+	double expectedCost = 0.0; //SAH estimate of a ray query's cost, in ray-box test units
+};
+
+AABBNODE *BuildAABBTree(std::vector<SubprocessFacet*>& facets,const size_t maxLeafSize);
+AABBTreeStats GetAABBTreeStats(const AABBNODE* root);
+void FlattenAABBTree(const AABBNODE* root, SubProcessSuperStructure& structure);
+void ClearAABBTrees(SubProcessSuperStructure& structure);
+
+// Wide (SIMD) trees, IntersectAABB_wide.cpp
+size_t GetSupportedAABBWidth();
+void BuildWideAABBTree(const AABBNODE* root, SubProcessSuperStructure& structure, const size_t width);
+void IntersectWideTree4(Simulation* sHandle, const SubProcessSuperStructure& structure, const Vector3d& rayPos, const Vector3d& rayDirOpposite, SubprocessFacet* const lastHitBefore,
+	bool& found, SubprocessFacet*& collidedFacet, double& minLength);
+void IntersectWideTree8(Simulation* sHandle, const SubProcessSuperStructure& structure, const Vector3d& rayPos, const Vector3d& rayDirOpposite, SubprocessFacet* const lastHitBefore,
+	bool& found, SubprocessFacet*& collidedFacet, double& minLength);
+void CheckFacetHit(Simulation* sHandle, SubprocessFacet* f, const double& u, const double& v, const double& d, bool& found, SubprocessFacet*& collidedFacet, double& minLength);
+
 
-void IntersectTree(Simulation* sHandle, const AABBNODE& node, const Vector3d& rayPos, const Vector3d& rayDirOpposite, SubprocessFacet* const lastHitBefore,
+void IntersectTree(Simulation* sHandle, const SubProcessSuperStructure& structure, const Vector3d& rayPos, const Vector3d& rayDirOpposite, SubprocessFacet* const lastHitBefore,
 	const bool& nullRx, const bool& nullRy, const bool& nullRz, const Vector3d& inverseRayDir,
 	/*std::vector<SubprocessFacet*>& transparentHitFacetPointers,*/ bool& found, SubprocessFacet*& collidedFacet, double& minLength);
 std::tuple<bool, SubprocessFacet*, double> Intersect(Simulation* sHandle, const std::vector<SubProcessSuperStructure>& structures, const Vector3d& rayPos, const Vector3d& rayDir);
@@ -0,0 +1,464 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+
+// Wide (4- and 8-ary) ray tracing trees, collapsed from the binary SAH tree.
+// Interior nodes test the ray against all their children's boxes at once (SSE: 4 floats, AVX2: 8 floats),
+// leaves hold facet packets tested 2 (SSE2) or 4 (AVX2) facets at a time in double precision.
+// The packet test computes u, v and d exactly like IntersectTree(), so both paths find the same hits.
+
+#include "IntersectAABB_shared.h"
+#include "Simulation.h"
+#include "GLApp/MathTools.h" //DET33
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define AABB_SIMD //SSE2 is part of x86-64, AVX2 is detected at runtime
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2 //MSVC accepts AVX intrinsics in any function
+#define FLATTEN
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define FLATTEN __attribute__((flatten)) //Inlines the traversal template, then the AVX2 kernels into it (they cannot be inlined into a function without the AVX2 target)
+#endif
+#else
+#define TARGET_AVX2
+#define FLATTEN
+#endif
+
+#define WIDE_MAXDEPTH 50 // Same as the binary tree's MAXDEPTH: collapsing never makes the tree deeper
+#define WIDE_PAD_FACTOR 4E-6 // Node boxes are padded by this fraction of the structure's largest coordinate (~16 float ulps) to absorb float rounding in the slab test
+
+/**
+* \brief Widest tree the processor can trace with SIMD instructions
+* \return 8 with AVX2, 4 on other x86-64 processors (SSE2), 1 (binary tree, scalar tests) elsewhere
+*/
+size_t GetSupportedAABBWidth() {
+#ifdef AABB_SIMD
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return 4;
+	__cpuid(info, 1);
+	bool osSavesAVX = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6); //OSXSAVE, AVX, and YMM state enabled
+	__cpuidex(info, 7, 0);
+	return (osSavesAVX && (info[1] & (1 << 5))) ? 8 : 4;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? 8 : 4;
+#endif
+#else
+	return 1;
+#endif
+}
+
+static float RoundDown(const double& value) {
+	float f = (float)value;
+	return ((double)f > value) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+static float RoundUp(const double& value) {
+	float f = (float)value;
+	return ((double)f < value) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+static double SurfaceArea(const AxisAlignedBoundingBox& bb) {
+	Vector3d d = bb.max - bb.min;
+	return 2.0 * (d.x*d.y + d.y*d.z + d.z*d.x);
+}
+
+static bool IsLeaf(const AABBNODE* node) {
+	return node->left == NULL || node->right == NULL;
+}
+
+static void AddPackets(const AABBNODE* leaf, std::vector<FacetPacket>& packets) {
+	for (size_t i = 0; i < leaf->facets.size(); i += 4) {
+		FacetPacket packet{}; //Unused lanes: zero vectors and NULL facet
+		for (size_t lane = 0; lane < 4 && i + lane < leaf->facets.size(); lane++) {
+			SubprocessFacet* f = leaf->facets[i + lane];
+			const Vector3d* vectors[4] = { &f->facetRef->sh.O, &f->facetRef->sh.U, &f->facetRef->sh.V, &f->facetRef->sh.Nuv };
+			double(*targets[4])[4] = { packet.O, packet.U, packet.V, packet.Nuv };
+			for (size_t k = 0; k < 4; k++) {
+				targets[k][0][lane] = vectors[k]->x;
+				targets[k][1][lane] = vectors[k]->y;
+				targets[k][2][lane] = vectors[k]->z;
+			}
+			packet.facet[lane] = f;
+			packet.is2sided[lane] = f->facetRef->sh.is2sided;
+		}
+		packets.push_back(packet);
+	}
+}
+
+/**
+* \brief Creates a wide node from a binary subtree: its children are the binary nodes left after repeatedly opening the largest interior one, until W of them
+* \param node binary node (a leaf only if it's the root of the tree)
+* \param pad box padding (absolute)
+* \return index of the created node
+*/
+template <size_t W>
+static uint32_t CollapseSubtree(const AABBNODE* node, const double& pad, std::vector<WideAABBNode<W>>& nodes, std::vector<FacetPacket>& packets) {
+	const AABBNODE* children[W];
+	size_t nbChildren = 0;
+	if (IsLeaf(node)) children[nbChildren++] = node;
+	else {
+		children[nbChildren++] = node->left;
+		children[nbChildren++] = node->right;
+	}
+	while (nbChildren < W) {
+		int largest = -1;
+		double largestArea = -1.0;
+		for (size_t i = 0; i < nbChildren; i++) {
+			if (!IsLeaf(children[i]) && SurfaceArea(children[i]->bb) > largestArea) {
+				largest = (int)i;
+				largestArea = SurfaceArea(children[i]->bb);
+			}
+		}
+		if (largest == -1) break; //All leaves
+		const AABBNODE* opened = children[largest];
+		children[largest] = opened->left;
+		children[nbChildren++] = opened->right;
+	}
+
+	uint32_t index = (uint32_t)nodes.size();
+	nodes.emplace_back();
+	WideAABBNode<W> wideNode{};
+	wideNode.nbChildren = (uint32_t)nbChildren;
+	for (size_t i = 0; i < nbChildren; i++) {
+		const AABBNODE* c = children[i];
+		wideNode.bbMin[0][i] = RoundDown(c->bb.min.x - pad); wideNode.bbMin[1][i] = RoundDown(c->bb.min.y - pad); wideNode.bbMin[2][i] = RoundDown(c->bb.min.z - pad);
+		wideNode.bbMax[0][i] = RoundUp(c->bb.max.x + pad); wideNode.bbMax[1][i] = RoundUp(c->bb.max.y + pad); wideNode.bbMax[2][i] = RoundUp(c->bb.max.z + pad);
+		if (IsLeaf(c)) {
+			wideNode.child[i] = (uint32_t)packets.size();
+			wideNode.nbPackets[i] = (uint32_t)((c->facets.size() + 3) / 4);
+			AddPackets(c, packets);
+		}
+		else {
+			wideNode.child[i] = CollapseSubtree(c, pad, nodes, packets);
+			wideNode.nbPackets[i] = 0;
+		}
+	}
+	nodes[index] = wideNode; //Not a reference kept across the recursion: nodes may have been reallocated
+	return index;
+}
+
+/**
+* \brief Converts a built (binary) AABB tree into a 4- or 8-wide tree with packed leaves, replacing the structure's other tree representations
+* \param root root node of the binary tree (may be a leaf)
+* \param structure structure whose wide tree is rebuilt
+* \param width 4 or 8
+*/
+void BuildWideAABBTree(const AABBNODE* root, SubProcessSuperStructure& structure, const size_t width) {
+	ClearAABBTrees(structure);
+	structure.aabbWidth = width;
+	if (!root || (IsLeaf(root) && root->facets.empty())) return; //Empty structure: no nodes
+
+	double maxCoord = std::max({ std::abs(root->bb.min.x), std::abs(root->bb.min.y), std::abs(root->bb.min.z),
+		std::abs(root->bb.max.x), std::abs(root->bb.max.y), std::abs(root->bb.max.z) });
+	double pad = maxCoord * WIDE_PAD_FACTOR;
+	if (width == 8) CollapseSubtree<8>(root, pad, structure.aabbNodes8, structure.aabbPackets);
+	else CollapseSubtree<4>(root, pad, structure.aabbNodes4, structure.aabbPackets);
+	structure.aabbNodes4.shrink_to_fit();
+	structure.aabbNodes8.shrink_to_fit();
+	structure.aabbPackets.shrink_to_fit();
+}
+
+// Ray in single precision for the node tests
+class WideRay {
+public:
+	float origin[3];
+	float inverseDir[3]; // Clamped to +/-1E30 (also for null components), so that no NaN can occur
+	float slack[3]; // Slab bounds widening in distance units, for the rounding of the origin to float
+};
+
+static WideRay MakeWideRay(const Vector3d& rayPos, const Vector3d& rayDirOpposite) {
+	WideRay ray;
+	double pos[3] = { rayPos.x, rayPos.y, rayPos.z };
+	double dir[3] = { -rayDirOpposite.x, -rayDirOpposite.y, -rayDirOpposite.z };
+	for (size_t i = 0; i < 3; i++) {
+		double inverse = (dir[i] == 0.0) ? 1E30 : std::min(std::max(1.0 / dir[i], -1E30), 1E30);
+		ray.origin[i] = (float)pos[i];
+		ray.inverseDir[i] = (float)inverse;
+		ray.slack[i] = RoundUp(std::abs(pos[i]) * 5E-7 * std::abs(inverse)); //8 float ulps of the origin coordinate
+	}
+	return ray;
+}
+
+class WideStackEntry {
+public:
+	uint32_t index; // Node, or first packet of a leaf
+	uint32_t nbPackets; // 0 for nodes
+	float tNear;
+};
+
+#ifdef AABB_SIMD
+
+/**
+* \brief Slab test of a ray against the 4 child boxes of a node
+* \param maxDist boxes entered farther than this are reported as missed
+* \param tNear entry distance of each child box (output)
+* \return bit mask of the children hit
+*/
+static inline int IntersectNode4(const WideAABBNode<4>& node, const WideRay& ray, const float& maxDist, float* tNear) {
+	__m128 tn = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+	__m128 tf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+	for (size_t a = 0; a < 3; a++) {
+		__m128 o = _mm_set1_ps(ray.origin[a]);
+		__m128 inv = _mm_set1_ps(ray.inverseDir[a]);
+		__m128 slack = _mm_set1_ps(ray.slack[a]);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bbMin[a]), o), inv);
+		__m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bbMax[a]), o), inv);
+		tn = _mm_max_ps(tn, _mm_sub_ps(_mm_min_ps(t1, t2), slack));
+		tf = _mm_min_ps(tf, _mm_add_ps(_mm_max_ps(t1, t2), slack));
+	}
+	__m128 hit = _mm_and_ps(_mm_cmple_ps(tn, tf), _mm_and_ps(_mm_cmpge_ps(tf, _mm_setzero_ps()), _mm_cmple_ps(tn, _mm_set1_ps(maxDist))));
+	_mm_storeu_ps(tNear, tn);
+	return _mm_movemask_ps(hit) & ((1 << node.nbChildren) - 1);
+}
+
+TARGET_AVX2 static inline int IntersectNode8(const WideAABBNode<8>& node, const WideRay& ray, const float& maxDist, float* tNear) {
+	__m256 tn = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+	__m256 tf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+	for (size_t a = 0; a < 3; a++) {
+		__m256 o = _mm256_set1_ps(ray.origin[a]);
+		__m256 inv = _mm256_set1_ps(ray.inverseDir[a]);
+		__m256 slack = _mm256_set1_ps(ray.slack[a]);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bbMin[a]), o), inv);
+		__m256 t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bbMax[a]), o), inv);
+		tn = _mm256_max_ps(tn, _mm256_sub_ps(_mm256_min_ps(t1, t2), slack));
+		tf = _mm256_min_ps(tf, _mm256_add_ps(_mm256_max_ps(t1, t2), slack));
+	}
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ),
+		_mm256_and_ps(_mm256_cmp_ps(tf, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(tn, _mm256_set1_ps(maxDist), _CMP_LE_OQ)));
+	_mm256_storeu_ps(tNear, tn);
+	return _mm256_movemask_ps(hit) & ((1 << node.nbChildren) - 1);
+}
+
+/**
+* \brief Ray-parallelogram test of the 4 facets of a packet, 2 at a time. Same operations as in IntersectTree(), lane by lane
+* \param u,v,d,det facet coordinates, distance and determinant of each lane (output)
+* \return bit mask of the lanes where 0<=u<=1, 0<=v<=1 and d>0 (never set for unused lanes or parallel rays)
+*/
+static inline int IntersectPacket4(const FacetPacket& p, const Vector3d& rayPos, const Vector3d& rayDirOpposite, double* u, double* v, double* d, double* det) {
+	__m128d rx = _mm_set1_pd(rayDirOpposite.x), ry = _mm_set1_pd(rayDirOpposite.y), rz = _mm_set1_pd(rayDirOpposite.z);
+	__m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1.0);
+	int mask = 0;
+	for (size_t h = 0; h < 4; h += 2) {
+		__m128d Nx = _mm_loadu_pd(&p.Nuv[0][h]), Ny = _mm_loadu_pd(&p.Nuv[1][h]), Nz = _mm_loadu_pd(&p.Nuv[2][h]);
+		__m128d Ux = _mm_loadu_pd(&p.U[0][h]), Uy = _mm_loadu_pd(&p.U[1][h]), Uz = _mm_loadu_pd(&p.U[2][h]);
+		__m128d Vx = _mm_loadu_pd(&p.V[0][h]), Vy = _mm_loadu_pd(&p.V[1][h]), Vz = _mm_loadu_pd(&p.V[2][h]);
+		__m128d izx = _mm_sub_pd(_mm_set1_pd(rayPos.x), _mm_loadu_pd(&p.O[0][h]));
+		__m128d izy = _mm_sub_pd(_mm_set1_pd(rayPos.y), _mm_loadu_pd(&p.O[1][h]));
+		__m128d izz = _mm_sub_pd(_mm_set1_pd(rayPos.z), _mm_loadu_pd(&p.O[2][h]));
+
+		__m128d dt = _mm_add_pd(_mm_add_pd(_mm_mul_pd(Nx, rx), _mm_mul_pd(Ny, ry)), _mm_mul_pd(Nz, rz));
+		__m128d iDet = _mm_div_pd(one, dt);
+		__m128d uu = _mm_mul_pd(iDet, _mm_add_pd(_mm_add_pd(
+			_mm_mul_pd(izx, _mm_sub_pd(_mm_mul_pd(Vy, rz), _mm_mul_pd(Vz, ry))),
+			_mm_mul_pd(Vx, _mm_sub_pd(_mm_mul_pd(ry, izz), _mm_mul_pd(rz, izy)))),
+			_mm_mul_pd(rx, _mm_sub_pd(_mm_mul_pd(izy, Vz), _mm_mul_pd(izz, Vy)))));
+		__m128d vv = _mm_mul_pd(iDet, _mm_add_pd(_mm_add_pd(
+			_mm_mul_pd(Ux, _mm_sub_pd(_mm_mul_pd(izy, rz), _mm_mul_pd(izz, ry))),
+			_mm_mul_pd(izx, _mm_sub_pd(_mm_mul_pd(ry, Uz), _mm_mul_pd(rz, Uy)))),
+			_mm_mul_pd(rx, _mm_sub_pd(_mm_mul_pd(Uy, izz), _mm_mul_pd(Uz, izy)))));
+		__m128d dd = _mm_mul_pd(iDet, _mm_add_pd(_mm_add_pd(_mm_mul_pd(Nx, izx), _mm_mul_pd(Ny, izy)), _mm_mul_pd(Nz, izz)));
+
+		__m128d in = _mm_and_pd(_mm_and_pd(_mm_cmpge_pd(uu, zero), _mm_cmple_pd(uu, one)),
+			_mm_and_pd(_mm_and_pd(_mm_cmpge_pd(vv, zero), _mm_cmple_pd(vv, one)), _mm_cmpgt_pd(dd, zero)));
+		_mm_storeu_pd(u + h, uu);
+		_mm_storeu_pd(v + h, vv);
+		_mm_storeu_pd(d + h, dd);
+		_mm_storeu_pd(det + h, dt);
+		mask |= _mm_movemask_pd(in) << h;
+	}
+	return mask;
+}
+
+/**
+* \brief Ray-parallelogram test of the 4 facets of a packet at once, see IntersectPacket4()
+*/
+TARGET_AVX2 static inline int IntersectPacket8(const FacetPacket& p, const Vector3d& rayPos, const Vector3d& rayDirOpposite, double* u, double* v, double* d, double* det) {
+	__m256d rx = _mm256_set1_pd(rayDirOpposite.x), ry = _mm256_set1_pd(rayDirOpposite.y), rz = _mm256_set1_pd(rayDirOpposite.z);
+	__m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1.0);
+	__m256d Nx = _mm256_loadu_pd(p.Nuv[0]), Ny = _mm256_loadu_pd(p.Nuv[1]), Nz = _mm256_loadu_pd(p.Nuv[2]);
+	__m256d Ux = _mm256_loadu_pd(p.U[0]), Uy = _mm256_loadu_pd(p.U[1]), Uz = _mm256_loadu_pd(p.U[2]);
+	__m256d Vx = _mm256_loadu_pd(p.V[0]), Vy = _mm256_loadu_pd(p.V[1]), Vz = _mm256_loadu_pd(p.V[2]);
+	__m256d izx = _mm256_sub_pd(_mm256_set1_pd(rayPos.x), _mm256_loadu_pd(p.O[0]));
+	__m256d izy = _mm256_sub_pd(_mm256_set1_pd(rayPos.y), _mm256_loadu_pd(p.O[1]));
+	__m256d izz = _mm256_sub_pd(_mm256_set1_pd(rayPos.z), _mm256_loadu_pd(p.O[2]));
+
+	__m256d dt = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(Nx, rx), _mm256_mul_pd(Ny, ry)), _mm256_mul_pd(Nz, rz));
+	__m256d iDet = _mm256_div_pd(one, dt);
+	__m256d uu = _mm256_mul_pd(iDet, _mm256_add_pd(_mm256_add_pd(
+		_mm256_mul_pd(izx, _mm256_sub_pd(_mm256_mul_pd(Vy, rz), _mm256_mul_pd(Vz, ry))),
+		_mm256_mul_pd(Vx, _mm256_sub_pd(_mm256_mul_pd(ry, izz), _mm256_mul_pd(rz, izy)))),
+		_mm256_mul_pd(rx, _mm256_sub_pd(_mm256_mul_pd(izy, Vz), _mm256_mul_pd(izz, Vy)))));
+	__m256d vv = _mm256_mul_pd(iDet, _mm256_add_pd(_mm256_add_pd(
+		_mm256_mul_pd(Ux, _mm256_sub_pd(_mm256_mul_pd(izy, rz), _mm256_mul_pd(izz, ry))),
+		_mm256_mul_pd(izx, _mm256_sub_pd(_mm256_mul_pd(ry, Uz), _mm256_mul_pd(rz, Uy)))),
+		_mm256_mul_pd(rx, _mm256_sub_pd(_mm256_mul_pd(Uy, izz), _mm256_mul_pd(Uz, izy)))));
+	__m256d dd = _mm256_mul_pd(iDet, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(Nx, izx), _mm256_mul_pd(Ny, izy)), _mm256_mul_pd(Nz, izz)));
+
+	__m256d in = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(uu, zero, _CMP_GE_OQ), _mm256_cmp_pd(uu, one, _CMP_LE_OQ)),
+		_mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(vv, zero, _CMP_GE_OQ), _mm256_cmp_pd(vv, one, _CMP_LE_OQ)), _mm256_cmp_pd(dd, zero, _CMP_GT_OQ)));
+	_mm256_storeu_pd(u, uu);
+	_mm256_storeu_pd(v, vv);
+	_mm256_storeu_pd(d, dd);
+	_mm256_storeu_pd(det, dt);
+	return _mm256_movemask_pd(in);
+}
+
+#else
+
+// Portable versions, same results
+
+template <size_t W>
+static inline int IntersectNode(const WideAABBNode<W>& node, const WideRay& ray, const float& maxDist, float* tNear) {
+	int mask = 0;
+	for (size_t i = 0; i < node.nbChildren; i++) {
+		float tn = -std::numeric_limits<float>::infinity();
+		float tf = std::numeric_limits<float>::infinity();
+		for (size_t a = 0; a < 3; a++) {
+			float t1 = (node.bbMin[a][i] - ray.origin[a]) * ray.inverseDir[a];
+			float t2 = (node.bbMax[a][i] - ray.origin[a]) * ray.inverseDir[a];
+			tn = std::max(tn, std::min(t1, t2) - ray.slack[a]);
+			tf = std::min(tf, std::max(t1, t2) + ray.slack[a]);
+		}
+		tNear[i] = tn;
+		if (tn <= tf && tf >= 0.0f && tn <= maxDist) mask |= 1 << i;
+	}
+	return mask;
+}
+
+static inline int IntersectNode4(const WideAABBNode<4>& node, const WideRay& ray, const float& maxDist, float* tNear) {
+	return IntersectNode<4>(node, ray, maxDist, tNear);
+}
+
+static inline int IntersectNode8(const WideAABBNode<8>& node, const WideRay& ray, const float& maxDist, float* tNear) {
+	return IntersectNode<8>(node, ray, maxDist, tNear);
+}
+
+static inline int IntersectPacket4(const FacetPacket& p, const Vector3d& rayPos, const Vector3d& rayDirOpposite, double* u, double* v, double* d, double* det) {
+	int mask = 0;
+	for (size_t lane = 0; lane < 4; lane++) {
+		Vector3d O(p.O[0][lane], p.O[1][lane], p.O[2][lane]);
+		Vector3d U(p.U[0][lane], p.U[1][lane], p.U[2][lane]);
+		Vector3d V(p.V[0][lane], p.V[1][lane], p.V[2][lane]);
+		Vector3d Nuv(p.Nuv[0][lane], p.Nuv[1][lane], p.Nuv[2][lane]);
+		det[lane] = Dot(Nuv, rayDirOpposite);
+		double iDet = 1.0 / det[lane];
+		Vector3d intZ = rayPos - O;
+		u[lane] = iDet * DET33(intZ.x, V.x, rayDirOpposite.x,
+			intZ.y, V.y, rayDirOpposite.y,
+			intZ.z, V.z, rayDirOpposite.z);
+		v[lane] = iDet * DET33(U.x, intZ.x, rayDirOpposite.x,
+			U.y, intZ.y, rayDirOpposite.y,
+			U.z, intZ.z, rayDirOpposite.z);
+		d[lane] = iDet * Dot(Nuv, intZ);
+		if (u[lane] >= 0.0 && u[lane] <= 1.0 && v[lane] >= 0.0 && v[lane] <= 1.0 && d[lane] > 0.0) mask |= 1 << lane;
+	}
+	return mask;
+}
+
+static inline int IntersectPacket8(const FacetPacket& p, const Vector3d& rayPos, const Vector3d& rayDirOpposite, double* u, double* v, double* d, double* det) {
+	return IntersectPacket4(p, rayPos, rayDirOpposite, u, v, d, det);
+}
+
+#endif
+
+/**
+* \brief Iterative traversal of a wide tree, children visited nearest first. Hits are recorded by CheckFacetHit(), like in IntersectTree()
+*/
+template <size_t W,
+	int(*IntersectNode)(const WideAABBNode<W>&, const WideRay&, const float&, float*),
+	int(*IntersectPacket)(const FacetPacket&, const Vector3d&, const Vector3d&, double*, double*, double*, double*)>
+static inline void IntersectWideTree(Simulation* sHandle, const std::vector<WideAABBNode<W>>& nodes, const std::vector<FacetPacket>& packets,
+	const Vector3d& rayPos, const Vector3d& rayDirOpposite, SubprocessFacet* const lastHitBefore,
+	bool& found, SubprocessFacet*& collidedFacet, double& minLength) {
+
+	if (nodes.empty()) return;
+	WideRay ray = MakeWideRay(rayPos, rayDirOpposite);
+	float maxDist = RoundUp(minLength);
+
+	WideStackEntry stack[WIDE_MAXDEPTH * W + 1]; //A node replaces itself by at most W children
+	size_t stackSize = 0;
+	stack[stackSize++] = { 0, 0, -std::numeric_limits<float>::infinity() };
+
+	while (stackSize > 0) {
+
+		WideStackEntry entry = stack[--stackSize];
+		if (entry.tNear > maxDist) continue; //A closer hit was found since it was pushed
+
+		if (entry.nbPackets == 0) { // Interior node
+			const WideAABBNode<W>& node = nodes[entry.index];
+			float tNear[W];
+			int mask = IntersectNode(node, ray, maxDist, tNear);
+			if (mask == 0) continue;
+			// Push the children hit, farthest first
+			size_t first = stackSize;
+			for (size_t i = 0; i < W; i++) {
+				if (!(mask & (1 << i))) continue;
+				WideStackEntry childEntry = { node.child[i], node.nbPackets[i], tNear[i] };
+				size_t pos = stackSize++;
+				while (pos > first && stack[pos - 1].tNear < childEntry.tNear) {
+					stack[pos] = stack[pos - 1];
+					pos--;
+				}
+				stack[pos] = childEntry;
+			}
+			continue;
+		}
+
+		// Leaf
+		for (uint32_t p = entry.index; p < entry.index + entry.nbPackets; p++) {
+			const FacetPacket& packet = packets[p];
+			double u[4], v[4], d[4], det[4];
+			int mask = IntersectPacket(packet, rayPos, rayDirOpposite, u, v, d, det);
+			if (mask == 0) continue;
+			for (size_t lane = 0; lane < 4; lane++) {
+				if (!(mask & (1 << lane))) continue;
+				SubprocessFacet* f = packet.facet[lane];
+				// Do not check last collided facet. Eliminate "back facet" unless 2-sided
+				if (f == lastHitBefore || !(packet.is2sided[lane] || det[lane] > 0.0)) continue;
+				CheckFacetHit(sHandle, f, u[lane], v[lane], d[lane], found, collidedFacet, minLength);
+			}
+		}
+		maxDist = RoundUp(minLength);
+	}
+}
+
+/**
+* \brief Traces a ray in a structure's 4-wide tree (SSE)
+*/
+void IntersectWideTree4(Simulation* sHandle, const SubProcessSuperStructure& structure, const Vector3d& rayPos, const Vector3d& rayDirOpposite, SubprocessFacet* const lastHitBefore,
+	bool& found, SubprocessFacet*& collidedFacet, double& minLength) {
+	IntersectWideTree<4, IntersectNode4, IntersectPacket4>(sHandle, structure.aabbNodes4, structure.aabbPackets, rayPos, rayDirOpposite, lastHitBefore, found, collidedFacet, minLength);
+}
+
+/**
+* \brief Traces a ray in a structure's 8-wide tree (AVX2). Only call if GetSupportedAABBWidth() returned 8
+*/
+TARGET_AVX2 FLATTEN void IntersectWideTree8(Simulation* sHandle, const SubProcessSuperStructure& structure, const Vector3d& rayPos, const Vector3d& rayDirOpposite, SubprocessFacet* const lastHitBefore,
+	bool& found, SubprocessFacet*& collidedFacet, double& minLength) {
+	IntersectWideTree<8, IntersectNode8, IntersectPacket8>(sHandle, structure.aabbNodes8, structure.aabbPackets, rayPos, rayDirOpposite, lastHitBefore, found, collidedFacet, minLength);
+}
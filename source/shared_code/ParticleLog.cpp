@@ -0,0 +1,277 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#include "ParticleLog.h"
+#include "Geometry_shared.h"
+#include "Facet_shared.h"
+#include <cstring> //memcpy, memcmp
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+
+#define PARTICLELOG_CHUNK 4096 //Records popped from a ring, or read from the file, at once
+#define PARTICLELOG_FILE_BUFFER (4 << 20)
+#define PARTICLELOG_WAKEUP_MS 50 //Longest time a record waits in a ring that isn't filling up
+
+static const char particleLogMagic[8] = { 'M','F','L','O','G','B','I','N' };
+
+size_t ParticleLogRing::Pop(ParticleLogRecord* dest, size_t maxCount) {
+	size_t t = tail.load(std::memory_order_relaxed);
+	size_t count = std::min(head.load(std::memory_order_acquire) - t, maxCount);
+	for (size_t i = 0; i < count; i++)
+		dest[i] = records[(t + i) & (PARTICLELOG_RING_SIZE - 1)];
+	tail.store(t + count, std::memory_order_release);
+	return count;
+}
+
+void ParticleLogRing::Discard() {
+	tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+ParticleLogWriter::~ParticleLogWriter() {
+	Stop();
+}
+
+/**
+* \brief Creates the log file and launches the writer thread. A running log is stopped first
+* \param fileName log file, overwritten
+* \param rings one ring per simulation thread. Records they still hold from a previous log are dropped
+* \param limit max. number of records, 0 for no limit
+*/
+void ParticleLogWriter::Start(const std::string& fileName, const std::vector<ParticleLogRing*>& rings, size_t limit) {
+	Stop();
+	std::filesystem::path parentDir = std::filesystem::path(fileName).parent_path();
+	if (!parentDir.empty()) std::filesystem::create_directories(parentDir);
+	file = fopen(fileName.c_str(), "wb");
+	if (!file) throw Error(("Can't create particle log file " + fileName).c_str());
+	setvbuf(file, NULL, _IOFBF, PARTICLELOG_FILE_BUFFER);
+	ParticleLogHeader header;
+	memcpy(header.magic, particleLogMagic, sizeof(header.magic));
+	header.version = PARTICLELOG_VERSION;
+	header.recordSize = (uint32_t)sizeof(ParticleLogRecord);
+	if (fwrite(&header, sizeof(header), 1, file) != 1 || fflush(file) != 0) { //Flushed: the file is fully buffered, a short write would only show later
+		fclose(file);
+		file = NULL;
+		throw Error(("Couldn't write the particle log header (disk full?): " + fileName).c_str());
+	}
+
+	this->fileName = fileName;
+	this->rings = rings;
+	this->limit = limit;
+	for (auto& ring : rings)
+		ring->Discard();
+	chunk.resize(PARTICLELOG_CHUNK);
+	stopRequested = false;
+	flushRequests = flushesDone = 0;
+	error.clear();
+	nbWritten = 0;
+	accepting = true;
+	writerThread = std::thread(&ParticleLogWriter::WriterLoop, this);
+}
+
+/**
+* \brief Stops accepting records, writes the ones already pushed and closes the file. The file is kept
+*/
+void ParticleLogWriter::Stop() {
+	accepting = false;
+	if (writerThread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopRequested = true;
+		}
+		wakeup.notify_one();
+		writerThread.join();
+	}
+	if (file) {
+		fclose(file);
+		file = NULL;
+	}
+	rings.clear();
+}
+
+/**
+* \brief Waits until the records pushed so far are written and flushed to disk, for example before an export
+*/
+void ParticleLogWriter::Flush() {
+	std::unique_lock<std::mutex> lock(mutex);
+	if (!writerThread.joinable()) return;
+	size_t request = ++flushRequests;
+	wakeup.notify_one();
+	flushed.wait(lock, [&] { return flushesDone >= request || !writerThread.joinable() || stopRequested; });
+}
+
+std::string ParticleLogWriter::GetError() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return error;
+}
+
+/**
+* \brief Main loop of the writer thread: drains the rings while they hold records, otherwise sleeps until woken or for PARTICLELOG_WAKEUP_MS
+*/
+void ParticleLogWriter::WriterLoop() {
+	while (true) {
+		size_t requests;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			requests = flushRequests; //Acknowledged once a drain that started after the request finds the rings empty
+		}
+		if (DrainRings() > 0) continue;
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if (flushesDone < requests) {
+			fflush(file);
+			flushesDone = requests;
+			flushed.notify_all();
+		}
+		if (stopRequested) break;
+		if (flushRequests == requests) //No request arrived during the drain
+			wakeup.wait_for(lock, std::chrono::milliseconds(PARTICLELOG_WAKEUP_MS));
+	}
+	DrainRings(); //Pushed just before the producers saw accepting==false
+	flushed.notify_all();
+}
+
+size_t ParticleLogWriter::DrainRings() {
+	size_t nbDrained = 0;
+	for (auto& ring : rings) {
+		size_t count;
+		while ((count = ring->Pop(chunk.data(), chunk.size())) > 0) {
+			nbDrained += count;
+			if (!file) continue; //Write error: keep the rings empty
+			size_t written = nbWritten;
+			if (limit > 0) count = std::min(count, limit - written);
+			if (count > 0 && fwrite(chunk.data(), sizeof(ParticleLogRecord), count, file) != count) {
+				std::lock_guard<std::mutex> lock(mutex);
+				error = "Couldn't write the particle log (disk full?)";
+				accepting = false;
+				fclose(file);
+				file = NULL;
+				continue;
+			}
+			nbWritten = written + count;
+			if (limit > 0 && written + count >= limit) accepting = false;
+		}
+	}
+	return nbDrained;
+}
+
+ParticleLogReader::ParticleLogReader(const std::string& fileName) {
+	file = fopen(fileName.c_str(), "rb");
+	if (!file) throw Error(("Can't open particle log file " + fileName).c_str());
+	ParticleLogHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, particleLogMagic, sizeof(header.magic)) != 0) {
+		fclose(file);
+		throw Error(("Not a particle log file: " + fileName).c_str());
+	}
+	if (header.version != PARTICLELOG_VERSION || header.recordSize != sizeof(ParticleLogRecord)) {
+		fclose(file);
+		throw Error(("Particle log written by an incompatible version: " + fileName).c_str());
+	}
+	nbRecords = (std::filesystem::file_size(fileName) - sizeof(header)) / sizeof(ParticleLogRecord);
+	setvbuf(file, NULL, _IOFBF, PARTICLELOG_FILE_BUFFER);
+}
+
+ParticleLogReader::~ParticleLogReader() {
+	if (file) fclose(file);
+}
+
+size_t ParticleLogReader::Read(ParticleLogRecord* dest, size_t maxCount) {
+	return fread(dest, sizeof(ParticleLogRecord), maxCount, file);
+}
+
+/**
+* \brief Converts a log file to delimited text (one hit per line). Only one chunk of records is in memory at a time
+* \param logFileName binary log, written by ParticleLogWriter
+* \param geom geometry the log was recorded on, to convert facet coordinates to global ones
+* \param separator column separator
+* \param out destination stream (file, or string for the clipboard)
+* \param progress called with the fraction done after each chunk, returns false to abort
+* \return number of records converted
+*/
+size_t ExportParticleLog(const std::string& logFileName, Geometry* geom, const std::string& separator, std::ostream& out,
+	const std::function<bool(double)>& progress) {
+
+	ParticleLogReader reader(logFileName);
+	const char* sep = separator.c_str();
+
+	out << "Facet" << separator
+		<< "Particle_ID" << separator
+		<< "Pos_X_[cm]" << separator
+		<< "Pos_Y_[cm]" << separator
+		<< "Pos_Z_[cm]" << separator
+		<< "Pos_u" << separator
+		<< "Pos_v" << separator
+		<< "Dir_X" << separator
+		<< "Dir_Y" << separator
+		<< "Dir_Z" << separator
+		<< "Dir_theta_[rad]" << separator
+		<< "Dir_phi_[rad]" << separator
+		<< "LowFluxRatio" << separator;
+#ifdef MOLFLOW
+	out << "Velocity_[m/s]" << separator
+		<< "HitTime_[s]" << separator
+		<< "ParticleDecayMoment_[s]" << separator;
+#endif // MOLFLOW
+#ifdef SYNRAD
+	out << "Energy_[eV]" << separator
+		<< "Flux_[photon/s]" << separator
+		<< "Power_[W]" << separator;
+#endif // SYNRAD
+	out << "\n";
+
+	std::vector<ParticleLogRecord> records(PARTICLELOG_CHUNK);
+	std::string text;
+	char line[1024];
+	size_t nbDone = 0;
+	size_t count;
+	while ((count = reader.Read(records.data(), records.size())) > 0) {
+		text.clear();
+		for (size_t i = 0; i < count; i++) {
+			const ParticleLogRecord& r = records[i];
+			if (r.facetId >= geom->GetNbFacet()) throw Error("The particle log doesn't match the geometry");
+			Facet* f = geom->GetFacet(r.facetId);
+			Vector3d hitPos = f->sh.O + (double)r.u * f->sh.U + (double)r.v * f->sh.V;
+			double u = sin(r.hitTheta)*cos(r.hitPhi);
+			double v = sin(r.hitTheta)*sin(r.hitPhi);
+			double n = cos(r.hitTheta);
+			Vector3d hitDir = u * f->sh.nU + v * f->sh.nV + n * f->sh.N;
+
+			int length = snprintf(line, sizeof(line), "%u%s%llu%s%.9g%s%.9g%s%.9g%s%.9g%s%.9g%s%.9g%s%.9g%s%.9g%s%.9g%s%.9g%s%.9g%s",
+				r.facetId + 1, sep, (unsigned long long)r.particleId, sep,
+				hitPos.x, sep, hitPos.y, sep, hitPos.z, sep,
+				r.u, sep, r.v, sep,
+				hitDir.x, sep, hitDir.y, sep, hitDir.z, sep,
+				r.hitTheta, sep, r.hitPhi, sep,
+				r.oriRatio, sep);
+			text.append(line, length);
+#ifdef MOLFLOW
+			length = snprintf(line, sizeof(line), "%.9g%s%.15g%s%.15g%s\n", r.velocity, sep, r.time, sep, r.particleDecayMoment, sep);
+#endif
+#ifdef SYNRAD
+			length = snprintf(line, sizeof(line), "%.15g%s%.15g%s%.15g%s\n", r.energy, sep, r.dF, sep, r.dP, sep);
+#endif
+			text.append(line, length);
+		}
+		out.write(text.data(), text.size());
+		if (!out) throw Error("Couldn't write the exported particle log (disk full?)");
+		nbDone += count;
+		if (!progress((double)nbDone / (double)reader.GetNbRecords())) break;
+	}
+	return nbDone;
+}
@@ -0,0 +1,157 @@
+/*
+Program:     MolFlow+ / Synrad+
+Description: Monte Carlo simulator for ultra-high vacuum and synchrotron radiation
+Authors:     Jean-Luc PONS / Roberto KERSEVAN / Marton ADY / Pascal BAEHR
+Copyright:   E.S.R.F / CERN
+Website:     https://cern.ch/molflow
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#pragma once
+
+// Streaming particle logger: the simulation threads push the hits on the logged facets to their own lock-free ring,
+// a writer thread drains the rings to a binary file of fixed-size records. The log is not kept in memory, its size
+// is only limited by the disk. ExportParticleLog converts the file to text a chunk of records at a time.
+
+#include <stdio.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <ostream>
+#include "GLApp/GLTypes.h" //Error
+
+#define PARTICLELOG_RING_SIZE 16384 //Records per simulation thread waiting for the writer (power of 2)
+#define PARTICLELOG_VERSION 1
+
+class Geometry;
+
+/**
+* \brief One logged hit, as stored in the log file. Floats where their precision is enough
+*/
+class ParticleLogRecord {
+public:
+	uint64_t particleId; //Index of the particle's desorption in the run (its random stream)
+#ifdef MOLFLOW
+	double time; //Flight time at the hit (s)
+	double particleDecayMoment; //(s), infinite without decay
+	float velocity; //(m/s)
+#endif
+#ifdef SYNRAD
+	double energy, dF, dP;
+#endif
+	float u, v; //Hit position in the facet's (U,V) frame
+	float hitTheta, hitPhi; //Incidence direction in the facet's (nU,nV,N) frame (rad)
+	float oriRatio; //Low flux mode weight
+	uint32_t facetId; //0-based
+};
+
+/**
+* \brief Start of a log file, followed by the records
+*/
+struct ParticleLogHeader {
+	char magic[8]; //"MFLOGBIN"
+	uint32_t version;
+	uint32_t recordSize; //sizeof(ParticleLogRecord) of the program that wrote the file
+};
+
+/**
+* \brief Single-producer single-consumer ring of records: a simulation thread pushes, the writer thread pops. Lock-free
+*/
+class ParticleLogRing {
+public:
+	ParticleLogRing() : records(PARTICLELOG_RING_SIZE) {}
+
+	//Producer side, called for every logged hit. False if full
+	bool Push(const ParticleLogRecord& record) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) == PARTICLELOG_RING_SIZE) return false;
+		records[h & (PARTICLELOG_RING_SIZE - 1)] = record;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+	size_t Size() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+	//Consumer side
+	size_t Pop(ParticleLogRecord* dest, size_t maxCount); //Moves out up to maxCount records, returns their number
+	void Discard(); //Drops everything pushed so far (leftovers of a previous log)
+
+private:
+	std::vector<ParticleLogRecord> records;
+	alignas(64) std::atomic<size_t> head{ 0 }; //Next slot to write. Only written by the producer
+	alignas(64) std::atomic<size_t> tail{ 0 }; //Next slot to read. Only written by the consumer
+};
+
+/**
+* \brief Background thread draining the simulation threads' rings to a log file
+*/
+class ParticleLogWriter {
+public:
+	~ParticleLogWriter();
+
+	void Start(const std::string& fileName, const std::vector<ParticleLogRing*>& rings, size_t limit); //Throws Error. Limit: max. records, 0 for no limit
+	void Stop(); //Writes the records already pushed, then closes the file
+	void Flush(); //Blocks until the records already pushed are in the file
+
+	bool Accepting() const { return accepting.load(std::memory_order_relaxed); } //False once stopped, or when the limit is reached: the producers skip logging
+	void Wake() { wakeup.notify_one(); } //Producer: its ring is filling up, don't wait for the timeout
+
+	const std::string& GetFileName() const { return fileName; }
+	size_t GetNbWritten() const { return nbWritten.load(); }
+	std::string GetError(); //Write error that stopped the log, empty if none
+
+private:
+	void WriterLoop();
+	size_t DrainRings(); //Writes what the rings hold, returns the number of records
+
+	std::string fileName;
+	FILE* file = NULL;
+	std::vector<ParticleLogRing*> rings;
+	std::vector<ParticleLogRecord> chunk; //Records popped from a ring, written at once
+	size_t limit = 0;
+
+	std::thread writerThread;
+	std::mutex mutex;
+	std::condition_variable wakeup; //Rings filling up, flush or stop requested
+	std::condition_variable flushed;
+	bool stopRequested = false;
+	size_t flushRequests = 0;
+	size_t flushesDone = 0;
+	std::string error;
+
+	std::atomic<bool> accepting{ false };
+	std::atomic<size_t> nbWritten{ 0 };
+};
+
+/**
+* \brief Reads a log file record by record
+*/
+class ParticleLogReader {
+public:
+	ParticleLogReader(const std::string& fileName); //Throws Error
+	~ParticleLogReader();
+
+	size_t GetNbRecords() const { return nbRecords; }
+	size_t Read(ParticleLogRecord* dest, size_t maxCount); //Next records, 0 at the end of the file
+
+private:
+	FILE* file = NULL;
+	size_t nbRecords = 0;
+};
+
+size_t ExportParticleLog(const std::string& logFileName, Geometry* geom, const std::string& separator, std::ostream& out,
+	const std::function<bool(double)>& progress); //Throws Error
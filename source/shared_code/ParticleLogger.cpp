@@ -27,6 +27,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "GLApp/GLTextField.h"
 #include "GLApp/GLLabel.h"
 #include "GLApp/GLToggle.h"
+#include "GLApp/MathTools.h" //SplitString, Contains
 //#include "GLApp/GLFileBox.h"
 #include "NativeFileDialog/molflow_wrapper/nfd_wrapper.h"
 
@@ -34,6 +35,9 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "Facet_shared.h"
 
 #include <fstream>
+#include <sstream>
+#include <numeric> //iota
+#include "ParticleLog.h"
 
 #ifdef MOLFLOW
 #include "MolFlow.h"
@@ -54,18 +58,18 @@ extern SynRad*mApp;
 ParticleLogger::ParticleLogger(Geometry *g, Worker *w) :GLWindow() {
 
 	int wD = 367;
-	int hD = 345;
+	int hD = 370;
 	logParamPanel = new GLTitledPanel("Recording settings");
-	logParamPanel->SetBounds(17, 79, 322, 149);
+	logParamPanel->SetBounds(17, 79, 322, 174);
 	Add(logParamPanel);
 	resultPanel = new GLTitledPanel("Result");
-	resultPanel->SetBounds(17, 234, 322, 84);
+	resultPanel->SetBounds(17, 259, 322, 84);
 	Add(resultPanel);
-	descriptionLabel = new GLLabel("This tool allows to record all test particles hitting a chosen facet.\nOnly one facet can be recorded at a time.\nThe recording must be exported, it is not saved with the file.");
+	descriptionLabel = new GLLabel("This tool records the test particles hitting the chosen facets.\nThe hits are streamed to a temporary file on disk.\nThe recording must be exported, it is not saved with the file.");
 	descriptionLabel->SetBounds(13, 18, 805, 13);
 	Add(descriptionLabel);
 
-	label2 = new GLLabel("Facet number:");
+	label2 = new GLLabel("Facets:");
 	logParamPanel->SetCompBounds(label2, 9, 52, 75, 13);
 	logParamPanel->Add(label2);
 
@@ -89,8 +93,16 @@ ParticleLogger::ParticleLogger(Geometry *g, Worker *w) :GLWindow() {
 	logParamPanel->SetCompBounds(memoryLabel, 202, 78, 43, 13);
 	logParamPanel->Add(memoryLabel);
 
+	samplingLabel = new GLLabel("Sampling:");
+	logParamPanel->SetCompBounds(samplingLabel, 9, 104, 75, 13);
+	logParamPanel->Add(samplingLabel);
+
+	samplingTextbox = new GLTextField(0, "1");
+	logParamPanel->SetCompBounds(samplingTextbox, 89, 101, 106, 20);
+	logParamPanel->Add(samplingTextbox);
+
 	applyButton = new GLButton(0, "Apply");
-	logParamPanel->SetCompBounds(applyButton, 120, 110, 75, 23);
+	logParamPanel->SetCompBounds(applyButton, 120, 135, 75, 23);
 	logParamPanel->Add(applyButton);
 
 	statusLabel = new GLLabel("No recording.");
@@ -132,35 +144,41 @@ void ParticleLogger::ProcessMessage(GLComponent *src, int message) {
 	case MSG_BUTTON:
 		if (!isRunning) {
 			if (src == applyButton) {
-				int facetId, nbRec;
-				if (!facetNumberTextbox->GetNumberInt(&facetId) || facetId<1 || facetId>geom->GetNbFacet()) {
-					GLMessageBox::Display("Invalid facet number", "Error", GLDLG_OK, GLDLG_ICONERROR);
+				std::vector<size_t> facetIds;
+				int nbRec;
+				double sampling;
+				if (!ParseFacetList(facetNumberTextbox->GetText(), facetIds)) return;
+				if (!maxRecordedTextbox->GetNumberInt(&nbRec) || nbRec < 0) {
+					GLMessageBox::Display("Invalid max rec. number (0: no limit)", "Error", GLDLG_OK, GLDLG_ICONERROR);
 					return;
 				}
-				facetId--;
-				if (!maxRecordedTextbox->GetNumberInt(&nbRec) || nbRec < 1) {
-					GLMessageBox::Display("Invalid max rec. number", "Error", GLDLG_OK, GLDLG_ICONERROR);
+				if (!samplingTextbox->GetNumber(&sampling) || sampling <= 0.0 || sampling > 1.0) {
+					GLMessageBox::Display("Sampling should be a fraction of the hits, between 0 (excluded) and 1", "Error", GLDLG_OK, GLDLG_ICONERROR);
 					return;
 				}
 				work->ontheflyParams.enableLogging = (enableCheckbox->GetState() == 1);
-				work->ontheflyParams.logFacetId = facetId;
+				work->ontheflyParams.logFacetIds = facetIds;
 				work->ontheflyParams.logLimit = nbRec;
+				work->ontheflyParams.logSampling = sampling;
 				work->ChangeSimuParams();
 				UpdateStatus();
 			}
 			else if (src == getSelectedFacetButton) {
 				auto selFacets = geom->GetSelectedFacets();
-				if (selFacets.size() != 1) {
-					GLMessageBox::Display("Select exactly one facet", "Error", GLDLG_OK, GLDLG_ICONERROR);
+				if (selFacets.empty()) {
+					GLMessageBox::Display("Select at least one facet", "Error", GLDLG_OK, GLDLG_ICONERROR);
 					return;
 				}
-				facetNumberTextbox->SetText(selFacets[0] + 1);
+				facetNumberTextbox->SetText(FormatFacetList(selFacets));
 				enableCheckbox->SetState(1);
 			}
 			else if (src == exportButton) {
 				//Export to CSV
-				
-				std::vector<ParticleLoggerItem>& log = work->GetLog();
+				work->particleLog.Flush();
+				if (work->particleLog.GetNbWritten() == 0) {
+					GLMessageBox::Display("Nothing logged yet", "Error", GLDLG_OK, GLDLG_ICONERROR);
+					return;
+				}
 				//FILENAME *fn = GLFileBox::SaveFile(NULL, NULL, "Save log", "All files\0*.*\0", NULL);
 				std::string fn = NFD_SaveFile_Cpp("csv", "");
 				if (!fn.empty()) {
@@ -179,35 +197,34 @@ void ParticleLogger::ProcessMessage(GLComponent *src, int message) {
 					}
 					
 					if (ok) {
-						std::ofstream file(formattedFileName);
+						std::ofstream file(formattedFileName, std::ios::binary);
 						exportButton->SetText("Abort");
 						isRunning = true;
-						ConvertLogToText(work->log, ",", &file);
+						ConvertLogToText(",", file);
 						isRunning = false;
 						exportButton->SetText("Export to CSV");
 						file.close();
 					}
 				}
-				work->ReleaseLog();
 			}
 			else if (src == copyButton) {
 				//Copy to clipboard
-				auto log = work->GetLog();
-				copyButton->SetText("Abort");
-				isRunning = true;
-				std::string clipBoardText = ConvertLogToText(log, "\t");
-				isRunning = false;
-				copyButton->SetText("Copy to clipboard");
-				work->ReleaseLog();
-				bool ok = sizeof(clipBoardText[0])*clipBoardText.length() < 50 * 1024 * 1024;
-				if (!ok) {
+				work->particleLog.Flush();
+				size_t estimatedSize = work->particleLog.GetNbWritten() * 200; //Typical line length
+				if (estimatedSize > 50 * 1024 * 1024) {
 					std::ostringstream msg;
-					msg << "Careful! You're putting " << mApp->FormatSize(sizeof(clipBoardText[0])*clipBoardText.length()) << " to the clipboard.";
+					msg << "Careful! You're putting about " << mApp->FormatSize(estimatedSize) << " to the clipboard.";
 					msg << "\nMaybe it's a better idea to save it as a file. Try anyway?";
 					int retVal = GLMessageBox::Display(msg.str(), "Large log size", { "Yes","Cancel" }, GLDLG_ICONWARNING);
-					ok = retVal == 0;
+					if (retVal != 0) return;
 				}
-				if (ok) GLToolkit::CopyTextToClipboard(clipBoardText);
+				std::ostringstream clipBoardText;
+				copyButton->SetText("Abort");
+				isRunning = true;
+				size_t nbConverted = ConvertLogToText("\t", clipBoardText);
+				isRunning = false;
+				copyButton->SetText("Copy to clipboard");
+				if (nbConverted > 0) GLToolkit::CopyTextToClipboard(clipBoardText.str());
 			}
 		}
 		else {
@@ -227,113 +244,96 @@ void ParticleLogger::ProcessMessage(GLComponent *src, int message) {
 
 void ParticleLogger::UpdateMemoryEstimate() {
 	int nbRec;
-	if (maxRecordedTextbox->GetNumberInt(&nbRec) && nbRec > 0) {
-		memoryLabel->SetText(mApp->FormatSize(2 * nbRec * sizeof(ParticleLoggerItem)));
+	if (maxRecordedTextbox->GetNumberInt(&nbRec)) {
+		if (nbRec > 0) memoryLabel->SetText(mApp->FormatSize(nbRec * sizeof(ParticleLogRecord)));
+		else if (nbRec == 0) memoryLabel->SetText("no limit");
 	}
 }
 
 void ParticleLogger::UpdateStatus() {
 
-	auto log = work->GetLog();
-	if (log.size() == 0) {
+	std::string error = work->particleLog.GetError();
+	size_t nbLogged = work->particleLog.GetNbWritten();
+	if (!error.empty()) {
+		statusLabel->SetText(error);
+	}
+	else if (nbLogged == 0) {
 		statusLabel->SetText("No recording.");
 	}
 	else {
 		std::ostringstream tmp;
-		tmp << log.size() << " particles logged";
+		tmp << nbLogged << " hits logged (" << mApp->FormatSize(nbLogged * sizeof(ParticleLogRecord)) << " on disk)";
 		statusLabel->SetText(tmp.str());
 	}
-	work->ReleaseLog();
 }
 
-std::string ParticleLogger::ConvertLogToText(const std::vector<ParticleLoggerItem>& log, const std::string& separator, std::ofstream* targetFile) {
-	std::ostringstream targetString;
+/**
+* \brief Parses a facet list like "1,5,7-9" (1-based) into 0-based facet ids, reporting errors in a message box
+* \return true on success
+*/
+bool ParticleLogger::ParseFacetList(const std::string& text, std::vector<size_t>& facetIds) {
+	facetIds.clear();
+	for (const auto& range : SplitString(text, ',')) {
+		auto tokens = SplitString(range, '-');
+		try {
+			if (!Contains({ 1,2 }, tokens.size())) throw std::invalid_argument("not a facet number or a range");
+			int first = std::stoi(tokens[0]);
+			int last = (tokens.size() == 2) ? std::stoi(tokens[1]) : first;
+			if (first < 1 || last > (int)geom->GetNbFacet() || last < first) throw std::invalid_argument("no such facet");
+			size_t oldSize = facetIds.size();
+			facetIds.resize(oldSize + last - first + 1);
+			std::iota(facetIds.begin() + oldSize, facetIds.end(), (size_t)first - 1);
+		}
+		catch (const std::exception& e) {
+			std::ostringstream tmp;
+			tmp << "Invalid facet number or range \"" << range << "\"\n" << e.what();
+			GLMessageBox::Display(tmp.str().c_str(), "Error", GLDLG_OK, GLDLG_ICONERROR);
+			return false;
+		}
+	}
+	if (facetIds.empty()) {
+		GLMessageBox::Display("No facet to log", "Error", GLDLG_OK, GLDLG_ICONERROR);
+		return false;
+	}
+	return true;
+}
+
+/**
+* \brief Formats 0-based facet ids as a 1-based list, consecutive ids as ranges ("1,5,7-9")
+*/
+std::string ParticleLogger::FormatFacetList(const std::vector<size_t>& facetIds) {
 	std::ostringstream tmp;
-	bool directWriteMode = targetFile != NULL;
-	//Header
-	work->abortRequested = false;
-	
-
-	tmp << "Pos_X_[cm]" << separator 
-		<< "Pos_Y_[cm]" << separator
-		<< "Pos_Z_[cm]" << separator
-		<< "Pos_u" << separator
-		<< "Pos_v" << separator
-		<< "Dir_X" << separator 
-		<< "Dir_Y" << separator
-		<< "Dir_Z" << separator
-		<< "Dir_theta_[rad]" << separator
-		<< "Dir_phi_[rad]" << separator
-		<< "LowFluxRatio" << separator;
+	for (size_t i = 0; i < facetIds.size(); i++) {
+		size_t j = i;
+		while (j + 1 < facetIds.size() && facetIds[j + 1] == facetIds[j] + 1) j++;
+		if (i > 0) tmp << ",";
+		tmp << facetIds[i] + 1;
+		if (j > i) tmp << "-" << facetIds[j] + 1;
+		i = j;
+	}
+	return tmp.str();
+}
 
-#ifdef MOLFLOW
-	tmp << "Velocity_[m/s]" << separator
-		<< "HitTime_[s]" << separator
-		<< "ParticleDecayMoment_[s]" << separator;
-#endif // MOLFLOW
-#ifdef SYNRAD
-	tmp << "Energy_[eV]" << separator
-		<< "Flux_[photon/s]" << separator
-		<< "Power_[W]" << separator;
-#endif // SYNRAD
-	tmp << "\n";
-
-	if (directWriteMode)
-		*targetFile << tmp.str();
-	else
-		targetString << tmp.str();
-	tmp.clear();
-	tmp.str(std::string());
-
-	//Lines
+/**
+* \brief Converts the log file to text, chunk by chunk (see ExportParticleLog), with a progress window and abort button
+* \return number of hits converted, 0 on error
+*/
+size_t ParticleLogger::ConvertLogToText(const std::string& separator, std::ostream& out) {
+	work->abortRequested = false;
 	GLProgress* prg = new GLProgress("Assembling text", "Particle logger");
 	prg->SetVisible(true);
-	for (size_t i = 0; !work->abortRequested && i < log.size(); i++) {
-		prg->SetProgress((double)i / (double)log.size());
-		mApp->DoEvents(); //To catch eventual abort button click
-		Facet* f = work->GetGeometry()->GetFacet(work->ontheflyParams.logFacetId);
-		Vector3d hitPos = f->sh.O + log[i].facetHitPosition.u*f->sh.U + log[i].facetHitPosition.v*f->sh.V;
-		
-		double u = sin(log[i].hitTheta)*cos(log[i].hitPhi);
-		double v = sin(log[i].hitTheta)*sin(log[i].hitPhi);
-		double n = cos(log[i].hitTheta);
-		
-		Vector3d hitDir = u*f->sh.nU + v*f->sh.nV + n* f->sh.N;
-
-		tmp << hitPos.x << separator
-			<< hitPos.y << separator
-			<< hitPos.z << separator
-			<< log[i].facetHitPosition.u << separator
-			<< log[i].facetHitPosition.v << separator
-			<< hitDir.x << separator
-			<< hitDir.y << separator
-			<< hitDir.z << separator
-			<< log[i].hitTheta << separator
-			<< log[i].hitPhi << separator
-			<< log[i].oriRatio << separator;
-
-#ifdef MOLFLOW
-		tmp << log[i].velocity << separator
-			<< log[i].time << separator
-			<< log[i].particleDecayMoment << separator;
-#endif // MOLFLOW
-#ifdef SYNRAD
-		tmp << log[i].energy << separator
-			<< log[i].dF << separator
-			<< log[i].dP << separator;
-#endif // SYNRAD
-
-		tmp << "\n";
-
-		if (directWriteMode)
-			*targetFile << tmp.str();
-		else
-			targetString << tmp.str();
-		tmp.clear();
-		tmp.str(std::string());
-
+	size_t nbConverted = 0;
+	try {
+		nbConverted = ExportParticleLog(work->particleLog.GetFileName(), geom, separator, out, [&](double progress) {
+			prg->SetProgress(progress);
+			mApp->DoEvents(); //To catch eventual abort button click
+			return !work->abortRequested;
+		});
+	}
+	catch (Error &e) {
+		GLMessageBox::Display(e.GetMsg(), "Error", GLDLG_OK, GLDLG_ICONERROR);
 	}
 	prg->SetVisible(false);
 	SAFE_DELETE(prg);
-	return targetString.str();
-}
\ No newline at end of file
+	return nbConverted;
+}
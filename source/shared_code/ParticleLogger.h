@@ -29,7 +29,6 @@ class GLToggle;
 class Geometry;
 class Worker;
 class GLTitledPanel;
-class ParticleLoggerItem;
 
 class ParticleLogger : public GLWindow {
 
@@ -57,6 +56,8 @@ private:
 	GLLabel	*label3;
 	GLTextField	*maxRecordedTextbox;
 	GLLabel	*memoryLabel;
+	GLLabel	*samplingLabel;
+	GLTextField	*samplingTextbox;
 	GLButton	*applyButton;
 	GLLabel	*statusLabel;
 	GLButton	*copyButton;
@@ -65,7 +66,9 @@ private:
 	GLTitledPanel	*logParamPanel;
 	GLTitledPanel	*resultPanel;
 
-	std::string ConvertLogToText(const std::vector<ParticleLoggerItem>& log, const std::string & separator, std::ofstream* file=NULL);
+	size_t ConvertLogToText(const std::string & separator, std::ostream& out);
+	bool ParseFacetList(const std::string& text, std::vector<size_t>& facetIds);
+	std::string FormatFacetList(const std::vector<size_t>& facetIds);
 	bool isRunning;
 };
 
@@ -785,3 +785,89 @@ return (((n_found/2)&1) ^ ((n_updown/2)&1));
 
 }
 */
+
+/**
+* \brief Builds the grid of a polygon (worth it from POLYGON_GRID_MIN_VERTICES vertices)
+* \param polyPoints polygon vertices, in order (same as for IsInPoly)
+*/
+void PolygonGrid::Build(const std::vector<Vector2d>& polyPoints) {
+	points = polyPoints;
+	cellParity.clear(); cellStart.clear(); cellEdges.clear();
+	size_t nbPoints = points.size();
+	if (nbPoints < 3) return;
+
+	uMin = uMax = points[0].u;
+	vMin = vMax = points[0].v;
+	for (const auto& p : points) {
+		uMin = std::min(uMin, p.u); uMax = std::max(uMax, p.u);
+		vMin = std::min(vMin, p.v); vMax = std::max(vMax, p.v);
+	}
+	if (uMax <= uMin || vMax <= vMin) return; //Degenerate
+	size_t resolution = (size_t)(2.0 * sqrt((double)nbPoints)); //Boundary cells hold a few edges on average
+	Saturate(resolution, (size_t)4, (size_t)64);
+	nbCols = nbRows = resolution;
+	double cellWidth = (uMax - uMin) / (double)nbCols;
+	double cellHeight = (vMax - vMin) / (double)nbRows;
+	invCellWidth = 1.0 / cellWidth;
+	invCellHeight = 1.0 / cellHeight;
+	// Decisions taken for a whole cell keep this margin, so that rounding in locating a point's cell or in IsInPoly's crossing test can't change the result
+	double epsU = 1E-9 * (uMax - uMin), epsV = 1E-9 * (vMax - vMin);
+
+	std::vector<std::vector<uint32_t>> edgesOfCell(nbCols * nbRows);
+	cellParity.assign(nbCols * nbRows, 0);
+	for (size_t j = 0; j < nbPoints; j++) {
+		const Vector2d& p1 = points[j];
+		const Vector2d& p2 = points[(j + 1) % nbPoints];
+		if (p1.u == p2.u) continue; //Vertical edges are never crossed
+		double edgeUMin = std::min(p1.u, p2.u), edgeUMax = std::max(p1.u, p2.u);
+		double slope = (p2.v - p1.v) / (p2.u - p1.u);
+		size_t colMin = (size_t)std::max(0.0, floor((edgeUMin - epsU - uMin) * invCellWidth));
+		size_t colMax = std::min(nbCols - 1, (size_t)std::max(0.0, floor((edgeUMax + epsU - uMin) * invCellWidth)));
+		for (size_t col = colMin; col <= colMax; col++) {
+			double colUMin = uMin + (double)col * cellWidth, colUMax = colUMin + cellWidth;
+			bool spansColumn = edgeUMin < colUMin - epsU && edgeUMax > colUMax + epsU; //Crossed by every vertical line of the column
+			// Edge's v range over the column
+			double clipUMin = std::max(edgeUMin, colUMin - epsU), clipUMax = std::min(edgeUMax, colUMax + epsU);
+			double clipV1 = p1.v + slope * (clipUMin - p1.u), clipV2 = p1.v + slope * (clipUMax - p1.u);
+			double clipVMin = std::min(clipV1, clipV2) - epsV, clipVMax = std::max(clipV1, clipV2) + epsV;
+			for (size_t row = 0; row < nbRows; row++) {
+				double rowVMin = vMin + (double)row * cellHeight, rowVMax = rowVMin + cellHeight;
+				if (clipVMin > rowVMax + epsV) continue; //Edge above the cell: never counted
+				size_t cell = row * nbCols + col;
+				if (spansColumn && clipVMax < rowVMin - epsV) cellParity[cell] ^= 1; //Edge crossed below every point of the cell
+				else edgesOfCell[cell].push_back((uint32_t)j);
+			}
+		}
+	}
+
+	cellStart.resize(nbCols * nbRows + 1);
+	cellStart[0] = 0;
+	for (size_t cell = 0; cell < edgesOfCell.size(); cell++) {
+		cellStart[cell + 1] = cellStart[cell] + (uint32_t)edgesOfCell[cell].size();
+		cellEdges.insert(cellEdges.end(), edgesOfCell[cell].begin(), edgesOfCell[cell].end());
+	}
+}
+
+/**
+* \brief Point-in-polygon check with the grid, same result as IsInPoly()
+* \param p point in the polygon's plane
+* \return true if the point is inside the polygon
+*/
+bool PolygonGrid::IsInside(const Vector2d& p) const {
+	if (p.u < uMin || p.u > uMax || p.v < vMin || p.v > vMax) return false; //Outside the vertices' bounding box
+	size_t col = std::min(nbCols - 1, (size_t)((p.u - uMin) * invCellWidth));
+	size_t row = std::min(nbRows - 1, (size_t)((p.v - vMin) * invCellHeight));
+	size_t cell = row * nbCols + col;
+	bool inside = cellParity[cell] != 0;
+	size_t nbPoints = points.size();
+	for (size_t i = cellStart[cell]; i < cellStart[cell + 1]; i++) {
+		size_t j = cellEdges[i];
+		const Vector2d& p1 = points[j];
+		const Vector2d& p2 = points[j + 1 < nbPoints ? j + 1 : 0];
+		if (p.u<p1.u != p.u<p2.u) { //Same crossing test as IsInPoly()
+			double slope = (p2.v - p1.v) / (p2.u - p1.u);
+			if ((slope * p.u - p.v) < (slope * p1.u - p1.v)) inside = !inside; //Crossed below the point
+		}
+	}
+	return inside;
+}
@@ -22,6 +22,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include <tuple>
 #include <optional>
 #include <vector>
+#include <cstdint>
 
 class GLAppPolygon { //To distinguish from possible other Polygon classes in the namespace
 public:
@@ -57,6 +58,26 @@ public:
   std::vector<PolyArc> arcs;
 };
 
+// Uniform grid over a polygon's bounding box for O(1) average point-in-polygon checks on many-vertex polygons.
+// Gives the same answer as IsInPoly(): each cell stores the parity of the edges that are below the whole cell and cross
+// every vertical line through it, plus the other edges that may cross a vertical line through the cell, tested like in IsInPoly()
+#define POLYGON_GRID_MIN_VERTICES 12 // Below this, IsInPoly()'s linear scan is as fast
+
+class PolygonGrid {
+public:
+	void Build(const std::vector<Vector2d>& polyPoints);
+	bool IsBuilt() const { return !cellStart.empty(); }
+	bool IsInside(const Vector2d& p) const;
+private:
+	std::vector<Vector2d> points;
+	double uMin = 0.0, vMin = 0.0, uMax = 0.0, vMax = 0.0;
+	double invCellWidth = 0.0, invCellHeight = 0.0;
+	size_t nbCols = 0, nbRows = 0;
+	std::vector<uint8_t> cellParity; // Parity of the edges always crossed below the cell
+	std::vector<uint32_t> cellStart; // nbCols*nbRows+1 offsets into cellEdges
+	std::vector<uint32_t> cellEdges; // Edges to test (index of their first vertex)
+};
+
 bool   IsConvex(const GLAppPolygon& p,size_t idx);
 bool   ContainsConcave(const GLAppPolygon& p,int i1,int i2,int i3);
 std::tuple<bool,Vector2d>  EmptyTriangle(const GLAppPolygon& p,int i1,int i2,int i3);
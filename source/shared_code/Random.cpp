@@ -115,6 +115,100 @@ MersenneTwister::MersenneTwister() {
 #endif
 }
 
+/* Philox4x32-10 block function on PHILOX_BLOCKS consecutive counters at once: 10 rounds of multiply-xor
+with Weyl-sequence key schedule. The blocks are independent, which lets the compiler interleave their multiplications */
+static void Philox4x32_10(const uint32_t counter[4], const uint32_t key[2], double* values)
+{
+	uint32_t c0[PHILOX_BLOCKS], c1[PHILOX_BLOCKS], c2[PHILOX_BLOCKS], c3[PHILOX_BLOCKS];
+	for (int b = 0; b < PHILOX_BLOCKS; b++) {
+		uint64_t blockIndex = (((uint64_t)counter[1] << 32) | counter[0]) + b;
+		c0[b] = (uint32_t)blockIndex; c1[b] = (uint32_t)(blockIndex >> 32); c2[b] = counter[2]; c3[b] = counter[3];
+	}
+	uint32_t k0 = key[0], k1 = key[1];
+	for (int round = 0; round < 10; round++) {
+		for (int b = 0; b < PHILOX_BLOCKS; b++) {
+			uint64_t p0 = (uint64_t)0xD2511F53U * c0[b];
+			uint64_t p1 = (uint64_t)0xCD9E8D57U * c2[b];
+			uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1[b] ^ k0;
+			uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3[b] ^ k1;
+			c1[b] = (uint32_t)p1;
+			c3[b] = (uint32_t)p0;
+			c0[b] = n0;
+			c2[b] = n2;
+		}
+		k0 += 0x9E3779B9U;
+		k1 += 0xBB67AE85U;
+	}
+	//Two doubles per block: 53 random bits each, centered in their interval so that neither 0 nor 1 occurs
+	const double scale = 1.0 / 9007199254740992.0; //2^-53
+	for (int b = 0; b < PHILOX_BLOCKS; b++) {
+		values[2 * b] = ((double)((((uint64_t)c0[b] << 32) | c1[b]) >> 11) + 0.5) * scale;
+		values[2 * b + 1] = ((double)((((uint64_t)c2[b] << 32) | c3[b]) >> 11) + 0.5) * scale;
+	}
+}
+
+Philox::Philox() {
+#ifdef DEBUG
+	SetSeed(42424242);
+#else
+	SetSeed(GetSeed());
+#endif
+}
+
+void Philox::SetSeed(uint64_t seed)
+{
+	key[0] = (uint32_t)seed;
+	key[1] = (uint32_t)(seed >> 32);
+	SetStream(0);
+}
+
+void Philox::SetStream(uint64_t id, uint64_t block)
+{
+	streamId = id;
+	blockIndex = block;
+	bufferPos = PHILOX_BUFFER; //Buffer empty
+}
+
+void Philox::NextBlock()
+{
+	uint32_t counter[4] = { (uint32_t)blockIndex, (uint32_t)(blockIndex >> 32), (uint32_t)streamId, (uint32_t)(streamId >> 32) };
+	Philox4x32_10(counter, key, buffer);
+	blockIndex += PHILOX_BLOCKS;
+	bufferPos = 0;
+}
+
+void Philox::FillUniform(double* values, size_t count)
+{
+	size_t i = 0;
+	while (i < count && bufferPos < PHILOX_BUFFER) values[i++] = buffer[bufferPos++]; //Leftover of the current blocks
+	uint32_t counter[4] = { 0, 0, (uint32_t)streamId, (uint32_t)(streamId >> 32) };
+	for (; i + PHILOX_BUFFER <= count; i += PHILOX_BUFFER) { //Whole block groups straight into the output
+		counter[0] = (uint32_t)blockIndex;
+		counter[1] = (uint32_t)(blockIndex >> 32);
+		Philox4x32_10(counter, key, values + i);
+		blockIndex += PHILOX_BLOCKS;
+	}
+	while (i < count) values[i++] = rnd(); //The rest of the last group stays buffered for the next call
+}
+
+double Philox::Gaussian(const double & sigma)
+{
+	//Polar Box-Muller, as MersenneTwister::Gaussian
+	double v1, v2, r, fac;
+	do {
+		v1 = 2.0*rnd() - 1.0;
+		v2 = 2.0*rnd() - 1.0;
+		r = v1 * v1 + v2 * v2;
+	} while (r >= 1.0);
+	fac = sqrt(-2.0*log(r) / r);
+	return v2 * fac*sigma;
+}
+
+unsigned long Philox::GetSeed() {
+	size_t ms = GetSysTimeMs();
+	return (unsigned long)(std::hash<size_t>()(ms*(std::hash<std::thread::id>()(std::this_thread::get_id()))));
+}
+
  double TruncatedGaussian::GetGaussian(gsl_rng * gen, const double & mean, const double & sigma, const double & lowerBound, const double & upperBound) //inline
 {
 	std::pair<double, double> s;  // Output argument of rtnorm
@@ -20,6 +20,8 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #pragma once
 
 #include "TruncatedGaussian/rtnorm.hpp"
+#include <cstdint>
+#include <cstddef>
 
 /* Maximum generated random value */
 #define RK_STATE_LEN 624
@@ -31,6 +33,9 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #define UPPER_MASK 0x80000000UL
 #define LOWER_MASK 0x7fffffffUL
 
+#define PHILOX_BLOCKS 4 // 128-bit blocks generated together
+#define PHILOX_BUFFER (2*PHILOX_BLOCKS) // Two doubles per block
+
 #ifdef WIN
 // Disable "unary minus operator applied to unsigned type, result still unsigned" warning.
 #pragma warning(disable : 4146)
@@ -63,6 +68,37 @@ private:
 	double rk_double();
 };
 
+/**
+* \brief Counter-based generator (Philox4x32-10, Salmon et al., SC'11)
+* Every output block is a pure function of (key, counter): the key comes from the seed, the counter
+* is (stream id, block index). Streams are therefore independent and can be entered in any order
+* without generating the numbers before them, so that each particle can draw from its own stream.
+*/
+class Philox {
+public:
+	Philox();
+	void   SetSeed(uint64_t seed); // Sets the key. Also rewinds to the start of stream 0
+	void   SetStream(uint64_t streamId, uint64_t blockIndex = 0); // Jumps to the given block (two values each) of the given stream of the current key
+	inline double rnd() { // Returns a uniform distributed double value in the interval ]0,1[
+		if (bufferPos == PHILOX_BUFFER) NextBlock();
+		return buffer[bufferPos++];
+	}
+	void   FillUniform(double* values, size_t count); // Same values as count rnd() calls, generated block by block
+
+	double Gaussian(const double &sigma);
+
+	static unsigned long GetSeed(); // Time and thread dependent seed, for unseeded runs
+
+private:
+	uint32_t key[2];
+	uint64_t streamId;
+	uint64_t blockIndex; // Next block to generate in the stream
+	double buffer[PHILOX_BUFFER]; // Current blocks, as doubles
+	int bufferPos; // Next unused value in buffer, PHILOX_BUFFER if none
+
+	void NextBlock();
+};
+
 class TruncatedGaussian {
 public:
 	double GetGaussian(gsl_rng *gen, const double &mean, const double &sigma, const double &lowerBound, const double &upperBound);
@@ -25,8 +25,11 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "GLApp/GLTypes.h"
 #include "SMP.h"
 #include "Buffer_shared.h" //LEAK, HIT
+#include "ParticleLog.h"
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <condition_variable>
 
 class Geometry;
 class GLProgress;
@@ -71,6 +74,12 @@ public:
   // Save a geometry (throws Error)
   void SaveGeometry(std::string fileName,GLProgress *prg,bool askConfirm=true,bool saveSelected=false,bool autoSave=false,bool crashSave=false);
   bool IsDpInitialized();
+#ifdef MOLFLOW
+  // Autosave without stalling the simulation: merges are held while results are copied to a back buffer, which is then written and zipped on a separate thread
+  void SaveGeometryInBackground(const std::string& fileName, GLProgress *prg); //Throws Error
+  bool IsBackgroundSaveRunning();
+  bool FinishBackgroundSave(std::string& errorMsg); //True if a background save ended since the last call, errorMsg empty on success
+#endif
   
   // Export textures (throws Error)
   void ExportTextures(const char *fileName,int grouping,int mode,bool askConfirm=true,bool saveSelected=false);
@@ -103,8 +112,7 @@ public:
   //void SendHitCache(Dataport *dpHit);  // From worker cache to dpHit shared memory
   void GetProcStatus(std::vector<size_t> &states,std::vector<std::string>& statusStrings);// Get process status
   GlobalSimuState* GetHits(); // Access to dataport (HIT)
-  std::vector<ParticleLoggerItem>& GetLog();
-  void ReleaseLog();
+  void StartParticleLog(); //Throws Error
   void ReleaseHits();
  
   void RemoveRegion(int index);
@@ -126,7 +134,8 @@ public:
   void LoadTexturesGEO(FileReader *f, int version);
   void OneACStep();
   void StepAC(float appTime); // AC iteration single step
-  //void ComputeAC(float appTime); // Send Compute AC matrix order
+  void ComputeAC(float appTime); // Send Compute AC matrix order
+  void BuildACElements(); // Surface elements of the AC mode, throws Error on features it doesn't model
   void PrepareToRun(); //Do calculations necessary before launching simulation
   int GetParamId(const std::string); //Get ID of parameter name
   void SendFacetHitCounts(/*Dataport * dpHit*/);
@@ -144,6 +153,9 @@ public:
   //Different signature:
   void SendToHitBuffer(bool skipFacetHits = false);// Send total and facet hit counts to subprocesses
   void StartStop(float appTime,size_t sMode);    // Switch running/stopped
+  void AddGlobalHits(const GlobalHitBuffer& src, bool copyHitCache); // Add a thread's global counters and leak (and hit) cache to results (caller holds results.mutex)
+  void UpdateTextureLimits(const GlobalSimuState& merged); // Widen the texture autoscale limits with the cells just merged into results (caller holds results.mutex)
+  void RescanTextureLimits(); // Full texture autoscale min/max search on results (caller holds results.mutex)
 #endif
 
 #ifdef SYNRAD
@@ -183,11 +195,20 @@ public:
   std::vector<std::vector<std::pair<double, double>>> IDs; //integrated distribution function for each time-dependent desorption type
   std::vector<double> temperatures; //keeping track of all temperatures that have a CDF already generated
   std::vector<double> moments;             //moments when a time-dependent simulation state is recorded
+  MomentIndex momentIndex;                 //moments sorted, for the simulation's recorders. Built by PrepareToRun()
+  bool sparseMomentResults;                //simulation threads allocate moment results (textures etc.) only for the moments they write, see GlobalSimuState::Resize
   std::vector<size_t> desorptionParameterIDs; //time-dependent parameters which are used as desorptions, therefore need to be integrated
   std::vector<std::string> userMoments;    //user-defined text values for defining time moments (can be time or time series)
 
 
   size_t    calcACprg;         // AC matrix progress
+  ViewFactorMatrix viewFactors; // AC mode elements, view factors and solution
+  size_t    aabbLeafSize;      // Max. number of facets in a ray-tracing tree leaf
+  size_t    aabbWidth;         // Ray-tracing tree: 1 (binary), 4 (SSE) or 8 (AVX2). Default: widest supported by the CPU
+  void BenchmarkRayTracing(size_t nbRays);
+  std::vector<double> sourceCdf;  // Cumulative number of desorbed molecules of the outgassing facets, in structure then facet order
+  std::vector<SubprocessFacet*> sourceFacets; // Facet of each sourceCdf entry
+  void BuildSourceCdf();
 #endif
 
 #ifdef SYNRAD
@@ -218,11 +239,21 @@ public:
 		);
 	}
 	*/
-	std::timed_mutex logMutex;
 	WorkerControl workerControl;
+#ifdef MOLFLOW
+	std::mutex reducerMutex; //Taken around the waits on the two signals below, so that no notification is lost
+	std::condition_variable handOverSignal; //Notified on each hand-over (Simulation::HandOverMCHits) and by StopReducer: wakes the reducer
+	std::condition_variable mergeSignal; //Notified by the reducer once handed-over blocks are merged: wakes Simulation::WaitForReducer
+	std::condition_variable mergesResumed; //Notified when a background save has copied 'results' and merges may continue
+	bool LockResultsForMerge(size_t timeout = 8000); //Locks results.mutex once no background save copy is in progress, false on timeout
+#endif
 	GlobalSimuState results,emptyResultTemplate; //replaces dpHit
-	std::vector<ParticleLoggerItem> log; //replaces dpLog
+	ParticleLogWriter particleLog; //replaces dpLog: hits on the logged facets, streamed to a file
+	std::string particleLogFileName;
 	std::vector<SubProcessSuperStructure> subprocessStructures;
+#ifdef MOLFLOW
+	std::vector<SubprocessFacet*> facetsById; //First copy of each facet in subprocessStructures, indexed by global id
+#endif
 private:
 
   // Process management
@@ -253,6 +284,23 @@ private:
   void Start();
   void Stop();
   void InnerStop(float appTime);
+#ifdef MOLFLOW
+  // Result reduction: simulation threads hand over their local results, one reducer thread merges them into 'results'
+  std::thread reducerThread;
+  std::atomic<bool> reducerEnd;
+  void StartReducer();
+  void StopReducer();
+  void ReducerLoop();
+  bool ReduceMCHits();
+  struct TextureCellId { size_t facetId, moment, cell; };
+  TextureCellId textureMinCells[3][2] = {}; //Cells holding texture_limits[v].min.all and .min.moments_only: if one grows, the minimum is searched again
+
+  std::thread backgroundSaveThread;
+  std::atomic<bool> backgroundSaveRunning;
+  std::string backgroundSaveError; //Written by the save thread, read after join
+  GlobalSimuState saveBuffer; //Back buffer of the background save, reused so its facet buffers are not reallocated on each autosave
+  std::atomic<bool> mergesHeld; //Set while 'results' is copied to saveBuffer outside its mutex: merges wait on mergesResumed
+#endif
 
   // Geometry handle
 #ifdef MOLFLOW
@@ -22,21 +22,25 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 
 #include "Worker.h"
 #include "Facet_shared.h"
-#include "GLApp/GLApp.h"
 #include "GLApp/GLMessageBox.h"
 #include "GLApp/MathTools.h" //Min max
+#ifndef MOLFLOW_CLI
+#include "GLApp/GLApp.h"
 #include "GLApp/GLList.h"
+#include "GLApp/GLUnitDialog.h"
+#include "LoadStatus.h"
+#endif
 #include <math.h>
 #include <stdlib.h>
 //#include <Process.h>
-#include "GLApp/GLUnitDialog.h"
-#include "LoadStatus.h"
 #include "Simulation.h"
 #ifdef MOLFLOW
 #include "MolFlow.h"
 #include "MolflowGeometry.h"
+#ifndef MOLFLOW_CLI
 #include "FacetAdvParams.h"
 #endif
+#endif
 
 #ifdef SYNRAD
 #include "SynRad.h"
@@ -68,6 +72,11 @@ Worker::~Worker() {
 	//CLOSEDP(dpHit);
 	//CLOSEDP(dpControl);
 	//CLOSEDP(dpLog);
+	particleLog.Stop();
+#ifdef MOLFLOW
+	StopReducer();
+	if (backgroundSaveThread.joinable()) backgroundSaveThread.join(); //Let the autosave complete
+#endif
 	delete geom;
 }
 
@@ -220,19 +229,16 @@ GlobalSimuState* Worker::GetHits() {
 	else return NULL;
 }
 
-std::vector<ParticleLoggerItem>& Worker::GetLog() {
-	try {
-		if (needsReload) RealReload();
-	}
-	catch (Error &e) {
-		GLMessageBox::Display(e.GetMsg(), "Error (Stop)", GLDLG_OK, GLDLG_ICONERROR);
-	}
-	LockMutex(logMutex);
-	return log;
-}
-
-void Worker::ReleaseLog() {
-	ReleaseMutex(logMutex);
+/**
+* \brief Closes the current particle log and, if logging is enabled, starts a new log file fed by the simulation threads' rings
+*/
+void Worker::StartParticleLog() {
+	particleLog.Stop();
+	if (!ontheflyParams.enableLogging || ontheflyParams.nbProcess == 0) return;
+	std::vector<ParticleLogRing*> rings;
+	for (size_t i = 0; i < ontheflyParams.nbProcess; i++)
+		rings.push_back(&workerControl.simuPointers[i]->logRing);
+	particleLog.Start(particleLogFileName, rings, ontheflyParams.logLimit);
 }
 
 void Worker::ThrowSubProcError(std::string message) {
@@ -304,17 +310,15 @@ bool Worker::Wait(size_t readyState, LoadStatus *statusWindow) {
 	bool finished = false;
 	bool error = false;
 
-	int waitTime = 0;
-	allDone = true;
+	auto waitStart = std::chrono::steady_clock::now();
 
-	// Wait for completion
-	while (!finished && !abortRequested) {
+	// Wait for completion: woken by the threads' state changes, the timeout only paces the status window refreshes
+	std::unique_lock<std::timed_mutex> lock(workerControl.mutex);
+	while (!abortRequested) {
 
 		finished = true;
-		//AccessDataport(dpControl);
-		LockMutex(workerControl.mutex);
-		//WorkerControl *shMaster = (WorkerControl *)dpControl->buff;
-
+		error = false;
+		allDone = true;
 		for (size_t i = 0; i < ontheflyParams.nbProcess; i++) {
 
 			finished = finished & (workerControl.states[i] == readyState || workerControl.states[i] == PROCESS_ERROR || workerControl.states[i] == PROCESS_DONE);
@@ -323,27 +327,29 @@ bool Worker::Wait(size_t readyState, LoadStatus *statusWindow) {
 			}
 			allDone = allDone & (workerControl.states[i] == PROCESS_DONE);
 		}
-		//ReleaseDataport(dpControl);
-		ReleaseMutex(workerControl.mutex);
+		if (finished) break;
 
-		if (!finished) {
-
-			if (statusWindow) {
-				if (waitTime >= 500) {
-					statusWindow->SetVisible(true);
-				}
-				statusWindow->SMPUpdate();
-				mApp->DoEvents(); //Do a few refreshes during waiting for subprocesses
+#ifndef MOLFLOW_CLI //No status window in the headless core
+		if (statusWindow) {
+			lock.unlock(); //The status window reads the threads' status strings
+			if (std::chrono::steady_clock::now() - waitStart >= std::chrono::milliseconds(500)) {
+				statusWindow->SetVisible(true);
 			}
-			std::this_thread::sleep_for(std::chrono::milliseconds(250));
-			waitTime += 250;
+			statusWindow->SMPUpdate();
+			mApp->DoEvents(); //Do a few refreshes during waiting for subprocesses
+			lock.lock();
 		}
+#endif
+		workerControl.stateChanged.wait_for(lock, std::chrono::milliseconds(250));
 	}
+	lock.unlock();
 
+#ifndef MOLFLOW_CLI
 	if (statusWindow) {
 		statusWindow->SetVisible(false);
 		statusWindow->EnableStopButton();
 	}
+#endif
 	return finished && !error;
 
 }
@@ -360,12 +366,14 @@ bool Worker::ExecuteAndWait(int command, size_t readyState, size_t param) {
 		workerControl.states[i] = command;
 		workerControl.cmdParam[i] = param;
 	}
+	workerControl.commandSerial++;
 	ReleaseMutex(workerControl.mutex);
 	//ReleaseDataport();
+	workerControl.commandIssued.notify_all(); //Wakes idle threads. Running ones see commandSerial within a few bounces
 
-	std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-	if (!mApp->loadStatus) mApp->loadStatus = new LoadStatus(this);
+#ifndef MOLFLOW_CLI
+	if (!mApp->loadStatus && !mApp->headless) mApp->loadStatus = new LoadStatus(this);
+#endif
 	bool result = Wait(readyState, mApp->loadStatus);
 	//SAFE_DELETE(statusWindow);
 	return result;
@@ -410,6 +418,10 @@ void Worker::KillAll(bool keepDpHit) {
 		std::unique_ptr<GLProgress> prg(new GLProgress("Stopping old threads...", "Restarting threads"));
 		prg->SetVisible(true);
 		bool result = ExecuteAndWait(COMMAND_EXIT, PROCESS_KILLED); //Wait until either the user request abort or subprocesses exit nicely
+		particleLog.Stop(); //Drains the threads' rings, must finish before the Simulation instances are deleted
+#ifdef MOLFLOW
+		StopReducer(); //Merges the last handed-over blocks, must finish before the Simulation instances are deleted
+#endif
 		for (size_t i = 0; i < ontheflyParams.nbProcess; i++) {
 			prg->SetProgress((double)i / (double)ontheflyParams.nbProcess);
 			if (workerControl.states[i] == PROCESS_KILLED) {
@@ -475,8 +487,13 @@ void Worker::SetProcNumber(size_t n, bool keepDpHit) {
 	}
 
 	ontheflyParams.nbProcess = n;
+#ifdef MOLFLOW
+	if (n > 0) StartReducer();
+#endif
 
-	if (!mApp->loadStatus) mApp->loadStatus = new LoadStatus(this);
+#ifndef MOLFLOW_CLI
+	if (!mApp->loadStatus && !mApp->headless) mApp->loadStatus = new LoadStatus(this);
+#endif
 	bool result = Wait(PROCESS_READY, mApp->loadStatus);
 	if (!result)
 		ThrowSubProcError("Sub process(es) starting failure");
@@ -586,7 +603,7 @@ void Worker::Update(float appTime) {
 			ReleaseMutex(results.mutex);
 			return;
 		}
-#ifdef MOLFLOW
+#if defined(MOLFLOW) && !defined(MOLFLOW_CLI)
 		if (mApp->facetAdvParams && mApp->facetAdvParams->IsVisible() && needsAngleMapStatusRefresh)
 			mApp->facetAdvParams->Refresh(geom->GetSelectedFacets());
 #endif
@@ -663,9 +680,7 @@ void Worker::ChangeSimuParams() { //Send simulation mode changes to subprocesses
 
 	//To do: only close if parameters changed
 	//CLOSEDP(dpLog);
-	LockMutex(logMutex);
-	log.clear();
-	ReleaseMutex(logMutex);
+	particleLog.Stop(); //Restarted once the threads use the new parameters: hits logged meanwhile are dropped
 	/*
 	progressDlg->SetMessage("Waiting for subprocesses to release log dataport...");
 	if (!ExecuteAndWait(COMMAND_RELEASEDPLOG, isRunning ? PROCESS_RUN : PROCESS_READY, isRunning ? PROCESS_RUN : PROCESS_READY)) {
@@ -731,6 +746,12 @@ void Worker::ChangeSimuParams() { //Send simulation mode changes to subprocesses
 
 	//progressDlg->SetMessage("Closing dataport...");
 	//CLOSEDP(loader);
+	try {
+		StartParticleLog();
+	}
+	catch (Error &e) {
+		GLMessageBox::Display(e.GetMsg(), "Warning (Updateparams)", GLDLG_OK, GLDLG_ICONWARNING);
+	}
 	progressDlg->SetVisible(false);
 	SAFE_DELETE(progressDlg);
 